@@ -1,16 +1,40 @@
+#ifndef BHUT_H
+#define BHUT_H
+
 #include "octree.h"
 #include "particle.h"
 #include "physics.h"
-#include <memory>
+#include "profiling.h"
+#include "integrator.h"
+#include "diagnostics.h"
+#include "trace.h"
+#include "perf_counters.h"
 #include <chrono>
+#include <cmath>
+#include <cstdint>
 #include <iostream>
 #include <algorithm>
+#include <memory>
+#include <type_traits>
 #include <vector>
 
-class BarnesHutCPUSimulator
+// Barnes-Hut simulator over the flat octree. The integrator is a policy
+// from integrator.h; tree walks give no jerks, so Hermite is not accepted.
+template <typename Integrator = Integrators::KickDriftKick>
+class BasicBarnesHutSimulator
 {
+    static_assert(!Integrator::NEEDS_JERK, "the tree walk does not compute jerks");
+
+    // block timesteps are built on the leapfrog's half kicks
+    static constexpr bool BLOCK_STEPS = std::is_same<Integrator, Integrators::KickDriftKick>::value;
+
 private:
-    std::shared_ptr<ParticleSystem> particles;
+    // particles handed to a thread at a time in the dynamic force schedule
+    static constexpr int FORCE_CHUNK_SIZE = 64;
+    // deepest block timestep bin: steps down to timeStep / 2^MAX_TIME_BIN
+    static constexpr int MAX_TIME_BIN = 12;
+    
+    ParticleSystem* particles;
     float timeStep;
     float theta;
     Octree octree;
@@ -18,87 +42,185 @@ private:
     float softening;
     
     bool enableProfiling = false;
+    // most frames between full rebuilds; the tree is refitted in between
     int rebuildFrequency = 1;
-    int frameCounter = 0;
+    int framesSinceBuild = 0;
+    bool useGroupWalk = true;
+    std::vector<glm::vec3> treeAccelerations;
+    Integrator integrator;
+    DiagnosticsMonitor diagnostics;
+    PhaseTimings lastTimings;
+    PhaseCounterRecorder counters;
+
+    // Block timesteps: particle i advances with timeStep / 2^timeBins[i],
+    // bins 0..maxTimeBin, from the criterion dt = sqrt(2 eta eps / |a|)
+    // with eps the softening length. maxTimeBin 0 is the global step, and
+    // the only one for integrators other than the leapfrog.
+    int maxTimeBin = 0;
+    float timestepAccuracy = 0.025f;
+    std::vector<uint8_t> timeBins;
+    std::vector<uint8_t> activeMask;
+    std::vector<long> binCounts;
+
+    // Orbit stabilisation (Physics::stabilizeOrbits) at the start of each
+    // update(), instead of as a pass of the caller's own
+    bool stabilizeOrbits = false;
+    float stabilizationDamping = 0.9995f;
+    // global leapfrog steps in two passes over the particles (see
+    // updateFused); off runs the separate passes, for validation
+    bool fusedPipeline = true;
 
 public:
-    BarnesHutCPUSimulator(ParticleSystem& particleSystem, float dt, float theta = 0.5f, 
-                         float G = Physics::G, float softening = Physics::SOFTENING)
-        : particles(std::make_shared<ParticleSystem>(particleSystem)),
+    BasicBarnesHutSimulator(ParticleSystem& particleSystem, float dt, float theta = 0.5f, 
+                            float G = Physics::G, float softening = Physics::SOFTENING)
+        : particles(&particleSystem),
           timeStep(dt), theta(theta), octree(theta), 
           G(G), softening(softening) {}
 
-    BarnesHutCPUSimulator(BarnesHutCPUSimulator&&) = default;
-    BarnesHutCPUSimulator& operator=(BarnesHutCPUSimulator&&) = default;
+    BasicBarnesHutSimulator(BasicBarnesHutSimulator&&) = default;
+    BasicBarnesHutSimulator& operator=(BasicBarnesHutSimulator&&) = default;
 
     void update()
     {
         if (!particles || particles->size() == 0) return;
-        
-        size_t n = particles->size();
-        
-        auto startTime = std::chrono::high_resolution_clock::now();
-        
-        for (size_t i = 0; i < n; i++) {
-            Physics::integrateLeapFrog((*particles)[i], timeStep);
+        NBODY_TRACE_SCOPE("bh.update");
+
+        if (BLOCK_STEPS && maxTimeBin > 0) {
+            updateBlockSteps();
+            return;
         }
-        
-        auto afterIntegrate1 = std::chrono::high_resolution_clock::now();
-        
-        bool rebuildTree = (frameCounter % rebuildFrequency == 0);
-        if (rebuildTree) {
-            try {
-                octree.buildTree(*particles);
-            } catch (const std::exception& e) {
-                std::cerr << "Error building octree: " << e.what() << std::endl;
-                calculateForcesDirectly();
-                return;
-            }
+        if (BLOCK_STEPS && fusedPipeline) {
+            updateFused();
+            return;
         }
         
-        auto afterTreeBuild = std::chrono::high_resolution_clock::now();
+        const long n = static_cast<long>(particles->size());
         
-        try {
-            calculateForcesSafely();
-        } catch (const std::exception& e) {
-            std::cerr << "Error calculating forces: " << e.what() << std::endl;
-            calculateForcesDirectly();
-        }
+        auto startTime = ProfileClock::now();
+        const CounterValues startCounters = counters.begin();
+        if (stabilizeOrbits) Physics::stabilizeOrbits(*particles, stabilizationDamping);
+        float treeMs = 0.0f, forcesMs = 0.0f;
+        long evaluated = 0;
+        int rebuilds = 0;
+        int evaluations = 0;
+        auto lastForcesEnd = startTime;
         
-        auto afterForces = std::chrono::high_resolution_clock::now();
+        // the first evaluation follows the rebuild policy, later ones in the
+        // same step refit
+        integrator.step(*particles, timeStep, 0, [&](std::vector<glm::vec3>*) {
+            // the far-field damping is friction per step, not per evaluation
+            const bool first = evaluations++ == 0;
+            evaluated += evaluateForces(!first, nullptr, first, rebuilds, treeMs, forcesMs);
+            lastForcesEnd = ProfileClock::now();
+        });
         
-        for (size_t i = 0; i < n; i++) {
-            Physics::finalizeLeapFrog((*particles)[i], timeStep);
-        }
+        auto endTime = ProfileClock::now();
         
-        auto endTime = std::chrono::high_resolution_clock::now();
+        lastTimings.total = elapsedMs(startTime, endTime);
+        lastTimings.treeBuild = treeMs;
+        lastTimings.forces = forcesMs;
+        lastTimings.finalize = elapsedMs(lastForcesEnd, endTime);
+        lastTimings.integrate = lastTimings.total - treeMs - forcesMs - lastTimings.finalize;
+        lastTimings.treeRebuilds = rebuilds;
+        lastTimings.forceEvaluations = evaluated;
+        counters.finish(startCounters);
+        
+        measureDiagnostics();
         
         if (enableProfiling) {
-            float integrateTime1 = std::chrono::duration<float, std::milli>(afterIntegrate1 - startTime).count();
-            float treeBuildTime = std::chrono::duration<float, std::milli>(afterTreeBuild - afterIntegrate1).count();
-            float forcesTime = std::chrono::duration<float, std::milli>(afterForces - afterTreeBuild).count();
-            float integrateTime2 = std::chrono::duration<float, std::milli>(endTime - afterForces).count();
-            float totalTime = std::chrono::duration<float, std::milli>(endTime - startTime).count();
-            
             std::cout << "BH Profiling [" << n << " particles]:" 
-                      << " Total: " << totalTime << "ms,"
-                      << " Tree: " << treeBuildTime << "ms," 
-                      << " Forces: " << forcesTime << "ms," 
-                      << " Integrate: " << (integrateTime1 + integrateTime2) << "ms" 
+                      << " Total: " << lastTimings.total << "ms,"
+                      << " Tree: " << lastTimings.treeBuild << (rebuilds == 0 ? "ms (refit)," : "ms,")
+                      << " Forces: " << lastTimings.forces << "ms," 
+                      << " Integrate: " << (lastTimings.integrate + lastTimings.finalize) << "ms" 
                       << std::endl;
         }
-        
-        frameCounter++;
     }
     
+    // Stabilise orbits at the start of every update(), folded into the
+    // first pass of the fused pipeline
+    void setOrbitStabilization(bool enable, float damping = 0.9995f) {
+        stabilizeOrbits = enable;
+        stabilizationDamping = damping;
+    }
+    
+    // Fuse the passes of a global leapfrog step (the default); block
+    // timesteps and other integrators always run them separately
+    void setFusedPipeline(bool enable) {
+        fusedPipeline = enable;
+    }
+    
+    bool isFusedPipeline() const {
+        return BLOCK_STEPS && fusedPipeline && maxTimeBin == 0;
+    }
+    
+    // Rebuild the tree at least every freq frames and refit it on the others.
+    // A refit also falls back to a rebuild once the tree has degraded by more
+    // than the refit tolerance (see Octree::refit).
     void setRebuildFrequency(int freq) {
         rebuildFrequency = std::max(1, freq);
     }
     
+    void setRefitTolerance(float tolerance) {
+        octree.setRefitTolerance(tolerance);
+    }
+    
+    // Deepest block timestep bin: particles step with timeStep / 2^k for
+    // k up to maxBin, and update() still advances everyone by timeStep.
+    // 0 keeps the single global step, as do integrators other than the
+    // leapfrog.
+    void setMaxTimeBin(int maxBin) {
+        maxTimeBin = std::min(std::max(0, maxBin), MAX_TIME_BIN);
+    }
+    
+    // eta in the timestep criterion dt = sqrt(2 eta eps / |a|)
+    void setTimestepAccuracy(float eta) {
+        timestepAccuracy = std::max(1e-4f, eta);
+    }
+    
+    // measure energy, momenta and virial ratio every K steps (0 = off)
+    void setDiagnosticsInterval(int everySteps) {
+        diagnostics.setInterval(everySteps);
+    }
+    
+    const Diagnostics& getDiagnostics() const {
+        return diagnostics.getLatest();
+    }
+    
     void enableProfilingOutput(bool enable) {
         enableProfiling = enable;
     }
     
+    void setTreeBuildMode(TreeBuildMode mode) {
+        octree.setBuildMode(mode);
+    }
+    
+    // bodies per octree leaf before it is split
+    void setLeafCapacity(uint32_t capacity) {
+        octree.setLeafCapacity(capacity);
+    }
+    
+    // share one tree walk per group of nearby particles instead of one each
+    void setGroupWalk(bool enable) {
+        useGroupWalk = enable;
+    }
+    
+    const PhaseTimings& getLastTimings() const {
+        return lastTimings;
+    }
+    
+    // Counts cycles, instructions, cache and branch misses and vector ops
+    // per phase with perf_event_open. Returns false, leaving timing only,
+    // when the counters cannot be opened.
+    bool enableHardwareCounters(bool enable) {
+        return counters.enable(enable);
+    }
+    
+    // counters of the last update(); available == 0 without counters
+    const PhaseCounters& getLastCounters() const {
+        return counters.getLast();
+    }
+    
     void setAdaptiveTheta(bool enable) {
         if (enable) {
             size_t n = particles->size();
@@ -108,50 +230,363 @@ public:
     }
 
 private:
-    void calculateForcesSafely() {
-        if (!particles) return;
+    // Refits the tree onto the current positions or rebuilds it. The first
+    // evaluation of an update() refits while the rebuild interval and the
+    // tree quality allow; later ones (block timestep substeps, integrator
+    // stages) always try the refit first. Returns false
+    // when the build failed and forces must be summed directly.
+    // bounds, when known, spare a build its own pass over the positions.
+    bool updateTree(bool substep, bool& refitted, const ParticleBounds* bounds = nullptr) {
+        refitted = (substep || framesSinceBuild + 1 < rebuildFrequency) && octree.refit(*particles);
+        if (refitted) {
+            if (!substep) framesSinceBuild++;
+            return true;
+        }
+        try {
+            if (bounds) {
+                octree.buildTree(*particles, *bounds);
+            } else {
+                octree.buildTree(*particles);
+            }
+        } catch (const std::exception& e) {
+            std::cerr << "Error building octree: " << e.what() << std::endl;
+            return false;
+        }
+        framesSinceBuild = 0;
+        return true;
+    }
+    
+    // Diagnostics for the finished step when due: the tree is refitted to
+    // the final positions (integrators may drift after the last force
+    // evaluation) and walked for the potential, with the black hole's extra
+    // pull as an external point mass like calculateForcesSafely applies it.
+    void measureDiagnostics() {
+        lastTimings.diagnostics = 0.0f;
+        if (!diagnostics.step()) return;
         
-        size_t n = particles->size();
+        auto start = ProfileClock::now();
+        try {
+            if (!octree.refit(*particles)) octree.buildTree(*particles);
+        } catch (const std::exception& e) {
+            std::cerr << "Error building octree for diagnostics: " << e.what() << std::endl;
+            return;
+        }
+        const float blackHoleMass = particles->getMass(0);
+        diagnostics.measure(*particles, octree, G, softening, blackHoleMass > 100.0f ? blackHoleMass : 0.0f);
+        lastTimings.diagnostics = elapsedMs(start, ProfileClock::now());
+        lastTimings.total += lastTimings.diagnostics;
+    }
+    
+    // Tree update and forces for one evaluation in a step (see
+    // calculateForcesSafely for active, damp and closingKick), falling back
+    // to direct summation. Adds the phase times and full builds; returns the
+    // particles evaluated.
+    long evaluateForces(bool substep, const std::vector<uint8_t>* active, bool damp, int& rebuilds,
+                        float& treeMs, float& forcesMs, const ParticleBounds* bounds = nullptr,
+                        float closingKick = 0.0f) {
+        auto treeStart = ProfileClock::now();
+        const CounterValues treeCounters = counters.read();
+        bool refitted = false;
+        bool treeReady = updateTree(substep, refitted, bounds);
+        rebuilds += refitted ? 0 : 1;
+        
+        auto forcesStart = ProfileClock::now();
+        const CounterValues forcesCounters = counters.read();
+        long evaluated = 0;
+        if (treeReady) {
+            try {
+                evaluated = calculateForcesSafely(active, damp, closingKick);
+            } catch (const std::exception& e) {
+                std::cerr << "Error calculating forces: " << e.what() << std::endl;
+                treeReady = false;
+            }
+        }
+        if (!treeReady) {
+            // the walk throws before its loop, so no particle was kicked yet
+            calculateForcesDirectly();
+            if (closingKick != 0.0f) Physics::finalizeLeapFrog(*particles, closingKick);
+            evaluated = static_cast<long>(particles->size());
+        }
+        
+        treeMs += elapsedMs(treeStart, forcesStart);
+        forcesMs += elapsedMs(forcesStart, ProfileClock::now());
+        counters.addBuild(treeCounters, forcesCounters);
+        counters.addWalk(forcesCounters);
+        return evaluated;
+    }
+    
+    // substeps of timeStep / 2^maxTimeBin in one step of the given bin
+    int binStride(int bin) const {
+        return 1 << (maxTimeBin - bin);
+    }
+    
+    float binStep(int bin) const {
+        return timeStep / static_cast<float>(1 << bin);
+    }
+    
+    // Bin for a particle whose step ends at substep s: the timestep
+    // criterion's bin, deepened until its step starts on the substep grid
+    // at s (a particle can shrink its step at any step end, but only grow
+    // it where the larger step lines up).
+    int chooseBin(const glm::vec3& acceleration, int s) const {
+        int bin = 0;
+        float accMag = glm::length(acceleration);
+        if (accMag > 0.0f) {
+            float dt = std::sqrt(2.0f * timestepAccuracy * std::sqrt(softening) / accMag);
+            bin = static_cast<int>(std::ceil(std::log2(timeStep / dt)));
+            bin = std::min(std::max(bin, 0), maxTimeBin);
+        }
+        while (s % binStride(bin) != 0) bin++;
+        return bin;
+    }
+    
+    // One global leapfrog step in two streaming passes over the particles
+    // where the separate path makes up to six (stabilise, kick-drift,
+    // bounds, clearing the accelerations, forces, closing kick): the first
+    // pass stabilises, kicks, drifts and reduces the bounding box the tree
+    // build needs, the force loop applies the closing kick with each new
+    // acceleration. The tree build's own passes (keys, sort, packing) stay.
+    void updateFused() {
+        const long n = static_cast<long>(particles->size());
+        
+        auto startTime = ProfileClock::now();
+        const CounterValues startCounters = counters.begin();
+        float treeMs = 0.0f, forcesMs = 0.0f;
+        int rebuilds = 0;
+        
+        const ParticleBounds bounds = Physics::stabilizeKickDrift(*particles, timeStep, stabilizeOrbits,
+                                                                  stabilizationDamping);
+        const float integrateMs = elapsedMs(startTime, ProfileClock::now());
+        const long evaluated = evaluateForces(false, nullptr, true, rebuilds, treeMs, forcesMs, &bounds, timeStep);
+        
+        auto endTime = ProfileClock::now();
+        
+        lastTimings.integrate = integrateMs;
+        lastTimings.treeBuild = treeMs;
+        lastTimings.forces = forcesMs;
+        lastTimings.finalize = 0.0f;
+        lastTimings.total = elapsedMs(startTime, endTime);
+        lastTimings.treeRebuilds = rebuilds;
+        lastTimings.forceEvaluations = evaluated;
+        counters.finish(startCounters);
+        
+        measureDiagnostics();
+        
+        if (enableProfiling) {
+            std::cout << "BH Profiling [" << n << " particles, fused]:"
+                      << " Total: " << lastTimings.total << "ms,"
+                      << " Tree: " << lastTimings.treeBuild << (rebuilds == 0 ? "ms (refit)," : "ms,")
+                      << " Forces + kick: " << lastTimings.forces << "ms,"
+                      << " Kick-drift: " << lastTimings.integrate << "ms"
+                      << std::endl;
+        }
+    }
+    
+    // One update() with block timesteps: timeStep is cut into 2^maxTimeBin
+    // substeps, and at each substep where some particle's step ends, only
+    // those particles get new forces, against the tree refitted to every
+    // particle's drifted position. Each particle gets the leapfrog's half
+    // kicks at the ends of its own step, so at the end of update() all of
+    // them are synchronised again, as with the global step.
+    void updateBlockSteps() {
+        const long n = static_cast<long>(particles->size());
+        const int substeps = 1 << maxTimeBin;
+        const float subStep = timeStep / static_cast<float>(substeps);
+        
+        auto startTime = ProfileClock::now();
+        const CounterValues startCounters = counters.begin();
+        float integrateMs = 0.0f, treeMs = 0.0f, forcesMs = 0.0f, finalizeMs = 0.0f;
         
-        for (size_t i = 0; i < n; i++) {
-            (*particles)[i].acceleration = glm::vec4(0.0f);
+        long evaluated = 0;
+        int rebuilds = 0;
+        
+        if (stabilizeOrbits) {
+            Physics::stabilizeOrbits(*particles, stabilizationDamping);
+            integrateMs += elapsedMs(startTime, ProfileClock::now());
+        }
+        
+        // everything starts a step now. A new or resized system has no
+        // accelerations to pick bins from yet, so it gets forces first.
+        if (timeBins.size() != static_cast<size_t>(n)) {
+            evaluated += evaluateForces(false, nullptr, false, rebuilds, treeMs, forcesMs);
+            timeBins.assign(n, 0);
+            #pragma omp parallel for
+            for (long i = 0; i < n; i++) {
+                timeBins[i] = static_cast<uint8_t>(chooseBin(particles->getAcceleration(i), 0));
+            }
+        }
+        activeMask.assign(n, 0);
+        binCounts.assign(maxTimeBin + 1, 0);
+        for (long i = 0; i < n; i++) {
+            timeBins[i] = static_cast<uint8_t>(std::min<int>(timeBins[i], maxTimeBin));
+            binCounts[timeBins[i]]++;
         }
+        
+        // opening half kicks, after the far-field damping, which is friction
+        // per update() whatever a particle's bin (see calculateForcesSafely)
+        #pragma omp parallel for
+        for (long i = 0; i < n; i++) {
+            glm::vec3 velocity = particles->getVelocity(i);
+            if (glm::length(particles->getPosition(i)) > 30.0f) velocity *= 0.998f;
+            velocity += particles->getAcceleration(i) * binStep(timeBins[i]) * 0.5f;
+            particles->setVelocity(i, velocity);
+        }
+        
+        int forceSubsteps = 0;
+        float pendingDrift = 0.0f;
+        
+        for (int s = 1; s <= substeps; s++) {
+            pendingDrift += subStep;
+            bool stepEnds = false;
+            for (int bin = 0; bin <= maxTimeBin && !stepEnds; bin++) {
+                stepEnds = binCounts[bin] > 0 && s % binStride(bin) == 0;
+            }
+            if (!stepEnds) continue;
+            forceSubsteps++;
+            
+            auto substepStart = ProfileClock::now();
+            Physics::drift(*particles, pendingDrift);
+            pendingDrift = 0.0f;
+            
+            #pragma omp parallel for
+            for (long i = 0; i < n; i++) {
+                activeMask[i] = s % binStride(timeBins[i]) == 0 ? 1 : 0;
+            }
+            
+            integrateMs += elapsedMs(substepStart, ProfileClock::now());
+            
+            evaluated += evaluateForces(s < substeps, &activeMask, false, rebuilds, treeMs, forcesMs);
+            
+            auto afterForces = ProfileClock::now();
+            
+            // closing half kick, then the opening half kick of the next step
+            // with the bin the new acceleration asks for
+            #pragma omp parallel for
+            for (long i = 0; i < n; i++) {
+                if (!activeMask[i]) continue;
+                glm::vec3 acceleration = particles->getAcceleration(i);
+                glm::vec3 velocity = particles->getVelocity(i);
+                velocity += acceleration * binStep(timeBins[i]) * 0.5f;
+                int bin = chooseBin(acceleration, s);
+                if (s < substeps) velocity += acceleration * binStep(bin) * 0.5f;
+                particles->setVelocity(i, velocity);
+                timeBins[i] = static_cast<uint8_t>(bin);
+            }
+            std::fill(binCounts.begin(), binCounts.end(), 0);
+            for (long i = 0; i < n; i++) binCounts[timeBins[i]]++;
+            
+            finalizeMs += elapsedMs(afterForces, ProfileClock::now());
+        }
+        
+        auto endTime = ProfileClock::now();
+        
+        lastTimings.integrate = integrateMs;
+        lastTimings.treeBuild = treeMs;
+        lastTimings.forces = forcesMs;
+        lastTimings.finalize = finalizeMs;
+        lastTimings.total = elapsedMs(startTime, endTime);
+        lastTimings.treeRebuilds = rebuilds;
+        lastTimings.forceEvaluations = evaluated;
+        counters.finish(startCounters);
+        
+        measureDiagnostics();
+        
+        if (enableProfiling) {
+            std::cout << "BH Profiling [" << n << " particles, " << forceSubsteps << " force substeps]:"
+                      << " Total: " << lastTimings.total << "ms,"
+                      << " Tree: " << lastTimings.treeBuild << "ms (" << rebuilds << " rebuilds),"
+                      << " Forces: " << lastTimings.forces << "ms (" << evaluated << " evaluations),"
+                      << " Integrate: " << (lastTimings.integrate + lastTimings.finalize) << "ms"
+                      << std::endl;
+        }
+    }
+    
+    // Computes accelerations for every particle, or only for those flagged in
+    // active (indexed by particle; the others keep theirs). damp applies the
+    // far-field friction (velocity * 0.998 beyond radius 30), which callers
+    // ask for once per update(). A nonzero closingKick is the dt of a
+    // leapfrog step whose closing half kick is applied here, with each new
+    // acceleration, instead of in another pass (global steps only). Returns
+    // how many particles were evaluated.
+    long calculateForcesSafely(const std::vector<uint8_t>* active = nullptr, bool damp = true,
+                               float closingKick = 0.0f) {
+        NBODY_TRACE_SCOPE("forces.walk");
+        if (!particles) return 0;
+        
+        const long n = static_cast<long>(particles->size());
+        
+        // with the kick fused, massless particles get their zero below instead
+        if (!active && closingKick == 0.0f) Physics::clearAccelerations(*particles);
 
-        for (size_t i = 0; i < n; i++) {
-            if ((*particles)[i].mass <= 0.0f) continue;
+        // visit particles in tree order so consecutive walks share nodes
+        const std::vector<uint32_t>& order = octree.getBodyOrder();
+        bool useTreeOrder = order.size() == static_cast<size_t>(n);
+        long fallbackCount = 0;
+        long evaluated = 0;
+        
+        bool groupAccelerations = false;
+        if (useGroupWalk) {
+            try {
+                octree.calculateGroupAccelerations(G, softening, treeAccelerations, active);
+                groupAccelerations = true;
+            } catch (const std::exception& e) {
+                std::cerr << "Error in group tree walk, walking per particle: " << e.what() << std::endl;
+            }
+        }
+        
+        const glm::vec3 blackHolePos = particles->getPosition(0);
+        const float blackHoleMass = particles->getMass(0);
+
+        // Walk cost varies by orders of magnitude between a dense core and the
+        // halo, so threads pull small chunks of the tree-ordered list as they go.
+        // Every write below touches only particle i, and the walk is read-only.
+        #pragma omp parallel for schedule(dynamic, FORCE_CHUNK_SIZE) reduction(+:fallbackCount, evaluated)
+        for (long k = 0; k < n; k++) {
+            size_t i = useTreeOrder ? order[k] : static_cast<size_t>(k);
+            if (active && !(*active)[i]) continue;
+            const glm::vec3 pos = particles->getPosition(i);
+            const float mass = particles->getMass(i);
+            if (mass <= 0.0f) {
+                if (closingKick != 0.0f) particles->setAcceleration(i, glm::vec3(0.0f));
+                continue;
+            }
+            evaluated++;
             
             float adaptiveSoftening = softening;
-            if ((*particles)[i].mass > 10.0f) {
+            if (mass > 10.0f) {
                 adaptiveSoftening = softening * 1.5f;
             }
             
             glm::vec3 force(0.0f);
             
+            // exceptions must not leave an OpenMP region: handle them per particle
+            // and report once after the loop
             try {
-                force = octree.calculateForce((*particles)[i], G, adaptiveSoftening);
-            } catch (const std::exception& e) {
-                std::cerr << "Error in octree force calc, using direct for particle " << i << std::endl;
+                // the group walk uses the base softening; heavy particles walk alone
+                if (groupAccelerations && adaptiveSoftening == softening) {
+                    force = treeAccelerations[i] * mass;
+                } else {
+                    force = octree.calculateForce(pos, mass, G, adaptiveSoftening);
+                }
+            } catch (const std::exception&) {
                 force = calculateDirectForce(i);
-                continue;
+                fallbackCount++;
             }
             
-            if (i > 0 && n > 1 && (*particles)[0].mass > 100.0f) {
-                glm::vec3 pos1((*particles)[i].position);
-                glm::vec3 pos2((*particles)[0].position);
-                
-                glm::vec3 direction = pos2 - pos1;
+            if (i > 0 && n > 1 && blackHoleMass > 100.0f) {
+                glm::vec3 direction = blackHolePos - pos;
                 float distSquared = glm::dot(direction, direction) + adaptiveSoftening;
                 
                 if (distSquared > 0.0001f) {
                     float dist = sqrt(distSquared);
                     direction /= dist;
                     
-                    float forceMag = G * (*particles)[i].mass * (*particles)[0].mass / distSquared;
+                    float forceMag = G * mass * blackHoleMass / distSquared;
                     force += direction * forceMag;
                 }
             }
             
-            glm::vec3 acceleration = force / std::max(0.001f, (*particles)[i].mass);
+            glm::vec3 acceleration = force / std::max(0.001f, mass);
             
             float maxAcc = 1000.0f; 
             float accMag = glm::length(acceleration);
@@ -159,33 +594,41 @@ private:
                 acceleration = acceleration * (maxAcc / accMag);
             }
             
-            glm::vec3 pos((*particles)[i].position);
-            float distFromCenter = glm::length(pos);
-            if (distFromCenter > 30.0f) {
-                glm::vec3 vel((*particles)[i].velocity);
-                vel *= 0.998f;
-                (*particles)[i].velocity = glm::vec4(vel, 0.0f);
+            const bool farField = damp && glm::length(pos) > 30.0f;
+            if (closingKick != 0.0f) {
+                glm::vec3 velocity = particles->getVelocity(i);
+                if (farField) velocity *= 0.998f;
+                velocity += acceleration * closingKick * 0.5f;
+                particles->setVelocity(i, velocity);
+            } else if (farField) {
+                particles->setVelocity(i, particles->getVelocity(i) * 0.998f);
             }
             
-            (*particles)[i].acceleration = glm::vec4(acceleration, 0.0f);
+            particles->setAcceleration(i, acceleration);
         }
+
+        if (fallbackCount > 0) {
+            std::cerr << "Error in octree force calc, used direct summation for " 
+                      << fallbackCount << " particles" << std::endl;
+        }
+        return evaluated;
     }
     
     void calculateForcesDirectly() {
+        NBODY_TRACE_SCOPE("forces.direct");
         if (!particles) return;
         
-        size_t n = particles->size();
+        const long n = static_cast<long>(particles->size());
         
-        for (size_t i = 0; i < n; i++) {
-            (*particles)[i].acceleration = glm::vec4(0.0f);
-        }
+        Physics::clearAccelerations(*particles);
         
-        for (size_t i = 0; i < n; i++) {
+        #pragma omp parallel for schedule(static)
+        for (long i = 0; i < n; i++) {
             glm::vec3 force(0.0f);
             
             force = calculateDirectForce(i);
             
-            glm::vec3 acceleration = force / std::max(0.001f, (*particles)[i].mass);
+            glm::vec3 acceleration = force / std::max(0.001f, particles->getMass(i));
             
             float maxAcc = 1000.0f;
             float accMag = glm::length(acceleration);
@@ -193,7 +636,7 @@ private:
                 acceleration = acceleration * (maxAcc / accMag);
             }
             
-            (*particles)[i].acceleration = glm::vec4(acceleration, 0.0f);
+            particles->setAcceleration(i, acceleration);
         }
         
         if (enableProfiling) {
@@ -201,30 +644,33 @@ private:
         }
     }
     
-    glm::vec3 calculateDirectForce(size_t index) {
+    glm::vec3 calculateDirectForce(size_t index) const {
         if (!particles || index >= particles->size()) return glm::vec3(0.0f);
         
         glm::vec3 force(0.0f);
         size_t n = particles->size();
+        glm::vec3 pos1 = particles->getPosition(index);
+        float mass1 = particles->getMass(index);
         
         for (size_t j = 0; j < n; j++) {
             if (j == index) continue;
             
-            glm::vec3 pos1((*particles)[index].position);
-            glm::vec3 pos2((*particles)[j].position);
-            
-            glm::vec3 direction = pos2 - pos1;
+            glm::vec3 direction = particles->getPosition(j) - pos1;
             float distSquared = glm::dot(direction, direction) + softening;
             
             if (distSquared > 0.0001f) {
                 float dist = sqrt(distSquared);
                 direction /= dist;
                 
-                float forceMag = G * (*particles)[index].mass * (*particles)[j].mass / distSquared;
+                float forceMag = G * mass1 * particles->getMass(j) / distSquared;
                 force += direction * forceMag;
             }
         }
         
         return force;
     }
-};
\ No newline at end of file
+};
+
+using BarnesHutCPUSimulator = BasicBarnesHutSimulator<>;
+
+#endif // BHUT_H
@@ -0,0 +1,360 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include "particle.h"
+#include "trace.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <string>
+#include <type_traits>
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define NBODY_CHECKPOINT_MMAP 1
+#endif
+
+// Binary checkpoints: a fixed header followed by the particle arrays in the
+// layout of the build that wrote them (ten 64-byte aligned float streams
+// for NBODY_SOA_LAYOUT, Particle records otherwise), starting at
+// CHECKPOINT_DATA_OFFSET. Loading maps the file copy-on-write and, when the
+// layouts match, points the ParticleSystem straight at the mapping, so a
+// restart costs one mmap regardless of N and pages fault in as the first
+// step touches them. A file from the other layout is converted on load.
+// Files are native-endian; byteOrder rejects ones from the other kind.
+
+constexpr uint32_t CHECKPOINT_VERSION = 1;
+constexpr uint32_t CHECKPOINT_BYTE_ORDER = 0x01020304u;
+// particle data start, one page on common systems
+constexpr uint64_t CHECKPOINT_DATA_OFFSET = 4096;
+constexpr uint64_t CHECKPOINT_ALIGNMENT = 64;
+
+enum CheckpointLayout : uint32_t
+{
+    CHECKPOINT_AOS = 0,
+    CHECKPOINT_SOA = 1
+};
+
+// simulation state saved next to the particles
+struct CheckpointInfo
+{
+    uint64_t step = 0;
+    double time = 0.0;
+    float dt = 0.01f;
+    float theta = 0.5f;
+    // generateGalaxy type of the initial conditions, -1 when unknown
+    int32_t galaxyType = -1;
+    // generateGalaxy seed, 0 when unknown
+    uint64_t seed = 0;
+};
+
+struct CheckpointHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t headerBytes;
+    uint32_t byteOrder;
+    uint32_t layout;
+    // sizeof(Particle) for CHECKPOINT_AOS, sizeof(float) for CHECKPOINT_SOA
+    uint32_t recordBytes;
+    uint32_t reserved0;
+    uint64_t numParticles;
+    uint64_t step;
+    double time;
+    float dt;
+    float theta;
+    int32_t galaxyType;
+    uint32_t reserved1;
+    uint64_t seed;
+    uint64_t dataOffset;
+    // distance between SoA streams, a multiple of CHECKPOINT_ALIGNMENT
+    uint64_t streamBytes;
+    // total size, so a truncated file is rejected
+    uint64_t fileBytes;
+};
+
+static_assert(std::is_trivially_copyable<CheckpointHeader>::value, "header is written with fwrite");
+static_assert(sizeof(CheckpointHeader) <= CHECKPOINT_DATA_OFFSET, "header overlaps the particle data");
+
+namespace CheckpointDetail
+{
+    const char MAGIC[8] = { 'N', 'B', 'O', 'D', 'Y', 'C', 'K', 'P' };
+    const int SOA_STREAMS = 10;
+
+    inline uint64_t alignUp(uint64_t bytes) {
+        return (bytes + CHECKPOINT_ALIGNMENT - 1) / CHECKPOINT_ALIGNMENT * CHECKPOINT_ALIGNMENT;
+    }
+
+    inline bool writeZeros(FILE* file, uint64_t bytes) {
+        static const char zeros[CHECKPOINT_DATA_OFFSET] = {};
+        while (bytes > 0) {
+            const size_t chunk = static_cast<size_t>(std::min<uint64_t>(bytes, sizeof(zeros)));
+            if (std::fwrite(zeros, 1, chunk, file) != chunk) return false;
+            bytes -= chunk;
+        }
+        return true;
+    }
+
+    // A whole file mapped private and writable: stores land in copy-on-write
+    // pages and never reach the file. Without mmap the file is read into an
+    // aligned heap block instead.
+    class MappedFile
+    {
+    private:
+        unsigned char* base = nullptr;
+        size_t bytes = 0;
+
+        MappedFile() = default;
+
+    public:
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+        ~MappedFile() {
+            if (!base) return;
+#ifdef NBODY_CHECKPOINT_MMAP
+            munmap(base, bytes);
+#else
+            ::operator delete(base, std::align_val_t(CHECKPOINT_ALIGNMENT));
+#endif
+        }
+
+        static std::shared_ptr<MappedFile> open(const std::string& path) {
+            std::shared_ptr<MappedFile> mapped(new MappedFile());
+#ifdef NBODY_CHECKPOINT_MMAP
+            const int fd = ::open(path.c_str(), O_RDONLY);
+            if (fd < 0) {
+                std::cerr << "Failed to open checkpoint " << path << std::endl;
+                return nullptr;
+            }
+            struct stat info;
+            if (fstat(fd, &info) != 0 || info.st_size <= 0) {
+                std::cerr << "Checkpoint " << path << " is empty" << std::endl;
+                ::close(fd);
+                return nullptr;
+            }
+            mapped->bytes = static_cast<size_t>(info.st_size);
+            void* address = mmap(nullptr, mapped->bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+            ::close(fd);
+            if (address == MAP_FAILED) {
+                std::cerr << "Failed to map checkpoint " << path << std::endl;
+                mapped->bytes = 0;
+                return nullptr;
+            }
+            mapped->base = static_cast<unsigned char*>(address);
+            // start readahead now; the first step faults in whatever is left
+            madvise(mapped->base, mapped->bytes, MADV_WILLNEED);
+#else
+            FILE* file = std::fopen(path.c_str(), "rb");
+            if (!file) {
+                std::cerr << "Failed to open checkpoint " << path << std::endl;
+                return nullptr;
+            }
+            std::fseek(file, 0, SEEK_END);
+            const long size = std::ftell(file);
+            std::fseek(file, 0, SEEK_SET);
+            if (size <= 0) {
+                std::cerr << "Checkpoint " << path << " is empty" << std::endl;
+                std::fclose(file);
+                return nullptr;
+            }
+            mapped->bytes = static_cast<size_t>(size);
+            mapped->base = static_cast<unsigned char*>(
+                ::operator new(mapped->bytes, std::align_val_t(CHECKPOINT_ALIGNMENT)));
+            const bool complete = std::fread(mapped->base, 1, mapped->bytes, file) == mapped->bytes;
+            std::fclose(file);
+            if (!complete) {
+                std::cerr << "Failed to read checkpoint " << path << std::endl;
+                return nullptr;
+            }
+#endif
+            return mapped;
+        }
+
+        unsigned char* data() { return base; }
+        size_t size() const { return bytes; }
+    };
+}
+
+// Writes the particles and info to path. The file is written under a
+// temporary name and renamed over path once complete, so a crash mid-write
+// leaves the previous checkpoint intact, and a particle system still mapping
+// the old file keeps reading the old contents.
+inline bool writeCheckpoint(const std::string& path, ParticleSystem& particles, const CheckpointInfo& info)
+{
+    NBODY_TRACE_SCOPE("checkpoint.write");
+    using namespace CheckpointDetail;
+
+    const uint64_t n = particles.size();
+    CheckpointHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version = CHECKPOINT_VERSION;
+    header.headerBytes = sizeof(CheckpointHeader);
+    header.byteOrder = CHECKPOINT_BYTE_ORDER;
+    header.numParticles = n;
+    header.step = info.step;
+    header.time = info.time;
+    header.dt = info.dt;
+    header.theta = info.theta;
+    header.galaxyType = info.galaxyType;
+    header.seed = info.seed;
+    header.dataOffset = CHECKPOINT_DATA_OFFSET;
+#ifdef NBODY_SOA_LAYOUT
+    header.layout = CHECKPOINT_SOA;
+    header.recordBytes = sizeof(float);
+    header.streamBytes = alignUp(n * sizeof(float));
+    header.fileBytes = header.dataOffset + SOA_STREAMS * header.streamBytes;
+#else
+    header.layout = CHECKPOINT_AOS;
+    header.recordBytes = sizeof(Particle);
+    header.streamBytes = 0;
+    header.fileBytes = header.dataOffset + n * sizeof(Particle);
+#endif
+
+    const std::string temporary = path + ".tmp";
+    FILE* file = std::fopen(temporary.c_str(), "wb");
+    if (!file) {
+        std::cerr << "Failed to open checkpoint " << temporary << std::endl;
+        return false;
+    }
+    // the arrays are written straight from the particle system, skip stdio's buffer
+    std::setvbuf(file, nullptr, _IONBF, 0);
+
+    bool ok = std::fwrite(&header, sizeof(header), 1, file) == 1 &&
+              writeZeros(file, header.dataOffset - sizeof(header));
+#ifdef NBODY_SOA_LAYOUT
+    ParticleStreams s = particles.streams();
+    const float* const streams[SOA_STREAMS] = { s.x, s.y, s.z, s.vx, s.vy, s.vz, s.ax, s.ay, s.az, s.m };
+    for (const float* stream : streams) {
+        if (!ok) break;
+        ok = std::fwrite(stream, sizeof(float), n, file) == n &&
+             writeZeros(file, header.streamBytes - n * sizeof(float));
+    }
+#else
+    ok = ok && std::fwrite(particles.data(), sizeof(Particle), n, file) == n;
+#endif
+    ok = std::fflush(file) == 0 && ok;
+#ifdef NBODY_CHECKPOINT_MMAP
+    ok = ok && fsync(fileno(file)) == 0;
+#endif
+    ok = std::fclose(file) == 0 && ok;
+
+#ifdef _WIN32
+    // rename does not replace an existing file here
+    if (ok) std::remove(path.c_str());
+#endif
+    if (!ok || std::rename(temporary.c_str(), path.c_str()) != 0) {
+        std::cerr << "Failed to write checkpoint " << path << std::endl;
+        std::remove(temporary.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Replaces the particles with the checkpoint at path and fills info. With a
+// matching layout the particle system views the mapping until it is resized
+// past its length or destroyed; writes go to private copies of the pages.
+// A checkpoint of more than maxParticles is rejected before the particles
+// are touched.
+inline bool loadCheckpoint(const std::string& path, ParticleSystem& particles, CheckpointInfo& info,
+                           uint64_t maxParticles = UINT64_MAX)
+{
+    NBODY_TRACE_SCOPE("checkpoint.load");
+    using namespace CheckpointDetail;
+
+    std::shared_ptr<MappedFile> mapped = MappedFile::open(path);
+    if (!mapped) return false;
+
+    CheckpointHeader header;
+    if (mapped->size() < sizeof(header)) {
+        std::cerr << "Checkpoint " << path << " is truncated" << std::endl;
+        return false;
+    }
+    std::memcpy(&header, mapped->data(), sizeof(header));
+
+    if (std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0) {
+        std::cerr << path << " is not an n-body checkpoint" << std::endl;
+        return false;
+    }
+    if (header.version != CHECKPOINT_VERSION || header.headerBytes != sizeof(CheckpointHeader) ||
+        header.byteOrder != CHECKPOINT_BYTE_ORDER) {
+        std::cerr << "Checkpoint " << path << " has version " << header.version
+                  << " or byte order this build cannot read" << std::endl;
+        return false;
+    }
+
+    const uint64_t n = header.numParticles;
+    uint64_t dataBytes = 0;
+    if (header.layout == CHECKPOINT_SOA && header.recordBytes == sizeof(float) &&
+        header.streamBytes >= n * sizeof(float) && header.streamBytes % CHECKPOINT_ALIGNMENT == 0) {
+        dataBytes = SOA_STREAMS * header.streamBytes;
+    } else if (header.layout == CHECKPOINT_AOS && header.recordBytes == sizeof(Particle)) {
+        dataBytes = n * sizeof(Particle);
+    } else {
+        std::cerr << "Checkpoint " << path << " has an unknown particle layout" << std::endl;
+        return false;
+    }
+    if (header.dataOffset % CHECKPOINT_ALIGNMENT != 0 || header.fileBytes != header.dataOffset + dataBytes ||
+        header.fileBytes > mapped->size()) {
+        std::cerr << "Checkpoint " << path << " is truncated" << std::endl;
+        return false;
+    }
+    if (n > maxParticles) {
+        std::cerr << "Checkpoint " << path << " holds " << n << " particles, more than the "
+                  << maxParticles << " allowed" << std::endl;
+        return false;
+    }
+
+    unsigned char* data = mapped->data() + header.dataOffset;
+    const size_t count = static_cast<size_t>(n);
+    if (header.layout == CHECKPOINT_SOA) {
+        float* stream[SOA_STREAMS];
+        for (int k = 0; k < SOA_STREAMS; k++) {
+            stream[k] = reinterpret_cast<float*>(data + k * header.streamBytes);
+        }
+#ifdef NBODY_SOA_LAYOUT
+        particles.adoptStreams({ stream[0], stream[1], stream[2], stream[3], stream[4],
+                                 stream[5], stream[6], stream[7], stream[8], stream[9] },
+                               count, mapped);
+#else
+        particles.resize(count);
+        const long total = static_cast<long>(count);
+        #pragma omp parallel for if(total > 65536)
+        for (long i = 0; i < total; i++) {
+            particles.setParticle(i, Particle(glm::vec3(stream[0][i], stream[1][i], stream[2][i]),
+                                              glm::vec3(stream[3][i], stream[4][i], stream[5][i]),
+                                              glm::vec3(stream[6][i], stream[7][i], stream[8][i]),
+                                              stream[9][i]));
+        }
+#endif
+    } else {
+        Particle* records = reinterpret_cast<Particle*>(data);
+#ifdef NBODY_SOA_LAYOUT
+        particles.resize(count);
+        const long total = static_cast<long>(count);
+        #pragma omp parallel for if(total > 65536)
+        for (long i = 0; i < total; i++) {
+            particles.setParticle(i, records[i]);
+        }
+#else
+        particles.adoptParticles(records, count, mapped);
+#endif
+    }
+
+    info.step = header.step;
+    info.time = header.time;
+    info.dt = header.dt;
+    info.theta = header.theta;
+    info.galaxyType = header.galaxyType;
+    info.seed = header.seed;
+    return true;
+}
+
+#endif // CHECKPOINT_H
@@ -0,0 +1,36 @@
+#ifndef CLI_H
+#define CLI_H
+
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Argument helpers shared by the command-line tools (nbody_run, nbody_bench,
+// nbody_accuracy), so they agree on names.
+
+// --galaxy names, indexed by generateGalaxy type
+inline const char* const galaxyNames[] = { "random", "disk", "spiral", "collision", "dense" };
+inline constexpr int galaxyNameCount = sizeof(galaxyNames) / sizeof(galaxyNames[0]);
+
+// generateGalaxy type for name, -1 when unknown
+inline int parseGalaxy(const std::string& name)
+{
+    for (int i = 0; i < galaxyNameCount; i++) {
+        if (name == galaxyNames[i]) return i;
+    }
+    return -1;
+}
+
+// the non-empty items of a comma-separated list
+inline std::vector<std::string> splitList(const std::string& list)
+{
+    std::vector<std::string> items;
+    std::stringstream stream(list);
+    std::string item;
+    while (std::getline(stream, item, ',')) {
+        if (!item.empty()) items.push_back(item);
+    }
+    return items;
+}
+
+#endif // CLI_H
@@ -5,12 +5,13 @@ const unsigned int SCR_WIDTH = 1280;
 const unsigned int SCR_HEIGHT = 720;
 float deltaTime = 0.0f;
 float lastFrame = 0.0f;
-const int MAX_PARTICLES = 10000;
+// top of the particle count slider; larger counts are limited only by memory
+const int PARTICLE_SLIDER_MAX = 10000000;
 int numParticles = 1000;
 float simSpeed = 1.0f;
 float physicsTimeStep = 0.01f;
 bool pauseSimulation = false;
-int simulationType = 1;
+int simulationType = 1;  // 0 sequential, 1 Barnes-Hut, 2 fast multipole
 float theta = 0.5f;
 int galaxyType = 0; 
 
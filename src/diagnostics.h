@@ -0,0 +1,133 @@
+#ifndef DIAGNOSTICS_H
+#define DIAGNOSTICS_H
+
+#include "octree.h"
+#include "particle.h"
+#include "profiling.h"
+#include "trace.h"
+#include <glm/glm.hpp>
+#include <cmath>
+#include <limits>
+
+// Conserved quantities of the particle system at one instant
+struct Diagnostics
+{
+    // simulator update() calls completed at the measurement; -1 before the first
+    long step = -1;
+    double kinetic = 0.0;
+    // tree-approximated, sum over pairs of -G m_i m_j / sqrt(r^2 + softening)
+    double potential = 0.0;
+    glm::dvec3 momentum = glm::dvec3(0.0);
+    // about the origin
+    glm::dvec3 angularMomentum = glm::dvec3(0.0);
+    // |E - E0| / |E0| and |L - L0| / |L0| against the first measurement
+    // since diagnostics were switched on
+    double energyDrift = 0.0;
+    double angularMomentumDrift = 0.0;
+    float elapsedMs = 0.0f;
+
+    bool valid() const { return step >= 0; }
+    double totalEnergy() const { return kinetic + potential; }
+    // 2K / |W|: 1 for a system in virial equilibrium
+    double virialRatio() const {
+        return potential != 0.0 ? 2.0 * kinetic / std::fabs(potential)
+                                : std::numeric_limits<double>::infinity();
+    }
+};
+
+// Measures Diagnostics every interval simulator steps (0 = never). Kinetic
+// energy and momenta are parallel reductions; the potential energy walks the
+// simulator's octree once per particle, O(N log N) in total, and also runs
+// in parallel. Simulators call measure() at the end of update() with the
+// tree matching the final positions.
+class DiagnosticsMonitor
+{
+private:
+    int interval = 0;
+    long steps = 0;
+    Diagnostics latest;
+    bool haveInitial = false;
+    double initialEnergy = 0.0;
+    glm::dvec3 initialAngularMomentum = glm::dvec3(0.0);
+
+public:
+    // switching on (from 0) starts a new baseline for the drifts
+    void setInterval(int everySteps) {
+        everySteps = everySteps > 0 ? everySteps : 0;
+        if (interval == 0 && everySteps > 0) haveInitial = false;
+        interval = everySteps;
+    }
+    int getInterval() const { return interval; }
+
+    // counts a finished update(); true when it should be measured (the
+    // first one and every interval-th after it)
+    bool step() {
+        steps++;
+        return interval > 0 && (steps - 1) % interval == 0;
+    }
+
+    // externalMass > 0 adds the point mass at particle 0 that the tree
+    // engines apply to particles 1..n-1 on top of the tree forces
+    template <int Order>
+    const Diagnostics& measure(const ParticleSystem &particles, const BasicOctree<Order> &octree,
+                               float G, float softening, float externalMass = 0.0f)
+    {
+        NBODY_TRACE_SCOPE("diagnostics");
+        auto start = ProfileClock::now();
+        const long n = static_cast<long>(particles.size());
+        const glm::vec3 externalPos = n > 0 ? particles.getPosition(0) : glm::vec3(0.0f);
+
+        double kinetic = 0.0, potential = 0.0;
+        double px = 0.0, py = 0.0, pz = 0.0;
+        double lx = 0.0, ly = 0.0, lz = 0.0;
+
+        #pragma omp parallel for schedule(dynamic, 256) reduction(+:kinetic, potential, px, py, pz, lx, ly, lz)
+        for (long i = 0; i < n; i++) {
+            const double m = particles.getMass(i);
+            if (m <= 0.0) continue;
+            const glm::dvec3 x(particles.getPosition(i));
+            const glm::dvec3 v(particles.getVelocity(i));
+
+            kinetic += 0.5 * m * glm::dot(v, v);
+            px += m * v.x;
+            py += m * v.y;
+            pz += m * v.z;
+            const glm::dvec3 l = m * glm::cross(x, v);
+            lx += l.x;
+            ly += l.y;
+            lz += l.z;
+
+            // every pair is seen from both ends
+            double phi = octree.calculatePotential(particles.getPosition(i), G, softening);
+            potential += 0.5 * m * phi;
+
+            if (i > 0 && externalMass > 0.0f) {
+                glm::vec3 d = externalPos - particles.getPosition(i);
+                potential -= G * externalMass * m / std::sqrt(glm::dot(d, d) + softening);
+            }
+        }
+
+        latest.step = steps;
+        latest.kinetic = kinetic;
+        latest.potential = potential;
+        latest.momentum = glm::dvec3(px, py, pz);
+        latest.angularMomentum = glm::dvec3(lx, ly, lz);
+
+        if (!haveInitial) {
+            haveInitial = true;
+            initialEnergy = latest.totalEnergy();
+            initialAngularMomentum = latest.angularMomentum;
+        }
+        latest.energyDrift = initialEnergy != 0.0
+            ? std::fabs(latest.totalEnergy() - initialEnergy) / std::fabs(initialEnergy) : 0.0;
+        const double l0 = glm::length(initialAngularMomentum);
+        latest.angularMomentumDrift = l0 > 0.0
+            ? glm::length(latest.angularMomentum - initialAngularMomentum) / l0 : 0.0;
+        latest.elapsedMs = elapsedMs(start, ProfileClock::now());
+        return latest;
+    }
+
+    const Diagnostics& getLatest() const { return latest; }
+};
+
+#endif // DIAGNOSTICS_H
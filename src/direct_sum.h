@@ -0,0 +1,355 @@
+#ifndef DIRECT_SUM_H
+#define DIRECT_SUM_H
+
+#include "particle.h"
+#include "simd.h"
+#include "aligned_allocator.h"
+#include <glm/glm.hpp>
+#include <algorithm>
+#include <vector>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+// Cache-blocked O(N^2) gravitational accelerations over particles [begin, n):
+//   a_i = G * sum_j m_j * d_ij / (|d_ij|^2 + softening)^(3/2)
+// which is what summing Physics::calculateForce(...) / m_i gives. Positions and
+// masses are gathered into padded aligned streams (padding has zero mass), and
+// 1/r comes from the vector rsqrt estimate refined by one Newton step.
+//
+// The default mode gives every thread a block of targets and streams sources
+// through it one L1-sized tile at a time; results do not depend on the thread
+// count. Symmetric mode visits each pair once and applies Newton's third law,
+// halving the pair count; each thread accumulates into its own buffer and the
+// buffers are summed at the end, so the last bits can vary with thread count.
+//
+// computeAccelerationsAndJerks also sums the jerk (da/dt, for the Hermite
+// integrator) in the one-sided layout:
+//   j_i = G * sum_j m_j * (v_ij / r^3 - 3 (d_ij . v_ij) d_ij / r^5)
+class DirectSumKernel
+{
+private:
+    using Stream = std::vector<float, AlignedAllocator<float, 64>>;
+
+    // targets per parallel work item; the accumulators stay in L1
+    static constexpr int TARGET_BLOCK = 32;
+    // sources per tile: 4 streams x 1024 floats = 16 KB
+    static constexpr int SOURCE_TILE = 1024;
+
+    static_assert(SOURCE_TILE % SimdFloat::WIDTH == 0, "tile must hold whole vectors");
+
+    size_t count = 0;
+    size_t padded = 0;
+    Stream x, y, z, m;
+    Stream ax, ay, az;
+    Stream vx, vy, vz;
+    Stream jx, jy, jz;
+    std::vector<Stream> threadAcc;
+
+public:
+    void computeAccelerations(const ParticleSystem &particles, size_t begin,
+                              float G, float softening, bool symmetric = false)
+    {
+        gather(particles, begin);
+        if (count == 0) return;
+
+        if (symmetric) {
+            computeSymmetric(G, softening);
+        } else {
+            computeOneSided(G, softening);
+        }
+    }
+
+    void computeAccelerationsAndJerks(const ParticleSystem &particles, size_t begin,
+                                      float G, float softening)
+    {
+        gather(particles, begin);
+        if (count == 0) return;
+
+        for (Stream *s : { &vx, &vy, &vz, &jx, &jy, &jz }) {
+            s->assign(padded, 0.0f);
+        }
+        const long n = static_cast<long>(count);
+        #pragma omp parallel for if(n > 65536)
+        for (long i = 0; i < n; i++) {
+            glm::vec3 v = particles.getVelocity(begin + i);
+            vx[i] = v.x;
+            vy[i] = v.y;
+            vz[i] = v.z;
+        }
+
+        computeWithJerks(G, softening);
+    }
+
+    // acceleration of particle begin + i from the last computeAccelerations call
+    glm::vec3 getAcceleration(size_t i) const { return glm::vec3(ax[i], ay[i], az[i]); }
+
+    // jerk of particle begin + i from the last computeAccelerationsAndJerks call
+    glm::vec3 getJerk(size_t i) const { return glm::vec3(jx[i], jy[i], jz[i]); }
+
+    size_t size() const { return count; }
+
+private:
+    void gather(const ParticleSystem &particles, size_t begin)
+    {
+        count = particles.size() > begin ? particles.size() - begin : 0;
+        padded = (count + SimdFloat::WIDTH - 1) / SimdFloat::WIDTH * SimdFloat::WIDTH;
+
+        for (Stream *s : { &x, &y, &z, &m, &ax, &ay, &az }) {
+            s->assign(padded, 0.0f);
+        }
+
+        const long n = static_cast<long>(count);
+        #pragma omp parallel for if(n > 65536)
+        for (long i = 0; i < n; i++) {
+            glm::vec3 p = particles.getPosition(begin + i);
+            x[i] = p.x;
+            y[i] = p.y;
+            z[i] = p.z;
+            m[i] = particles.getMass(begin + i);
+        }
+    }
+
+    // G * m_j * inv^3 for the pair (target at xi,yi,zi; sources at j..j+WIDTH)
+    static inline SimdFloat pairScale(SimdFloat dx, SimdFloat dy, SimdFloat dz,
+                                      SimdFloat mj, SimdFloat eps, SimdFloat g)
+    {
+        SimdFloat r2 = SimdFloat::fma(dx, dx, SimdFloat::fma(dy, dy, SimdFloat::fma(dz, dz, eps)));
+        SimdFloat inv = rsqrt(r2);
+        return g * mj * inv * inv * inv;
+    }
+
+    void computeOneSided(float G, float softening)
+    {
+        const long blocks = static_cast<long>((count + TARGET_BLOCK - 1) / TARGET_BLOCK);
+        const SimdFloat eps = SimdFloat::broadcast(softening);
+        const SimdFloat g = SimdFloat::broadcast(G);
+
+        #pragma omp parallel for schedule(static)
+        for (long block = 0; block < blocks; block++) {
+            const size_t iBegin = static_cast<size_t>(block) * TARGET_BLOCK;
+            const size_t iEnd = std::min(count, iBegin + TARGET_BLOCK);
+
+            SimdFloat accX[TARGET_BLOCK], accY[TARGET_BLOCK], accZ[TARGET_BLOCK];
+            for (int k = 0; k < TARGET_BLOCK; k++) {
+                accX[k] = accY[k] = accZ[k] = SimdFloat::zero();
+            }
+
+            for (size_t tile = 0; tile < padded; tile += SOURCE_TILE) {
+                const size_t tileEnd = std::min(padded, tile + SOURCE_TILE);
+
+                for (size_t i = iBegin; i < iEnd; i++) {
+                    const SimdFloat xi = SimdFloat::broadcast(x[i]);
+                    const SimdFloat yi = SimdFloat::broadcast(y[i]);
+                    const SimdFloat zi = SimdFloat::broadcast(z[i]);
+                    SimdFloat sx = accX[i - iBegin], sy = accY[i - iBegin], sz = accZ[i - iBegin];
+
+                    // the self pair has d = 0 and contributes nothing
+                    for (size_t j = tile; j < tileEnd; j += SimdFloat::WIDTH) {
+                        SimdFloat dx = SimdFloat::load(&x[j]) - xi;
+                        SimdFloat dy = SimdFloat::load(&y[j]) - yi;
+                        SimdFloat dz = SimdFloat::load(&z[j]) - zi;
+                        SimdFloat s = pairScale(dx, dy, dz, SimdFloat::load(&m[j]), eps, g);
+                        sx = SimdFloat::fma(dx, s, sx);
+                        sy = SimdFloat::fma(dy, s, sy);
+                        sz = SimdFloat::fma(dz, s, sz);
+                    }
+
+                    accX[i - iBegin] = sx;
+                    accY[i - iBegin] = sy;
+                    accZ[i - iBegin] = sz;
+                }
+            }
+
+            for (size_t i = iBegin; i < iEnd; i++) {
+                ax[i] = accX[i - iBegin].sum();
+                ay[i] = accY[i - iBegin].sum();
+                az[i] = accZ[i - iBegin].sum();
+            }
+        }
+    }
+
+    // computeOneSided plus the jerk; sources stream 7 arrays per tile
+    void computeWithJerks(float G, float softening)
+    {
+        const long blocks = static_cast<long>((count + TARGET_BLOCK - 1) / TARGET_BLOCK);
+        const SimdFloat eps = SimdFloat::broadcast(softening);
+        const SimdFloat g = SimdFloat::broadcast(G);
+        const SimdFloat three = SimdFloat::broadcast(3.0f);
+
+        #pragma omp parallel for schedule(static)
+        for (long block = 0; block < blocks; block++) {
+            const size_t iBegin = static_cast<size_t>(block) * TARGET_BLOCK;
+            const size_t iEnd = std::min(count, iBegin + TARGET_BLOCK);
+
+            SimdFloat acc[6][TARGET_BLOCK];
+            for (int c = 0; c < 6; c++) {
+                for (int k = 0; k < TARGET_BLOCK; k++) acc[c][k] = SimdFloat::zero();
+            }
+
+            for (size_t tile = 0; tile < padded; tile += SOURCE_TILE) {
+                const size_t tileEnd = std::min(padded, tile + SOURCE_TILE);
+
+                for (size_t i = iBegin; i < iEnd; i++) {
+                    const size_t k = i - iBegin;
+                    const SimdFloat xi = SimdFloat::broadcast(x[i]);
+                    const SimdFloat yi = SimdFloat::broadcast(y[i]);
+                    const SimdFloat zi = SimdFloat::broadcast(z[i]);
+                    const SimdFloat vxi = SimdFloat::broadcast(vx[i]);
+                    const SimdFloat vyi = SimdFloat::broadcast(vy[i]);
+                    const SimdFloat vzi = SimdFloat::broadcast(vz[i]);
+                    SimdFloat sx = acc[0][k], sy = acc[1][k], sz = acc[2][k];
+                    SimdFloat tx = acc[3][k], ty = acc[4][k], tz = acc[5][k];
+
+                    for (size_t j = tile; j < tileEnd; j += SimdFloat::WIDTH) {
+                        SimdFloat dx = SimdFloat::load(&x[j]) - xi;
+                        SimdFloat dy = SimdFloat::load(&y[j]) - yi;
+                        SimdFloat dz = SimdFloat::load(&z[j]) - zi;
+                        SimdFloat dvx = SimdFloat::load(&vx[j]) - vxi;
+                        SimdFloat dvy = SimdFloat::load(&vy[j]) - vyi;
+                        SimdFloat dvz = SimdFloat::load(&vz[j]) - vzi;
+                        SimdFloat r2 = SimdFloat::fma(dx, dx, SimdFloat::fma(dy, dy, SimdFloat::fma(dz, dz, eps)));
+                        SimdFloat inv = rsqrt(r2);
+                        SimdFloat s = g * SimdFloat::load(&m[j]) * inv * inv * inv;
+                        // 3 (d . dv) / r^2 * s
+                        SimdFloat rv = SimdFloat::fma(dx, dvx, SimdFloat::fma(dy, dvy, dz * dvz));
+                        SimdFloat q = three * rv * inv * inv * s;
+                        sx = SimdFloat::fma(dx, s, sx);
+                        sy = SimdFloat::fma(dy, s, sy);
+                        sz = SimdFloat::fma(dz, s, sz);
+                        tx = SimdFloat::fnma(dx, q, SimdFloat::fma(dvx, s, tx));
+                        ty = SimdFloat::fnma(dy, q, SimdFloat::fma(dvy, s, ty));
+                        tz = SimdFloat::fnma(dz, q, SimdFloat::fma(dvz, s, tz));
+                    }
+
+                    acc[0][k] = sx; acc[1][k] = sy; acc[2][k] = sz;
+                    acc[3][k] = tx; acc[4][k] = ty; acc[5][k] = tz;
+                }
+            }
+
+            for (size_t i = iBegin; i < iEnd; i++) {
+                const size_t k = i - iBegin;
+                ax[i] = acc[0][k].sum();
+                ay[i] = acc[1][k].sum();
+                az[i] = acc[2][k].sum();
+                jx[i] = acc[3][k].sum();
+                jy[i] = acc[4][k].sum();
+                jz[i] = acc[5][k].sum();
+            }
+        }
+    }
+
+    void computeSymmetric(float G, float softening)
+    {
+        const long tiles = static_cast<long>((padded + SOURCE_TILE - 1) / SOURCE_TILE);
+        const long pairs = tiles * (tiles + 1) / 2;
+        const SimdFloat eps = SimdFloat::broadcast(softening);
+        const SimdFloat g = SimdFloat::broadcast(G);
+
+#ifdef _OPENMP
+        const int threads = omp_get_max_threads();
+#else
+        const int threads = 1;
+#endif
+        threadAcc.resize(static_cast<size_t>(threads));
+        // OpenMP may grant fewer threads than asked for; only the buffers of
+        // the team that ran are current
+        int team = 1;
+
+        #pragma omp parallel num_threads(threads)
+        {
+#ifdef _OPENMP
+            const int t = omp_get_thread_num();
+            #pragma omp single nowait
+            team = omp_get_num_threads();
+#else
+            const int t = 0;
+#endif
+            // one buffer per thread: x, y, z accelerations back to back
+            Stream &acc = threadAcc[t];
+            acc.assign(3 * padded, 0.0f);
+            float *accX = acc.data();
+            float *accY = accX + padded;
+            float *accZ = accY + padded;
+
+            #pragma omp for schedule(dynamic, 1)
+            for (long pair = 0; pair < pairs; pair++) {
+                // unrank pair -> (tileI, tileJ) with tileI <= tileJ
+                long tileI = 0, rowStart = 0;
+                while (rowStart + (tiles - tileI) <= pair) {
+                    rowStart += tiles - tileI;
+                    tileI++;
+                }
+                const long tileJ = tileI + (pair - rowStart);
+
+                const size_t iBegin = static_cast<size_t>(tileI) * SOURCE_TILE;
+                const size_t iEnd = std::min(padded, iBegin + SOURCE_TILE);
+                const size_t jBegin = static_cast<size_t>(tileJ) * SOURCE_TILE;
+                const size_t jEnd = std::min(padded, jBegin + SOURCE_TILE);
+
+                for (size_t i = iBegin; i < std::min(iEnd, count); i++) {
+                    const SimdFloat xi = SimdFloat::broadcast(x[i]);
+                    const SimdFloat yi = SimdFloat::broadcast(y[i]);
+                    const SimdFloat zi = SimdFloat::broadcast(z[i]);
+                    const SimdFloat mi = SimdFloat::broadcast(m[i]);
+                    SimdFloat sx = SimdFloat::zero(), sy = SimdFloat::zero(), sz = SimdFloat::zero();
+
+                    if (tileI == tileJ) {
+                        // diagonal tile: one-sided, every pair is seen from both ends
+                        for (size_t j = jBegin; j < jEnd; j += SimdFloat::WIDTH) {
+                            SimdFloat dx = SimdFloat::load(&x[j]) - xi;
+                            SimdFloat dy = SimdFloat::load(&y[j]) - yi;
+                            SimdFloat dz = SimdFloat::load(&z[j]) - zi;
+                            SimdFloat s = pairScale(dx, dy, dz, SimdFloat::load(&m[j]), eps, g);
+                            sx = SimdFloat::fma(dx, s, sx);
+                            sy = SimdFloat::fma(dy, s, sy);
+                            sz = SimdFloat::fma(dz, s, sz);
+                        }
+                    } else {
+                        for (size_t j = jBegin; j < jEnd; j += SimdFloat::WIDTH) {
+                            SimdFloat dx = SimdFloat::load(&x[j]) - xi;
+                            SimdFloat dy = SimdFloat::load(&y[j]) - yi;
+                            SimdFloat dz = SimdFloat::load(&z[j]) - zi;
+                            SimdFloat r2 = SimdFloat::fma(dx, dx, SimdFloat::fma(dy, dy, SimdFloat::fma(dz, dz, eps)));
+                            SimdFloat inv = rsqrt(r2);
+                            SimdFloat gInv3 = g * inv * inv * inv;
+
+                            SimdFloat si = gInv3 * SimdFloat::load(&m[j]);
+                            sx = SimdFloat::fma(dx, si, sx);
+                            sy = SimdFloat::fma(dy, si, sy);
+                            sz = SimdFloat::fma(dz, si, sz);
+
+                            // equal and opposite on j
+                            SimdFloat sj = gInv3 * mi;
+                            SimdFloat::fnma(dx, sj, SimdFloat::load(&accX[j])).store(&accX[j]);
+                            SimdFloat::fnma(dy, sj, SimdFloat::load(&accY[j])).store(&accY[j]);
+                            SimdFloat::fnma(dz, sj, SimdFloat::load(&accZ[j])).store(&accZ[j]);
+                        }
+                    }
+
+                    accX[i] += sx.sum();
+                    accY[i] += sy.sum();
+                    accZ[i] += sz.sum();
+                }
+            }
+
+            // implicit barrier above; now sum the per-thread buffers
+            const long n = static_cast<long>(count);
+            #pragma omp for schedule(static)
+            for (long i = 0; i < n; i++) {
+                float sumX = 0.0f, sumY = 0.0f, sumZ = 0.0f;
+                for (int k = 0; k < team; k++) {
+                    const float *buffer = threadAcc[k].data();
+                    sumX += buffer[i];
+                    sumY += buffer[padded + i];
+                    sumZ += buffer[2 * padded + i];
+                }
+                ax[i] = sumX;
+                ay[i] = sumY;
+                az[i] = sumZ;
+            }
+        }
+    }
+};
+
+#endif // DIRECT_SUM_H
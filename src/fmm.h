@@ -0,0 +1,505 @@
+#ifndef FMM_H
+#define FMM_H
+
+#include "octree.h"
+#include "interaction_list.h"
+#include <glm/glm.hpp>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+// Multi-index bookkeeping for Cartesian Taylor expansions up to `order`.
+// Coefficients are stored graded by degree |n| = nx + ny + nz, so the first
+// (d+1)(d+2)(d+3)/6 entries are exactly those of degree <= d.
+class ExpansionTables
+{
+public:
+    static constexpr int MAX_ORDER = 8;
+
+    // L[n] += sum over its terms of signedM[k] * D[nk], terms grouped by n
+    struct M2LTerm { uint16_t k, nk; };
+    // parent M[n] += child M[k] * s^(n-k) / (n-k)!
+    struct M2MTerm { uint16_t n, k, diff; };
+    // child L[n] += parent L[nk] * t^k / k!
+    struct L2LTerm { uint16_t n, k, nk; };
+    // degree-(p-1) coefficient and the coefficients one step up each axis
+    struct L2PTerm { uint16_t m, x, y, z; };
+
+    int order = 0;
+    int count = 0;
+    std::vector<int> nx, ny, nz, degree;
+    std::vector<M2LTerm> m2l;
+    std::vector<M2MTerm> m2m;
+    std::vector<L2LTerm> l2l;
+    std::vector<L2PTerm> l2p;
+
+    std::vector<uint32_t> m2lStart;
+
+    // one step of the derivative recurrence, flattened in evaluation order:
+    // scratch[dst] = R[axis] * scratch[src] + coef * scratch[src2]
+    struct DerivativeStep { uint16_t dst, src, src2, axis; double coef; };
+    std::vector<DerivativeStep> derivativeSteps;
+
+    static constexpr int countUpTo(int d) { return (d + 1) * (d + 2) * (d + 3) / 6; }
+
+    void build(int p)
+    {
+        order = p;
+        count = countUpTo(p);
+        nx.clear(); ny.clear(); nz.clear(); degree.clear();
+        lookup.assign(static_cast<size_t>((p + 1) * (p + 1) * (p + 1)), -1);
+
+        for (int d = 0; d <= p; d++) {
+            for (int x = d; x >= 0; x--) {
+                for (int y = d - x; y >= 0; y--) {
+                    int z = d - x - y;
+                    lookup[key(x, y, z)] = static_cast<int>(nx.size());
+                    nx.push_back(x); ny.push_back(y); nz.push_back(z); degree.push_back(d);
+                }
+            }
+        }
+
+        // D^c phi_m is reached from its parent c - e_i along the first axis i
+        // with n_i > 0; m runs up to order - degree(c)
+        derivativeSteps.clear();
+        for (int c = 1; c < count; c++) {
+            int n[3] = { nx[c], ny[c], nz[c] };
+            int i = n[0] > 0 ? 0 : (n[1] > 0 ? 1 : 2);
+            n[i]--;
+            const int parent = index(n[0], n[1], n[2]);
+            const int power = n[i];
+            int grandparent = 0;
+            if (power > 0) {
+                n[i]--;
+                grandparent = index(n[0], n[1], n[2]);
+            }
+            for (int m = 0; m <= p - degree[c]; m++) {
+                derivativeSteps.push_back({ static_cast<uint16_t>(m * count + c),
+                                            static_cast<uint16_t>((m + 1) * count + parent),
+                                            static_cast<uint16_t>((m + 1) * count + grandparent),
+                                            static_cast<uint16_t>(i), static_cast<double>(power) });
+            }
+        }
+
+        m2l.clear(); m2m.clear(); l2l.clear(); l2p.clear();
+        m2lStart.assign(1, 0);
+        for (int n = 0; n < count; n++) {
+            for (int k = 0; k < count; k++) {
+                int sx = nx[n] + nx[k], sy = ny[n] + ny[k], sz = nz[n] + nz[k];
+                if (sx + sy + sz <= p) {
+                    uint16_t nk = static_cast<uint16_t>(index(sx, sy, sz));
+                    m2l.push_back({ static_cast<uint16_t>(k), nk });
+                    l2l.push_back({ static_cast<uint16_t>(n), static_cast<uint16_t>(k), nk });
+                }
+                if (nx[k] <= nx[n] && ny[k] <= ny[n] && nz[k] <= nz[n]) {
+                    m2m.push_back({ static_cast<uint16_t>(n), static_cast<uint16_t>(k),
+                                    static_cast<uint16_t>(index(nx[n] - nx[k], ny[n] - ny[k], nz[n] - nz[k])) });
+                }
+            }
+            m2lStart.push_back(static_cast<uint32_t>(m2l.size()));
+        }
+        for (int m = 0; m < countUpTo(p - 1); m++) {
+            l2p.push_back({ static_cast<uint16_t>(m),
+                            static_cast<uint16_t>(index(nx[m] + 1, ny[m], nz[m])),
+                            static_cast<uint16_t>(index(nx[m], ny[m] + 1, nz[m])),
+                            static_cast<uint16_t>(index(nx[m], ny[m], nz[m] + 1)) });
+        }
+    }
+
+    int index(int x, int y, int z) const { return lookup[key(x, y, z)]; }
+
+    // out[c] = v^n / n! for every coefficient up to `upTo` degree
+    void monomials(const glm::dvec3 &v, double *out, int upTo) const
+    {
+        double px[MAX_ORDER + 1], py[MAX_ORDER + 1], pz[MAX_ORDER + 1];
+        px[0] = py[0] = pz[0] = 1.0;
+        for (int j = 1; j <= upTo; j++) {
+            px[j] = px[j - 1] * v.x / j;
+            py[j] = py[j - 1] * v.y / j;
+            pz[j] = pz[j - 1] * v.z / j;
+        }
+        const int last = countUpTo(upTo);
+        for (int c = 0; c < last; c++) {
+            out[c] = px[nx[c]] * py[ny[c]] * pz[nz[c]];
+        }
+    }
+
+    // out[c] = D^n g(R) for the Plummer kernel g(r) = (|r|^2 + softening)^(-1/2).
+    // With s = |r|^2 / 2 and phi_m = d^m g / ds^m, the radial structure gives
+    //   D^(n+e_i) phi_m = R_i D^n phi_(m+1) + n_i D^(n-e_i) phi_(m+1)
+    // scratch holds (order + 1) * count doubles.
+    void derivatives(const glm::dvec3 &R, double softening, double *out, double *scratch) const
+    {
+        const double inv = 1.0 / std::sqrt(glm::dot(R, R) + softening);
+        const double inv2 = inv * inv;
+
+        // scratch[m * count + c] = D^c phi_m, needed for degree(c) + m <= order
+        double phi = inv;
+        for (int m = 0; m <= order; m++) {
+            if (m > 0) phi *= -(2 * m - 1) * inv2;
+            scratch[m * count] = phi;
+        }
+
+        const double r[3] = { R.x, R.y, R.z };
+        for (const DerivativeStep &step : derivativeSteps) {
+            scratch[step.dst] = r[step.axis] * scratch[step.src] + step.coef * scratch[step.src2];
+        }
+
+        std::copy(scratch, scratch + count, out);
+    }
+
+    // L[n] += sum_k (-1)^|k| M[k] D^(n+k); signedM holds (-1)^|k| M[k]
+    void multipoleToLocal(const double *signedM, const double *D, double *L) const
+    {
+        for (int n = 0; n < count; n++) {
+            // two partial sums break the add dependency chain
+            double sum0 = 0.0, sum1 = 0.0;
+            uint32_t t = m2lStart[n];
+            const uint32_t end = m2lStart[n + 1];
+            for (; t + 1 < end; t += 2) {
+                sum0 += signedM[m2l[t].k] * D[m2l[t].nk];
+                sum1 += signedM[m2l[t + 1].k] * D[m2l[t + 1].nk];
+            }
+            if (t < end) sum0 += signedM[m2l[t].k] * D[m2l[t].nk];
+            L[n] += sum0 + sum1;
+        }
+    }
+
+private:
+    std::vector<int> lookup;
+
+    size_t key(int x, int y, int z) const {
+        return static_cast<size_t>((x * (order + 1) + y) * (order + 1) + z);
+    }
+};
+
+// Fast multipole solver over an Octree built in Morton mode (leaf ranges of
+// the tree's body array are then contiguous). Cells are the octree nodes
+// down to FMM leaves of at most LEAF_BODIES bodies; each carries a Cartesian
+// multipole expansion about its centre of mass and a local expansion.
+//
+//   upward:   P2M at leaves, M2M level by level towards the root
+//   dual walk: target cell A against a worklist of source cells B
+//              - (r_A + r_B) < theta * |z_A - z_B|: M2L into A's local
+//              - both leaves: B's bodies join A's direct (P2P) list
+//              - otherwise split the bigger one; splitting A defers B to
+//                A's children, so each cell's local is written by one task
+//   downward: L2L into children before they are walked, L2P at leaves
+//
+// Cost is O(N) for fixed theta and order; accuracy improves with order.
+class FmmSolver
+{
+private:
+    static constexpr uint32_t LEAF_BODIES = 64;
+    // cells with more bodies than this walk their children as OpenMP tasks
+    static constexpr uint32_t TASK_BODIES = 2048;
+
+    struct Cell
+    {
+        glm::dvec3 center;
+        double radius;
+        double mass;
+        uint32_t node;
+        uint32_t firstBody, bodyCount;
+        uint32_t firstChild, childCount;
+
+        bool isLeaf() const { return childCount == 0; }
+    };
+
+    ExpansionTables tables;
+    float theta;
+
+    std::vector<Cell> cells;
+    std::vector<uint32_t> levelStart;
+    std::vector<double> multipoles;
+    // (-1)^|k| M[k], the form M2L consumes
+    std::vector<double> signedMultipoles;
+    std::vector<double> locals;
+    std::vector<glm::vec3> bodyAcc;
+    std::vector<InteractionList> threadLists;
+
+    // per-node body counts / first body, from one sweep over the octree
+    std::vector<uint32_t> nodeBodies;
+    std::vector<uint32_t> nodeFirst;
+    std::vector<uint32_t> walkOrder;
+
+public:
+    FmmSolver(int order = 4, float theta = 0.5f) : theta(theta) {
+        setExpansionOrder(order);
+    }
+
+    void setExpansionOrder(int order) {
+        order = std::max(1, std::min(ExpansionTables::MAX_ORDER, order));
+        if (order != tables.order) tables.build(order);
+    }
+
+    int getExpansionOrder() const { return tables.order; }
+
+    void setTheta(float newTheta) {
+        theta = std::max(0.1f, std::min(1.0f, newTheta));
+    }
+
+    size_t getCellCount() const { return cells.size(); }
+
+    // G * sum m d / (r^2 + softening)^(3/2) for every body of the tree,
+    // written to accelerations[particle index]
+    void calculateAccelerations(const Octree &tree, float G, float softening,
+                                std::vector<glm::vec3> &accelerations)
+    {
+        const std::vector<glm::vec4> &bodies = tree.getBodies();
+        const std::vector<uint32_t> &order = tree.getBodyOrder();
+        accelerations.assign(bodies.size(), glm::vec3(0.0f));
+        if (bodies.empty()) return;
+
+        buildCells(tree);
+        upwardPass(bodies);
+
+        locals.assign(cells.size() * tables.count, 0.0);
+        bodyAcc.assign(bodies.size(), glm::vec3(0.0f));
+        threadLists.resize(static_cast<size_t>(Morton::threadCount()));
+
+        #pragma omp parallel
+        #pragma omp single
+        {
+            std::vector<uint32_t> sources(1, 0);
+            walk(0, sources, bodies, G, softening);
+        }
+
+        const long n = static_cast<long>(bodies.size());
+        #pragma omp parallel for if(n > 65536)
+        for (long k = 0; k < n; k++) {
+            accelerations[order[k]] = bodyAcc[k];
+        }
+    }
+
+private:
+    void buildCells(const Octree &tree)
+    {
+        const std::vector<OctreeNode> &nodes = tree.getNodes();
+
+        // preorder, then a reverse sweep gives each subtree's count and first body
+        walkOrder.clear();
+        walkOrder.push_back(0);
+        for (size_t k = 0; k < walkOrder.size(); k++) {
+            const OctreeNode &node = nodes[walkOrder[k]];
+            for (int i = 0; i < 8; i++) {
+                if (node.children[i] != OctreeNode::NULL_INDEX) walkOrder.push_back(node.children[i]);
+            }
+        }
+
+        nodeBodies.resize(nodes.size());
+        nodeFirst.resize(nodes.size());
+        for (size_t k = walkOrder.size(); k-- > 0;) {
+            const uint32_t index = walkOrder[k];
+            const OctreeNode &node = nodes[index];
+            uint32_t count = node.bodyCount;
+            uint32_t first = node.bodyCount > 0 ? node.firstBody : OctreeNode::NULL_INDEX;
+            for (int i = 0; i < 8; i++) {
+                uint32_t child = node.children[i];
+                if (child == OctreeNode::NULL_INDEX) continue;
+                count += nodeBodies[child];
+                first = std::min(first, nodeFirst[child]);
+            }
+            nodeBodies[index] = count;
+            nodeFirst[index] = first;
+        }
+
+        // breadth first, so each level is a contiguous run of cells and
+        // siblings are adjacent
+        cells.clear();
+        levelStart.assign(1, 0);
+        cells.push_back(makeCell(0));
+        size_t levelEnd = 1;
+
+        for (size_t k = 0; k < cells.size(); k++) {
+            if (k == levelEnd) {
+                levelStart.push_back(static_cast<uint32_t>(k));
+                levelEnd = cells.size();
+            }
+
+            const OctreeNode &node = nodes[cells[k].node];
+            if (node.isExternal() || cells[k].bodyCount <= LEAF_BODIES) continue;
+
+            uint32_t firstChild = static_cast<uint32_t>(cells.size());
+            for (int i = 0; i < 8; i++) {
+                uint32_t child = node.children[i];
+                if (child != OctreeNode::NULL_INDEX && nodeBodies[child] > 0) {
+                    cells.push_back(makeCell(child));
+                }
+            }
+            cells[k].firstChild = firstChild;
+            cells[k].childCount = static_cast<uint32_t>(cells.size()) - firstChild;
+        }
+        levelStart.push_back(static_cast<uint32_t>(cells.size()));
+    }
+
+    Cell makeCell(uint32_t node) const {
+        Cell cell;
+        cell.center = glm::dvec3(0.0);
+        cell.radius = 0.0;
+        cell.mass = 0.0;
+        cell.node = node;
+        cell.firstBody = nodeFirst[node];
+        cell.bodyCount = nodeBodies[node];
+        cell.firstChild = 0;
+        cell.childCount = 0;
+        return cell;
+    }
+
+    void upwardPass(const std::vector<glm::vec4> &bodies)
+    {
+        const int count = tables.count;
+        multipoles.assign(cells.size() * count, 0.0);
+
+        for (size_t level = levelStart.size() - 1; level-- > 0;) {
+            const long begin = levelStart[level];
+            const long end = levelStart[level + 1];
+
+            #pragma omp parallel for schedule(dynamic, 16) if(end - begin > 64)
+            for (long c = begin; c < end; c++) {
+                Cell &cell = cells[c];
+                double *M = &multipoles[c * count];
+                double mono[ExpansionTables::countUpTo(ExpansionTables::MAX_ORDER)];
+
+                if (cell.isLeaf()) {
+                    glm::dvec3 weighted(0.0);
+                    for (uint32_t b = cell.firstBody; b < cell.firstBody + cell.bodyCount; b++) {
+                        cell.mass += bodies[b].w;
+                        weighted += glm::dvec3(glm::vec3(bodies[b])) * static_cast<double>(bodies[b].w);
+                    }
+                    cell.center = cell.mass > 0.0 ? weighted / cell.mass : glm::dvec3(glm::vec3(bodies[cell.firstBody]));
+
+                    for (uint32_t b = cell.firstBody; b < cell.firstBody + cell.bodyCount; b++) {
+                        glm::dvec3 offset = glm::dvec3(glm::vec3(bodies[b])) - cell.center;
+                        cell.radius = std::max(cell.radius, glm::length(offset));
+                        tables.monomials(offset, mono, tables.order);
+                        for (int n = 0; n < count; n++) M[n] += bodies[b].w * mono[n];
+                    }
+                    continue;
+                }
+
+                glm::dvec3 weighted(0.0);
+                for (uint32_t k = cell.firstChild; k < cell.firstChild + cell.childCount; k++) {
+                    cell.mass += cells[k].mass;
+                    weighted += cells[k].center * cells[k].mass;
+                }
+                cell.center = cell.mass > 0.0 ? weighted / cell.mass : cells[cell.firstChild].center;
+
+                for (uint32_t k = cell.firstChild; k < cell.firstChild + cell.childCount; k++) {
+                    const Cell &child = cells[k];
+                    glm::dvec3 shift = child.center - cell.center;
+                    cell.radius = std::max(cell.radius, glm::length(shift) + child.radius);
+
+                    const double *childM = &multipoles[k * count];
+                    tables.monomials(shift, mono, tables.order);
+                    for (const ExpansionTables::M2MTerm &t : tables.m2m) {
+                        M[t.n] += childM[t.k] * mono[t.diff];
+                    }
+                }
+            }
+        }
+
+        signedMultipoles.resize(multipoles.size());
+        const long total = static_cast<long>(multipoles.size());
+        #pragma omp parallel for if(total > 65536)
+        for (long i = 0; i < total; i++) {
+            signedMultipoles[i] = tables.degree[i % count] % 2 ? -multipoles[i] : multipoles[i];
+        }
+    }
+
+    void walk(uint32_t a, const std::vector<uint32_t> &sources,
+              const std::vector<glm::vec4> &bodies, float G, float softening)
+    {
+        const Cell &A = cells[a];
+        const int count = tables.count;
+        double *L = &locals[static_cast<size_t>(a) * count];
+        double derivative[ExpansionTables::countUpTo(ExpansionTables::MAX_ORDER)];
+        double scratch[(ExpansionTables::MAX_ORDER + 1) * ExpansionTables::countUpTo(ExpansionTables::MAX_ORDER)];
+
+        std::vector<uint32_t> pending(sources);
+        std::vector<uint32_t> deferred;
+        const double thetaD = theta;
+
+        // a leaf walk spawns no tasks, so it keeps its thread throughout
+#ifdef _OPENMP
+        InteractionList &direct = threadLists[omp_get_thread_num()];
+#else
+        InteractionList &direct = threadLists[0];
+#endif
+        if (A.isLeaf()) direct.clear();
+
+        while (!pending.empty()) {
+            const uint32_t b = pending.back();
+            pending.pop_back();
+            const Cell &B = cells[b];
+            if (B.mass <= 0.0) continue;
+
+            glm::dvec3 R = A.center - B.center;
+            double distance = glm::length(R);
+
+            if (A.radius + B.radius < thetaD * distance) {
+                tables.derivatives(R, softening, derivative, scratch);
+                tables.multipoleToLocal(&signedMultipoles[static_cast<size_t>(b) * count], derivative, L);
+                continue;
+            }
+
+            if (A.isLeaf() && B.isLeaf()) {
+                for (uint32_t j = B.firstBody; j < B.firstBody + B.bodyCount; j++) {
+                    direct.add(glm::vec3(bodies[j]), bodies[j].w);
+                }
+            } else if (!A.isLeaf() && (B.isLeaf() || A.radius >= B.radius)) {
+                deferred.push_back(b);
+            } else {
+                for (uint32_t k = B.firstChild; k < B.firstChild + B.childCount; k++) {
+                    pending.push_back(k);
+                }
+            }
+        }
+
+        if (A.isLeaf()) {
+            direct.pad();
+            evaluateLeaf(A, L, direct, bodies, G, softening);
+            return;
+        }
+
+        double mono[ExpansionTables::countUpTo(ExpansionTables::MAX_ORDER)];
+        for (uint32_t c = A.firstChild; c < A.firstChild + A.childCount; c++) {
+            double *childL = &locals[static_cast<size_t>(c) * count];
+            tables.monomials(cells[c].center - A.center, mono, tables.order);
+            for (const ExpansionTables::L2LTerm &t : tables.l2l) {
+                childL[t.n] += L[t.nk] * mono[t.k];
+            }
+        }
+
+        for (uint32_t c = A.firstChild; c < A.firstChild + A.childCount; c++) {
+            #pragma omp task default(shared) firstprivate(c) if(A.bodyCount > TASK_BODIES)
+            walk(c, deferred, bodies, G, softening);
+        }
+        #pragma omp taskwait
+    }
+
+    // direct sum over the leaf's P2P list plus the far field from the local
+    // expansion: acceleration_i = G * sum_m L[m + e_i] a^m / m!, a = body - centre
+    void evaluateLeaf(const Cell &A, const double *L, const InteractionList &direct,
+                      const std::vector<glm::vec4> &bodies, float G, float softening)
+    {
+        double mono[ExpansionTables::countUpTo(ExpansionTables::MAX_ORDER)];
+        for (uint32_t i = A.firstBody; i < A.firstBody + A.bodyCount; i++) {
+            tables.monomials(glm::dvec3(glm::vec3(bodies[i])) - A.center, mono, tables.order - 1);
+            double ax = 0.0, ay = 0.0, az = 0.0;
+            for (const ExpansionTables::L2PTerm &t : tables.l2p) {
+                ax += L[t.x] * mono[t.m];
+                ay += L[t.y] * mono[t.m];
+                az += L[t.z] * mono[t.m];
+            }
+            glm::vec3 farField(static_cast<float>(ax), static_cast<float>(ay), static_cast<float>(az));
+            bodyAcc[i] = farField * G + direct.accelerationAt(glm::vec3(bodies[i]), G, softening);
+        }
+    }
+};
+
+#endif // FMM_H
@@ -0,0 +1,216 @@
+#ifndef FMMSIM_H
+#define FMMSIM_H
+
+#include "octree.h"
+#include "fmm.h"
+#include "particle.h"
+#include "physics.h"
+#include "profiling.h"
+#include "integrator.h"
+#include "diagnostics.h"
+#include "trace.h"
+#include "perf_counters.h"
+#include <chrono>
+#include <iostream>
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+// Same step as BarnesHutCPUSimulator, with the tree walk replaced by the
+// O(N) fast multipole solver over the same Morton-built octree
+template <typename Integrator = Integrators::KickDriftKick>
+class BasicFastMultipoleSimulator
+{
+    static_assert(!Integrator::NEEDS_JERK, "the multipole solver does not compute jerks");
+
+private:
+    ParticleSystem* particles;
+    float timeStep;
+    Octree octree;
+    FmmSolver fmm;
+    float G;
+    float softening;
+    
+    bool enableProfiling = false;
+    std::vector<glm::vec3> accelerations;
+    Integrator integrator;
+    DiagnosticsMonitor diagnostics;
+    PhaseTimings lastTimings;
+    PhaseCounterRecorder counters;
+
+public:
+    BasicFastMultipoleSimulator(ParticleSystem& particleSystem, float dt, float theta = 0.7f, int order = 3,
+                                float G = Physics::G, float softening = Physics::SOFTENING)
+        : particles(&particleSystem), timeStep(dt),
+          fmm(order, theta), G(G), softening(softening) {
+        // FMM cells need each subtree's bodies to be one contiguous range
+        octree.setBuildMode(TreeBuildMode::Morton);
+    }
+
+    BasicFastMultipoleSimulator(BasicFastMultipoleSimulator&&) = default;
+    BasicFastMultipoleSimulator& operator=(BasicFastMultipoleSimulator&&) = default;
+
+    void update()
+    {
+        if (!particles || particles->size() == 0) return;
+        NBODY_TRACE_SCOPE("fmm.update");
+        
+        const long n = static_cast<long>(particles->size());
+        
+        auto startTime = ProfileClock::now();
+        const CounterValues startCounters = counters.begin();
+        float treeMs = 0.0f, forcesMs = 0.0f;
+        int evaluations = 0;
+        auto lastForcesEnd = startTime;
+        
+        integrator.step(*particles, timeStep, 0, [&](std::vector<glm::vec3>*) {
+            auto treeStart = ProfileClock::now();
+            const CounterValues treeCounters = counters.read();
+            octree.buildTree(*particles);
+            auto forcesStart = ProfileClock::now();
+            const CounterValues forcesCounters = counters.read();
+            calculateForces();
+            lastForcesEnd = ProfileClock::now();
+            treeMs += elapsedMs(treeStart, forcesStart);
+            forcesMs += elapsedMs(forcesStart, lastForcesEnd);
+            evaluations++;
+            counters.addBuild(treeCounters, forcesCounters);
+            counters.addWalk(forcesCounters);
+        });
+        
+        auto endTime = ProfileClock::now();
+        counters.finish(startCounters);
+        
+        lastTimings.total = elapsedMs(startTime, endTime);
+        lastTimings.treeBuild = treeMs;
+        lastTimings.forces = forcesMs;
+        lastTimings.finalize = elapsedMs(lastForcesEnd, endTime);
+        lastTimings.integrate = lastTimings.total - treeMs - forcesMs - lastTimings.finalize;
+        lastTimings.treeRebuilds = evaluations;
+        lastTimings.forceEvaluations = evaluations * n;
+        
+        lastTimings.diagnostics = 0.0f;
+        if (diagnostics.step()) {
+            // same as BarnesHutCPUSimulator::measureDiagnostics
+            auto diagnosticsStart = ProfileClock::now();
+            if (!octree.refit(*particles)) octree.buildTree(*particles);
+            const float blackHoleMass = particles->getMass(0);
+            diagnostics.measure(*particles, octree, G, softening, blackHoleMass > 100.0f ? blackHoleMass : 0.0f);
+            lastTimings.diagnostics = elapsedMs(diagnosticsStart, ProfileClock::now());
+            lastTimings.total += lastTimings.diagnostics;
+        }
+        
+        if (enableProfiling) {
+            std::cout << "FMM Profiling [" << n << " particles, order " << fmm.getExpansionOrder()
+                      << ", " << fmm.getCellCount() << " cells]:"
+                      << " Total: " << lastTimings.total << "ms,"
+                      << " Tree: " << lastTimings.treeBuild << "ms,"
+                      << " Forces: " << lastTimings.forces << "ms"
+                      << std::endl;
+        }
+    }
+    
+    void setExpansionOrder(int order) {
+        fmm.setExpansionOrder(order);
+    }
+    
+    void setTheta(float theta) {
+        fmm.setTheta(theta);
+    }
+    
+    // measure energy, momenta and virial ratio every K steps (0 = off)
+    void setDiagnosticsInterval(int everySteps) {
+        diagnostics.setInterval(everySteps);
+    }
+    
+    const Diagnostics& getDiagnostics() const {
+        return diagnostics.getLatest();
+    }
+    
+    void enableProfilingOutput(bool enable) {
+        enableProfiling = enable;
+    }
+    
+    // per-phase perf_event_open counters; false (timing only) when they
+    // cannot be opened
+    bool enableHardwareCounters(bool enable) {
+        return counters.enable(enable);
+    }
+    
+    const PhaseCounters& getLastCounters() const {
+        return counters.getLast();
+    }
+    
+    const PhaseTimings& getLastTimings() const {
+        return lastTimings;
+    }
+
+private:
+    void calculateForces() {
+        NBODY_TRACE_SCOPE("forces.fmm");
+        const long n = static_cast<long>(particles->size());
+        
+        fmm.calculateAccelerations(octree, G, softening, accelerations);
+        
+        const glm::vec3 blackHolePos = particles->getPosition(0);
+        const float blackHoleMass = particles->getMass(0);
+        
+        // the per-particle terms match BarnesHutCPUSimulator::calculateForcesSafely
+        #pragma omp parallel for schedule(static)
+        for (long i = 0; i < n; i++) {
+            const glm::vec3 pos = particles->getPosition(i);
+            const float mass = particles->getMass(i);
+            if (mass <= 0.0f) {
+                particles->setAcceleration(i, glm::vec3(0.0f));
+                continue;
+            }
+            
+            glm::vec3 acceleration = accelerations[i];
+            float adaptiveSoftening = softening;
+            if (mass > 10.0f) {
+                // heavy particles use a wider softening than the solver, sum them directly
+                adaptiveSoftening = softening * 1.5f;
+                acceleration = directAcceleration(i, adaptiveSoftening);
+            }
+            
+            if (i > 0 && n > 1 && blackHoleMass > 100.0f) {
+                glm::vec3 direction = blackHolePos - pos;
+                float distSquared = glm::dot(direction, direction) + adaptiveSoftening;
+                
+                if (distSquared > 0.0001f) {
+                    float dist = sqrt(distSquared);
+                    acceleration += direction * (G * blackHoleMass / (distSquared * dist));
+                }
+            }
+            
+            float maxAcc = 1000.0f;
+            float accMag = glm::length(acceleration);
+            if (accMag > maxAcc) {
+                acceleration = acceleration * (maxAcc / accMag);
+            }
+            
+            if (glm::length(pos) > 30.0f) {
+                particles->setVelocity(i, particles->getVelocity(i) * 0.998f);
+            }
+            
+            particles->setAcceleration(i, acceleration);
+        }
+    }
+    
+    glm::vec3 directAcceleration(size_t index, float eps) const {
+        glm::vec3 acceleration(0.0f);
+        const glm::vec3 pos = particles->getPosition(index);
+        for (size_t j = 0; j < particles->size(); j++) {
+            if (j == index) continue;
+            glm::vec3 direction = particles->getPosition(j) - pos;
+            float distSquared = glm::dot(direction, direction) + eps;
+            float dist = sqrt(distSquared);
+            acceleration += direction * (G * particles->getMass(j) / (distSquared * dist));
+        }
+        return acceleration;
+    }
+};
+
+using FastMultipoleSimulator = BasicFastMultipoleSimulator<>;
+
+#endif // FMMSIM_H
@@ -1,46 +1,55 @@
 #ifndef GENERATE_H
 #define GENERATE_H
 #include "particle.h"
-#include "library.h"
 #include "physics.h"
+#include "philox.h"
+#include <glm/glm.hpp>
+#include <random>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <utility>
 
+// Every generator draws particle i's numbers from ParticleRandom(seed, i)
+// and fills the particles in parallel, so a seed gives bit-identical initial
+// conditions on any thread count.
 
-glm::vec3 randomSphere(float radius) {
-    // use rejection sampling to get points in a unit cube into a unit sphere to get points uniformly
+glm::vec3 randomSphere(ParticleRandom& rng, float radius) {
+    // uniform in the ball by inverting the radius and direction distributions,
+    // a fixed three draws instead of rejection sampling from the cube
+    float cosTheta = rng.uniform(-1.0f, 1.0f);
+    float sinTheta = std::sqrt(std::max(0.0f, 1.0f - cosTheta * cosTheta));
+    float phi = rng.uniform(0.0f, 6.28318531f);
+    float r = radius * std::cbrt(rng.uniform());
+    return glm::vec3(r * sinTheta * std::cos(phi), r * sinTheta * std::sin(phi), r * cosTheta);
+}
+
+// a seed from std::random_device, never 0
+uint64_t randomSeed() {
     std::random_device rd;
-    std::mt19937 gen(rd());
-    std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
-    
-    glm::vec3 point;
-    float length;
-    
-    do {
-        point.x = dist(gen);
-        point.y = dist(gen);
-        point.z = dist(gen);
-        length = glm::length(point);
-    } while (length > 1.0f);
-    
-    return point * radius;
+    uint64_t seed = (static_cast<uint64_t>(rd()) << 32) | rd();
+    return seed ? seed : 1;
 }
 
-void generateDiskGalaxy(Particle* particles, int count)
+void generateDiskGalaxy(ParticleSystem& particles, int count, uint64_t seed)
 {
     const float galaxy_diameter = 20.0f;
     const float galaxy_thickness = 1.0f;
     const float stars_speed = 5.0f;
     const float black_hole_mass = 1000.0f;
     // placing central black hole 
-    particles[0] = Particle(
+    particles.setParticle(0, Particle(
         glm::vec4(0.0f, 0.0f, 0.0f, 0.0f),
         glm::vec4(0.0f, 0.0f, 0.0f, 0.0f),
         glm::vec4(0.0f, 0.0f, 0.0f, 0.0f),
         black_hole_mass
-    );
+    ));
     
+    #pragma omp parallel for if(count > 65536)
     for (int i = 1; i < count; i++) {
+        ParticleRandom rng(seed, i);
         // places stars in disk by putting more stars closer to center like real galaxy
-        glm::vec3 pos = randomSphere(galaxy_diameter / 2.0f);
+        glm::vec3 pos = randomSphere(rng, galaxy_diameter / 2.0f);
         float radius = glm::length(glm::vec2(pos.x, pos.z));
         float scaledRadius = pow(radius / (galaxy_diameter / 2.0f), 5.0f) * (galaxy_diameter / 2.0f);
         
@@ -55,11 +64,11 @@ void generateDiskGalaxy(Particle* particles, int count)
         // calculating force direction and velocity direction
         glm::vec3 direction = glm::normalize(glm::cross(glm::vec3(pos.x, 0.0f, pos.z), glm::vec3(0.0f, 1.0f, 0.0f)));
         glm::vec3 vel = direction * stars_speed;
-        particles[i] = Particle(glm::vec4(pos, 0.0f), glm::vec4(vel, 0.0f), glm::vec4(0.0f, 0.0f, 0.0f, 0.0f), 1.0f);
+        particles.setParticle(i, Particle(glm::vec4(pos, 0.0f), glm::vec4(vel, 0.0f), glm::vec4(0.0f, 0.0f, 0.0f, 0.0f), 1.0f));
     }
 }
 
-void generateSpiralGalaxy(Particle* particles, int count)
+void generateSpiralGalaxy(ParticleSystem& particles, int count, uint64_t seed)
 {
     const float galaxy_diameter = 20.0f;
     const float galaxy_thickness = 1.0f;
@@ -67,31 +76,27 @@ void generateSpiralGalaxy(Particle* particles, int count)
     const float black_hole_mass = 1000.0f;
     
     // placing central black hole 
-    particles[0] = Particle(
+    particles.setParticle(0, Particle(
         glm::vec4(0.0f, 0.0f, 0.0f, 0.0f),
         glm::vec4(0.0f, 0.0f, 0.0f, 0.0f),
         glm::vec4(0.0f, 0.0f, 0.0f, 0.0f),
         black_hole_mass
-    );
-    
-    std::mt19937 gen(std::random_device{}());
-    std::uniform_real_distribution<float> angleDist(0.0f, 2.0f * 3.14159f);
-    std::uniform_real_distribution<float> radiusDist(0.1f, galaxy_diameter / 2.0f);
-    std::uniform_real_distribution<float> armPhase(0.0f, 2.0f * 3.14159f);
-    std::normal_distribution<float> heightDist(0.0f, 0.2f);
+    ));
     
     const int arms = 2; 
     const float arm_tightness = 0.5f;
     
+    #pragma omp parallel for if(count > 65536)
     for (int i = 1; i < count; i++) {
-        float baseRadius = radiusDist(gen);
-        float arm = static_cast<int>(gen() % arms);
+        ParticleRandom rng(seed, i);
+        float baseRadius = rng.uniform(0.1f, galaxy_diameter / 2.0f);
+        float arm = static_cast<int>(rng.next() % arms);
         float armOffset = arm * (2.0f * 3.14159f / arms);
         float angle = armOffset + (arm_tightness * baseRadius);
         
-        angle += angleDist(gen) * 0.2f;
+        angle += rng.uniform(0.0f, 2.0f * 3.14159f) * 0.2f;
         
-        float height = heightDist(gen) * (0.1f + baseRadius * 0.03f);
+        float height = rng.normal(0.0f, 0.2f) * (0.1f + baseRadius * 0.03f);
         glm::vec3 pos(
             baseRadius * cos(angle),
             baseRadius * sin(angle),
@@ -101,11 +106,11 @@ void generateSpiralGalaxy(Particle* particles, int count)
         glm::vec3 direction = glm::normalize(glm::cross(glm::vec3(pos.x, pos.y, 0.0f),glm::vec3(0.0f, 0.0f, 1.0f)     ));
         float speed = stars_speed;
         glm::vec3 vel = direction * speed;
-        particles[i] = Particle(glm::vec4(pos, 0.0f),glm::vec4(vel, 0.0f),glm::vec4(0.0f, 0.0f, 0.0f, 0.0f),1.0f);
+        particles.setParticle(i, Particle(glm::vec4(pos, 0.0f),glm::vec4(vel, 0.0f),glm::vec4(0.0f, 0.0f, 0.0f, 0.0f),1.0f));
     }
 }
 
-void generateCollisionGalaxy(Particle* particles, int count)
+void generateCollisionGalaxy(ParticleSystem& particles, int count, uint64_t seed)
 {
     const float galaxy_separation = 15.0f;
     const float galaxy_diameter = 15.0f;
@@ -116,22 +121,24 @@ void generateCollisionGalaxy(Particle* particles, int count)
     
     int half = count / 2;
     
-    particles[0] = Particle(
+    particles.setParticle(0, Particle(
         glm::vec4(-galaxy_separation/2.0f, 0.0f, 0.0f, 0.0f),
         glm::vec4(collision_speed, 0.0f, 0.0f, 0.0f),
         glm::vec4(0.0f, 0.0f, 0.0f, 0.0f),
         black_hole_mass
-    );
+    ));
     
-    particles[half] = Particle(
+    particles.setParticle(half, Particle(
         glm::vec4(galaxy_separation/2.0f, 0.0f, 0.0f, 0.0f),
         glm::vec4(-collision_speed, 0.0f, 0.0f, 0.0f),
         glm::vec4(0.0f, 0.0f, 0.0f, 0.0f),
         black_hole_mass
-    );
+    ));
     
+    #pragma omp parallel for if(count > 65536)
     for (int i = 1; i < half; i++) {
-        glm::vec3 pos = randomSphere(galaxy_diameter / 2.0f);
+        ParticleRandom rng(seed, i);
+        glm::vec3 pos = randomSphere(rng, galaxy_diameter / 2.0f);
         
         float radius = glm::length(glm::vec2(pos.x, pos.z));
         float scaledRadius = pow(radius / (galaxy_diameter / 2.0f), 5.0f) * (galaxy_diameter / 2.0f);
@@ -151,16 +158,18 @@ void generateCollisionGalaxy(Particle* particles, int count)
         
         glm::vec3 vel = direction * stars_speed + glm::vec3(collision_speed, 0.0f, 0.0f);
         
-        particles[i] = Particle(
+        particles.setParticle(i, Particle(
             glm::vec4(pos, 0.0f),
             glm::vec4(vel, 0.0f),
             glm::vec4(0.0f, 0.0f, 0.0f, 0.0f),
             1.0f
-        );
+        ));
     }
     
+    #pragma omp parallel for if(count > 65536)
     for (int i = half + 1; i < count; i++) {
-        glm::vec3 pos = randomSphere(galaxy_diameter / 2.0f);
+        ParticleRandom rng(seed, i);
+        glm::vec3 pos = randomSphere(rng, galaxy_diameter / 2.0f);
         
         float radius = glm::length(glm::vec2(pos.x, pos.z));
         float scaledRadius = pow(radius / (galaxy_diameter / 2.0f), 5.0f) * (galaxy_diameter / 2.0f);
@@ -184,71 +193,72 @@ void generateCollisionGalaxy(Particle* particles, int count)
         
         glm::vec3 vel = direction * stars_speed + glm::vec3(-collision_speed, 0.0f, 0.0f);
         
-        particles[i] = Particle(
+        particles.setParticle(i, Particle(
             glm::vec4(pos, 0.0f),
             glm::vec4(vel, 0.0f),
             glm::vec4(0.0f, 0.0f, 0.0f, 0.0f),
             1.0f
-        );
+        ));
     }
 }
 
-void generateRandomGalaxy(Particle* particles, int count)
+void generateRandomGalaxy(ParticleSystem& particles, int count, uint64_t seed)
 {
     const float maxDistance = 20.0f;
     const float black_hole_mass = 1000.0f;
     
-    particles[0] = Particle(
+    particles.setParticle(0, Particle(
         glm::vec4(0.0f, 0.0f, 0.0f, 0.0f),
         glm::vec4(0.0f, 0.0f, 0.0f, 0.0f),
         glm::vec4(0.0f, 0.0f, 0.0f, 0.0f),
         black_hole_mass
-    );
-    
-    std::mt19937 gen(std::random_device{}());
-    std::uniform_real_distribution<float> posDist(-maxDistance, maxDistance);
-    std::uniform_real_distribution<float> velDist(-1.0f, 1.0f);
+    ));
     
+    #pragma omp parallel for if(count > 65536)
     for (int i = 1; i < count; i++) {
-        glm::vec3 pos(posDist(gen), posDist(gen), posDist(gen));
-        glm::vec3 vel(velDist(gen), velDist(gen), velDist(gen));
+        ParticleRandom rng(seed, i);
+        glm::vec3 pos;
+        pos.x = rng.uniform(-maxDistance, maxDistance);
+        pos.y = rng.uniform(-maxDistance, maxDistance);
+        pos.z = rng.uniform(-maxDistance, maxDistance);
+        glm::vec3 vel;
+        vel.x = rng.uniform(-1.0f, 1.0f);
+        vel.y = rng.uniform(-1.0f, 1.0f);
+        vel.z = rng.uniform(-1.0f, 1.0f);
         
         vel *= (1.0f - glm::length(pos) / maxDistance) * 2.0f;
         
-        particles[i] = Particle(
+        particles.setParticle(i, Particle(
             glm::vec4(pos, 0.0f),
             glm::vec4(vel, 0.0f),
             glm::vec4(0.0f, 0.0f, 0.0f, 0.0f),
             1.0f
-        );
+        ));
     }
 }
 
-void generateDenseDiskGalaxy(Particle* particles, int count)
+void generateDenseDiskGalaxy(ParticleSystem& particles, int count, uint64_t seed)
 {
     const float galaxy_diameter = 15.0f;
     const float galaxy_thickness = 0.5f;
     const float stars_speed = 6.0f;
     const float black_hole_mass = 1500.0f;
     
-    particles[0] = Particle(
+    particles.setParticle(0, Particle(
         glm::vec4(0.0f, 0.0f, 0.0f, 0.0f),
         glm::vec4(0.0f, 0.0f, 0.0f, 0.0f),
         glm::vec4(0.0f, 0.0f, 0.0f, 0.0f),
         black_hole_mass
-    );
-    
-    std::mt19937 gen(std::random_device{}());
-    std::uniform_real_distribution<float> radiusDist(0.1f, galaxy_diameter / 2.0f);
-    std::uniform_real_distribution<float> angleDist(0.0f, 2.0f * 3.14159f);
-    std::normal_distribution<float> heightDist(0.0f, 0.1f);
+    ));
     
+    #pragma omp parallel for if(count > 65536)
     for (int i = 1; i < count; i++) {
-        float r = radiusDist(gen);
+        ParticleRandom rng(seed, i);
+        float r = rng.uniform(0.1f, galaxy_diameter / 2.0f);
         r = pow(r, 1.5f) * pow(galaxy_diameter / 2.0f, -0.5f);
         
-        float angle = angleDist(gen);
-        float height = heightDist(gen) * galaxy_thickness;
+        float angle = rng.uniform(0.0f, 2.0f * 3.14159f);
+        float height = rng.normal(0.0f, 0.1f) * galaxy_thickness;
         
         glm::vec3 pos(
             r * cos(angle),
@@ -267,12 +277,37 @@ void generateDenseDiskGalaxy(Particle* particles, int count)
             pos.x / dist * speed
         );
         
-        particles[i] = Particle(
+        particles.setParticle(i, Particle(
             glm::vec4(pos, 0.0f),
             glm::vec4(vel, 0.0f),
             glm::vec4(0.0f, 0.0f, 0.0f, 0.0f),
             1.0f
-        );
+        ));
+    }
+}
+// Returns the seed used: seed itself, or a fresh one from randomSeed() when
+// seed is 0. The same type, count and seed reproduce the same particles.
+uint64_t generateGalaxy(int galaxyType, ParticleSystem& particles, int count, uint64_t seed = 0)
+{
+    if (seed == 0) seed = randomSeed();
+    // indices match the "Galaxy Type" combo in the menu
+    switch (galaxyType) {
+        case 0:
+            generateRandomGalaxy(particles, count, seed);
+            break;
+        case 1:
+            generateDiskGalaxy(particles, count, seed);
+            break;
+        case 2:
+            generateSpiralGalaxy(particles, count, seed);
+            break;
+        case 3:
+            generateCollisionGalaxy(particles, count, seed);
+            break;
+        case 4:
+            generateDenseDiskGalaxy(particles, count, seed);
+            break;
     }
+    return seed;
 }
 #endif
\ No newline at end of file
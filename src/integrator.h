@@ -0,0 +1,157 @@
+#ifndef INTEGRATOR_H
+#define INTEGRATOR_H
+
+#include "particle.h"
+#include "physics.h"
+#include <glm/glm.hpp>
+#include <cmath>
+#include <vector>
+
+// Time integrators as compile-time policies for the simulators. A simulator
+// owns one and calls
+//   step(particles, dt, begin, computeForces)
+// once per update() to advance particles [begin, size()) by dt. The
+// callback recomputes every particle's acceleration at the current
+// positions; it takes a std::vector<glm::vec3> *jerks that is null unless
+// the policy sets NEEDS_JERK, in which case the callback also fills
+// (*jerks)[i] = da_i/dt. Engines that cannot produce jerks reject those
+// policies with a static_assert.
+//
+// Accelerations left in the particles by the previous step are reused where
+// the scheme allows (first same as last), so the evaluations per step below
+// are the steady-state counts.
+namespace Integrators
+{
+    // Kick-drift-kick leapfrog: 2nd order, symplectic, 1 evaluation per step
+    struct KickDriftKick
+    {
+        static constexpr const char *NAME = "leapfrog";
+        static constexpr int ORDER = 2;
+        static constexpr int FORCE_EVALUATIONS = 1;
+        static constexpr bool NEEDS_JERK = false;
+
+        template <typename Forces>
+        void step(ParticleSystem &particles, float dt, size_t begin, Forces &&computeForces)
+        {
+            Physics::integrateLeapFrog(particles, dt, begin);
+            computeForces(nullptr);
+            Physics::finalizeLeapFrog(particles, dt, begin);
+        }
+    };
+
+    // Yoshida's 4th-order triple jump: three leapfrog steps of w1 dt, w0 dt,
+    // w1 dt with w1 = 1 / (2 - 2^(1/3)) and w0 = 1 - 2 w1 (a step backwards).
+    // Symplectic, 3 evaluations per step.
+    struct Yoshida4
+    {
+        static constexpr const char *NAME = "yoshida4";
+        static constexpr int ORDER = 4;
+        static constexpr int FORCE_EVALUATIONS = 3;
+        static constexpr bool NEEDS_JERK = false;
+
+        template <typename Forces>
+        void step(ParticleSystem &particles, float dt, size_t begin, Forces &&computeForces)
+        {
+            const float w1 = 1.0f / (2.0f - std::cbrt(2.0f));
+            const float w0 = 1.0f - 2.0f * w1;
+            for (float w : { w1, w0, w1 }) {
+                Physics::integrateLeapFrog(particles, w * dt, begin);
+                computeForces(nullptr);
+                Physics::finalizeLeapFrog(particles, w * dt, begin);
+            }
+        }
+    };
+
+    // Forest-Ruth 4th-order scheme in its position-first form:
+    // drift theta/2, kick theta, drift (1 - theta)/2, kick 1 - 2 theta,
+    // drift (1 - theta)/2, kick theta, drift theta/2, theta = 1 / (2 - 2^(1/3)).
+    // Symplectic, 3 evaluations per step; the accelerations left behind are
+    // from inside the step, which the next step does not use.
+    struct ForestRuth
+    {
+        static constexpr const char *NAME = "forest-ruth";
+        static constexpr int ORDER = 4;
+        static constexpr int FORCE_EVALUATIONS = 3;
+        static constexpr bool NEEDS_JERK = false;
+
+        template <typename Forces>
+        void step(ParticleSystem &particles, float dt, size_t begin, Forces &&computeForces)
+        {
+            const float theta = 1.0f / (2.0f - std::cbrt(2.0f));
+            Physics::drift(particles, 0.5f * theta * dt, begin);
+            computeForces(nullptr);
+            Physics::kick(particles, theta * dt, begin);
+            Physics::drift(particles, 0.5f * (1.0f - theta) * dt, begin);
+            computeForces(nullptr);
+            Physics::kick(particles, (1.0f - 2.0f * theta) * dt, begin);
+            Physics::drift(particles, 0.5f * (1.0f - theta) * dt, begin);
+            computeForces(nullptr);
+            Physics::kick(particles, theta * dt, begin);
+            Physics::drift(particles, 0.5f * theta * dt, begin);
+        }
+    };
+
+    // 4th-order Hermite predictor-corrector (Makino & Aarseth 1992): a Taylor
+    // prediction from a and its time derivative, the jerk j, then one force
+    // and jerk evaluation at the predicted state and the corrector
+    //   v1 = v0 + (a0 + a1) dt / 2 + (j0 - j1) dt^2 / 12
+    //   x1 = x0 + (v0 + v1) dt / 2 + (a0 - a1) dt^2 / 12
+    // Not symplectic, but 4th order for 1 evaluation per step; each one
+    // costs about twice a plain force sum. The first step evaluates once
+    // more to get the starting jerks.
+    struct Hermite4
+    {
+        static constexpr const char *NAME = "hermite4";
+        static constexpr int ORDER = 4;
+        static constexpr int FORCE_EVALUATIONS = 1;
+        static constexpr bool NEEDS_JERK = true;
+
+        std::vector<glm::vec3> jerks;
+        std::vector<glm::vec3> startPosition, startVelocity, startAcceleration, startJerk;
+
+        template <typename Forces>
+        void step(ParticleSystem &particles, float dt, size_t begin, Forces &&computeForces)
+        {
+            const size_t n = particles.size();
+            if (jerks.size() != n) {
+                jerks.assign(n, glm::vec3(0.0f));
+                computeForces(&jerks);
+            }
+            startPosition.resize(n);
+            startVelocity.resize(n);
+            startAcceleration.resize(n);
+            startJerk = jerks;
+
+            const long count = static_cast<long>(n);
+            const float dt2 = dt * dt;
+            const float dt3 = dt2 * dt;
+
+            #pragma omp parallel for
+            for (long i = static_cast<long>(begin); i < count; i++) {
+                const glm::vec3 x = particles.getPosition(i);
+                const glm::vec3 v = particles.getVelocity(i);
+                const glm::vec3 a = particles.getAcceleration(i);
+                const glm::vec3 j = startJerk[i];
+                startPosition[i] = x;
+                startVelocity[i] = v;
+                startAcceleration[i] = a;
+                particles.setPosition(i, x + v * dt + a * (dt2 / 2.0f) + j * (dt3 / 6.0f));
+                particles.setVelocity(i, v + a * dt + j * (dt2 / 2.0f));
+            }
+
+            computeForces(&jerks);
+
+            #pragma omp parallel for
+            for (long i = static_cast<long>(begin); i < count; i++) {
+                const glm::vec3 a1 = particles.getAcceleration(i);
+                const glm::vec3 v0 = startVelocity[i];
+                const glm::vec3 a0 = startAcceleration[i];
+                const glm::vec3 v1 = v0 + (a0 + a1) * (dt / 2.0f) + (startJerk[i] - jerks[i]) * (dt2 / 12.0f);
+                particles.setVelocity(i, v1);
+                particles.setPosition(i, startPosition[i] + (v0 + v1) * (dt / 2.0f) + (a0 - a1) * (dt2 / 12.0f));
+            }
+        }
+    };
+}
+
+#endif // INTEGRATOR_H
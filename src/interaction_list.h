@@ -0,0 +1,175 @@
+#ifndef INTERACTION_LIST_H
+#define INTERACTION_LIST_H
+
+#include "simd.h"
+#include "aligned_allocator.h"
+#include "multipole.h"
+#include <glm/glm.hpp>
+#include <array>
+#include <vector>
+
+// Point masses (tree cells or bodies) that a group of targets interacts with,
+// stored as aligned streams so every target sums them in one SIMD loop
+struct InteractionList
+{
+    using Stream = std::vector<float, AlignedAllocator<float, 64>>;
+
+    Stream x, y, z, m;
+
+    void clear() { x.clear(); y.clear(); z.clear(); m.clear(); }
+
+    size_t size() const { return m.size(); }
+
+    void add(const glm::vec3 &position, float mass) {
+        x.push_back(position.x);
+        y.push_back(position.y);
+        z.push_back(position.z);
+        m.push_back(mass);
+    }
+
+    // zero-mass padding up to a whole number of vectors; call before accelerationAt
+    void pad() {
+        while (m.size() % SimdFloat::WIDTH != 0) add(glm::vec3(0.0f), 0.0f);
+    }
+
+    // G * sum m d / (|d|^2 + softening)^(3/2) at position. softening must be
+    // positive when the target itself may be in the list (d = 0 then adds 0)
+    glm::vec3 accelerationAt(const glm::vec3 &position, float G, float softening) const
+    {
+        const SimdFloat eps = SimdFloat::broadcast(softening);
+        const SimdFloat g = SimdFloat::broadcast(G);
+        const SimdFloat xi = SimdFloat::broadcast(position.x);
+        const SimdFloat yi = SimdFloat::broadcast(position.y);
+        const SimdFloat zi = SimdFloat::broadcast(position.z);
+        SimdFloat ax = SimdFloat::zero(), ay = SimdFloat::zero(), az = SimdFloat::zero();
+
+        for (size_t j = 0; j < m.size(); j += SimdFloat::WIDTH) {
+            SimdFloat dx = SimdFloat::load(&x[j]) - xi;
+            SimdFloat dy = SimdFloat::load(&y[j]) - yi;
+            SimdFloat dz = SimdFloat::load(&z[j]) - zi;
+            SimdFloat r2 = SimdFloat::fma(dx, dx, SimdFloat::fma(dy, dy, SimdFloat::fma(dz, dz, eps)));
+            SimdFloat inv = rsqrt(r2);
+            SimdFloat s = g * SimdFloat::load(&m[j]) * inv * inv * inv;
+            ax = SimdFloat::fma(dx, s, ax);
+            ay = SimdFloat::fma(dy, s, ay);
+            az = SimdFloat::fma(dz, s, az);
+        }
+
+        return glm::vec3(ax.sum(), ay.sum(), az.sum());
+    }
+};
+
+// Accepted tree cells with their quadrupole (and octupole) moments, summed in
+// one SIMD loop per target: the monopole of InteractionList plus the terms of
+// Multipole<Order>::acceleration. Order must be 2 or 3.
+template <int Order>
+struct MultipoleInteractionList
+{
+    using Stream = InteractionList::Stream;
+
+    static constexpr int QUADRUPOLE_TERMS = Multipole<Order>::QUADRUPOLE_TERMS;
+    static constexpr int OCTUPOLE_TERMS = Multipole<Order>::OCTUPOLE_TERMS;
+
+    Stream x, y, z, m;
+    std::array<Stream, QUADRUPOLE_TERMS> q;
+    std::array<Stream, OCTUPOLE_TERMS> o;
+
+    void clear() {
+        x.clear(); y.clear(); z.clear(); m.clear();
+        for (Stream &s : q) s.clear();
+        for (Stream &s : o) s.clear();
+    }
+
+    size_t size() const { return m.size(); }
+
+    void add(const glm::vec3 &position, float mass, const Multipole<Order> &moments) {
+        x.push_back(position.x);
+        y.push_back(position.y);
+        z.push_back(position.z);
+        m.push_back(mass);
+        for (int k = 0; k < QUADRUPOLE_TERMS; k++) q[k].push_back(moments.quadrupole[k]);
+        for (int k = 0; k < OCTUPOLE_TERMS; k++) o[k].push_back(moments.octupole[k]);
+    }
+
+    // padding cells have zero mass and zero moments
+    void pad() {
+        while (m.size() % SimdFloat::WIDTH != 0) {
+            x.push_back(0.0f); y.push_back(0.0f); z.push_back(0.0f); m.push_back(0.0f);
+            for (Stream &s : q) s.push_back(0.0f);
+            for (Stream &s : o) s.push_back(0.0f);
+        }
+    }
+
+    // G * (monopole + higher terms) at position; see Multipole::acceleration
+    glm::vec3 accelerationAt(const glm::vec3 &position, float G, float softening) const
+    {
+        const SimdFloat eps = SimdFloat::broadcast(softening);
+        const SimdFloat xi = SimdFloat::broadcast(position.x);
+        const SimdFloat yi = SimdFloat::broadcast(position.y);
+        const SimdFloat zi = SimdFloat::broadcast(position.z);
+        SimdFloat ax = SimdFloat::zero(), ay = SimdFloat::zero(), az = SimdFloat::zero();
+
+        for (size_t j = 0; j < m.size(); j += SimdFloat::WIDTH) {
+            SimdFloat dx = SimdFloat::load(&x[j]) - xi;
+            SimdFloat dy = SimdFloat::load(&y[j]) - yi;
+            SimdFloat dz = SimdFloat::load(&z[j]) - zi;
+            SimdFloat r2 = SimdFloat::fma(dx, dx, SimdFloat::fma(dy, dy, SimdFloat::fma(dz, dz, eps)));
+            SimdFloat inv = rsqrt(r2);
+            SimdFloat inv2 = inv * inv;
+            SimdFloat inv3 = inv2 * inv;
+            SimdFloat inv5 = inv3 * inv2;
+
+            // monopole: m d / r^3
+            SimdFloat s = SimdFloat::load(&m[j]) * inv3;
+            SimdFloat sx = dx * s, sy = dy * s, sz = dz * s;
+
+            // quadrupole: -Q d / r^5 + 5/2 (d.Q.d) d / r^7
+            SimdFloat qxx = SimdFloat::load(&q[0][j]), qxy = SimdFloat::load(&q[1][j]);
+            SimdFloat qxz = SimdFloat::load(&q[2][j]), qyy = SimdFloat::load(&q[3][j]);
+            SimdFloat qyz = SimdFloat::load(&q[4][j]), qzz = SimdFloat::load(&q[5][j]);
+            SimdFloat qdx = SimdFloat::fma(qxx, dx, SimdFloat::fma(qxy, dy, qxz * dz));
+            SimdFloat qdy = SimdFloat::fma(qxy, dx, SimdFloat::fma(qyy, dy, qyz * dz));
+            SimdFloat qdz = SimdFloat::fma(qxz, dx, SimdFloat::fma(qyz, dy, qzz * dz));
+            SimdFloat dqd = SimdFloat::fma(dx, qdx, SimdFloat::fma(dy, qdy, dz * qdz));
+            SimdFloat radial = SimdFloat::broadcast(2.5f) * dqd * inv2;
+
+            if constexpr (OCTUPOLE_TERMS > 0) {
+                // octupole: 1/2 O(d,d,.) / r^7 - 7/6 O(d,d,d) d / r^9
+                SimdFloat xx = dx * dx, yy = dy * dy, zz = dz * dz;
+                SimdFloat two = SimdFloat::broadcast(2.0f);
+                SimdFloat xy2 = two * dx * dy, xz2 = two * dx * dz, yz2 = two * dy * dz;
+                SimdFloat o0 = SimdFloat::load(&o[0][j]), o1 = SimdFloat::load(&o[1][j]);
+                SimdFloat o2 = SimdFloat::load(&o[2][j]), o3 = SimdFloat::load(&o[3][j]);
+                SimdFloat o4 = SimdFloat::load(&o[4][j]), o5 = SimdFloat::load(&o[5][j]);
+                SimdFloat o6 = SimdFloat::load(&o[6][j]), o7 = SimdFloat::load(&o[7][j]);
+                SimdFloat o8 = SimdFloat::load(&o[8][j]), o9 = SimdFloat::load(&o[9][j]);
+                SimdFloat oddx = SimdFloat::fma(o0, xx, SimdFloat::fma(o3, yy, SimdFloat::fma(o5, zz,
+                                 SimdFloat::fma(o1, xy2, SimdFloat::fma(o2, xz2, o4 * yz2)))));
+                SimdFloat oddy = SimdFloat::fma(o1, xx, SimdFloat::fma(o6, yy, SimdFloat::fma(o8, zz,
+                                 SimdFloat::fma(o3, xy2, SimdFloat::fma(o4, xz2, o7 * yz2)))));
+                SimdFloat oddz = SimdFloat::fma(o2, xx, SimdFloat::fma(o7, yy, SimdFloat::fma(o9, zz,
+                                 SimdFloat::fma(o4, xy2, SimdFloat::fma(o5, xz2, o8 * yz2)))));
+                SimdFloat oddd = SimdFloat::fma(dx, oddx, SimdFloat::fma(dy, oddy, dz * oddz));
+
+                // fold into the quadrupole terms, which carry one less 1/r^2
+                SimdFloat half = SimdFloat::broadcast(0.5f) * inv2;
+                qdx = SimdFloat::fnma(oddx, half, qdx);
+                qdy = SimdFloat::fnma(oddy, half, qdy);
+                qdz = SimdFloat::fnma(oddz, half, qdz);
+                radial = SimdFloat::fnma(SimdFloat::broadcast(7.0f / 6.0f) * oddd, inv2 * inv2, radial);
+            }
+
+            sx = SimdFloat::fma(SimdFloat::fma(radial, dx, SimdFloat::zero() - qdx), inv5, sx);
+            sy = SimdFloat::fma(SimdFloat::fma(radial, dy, SimdFloat::zero() - qdy), inv5, sy);
+            sz = SimdFloat::fma(SimdFloat::fma(radial, dz, SimdFloat::zero() - qdz), inv5, sz);
+
+            ax = ax + sx;
+            ay = ay + sy;
+            az = az + sz;
+        }
+
+        return glm::vec3(ax.sum(), ay.sum(), az.sum()) * G;
+    }
+};
+
+#endif // INTERACTION_LIST_H
@@ -5,25 +5,37 @@
 #include <backends/imgui_impl_glfw.h>
 #include <backends/imgui_impl_opengl3.h>
 #include <string>
-#include "particle.h"
-#include "bhut.h"
-#include "seqnbody.h"
-#include "generate.h"
+#include "simulation_thread.h"
+#include "replay.h"
 #include <functional>
 #include "cosntlib.h"
+#include "trace.h"
+#include <cfloat>
+#include <vector>
 class SimulationMenu {
 private:
     // Performance metrics
     float fps = 0.0f;
     float frameTime = 0.0f;
     float simulationTime = 0.0f;
+    float stepsPerSecond = 0.0f;
+    int diagnosticsInterval = 0;
+    Diagnostics diagnostics;
+    // rolling trace percentiles, refreshed a few times a second
+    std::vector<Trace::Stat> traceStats;
+    float lastTraceRefresh = -1.0f;
     
     // Simulation settings
     bool pauseSimulation = false;
     int simulationType = 1;
     float simSpeed = 1.0f;
+    float maxStatesPerSecond = 60.0f;
     float physicsTimeStep = 0.01f;
     float theta = 0.5f;
+    bool symmetricForces = false;
+    int expansionOrder = 3;
+    float fmmTheta = 0.7f;
+    bool fusedPipeline = true;
     
     // Visual settings
     bool enablePostProcessing = true;
@@ -33,8 +45,29 @@ private:
     float starDensity = 0.997f;
     
     // Galaxy settings
+    static constexpr int GALAXY_TYPES = 5;
     int galaxyType = 0;
     int numParticles = 1000;
+    // seed for the next generation, 0 for a random one
+    uint64_t galaxySeed = 0;
+    // seed of the particles shown
+    uint64_t currentSeed = 0;
+
+    // Checkpointing: steps and time simulated since the galaxy was generated
+    char checkpointPath[256] = "nbody_checkpoint.nbc";
+    uint64_t simulationStep = 0;
+    double simulatedTime = 0.0;
+    // generation of the last simulation state seen
+    uint64_t particleGeneration = 0;
+
+    // Trajectory recording, one frame per published simulation state
+    char trajectoryPath[256] = "nbody_trajectory.trj";
+    int trajectoryBits = 16;
+    bool recordingTrajectory = false;
+    TrajectoryStats trajectoryStats;
+
+    // set in replay mode, which replaces the simulation and galaxy sections
+    TrajectoryPlayer* replay = nullptr;
     
     // Camera settings
     bool cameraEnabled = false;
@@ -63,17 +96,58 @@ public:
         setUniformIntFunc = setUniformInt;
     }
     
-    void updatePerformanceMetrics(float newFps, float newFrameTime, float newSimTime) {
+    void updatePerformanceMetrics(float newFps, float newFrameTime) {
         fps = newFps;
         frameTime = newFrameTime;
-        simulationTime = newSimTime;
     }
+
+    // takes the figures of the state being drawn; particles replaced on the
+    // simulation thread, as by a loaded checkpoint, also bring their settings
+    void updateSimulationState(const SimulationState& state) {
+        simulationTime = state.stepMs;
+        stepsPerSecond = state.stepsPerSecond;
+        diagnostics = state.diagnostics;
+        simulationStep = state.step;
+        simulatedTime = state.time;
+        recordingTrajectory = state.recording;
+        trajectoryStats = state.trajectory;
+        currentSeed = state.seed;
+        if (state.generation != particleGeneration) {
+            particleGeneration = state.generation;
+            numParticles = static_cast<int>(state.renderData.size());
+            if (state.galaxyType >= 0 && state.galaxyType < GALAXY_TYPES) galaxyType = state.galaxyType;
+            physicsTimeStep = state.dt;
+            theta = state.theta;
+        }
+    }
+
+    void setReplay(TrajectoryPlayer* player) { replay = player; }
     
     bool isPaused() const { return pauseSimulation; }
     int getSimulationType() const { return simulationType; }
     float getSimSpeed() const { return simSpeed; }
     float getTimeStep() const { return physicsTimeStep; }
     float getTheta() const { return theta; }
+    bool useSymmetricForces() const { return symmetricForces; }
+    int getExpansionOrder() const { return expansionOrder; }
+    float getFmmTheta() const { return fmmTheta; }
+    int getDiagnosticsInterval() const { return diagnosticsInterval; }
+
+    SimulationSettings getSettings() const {
+        SimulationSettings settings;
+        settings.paused = pauseSimulation;
+        settings.simulationType = simulationType;
+        settings.simSpeed = simSpeed;
+        settings.maxStatesPerSecond = maxStatesPerSecond;
+        settings.dt = physicsTimeStep;
+        settings.theta = theta;
+        settings.symmetricForces = symmetricForces;
+        settings.expansionOrder = expansionOrder;
+        settings.fmmTheta = fmmTheta;
+        settings.diagnosticsInterval = diagnosticsInterval;
+        settings.fusedPipeline = fusedPipeline;
+        return settings;
+    }
     bool isPostProcessingEnabled() const { return enablePostProcessing; }
     int getColorType() const { return colorType; }
     float getExposure() const { return exposureValue; }
@@ -84,11 +158,8 @@ public:
     bool isCameraEnabled() const { return cameraEnabled; }
     float getCameraSpeed() const { return cameraSpeed; }
     
-    bool renderMenu(Particle* particles, ParticleSystem& particleSystem, 
-                   SequentialNBodySimulator& seqSimulator, 
-                   BarnesHutCPUSimulator& bhSimulator) {
-        bool galaxyRegenerated = false;
-        
+    // changes to the particles and simulators are posted to simulation
+    void renderMenu(SimulationThread& simulation) {
         // ImGui new frame
         ImGui_ImplOpenGL3_NewFrame();
         ImGui_ImplGlfw_NewFrame();
@@ -98,9 +169,14 @@ public:
         ImGui::Begin("N-Body Simulation Controls");
         
         renderPerformanceSection();
-        renderSimulationControls(bhSimulator);
-        renderVisualSettings();
-        galaxyRegenerated = renderGalaxySettings(particles, particleSystem, seqSimulator, bhSimulator);
+        if (replay) {
+            renderReplayControls();
+            renderVisualSettings();
+        } else {
+            renderSimulationControls(simulation);
+            renderVisualSettings();
+            renderGalaxySettings(simulation);
+        }
         renderCameraControls();
         
         ImGui::End();
@@ -108,51 +184,160 @@ public:
         // Render ImGui
         ImGui::Render();
         ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
-        
-        return galaxyRegenerated;
     }
 
 private:
     void renderPerformanceSection() {
         ImGui::Text("Performance Metrics");
         ImGui::Text("FPS: %.1f (%.1f ms/frame)", fps, frameTime);
-        ImGui::Text("Simulation Time: %.1f ms", simulationTime);
+        if (replay) {
+            ImGui::Text("Simulation Time: %.1f ms", simulationTime);
+        } else {
+            ImGui::Text("Simulation: %.1f steps/s (%.1f ms per state)", stepsPerSecond, simulationTime);
+        }
         ImGui::Text("Particles: %d", numParticles);
+
+        ImGui::SliderInt("Diagnostics Every N Steps", &diagnosticsInterval, 0, 100);
+        if (diagnosticsInterval > 0 && diagnostics.valid()) {
+            ImGui::Text("Energy: %.4g (drift %.2e)", diagnostics.totalEnergy(), diagnostics.energyDrift);
+            ImGui::Text("Momentum: %.3g, %.3g, %.3g",
+                        diagnostics.momentum.x, diagnostics.momentum.y, diagnostics.momentum.z);
+            ImGui::Text("Angular Momentum: %.3g (drift %.2e)",
+                        glm::length(diagnostics.angularMomentum), diagnostics.angularMomentumDrift);
+            ImGui::Text("Virial Ratio 2K/|W|: %.3f (%.1f ms)", diagnostics.virialRatio(), diagnostics.elapsedMs);
+        }
+
+        renderTraceStats();
         ImGui::Separator();
     }
     
-    void renderSimulationControls(BarnesHutCPUSimulator& bhSimulator) {
+    void renderTraceStats() {
+        if (!Trace::ENABLED) {
+            ImGui::TextDisabled("Tracing off (build with NBODY_TRACING)");
+            return;
+        }
+        if (!ImGui::CollapsingHeader("Trace (last 2 s)")) return;
+
+        float now = static_cast<float>(ImGui::GetTime());
+        if (lastTraceRefresh < 0.0f || now - lastTraceRefresh > 0.5f) {
+            traceStats = Trace::collectStats();
+            lastTraceRefresh = now;
+        }
+
+        for (const Trace::Stat& stat : traceStats) {
+            ImGui::Text("%-24s p50 %7.3f  p99 %7.3f  max %7.3f ms (%ld)",
+                        stat.name, stat.p50Ms, stat.p99Ms, stat.maxMs, stat.count);
+            ImGui::PushID(stat.name);
+            ImGui::PlotHistogram("##histogram", stat.histogram.data(), Trace::HISTOGRAM_BUCKETS,
+                                 0, "log2 us", 0.0f, FLT_MAX, ImVec2(0.0f, 30.0f));
+            ImGui::PopID();
+        }
+
+        if (ImGui::Button("Export Chrome Trace")) {
+            Trace::writeChromeTrace("nbody_trace.json");
+        }
+    }
+
+    void renderReplayControls() {
+        ImGui::Text("Replay");
+        if (ImGui::Button(replay->isPaused() ? "Play" : "Pause")) {
+            replay->setPaused(!replay->isPaused());
+        }
+
+        float speed = replay->getSpeed();
+        if (ImGui::SliderFloat("Frames per Second", &speed, -240.0f, 240.0f, "%.1f")) {
+            replay->setSpeed(speed);
+        }
+
+        const float lastFrame = static_cast<float>(replay->getFrameCount() - 1);
+        float frame = static_cast<float>(replay->getCursor());
+        if (ImGui::SliderFloat("Frame", &frame, 0.0f, lastFrame, "%.1f")) {
+            replay->seek(frame);
+        }
+
+        bool looping = replay->isLooping();
+        if (ImGui::Checkbox("Loop", &looping)) replay->setLooping(looping);
+        ImGui::SameLine();
+        bool interpolating = replay->isInterpolating();
+        if (ImGui::Checkbox("Interpolate", &interpolating)) replay->setInterpolating(interpolating);
+
+        ImGui::Text("Step %llu, t = %.3f", static_cast<unsigned long long>(replay->getStep()), replay->getTime());
+        ImGui::Text("%zu particles, %zu frames", replay->getNumParticles(), replay->getFrameCount());
+        ImGui::Separator();
+    }
+
+    void renderSimulationControls(SimulationThread& simulation) {
         ImGui::Text("Simulation Controls");
         if (ImGui::Button(pauseSimulation ? "Resume" : "Pause")) {
             pauseSimulation = !pauseSimulation;
         }
         
-        const char* simTypes[] = { "Sequential", "Barnes-Hut" };
+        const char* simTypes[] = { "Sequential", "Barnes-Hut", "Fast Multipole" };
         ImGui::Combo("Simulation Type", &simulationType, simTypes, IM_ARRAYSIZE(simTypes));
         
         ImGui::SliderFloat("Speed", &simSpeed, 0.1f, 10.0f, "%.1f");
+        ImGui::SliderFloat("Max States per Second (0 off)", &maxStatesPerSecond, 0.0f, 240.0f, "%.0f");
         ImGui::SliderFloat("Time Step", &physicsTimeStep, 0.001f, 0.1f, "%.3f");
         
+        if (simulationType == 0) {
+            ImGui::Checkbox("Symmetric Pair Forces", &symmetricForces);
+        }
+        
         if (simulationType == 1) {
             ImGui::SliderFloat("Theta", &theta, 0.1f, 1.0f, "%.2f");
             ImGui::Text("Barnes-Hut Optimizations:");
             
             static bool adaptiveTheta = true;
             if (ImGui::Checkbox("Adaptive Theta", &adaptiveTheta)) {
-                bhSimulator.setAdaptiveTheta(adaptiveTheta);
+                const auto value = adaptiveTheta;
+                simulation.post([value](SimulationThread& sim) { sim.getBarnesHut().setAdaptiveTheta(value); });
+            }
+            
+            static bool mortonBuild = true;
+            if (ImGui::Checkbox("Morton Tree Build", &mortonBuild)) {
+                const auto value = mortonBuild;
+                simulation.post([value](SimulationThread& sim) { sim.getBarnesHut().setTreeBuildMode(value ? TreeBuildMode::Morton : TreeBuildMode::Insertion); });
+            }
+            
+            static bool groupWalk = true;
+            if (ImGui::Checkbox("Group Tree Walk", &groupWalk)) {
+                const auto value = groupWalk;
+                simulation.post([value](SimulationThread& sim) { sim.getBarnesHut().setGroupWalk(value); });
+            }
+            
+            static int leafCapacity = 16;
+            if (ImGui::SliderInt("Leaf Capacity", &leafCapacity, 1, 64)) {
+                const auto value = leafCapacity;
+                simulation.post([value](SimulationThread& sim) { sim.getBarnesHut().setLeafCapacity(static_cast<uint32_t>(value)); });
             }
             
             static int rebuildFrequency = 1;
-            if (ImGui::SliderInt("Tree Rebuild Frequency", &rebuildFrequency, 1, 10)) {
-                bhSimulator.setRebuildFrequency(rebuildFrequency);
+            if (ImGui::SliderInt("Tree Rebuild Frequency", &rebuildFrequency, 1, 30)) {
+                const auto value = rebuildFrequency;
+                simulation.post([value](SimulationThread& sim) { sim.getBarnesHut().setRebuildFrequency(value); });
             }
             
+            static int maxTimeBin = 0;
+            if (ImGui::SliderInt("Block Timestep Bins", &maxTimeBin, 0, 8)) {
+                const auto value = maxTimeBin;
+                simulation.post([value](SimulationThread& sim) { sim.getBarnesHut().setMaxTimeBin(value); });
+            }
+            
+            // global steps only; off runs the separate passes for comparison
+            ImGui::Checkbox("Fused Step Pipeline", &fusedPipeline);
+            
             static bool showProfiling = false;
             if (ImGui::Checkbox("Show Performance Metrics", &showProfiling)) {
-                bhSimulator.enableProfilingOutput(showProfiling);
+                const auto value = showProfiling;
+                simulation.post([value](SimulationThread& sim) { sim.getBarnesHut().enableProfilingOutput(value); });
             }
         }
         
+        if (simulationType == 2) {
+            ImGui::SliderInt("Expansion Order", &expansionOrder, 1, 8);
+            ImGui::SliderFloat("Opening Angle", &fmmTheta, 0.3f, 0.9f, "%.2f");
+        }
+        
         static float blackHoleMass = 1000.0f;
         if (ImGui::SliderFloat("Black Hole Mass", &blackHoleMass, 100.0f, 5000.0f, "%.0f")) {
             // This will be handled externally when regenerating the galaxy
@@ -185,43 +370,57 @@ private:
         ImGui::Separator();
     }
     
-    bool renderGalaxySettings(Particle* particles, ParticleSystem& particleSystem, 
-                            SequentialNBodySimulator& seqSimulator, 
-                            BarnesHutCPUSimulator& bhSimulator) {
-        bool galaxyRegenerated = false;
-        
+    void renderGalaxySettings(SimulationThread& simulation) {
         ImGui::Text("Galaxy Configuration");
-        const char* galaxyTypes[] = { "Random", "Disk", "Spiral", "Collision", "Dense" };
+        const char* galaxyTypes[GALAXY_TYPES] = { "Random", "Disk", "Spiral", "Collision", "Dense" };
         bool galaxyChanged = ImGui::Combo("Galaxy Type", &galaxyType, galaxyTypes, IM_ARRAYSIZE(galaxyTypes));
         
-        bool particleCountChanged = ImGui::SliderInt("Particle Count", &numParticles, 100, MAX_PARTICLES);
+        bool particleCountChanged = ImGui::SliderInt("Particle Count", &numParticles, 100, PARTICLE_SLIDER_MAX,
+                                                     "%d", ImGuiSliderFlags_Logarithmic);
         
         if (galaxyChanged || particleCountChanged || ImGui::Button("Generate New Galaxy")) {
-            switch (galaxyType) {
-                case 0:
-                    generateRandomGalaxy(particles, numParticles);
-                    break;
-                case 1:
-                    generateDiskGalaxy(particles, numParticles);
-                    break;
-                case 2:
-                    generateSpiralGalaxy(particles, numParticles);
-                    break;
-                case 3:
-                    generateCollisionGalaxy(particles, numParticles);
-                    break;
-                case 4:
-                    generateDenseDiskGalaxy(particles, numParticles);
-                    break;
+            const int type = galaxyType;
+            const int count = numParticles;
+            const uint64_t seed = galaxySeed;
+            simulation.post([type, count, seed](SimulationThread& sim) { sim.regenerate(type, count, seed); });
+        }
+        ImGui::InputScalar("Seed (0 random)", ImGuiDataType_U64, &galaxySeed);
+        ImGui::Text("Current seed: %llu", static_cast<unsigned long long>(currentSeed));
+
+        ImGui::InputText("Checkpoint File", checkpointPath, sizeof(checkpointPath));
+        if (ImGui::Button("Save Checkpoint")) {
+            const std::string path = checkpointPath;
+            simulation.post([path](SimulationThread& sim) { sim.saveCheckpoint(path); });
+        }
+        ImGui::SameLine();
+        if (ImGui::Button("Load Checkpoint")) {
+            const std::string path = checkpointPath;
+            simulation.post([path](SimulationThread& sim) { sim.restoreCheckpoint(path); });
+        }
+        ImGui::Text("Step %llu, t = %.3f", static_cast<unsigned long long>(simulationStep), simulatedTime);
+
+        ImGui::InputText("Trajectory File", trajectoryPath, sizeof(trajectoryPath));
+        ImGui::SliderInt("Quantisation Bits (0 raw)", &trajectoryBits, 0, 24);
+        // shows the simulation thread's state, which catches up a state later
+        bool record = recordingTrajectory;
+        if (ImGui::Checkbox("Record Trajectory", &record)) {
+            if (record) {
+                TrajectoryWriter::Options options;
+                options.quantizationBits = trajectoryBits;
+                options.dropWhenFull = true;
+                const std::string path = trajectoryPath;
+                simulation.post([path, options](SimulationThread& sim) { sim.startRecording(path, options); });
+            } else {
+                simulation.post([](SimulationThread& sim) { sim.stopRecording(); });
             }
-            
-            // The main renderer will update the simulation with the new particles
-            galaxyRegenerated = true;
+        }
+        if (recordingTrajectory) {
+            ImGui::Text("%ld frames, %ld dropped, %.1f MB (%.1fx)", trajectoryStats.framesWritten,
+                        trajectoryStats.framesDropped, trajectoryStats.bytesWritten / 1.0e6,
+                        trajectoryStats.compressionRatio());
         }
         
         ImGui::Separator();
-        
-        return galaxyRegenerated;
     }
     
     void renderCameraControls() {
@@ -0,0 +1,195 @@
+#ifndef MORTON_H
+#define MORTON_H
+
+#include <glm/glm.hpp>
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+// 63-bit Morton keys (21 bits per axis) and the parallel helpers the octree's
+// Morton build uses. Bit 3k of a key is x, 3k+1 is y and 3k+2 is z, so the
+// 3-bit digit at each level equals OctreeNode::getOctantForPosition.
+namespace Morton
+{
+    constexpr int BITS_PER_AXIS = 21;
+    constexpr int KEY_BITS = 3 * BITS_PER_AXIS;
+    constexpr int MAX_LEVEL = BITS_PER_AXIS;
+    constexpr uint32_t AXIS_CELLS = 1u << BITS_PER_AXIS;
+
+    inline uint64_t expandBits(uint32_t v)
+    {
+        uint64_t x = v & 0x1fffff;
+        x = (x | x << 32) & 0x1f00000000ffffull;
+        x = (x | x << 16) & 0x1f0000ff0000ffull;
+        x = (x | x << 8) & 0x100f00f00f00f00full;
+        x = (x | x << 4) & 0x10c30c30c30c30c3ull;
+        x = (x | x << 2) & 0x1249249249249249ull;
+        return x;
+    }
+
+    inline uint32_t compactBits(uint64_t x)
+    {
+        x &= 0x1249249249249249ull;
+        x = (x ^ (x >> 2)) & 0x10c30c30c30c30c3ull;
+        x = (x ^ (x >> 4)) & 0x100f00f00f00f00full;
+        x = (x ^ (x >> 8)) & 0x1f0000ff0000ffull;
+        x = (x ^ (x >> 16)) & 0x1f00000000ffffull;
+        x = (x ^ (x >> 32)) & 0x1fffffull;
+        return static_cast<uint32_t>(x);
+    }
+
+    inline uint32_t quantize(float value, float origin, float scale)
+    {
+        float cell = (value - origin) * scale;
+        if (cell <= 0.0f) return 0;
+        if (cell >= static_cast<float>(AXIS_CELLS - 1)) return AXIS_CELLS - 1;
+        return static_cast<uint32_t>(cell);
+    }
+
+    // scale = AXIS_CELLS / (edge length of the cubic domain starting at origin)
+    inline uint64_t encode(const glm::vec3 &position, const glm::vec3 &origin, float scale)
+    {
+        return expandBits(quantize(position.x, origin.x, scale)) |
+               (expandBits(quantize(position.y, origin.y, scale)) << 1) |
+               (expandBits(quantize(position.z, origin.z, scale)) << 2);
+    }
+
+    // octant of the cell at `level` (1..MAX_LEVEL) within its parent
+    inline int digit(uint64_t key, int level)
+    {
+        return static_cast<int>((key >> (KEY_BITS - 3 * level)) & 7);
+    }
+
+    // integer cell coordinates of the level-`level` cell containing key
+    inline void cellCoordinates(uint64_t key, int level, uint32_t &x, uint32_t &y, uint32_t &z)
+    {
+        int shift = BITS_PER_AXIS - level;
+        x = compactBits(key) >> shift;
+        y = compactBits(key >> 1) >> shift;
+        z = compactBits(key >> 2) >> shift;
+    }
+
+    inline int countLeadingZeros(uint64_t x)
+    {
+#if defined(__GNUC__) || defined(__clang__)
+        return x ? __builtin_clzll(x) : 64;
+#else
+        int count = 0;
+        for (uint64_t bit = 1ull << 63; bit && !(x & bit); bit >>= 1) count++;
+        return count;
+#endif
+    }
+
+    inline int threadCount()
+    {
+#ifdef _OPENMP
+        return omp_get_max_threads();
+#else
+        return 1;
+#endif
+    }
+
+    // Stable LSD radix sort of (key, value) pairs, 8 bits per pass. The keys
+    // are split into a fixed number of contiguous chunks, each histogrammed
+    // and scattered by whichever thread the static schedule gives it, so the
+    // result holds for any team size OpenMP actually grants. Passes whose
+    // digit is constant are skipped.
+    inline void radixSortPairs(std::vector<uint64_t> &keys, std::vector<uint32_t> &values,
+                               std::vector<uint64_t> &keyScratch, std::vector<uint32_t> &valueScratch,
+                               int keyBits = KEY_BITS)
+    {
+        const size_t n = keys.size();
+        keyScratch.resize(n);
+        valueScratch.resize(n);
+        if (n < 2) return;
+
+        const int chunks = n < 65536 ? 1 : threadCount();
+        std::vector<size_t> histogram(static_cast<size_t>(chunks) * 256);
+
+        for (int shift = 0; shift < keyBits; shift += 8) {
+            std::fill(histogram.begin(), histogram.end(), 0);
+
+            #pragma omp parallel for schedule(static) num_threads(chunks)
+            for (int c = 0; c < chunks; c++) {
+                const size_t begin = n * c / chunks;
+                const size_t end = n * (c + 1) / chunks;
+                size_t *counts = &histogram[static_cast<size_t>(c) * 256];
+                for (size_t i = begin; i < end; i++) {
+                    counts[(keys[i] >> shift) & 0xff]++;
+                }
+            }
+
+            bool constantDigit = false;
+            for (int d = 0; d < 256 && !constantDigit; d++) {
+                size_t total = 0;
+                for (int c = 0; c < chunks; c++) total += histogram[static_cast<size_t>(c) * 256 + d];
+                if (total == n) constantDigit = true;
+                else if (total != 0) break;
+            }
+            if (constantDigit) continue;
+
+            // digit-major, chunk-minor exclusive scan keeps the sort stable
+            size_t offset = 0;
+            for (int d = 0; d < 256; d++) {
+                for (int c = 0; c < chunks; c++) {
+                    size_t count = histogram[static_cast<size_t>(c) * 256 + d];
+                    histogram[static_cast<size_t>(c) * 256 + d] = offset;
+                    offset += count;
+                }
+            }
+
+            #pragma omp parallel for schedule(static) num_threads(chunks)
+            for (int c = 0; c < chunks; c++) {
+                const size_t begin = n * c / chunks;
+                const size_t end = n * (c + 1) / chunks;
+                size_t *offsets = &histogram[static_cast<size_t>(c) * 256];
+                for (size_t i = begin; i < end; i++) {
+                    size_t dst = offsets[(keys[i] >> shift) & 0xff]++;
+                    keyScratch[dst] = keys[i];
+                    valueScratch[dst] = values[i];
+                }
+            }
+
+            keys.swap(keyScratch);
+            values.swap(valueScratch);
+        }
+    }
+
+    // in-place exclusive prefix sum over fixed chunks (see radixSortPairs);
+    // returns the total
+    inline uint32_t exclusiveScan(std::vector<uint32_t> &values)
+    {
+        const size_t n = values.size();
+        const int chunks = n < 65536 ? 1 : threadCount();
+        std::vector<uint32_t> partial(static_cast<size_t>(chunks) + 1, 0);
+
+        #pragma omp parallel for schedule(static) num_threads(chunks)
+        for (int c = 0; c < chunks; c++) {
+            const size_t begin = n * c / chunks;
+            const size_t end = n * (c + 1) / chunks;
+            uint32_t sum = 0;
+            for (size_t i = begin; i < end; i++) sum += values[i];
+            partial[c + 1] = sum;
+        }
+
+        for (int c = 0; c < chunks; c++) partial[c + 1] += partial[c];
+
+        #pragma omp parallel for schedule(static) num_threads(chunks)
+        for (int c = 0; c < chunks; c++) {
+            const size_t begin = n * c / chunks;
+            const size_t end = n * (c + 1) / chunks;
+            uint32_t running = partial[c];
+            for (size_t i = begin; i < end; i++) {
+                uint32_t v = values[i];
+                values[i] = running;
+                running += v;
+            }
+        }
+        return partial[chunks];
+    }
+}
+
+#endif // MORTON_H
@@ -0,0 +1,176 @@
+#ifndef MULTIPOLE_H
+#define MULTIPOLE_H
+
+#include <glm/glm.hpp>
+#include <array>
+#include <cmath>
+
+// Higher multipole moments of a tree cell about its centre of mass, on top of
+// the monopole (totalMass, centerOfMass) kept in OctreeNode. The dipole
+// vanishes about the centre of mass, so Order 1 is the plain monopole,
+// Order 2 adds the traceless quadrupole
+//   Q_ij = sum m (3 y_i y_j - |y|^2 delta_ij)
+// and Order 3 the traceless octupole
+//   O_ijk = sum m (15 y_i y_j y_k - 3 |y|^2 (y_i delta_jk + y_j delta_ik + y_k delta_ij))
+// with y the body offset from the centre of mass. Both are symmetric and
+// stored as their 6 and 10 distinct components.
+//
+// The terms are derivatives of the Plummer kernel 1/sqrt(r^2 + softening).
+// Dropping the traces is exact only for the unsoftened kernel; the error is
+// O(softening / r^2) of the quadrupole term, below the truncation error
+// wherever the opening test accepts a cell.
+template <int Order>
+struct Multipole
+{
+    static_assert(Order >= 1 && Order <= 3, "multipole order must be 1 (monopole) to 3 (octupole)");
+
+    static constexpr int QUADRUPOLE_TERMS = Order >= 2 ? 6 : 0;
+    static constexpr int OCTUPOLE_TERMS = Order >= 3 ? 10 : 0;
+
+    // xx, xy, xz, yy, yz, zz
+    std::array<float, QUADRUPOLE_TERMS> quadrupole;
+    // xxx, xxy, xxz, xyy, xyz, xzz, yyy, yyz, yzz, zzz
+    std::array<float, OCTUPOLE_TERMS> octupole;
+
+    void clear() {
+        quadrupole.fill(0.0f);
+        octupole.fill(0.0f);
+    }
+
+    // Adds a point mass at offset t from the centre of mass
+    void addBody(float mass, const glm::vec3 &t) {
+        addShifted(nullptr, mass, t);
+    }
+
+    // Adds a child cell of the given mass whose centre of mass sits at offset
+    // t; the child's own moments are translated to this centre (M2M)
+    void addChild(const Multipole &child, float mass, const glm::vec3 &t) {
+        addShifted(&child, mass, t);
+    }
+
+    // Acceleration from the quadrupole and octupole terms for G = 1, with
+    // d = centre of mass - target and r2 = |d|^2 + softening. Add it to the
+    // monopole term m d / r2^(3/2).
+    glm::vec3 acceleration(const glm::vec3 &d, float r2) const {
+        glm::vec3 result(0.0f);
+        if constexpr (Order >= 2) {
+            const float inv2 = 1.0f / r2;
+            const float inv5 = inv2 * inv2 / std::sqrt(r2);
+            const float *q = quadrupole.data();
+
+            // a = -Q d / r^5 + 5/2 (d.Q.d) d / r^7
+            glm::vec3 qd(q[0] * d.x + q[1] * d.y + q[2] * d.z,
+                         q[1] * d.x + q[3] * d.y + q[4] * d.z,
+                         q[2] * d.x + q[4] * d.y + q[5] * d.z);
+            float dqd = glm::dot(d, qd);
+            result = (2.5f * dqd * inv2 * d - qd) * inv5;
+
+            if constexpr (Order >= 3) {
+                const float *o = octupole.data();
+
+                // a += 1/2 O(d,d,.) / r^7 - 7/6 O(d,d,d) d / r^9
+                const float xx = d.x * d.x, yy = d.y * d.y, zz = d.z * d.z;
+                const float xy2 = 2.0f * d.x * d.y, xz2 = 2.0f * d.x * d.z, yz2 = 2.0f * d.y * d.z;
+                glm::vec3 odd(o[0] * xx + o[3] * yy + o[5] * zz + o[1] * xy2 + o[2] * xz2 + o[4] * yz2,
+                              o[1] * xx + o[6] * yy + o[8] * zz + o[3] * xy2 + o[4] * xz2 + o[7] * yz2,
+                              o[2] * xx + o[7] * yy + o[9] * zz + o[4] * xy2 + o[5] * xz2 + o[8] * yz2);
+                float oddd = glm::dot(d, odd);
+                result += (0.5f * odd - (7.0f / 6.0f) * oddd * inv2 * d) * (inv5 * inv2);
+            }
+        }
+        return result;
+    }
+
+    // Potential from the quadrupole and octupole terms for G = 1, with d and
+    // r2 as in acceleration(). Add it to the monopole term -m / r.
+    //   phi = -(d.Q.d) / (2 r^5) + O(d,d,d) / (6 r^7)
+    float potential(const glm::vec3 &d, float r2) const {
+        float result = 0.0f;
+        if constexpr (Order >= 2) {
+            const float inv2 = 1.0f / r2;
+            const float inv5 = inv2 * inv2 / std::sqrt(r2);
+            const float *q = quadrupole.data();
+            glm::vec3 qd(q[0] * d.x + q[1] * d.y + q[2] * d.z,
+                         q[1] * d.x + q[3] * d.y + q[4] * d.z,
+                         q[2] * d.x + q[4] * d.y + q[5] * d.z);
+            result = -0.5f * glm::dot(d, qd) * inv5;
+
+            if constexpr (Order >= 3) {
+                const float *o = octupole.data();
+                const float xx = d.x * d.x, yy = d.y * d.y, zz = d.z * d.z;
+                const float xy2 = 2.0f * d.x * d.y, xz2 = 2.0f * d.x * d.z, yz2 = 2.0f * d.y * d.z;
+                glm::vec3 odd(o[0] * xx + o[3] * yy + o[5] * zz + o[1] * xy2 + o[2] * xz2 + o[4] * yz2,
+                              o[1] * xx + o[6] * yy + o[8] * zz + o[3] * xy2 + o[4] * xz2 + o[7] * yz2,
+                              o[2] * xx + o[7] * yy + o[9] * zz + o[4] * xy2 + o[5] * xz2 + o[8] * yz2);
+                result += glm::dot(d, odd) * inv5 * inv2 / 6.0f;
+            }
+        }
+        return result;
+    }
+
+private:
+    void addShifted(const Multipole *child, float mass, const glm::vec3 &t) {
+        if constexpr (Order >= 2) {
+            // Q += Q_child + M (3 t t - |t|^2 I)
+            const float t2 = glm::dot(t, t);
+            float *q = quadrupole.data();
+            q[0] += mass * (3.0f * t.x * t.x - t2);
+            q[1] += mass * 3.0f * t.x * t.y;
+            q[2] += mass * 3.0f * t.x * t.z;
+            q[3] += mass * (3.0f * t.y * t.y - t2);
+            q[4] += mass * 3.0f * t.y * t.z;
+            q[5] += mass * (3.0f * t.z * t.z - t2);
+            if (child) {
+                for (int k = 0; k < 6; k++) q[k] += child->quadrupole[k];
+            }
+
+            if constexpr (Order >= 3) {
+                // raw third moment of the shift: M t t t plus t (x) S_child
+                // symmetrised, where the child's second moment S_child can be
+                // replaced by Q_child / 3 as its isotropic part projects out
+                float a[10] = {
+                    mass * t.x * t.x * t.x, mass * t.x * t.x * t.y, mass * t.x * t.x * t.z,
+                    mass * t.x * t.y * t.y, mass * t.x * t.y * t.z, mass * t.x * t.z * t.z,
+                    mass * t.y * t.y * t.y, mass * t.y * t.y * t.z, mass * t.y * t.z * t.z,
+                    mass * t.z * t.z * t.z
+                };
+                if (child) {
+                    const float *c = child->quadrupole.data();
+                    const float sxx = c[0] / 3.0f, sxy = c[1] / 3.0f, sxz = c[2] / 3.0f;
+                    const float syy = c[3] / 3.0f, syz = c[4] / 3.0f, szz = c[5] / 3.0f;
+                    a[0] += 3.0f * t.x * sxx;
+                    a[1] += 2.0f * t.x * sxy + t.y * sxx;
+                    a[2] += 2.0f * t.x * sxz + t.z * sxx;
+                    a[3] += t.x * syy + 2.0f * t.y * sxy;
+                    a[4] += t.x * syz + t.y * sxz + t.z * sxy;
+                    a[5] += t.x * szz + 2.0f * t.z * sxz;
+                    a[6] += 3.0f * t.y * syy;
+                    a[7] += 2.0f * t.y * syz + t.z * syy;
+                    a[8] += t.y * szz + 2.0f * t.z * syz;
+                    a[9] += 3.0f * t.z * szz;
+                }
+
+                // traceless projection 15 A - 3 (delta (x) trace) of the raw moment
+                const float ax = a[0] + a[3] + a[5];
+                const float ay = a[1] + a[6] + a[8];
+                const float az = a[2] + a[7] + a[9];
+                float *o = octupole.data();
+                o[0] += 15.0f * a[0] - 9.0f * ax;
+                o[1] += 15.0f * a[1] - 3.0f * ay;
+                o[2] += 15.0f * a[2] - 3.0f * az;
+                o[3] += 15.0f * a[3] - 3.0f * ax;
+                o[4] += 15.0f * a[4];
+                o[5] += 15.0f * a[5] - 3.0f * ax;
+                o[6] += 15.0f * a[6] - 9.0f * ay;
+                o[7] += 15.0f * a[7] - 3.0f * az;
+                o[8] += 15.0f * a[8] - 3.0f * ay;
+                o[9] += 15.0f * a[9] - 9.0f * az;
+                if (child) {
+                    for (int k = 0; k < 10; k++) o[k] += child->octupole[k];
+                }
+            }
+        }
+    }
+};
+
+#endif // MULTIPOLE_H
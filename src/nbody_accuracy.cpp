@@ -0,0 +1,368 @@
+// Force-accuracy harness: compares Barnes-Hut accelerations on a snapshot to
+// a double-precision direct sum over a sweep of opening angle, leaf size,
+// multipole order and tree walk, and reports error percentiles next to
+// interactions per particle and walk time, marking each galaxy's Pareto
+// front (no other setting is both more accurate and faster).
+#include "particle.h"
+#include "physics.h"
+#include "generate.h"
+#include "octree.h"
+#include "bhut.h"
+#include "profiling.h"
+#include "cli.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+namespace {
+
+struct AccuracyOptions
+{
+    std::vector<int> galaxies = { 0, 1, 2, 3, 4 };
+    int numParticles = 20000;
+    // initial-condition seed, 0 picks a random one
+    uint64_t seed = 1;
+    std::vector<float> thetas = { 0.3f, 0.4f, 0.5f, 0.6f, 0.7f, 0.8f, 1.0f };
+    std::vector<int> leafSizes = { 1, 4, 8, 16, 32 };
+    std::vector<int> orders = { 1, 2, 3 };
+    bool particleWalk = true;
+    bool groupWalk = true;
+    // Barnes-Hut steps run before the snapshot, to measure a clustered state
+    int evolveSteps = 0;
+    float dt = 0.01f;
+    int repetitions = 3;
+    std::string format = "table";
+};
+
+struct AccuracyResult
+{
+    int galaxyType = 0;
+    float theta = 0.0f;
+    int leafSize = 0;
+    int order = 0;
+    bool groupWalk = false;
+    // relative acceleration error |a - a_ref| / |a_ref| over all particles
+    double medianError = 0.0;
+    double p99Error = 0.0;
+    double maxError = 0.0;
+    double interactionsPerParticle = 0.0;
+    double buildMs = 0.0;
+    double walkMs = 0.0;
+    bool pareto = false;
+};
+
+void printUsage(const char* program)
+{
+    std::cerr << "usage: " << program << " [options]\n"
+              << "  --galaxy NAME[,NAME...] random|disk|spiral|collision|dense or all (default all)\n"
+              << "  --n N                   particle count (default 20000)\n"
+              << "  --seed S                initial-condition seed, 0 for a random one (default 1)\n"
+              << "  --theta T[,T...]        opening angles (default 0.3,0.4,0.5,0.6,0.7,0.8,1.0)\n"
+              << "  --leaf-size N[,N...]    bodies per leaf (default 1,4,8,16,32)\n"
+              << "  --order P[,P...]        multipole orders 1-3 (default 1,2,3)\n"
+              << "  --walk particle|group|both  tree walks to measure (default both)\n"
+              << "  --evolve N              Barnes-Hut steps before the snapshot (default 0)\n"
+              << "  --dt DT                 time step for --evolve (default 0.01)\n"
+              << "  --reps N                timed walks per setting, median reported (default 3)\n"
+              << "  --format table|csv      output format (default table)\n";
+}
+
+bool parseArgs(int argc, char** argv, AccuracyOptions& options)
+{
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+
+        if (arg == "--help" || arg == "-h") {
+            return false;
+        } else if (i + 1 >= argc) {
+            std::cerr << "Missing value for " << arg << std::endl;
+            return false;
+        } else if (arg == "--galaxy") {
+            std::string value = argv[++i];
+            if (value == "all") continue;
+            options.galaxies.clear();
+            for (const std::string& item : splitList(value)) {
+                int type = parseGalaxy(item);
+                if (type < 0) {
+                    std::cerr << "Unknown galaxy " << item << std::endl;
+                    return false;
+                }
+                options.galaxies.push_back(type);
+            }
+        } else if (arg == "--n") {
+            options.numParticles = std::atoi(argv[++i]);
+        } else if (arg == "--seed") {
+            options.seed = std::strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--theta") {
+            options.thetas.clear();
+            for (const std::string& item : splitList(argv[++i])) {
+                options.thetas.push_back(static_cast<float>(std::atof(item.c_str())));
+            }
+        } else if (arg == "--leaf-size") {
+            options.leafSizes.clear();
+            for (const std::string& item : splitList(argv[++i])) {
+                options.leafSizes.push_back(std::atoi(item.c_str()));
+            }
+        } else if (arg == "--order") {
+            options.orders.clear();
+            for (const std::string& item : splitList(argv[++i])) {
+                int order = std::atoi(item.c_str());
+                if (order < 1 || order > 3) {
+                    std::cerr << "Multipole order must be 1-3" << std::endl;
+                    return false;
+                }
+                options.orders.push_back(order);
+            }
+        } else if (arg == "--walk") {
+            std::string walk = argv[++i];
+            if (walk != "particle" && walk != "group" && walk != "both") {
+                std::cerr << "Unknown walk " << walk << std::endl;
+                return false;
+            }
+            options.particleWalk = walk != "group";
+            options.groupWalk = walk != "particle";
+        } else if (arg == "--evolve") {
+            options.evolveSteps = std::atoi(argv[++i]);
+        } else if (arg == "--dt") {
+            options.dt = static_cast<float>(std::atof(argv[++i]));
+        } else if (arg == "--reps") {
+            options.repetitions = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--format") {
+            options.format = argv[++i];
+        } else {
+            std::cerr << "Unknown option " << arg << std::endl;
+            return false;
+        }
+    }
+
+    if (options.numParticles < 2) {
+        std::cerr << "Particle count must be at least 2" << std::endl;
+        return false;
+    }
+    if (options.format != "table" && options.format != "csv") {
+        std::cerr << "Unknown format " << options.format << std::endl;
+        return false;
+    }
+    return !options.galaxies.empty() && !options.thetas.empty() &&
+           !options.leafSizes.empty() && !options.orders.empty();
+}
+
+// Exact accelerations in double precision, with the same Plummer softening
+// as the tree: a_i = G sum_j m_j d_ij / (|d_ij|^2 + softening)^(3/2)
+std::vector<glm::dvec3> directAccelerations(const ParticleSystem& particles)
+{
+    const long n = static_cast<long>(particles.size());
+    std::vector<glm::dvec3> accelerations(n);
+
+    #pragma omp parallel for schedule(dynamic, 16)
+    for (long i = 0; i < n; i++) {
+        const glm::dvec3 xi(particles.getPosition(i));
+        glm::dvec3 sum(0.0);
+        for (long j = 0; j < n; j++) {
+            if (j == i) continue;
+            const glm::dvec3 d = glm::dvec3(particles.getPosition(j)) - xi;
+            const double r2 = glm::dot(d, d) + Physics::SOFTENING;
+            sum += d * (static_cast<double>(particles.getMass(j)) / (r2 * std::sqrt(r2)));
+        }
+        accelerations[i] = sum * static_cast<double>(Physics::G);
+    }
+    return accelerations;
+}
+
+double percentile(const std::vector<double>& sorted, double p)
+{
+    size_t rank = static_cast<size_t>(p / 100.0 * sorted.size() + 0.999999);
+    rank = std::min(std::max<size_t>(rank, 1), sorted.size());
+    return sorted[rank - 1];
+}
+
+template <int Order>
+AccuracyResult measureSetting(const AccuracyOptions& options, const ParticleSystem& particles,
+                              const std::vector<glm::dvec3>& reference,
+                              float theta, int leafSize, bool groupWalk)
+{
+    const long n = static_cast<long>(particles.size());
+    BasicOctree<Order> octree(theta);
+    octree.setLeafCapacity(static_cast<uint32_t>(leafSize));
+
+    auto buildStart = ProfileClock::now();
+    octree.buildTree(particles);
+    const double buildMs = elapsedMs(buildStart, ProfileClock::now());
+
+    std::vector<glm::vec3> accelerations(n);
+    std::vector<uint32_t> interactions(n);
+    long totalInteractions = 0;
+    std::vector<double> walkSamples;
+
+    for (int r = 0; r < options.repetitions; r++) {
+        auto walkStart = ProfileClock::now();
+        if (groupWalk) {
+            octree.calculateGroupAccelerations(Physics::G, Physics::SOFTENING, accelerations);
+        } else {
+            #pragma omp parallel for schedule(dynamic, 64)
+            for (long i = 0; i < n; i++) {
+                const float mass = particles.getMass(i);
+                glm::vec3 force = octree.calculateForce(particles.getPosition(i), mass,
+                                                        Physics::G, Physics::SOFTENING, &interactions[i]);
+                accelerations[i] = mass > 0.0f ? force / mass : glm::vec3(0.0f);
+            }
+        }
+        walkSamples.push_back(elapsedMs(walkStart, ProfileClock::now()));
+    }
+    std::sort(walkSamples.begin(), walkSamples.end());
+
+    if (groupWalk) {
+        totalInteractions = octree.getGroupInteractionCount();
+    } else {
+        for (uint32_t count : interactions) totalInteractions += count;
+    }
+
+    std::vector<double> errors(n);
+    for (long i = 0; i < n; i++) {
+        const double exact = glm::length(reference[i]);
+        const glm::dvec3 difference = glm::dvec3(accelerations[i]) - reference[i];
+        errors[i] = exact > 0.0 ? glm::length(difference) / exact : 0.0;
+    }
+    std::sort(errors.begin(), errors.end());
+
+    AccuracyResult result;
+    result.theta = theta;
+    result.leafSize = leafSize;
+    result.order = Order;
+    result.groupWalk = groupWalk;
+    result.medianError = percentile(errors, 50.0);
+    result.p99Error = percentile(errors, 99.0);
+    result.maxError = errors.back();
+    result.interactionsPerParticle = static_cast<double>(totalInteractions) / n;
+    result.buildMs = buildMs;
+    result.walkMs = percentile(walkSamples, 50.0);
+    return result;
+}
+
+// marks the settings no other one beats on both p99 error and walk time
+void markPareto(std::vector<AccuracyResult>& results)
+{
+    for (AccuracyResult& candidate : results) {
+        candidate.pareto = true;
+        for (const AccuracyResult& other : results) {
+            bool noWorse = other.p99Error <= candidate.p99Error && other.walkMs <= candidate.walkMs;
+            bool better = other.p99Error < candidate.p99Error || other.walkMs < candidate.walkMs;
+            if (noWorse && better) {
+                candidate.pareto = false;
+                break;
+            }
+        }
+    }
+}
+
+void printTable(const std::vector<AccuracyResult>& results)
+{
+    std::printf("%-10s %-8s %5s %4s %5s %10s %10s %10s %12s %9s %9s %6s\n",
+                "galaxy", "walk", "theta", "leaf", "order", "err_med", "err_p99", "err_max",
+                "inter/part", "build_ms", "walk_ms", "pareto");
+    for (const AccuracyResult& r : results) {
+        std::printf("%-10s %-8s %5.2f %4d %5d %10.3e %10.3e %10.3e %12.1f %9.3f %9.3f %6s\n",
+                    galaxyNames[r.galaxyType], r.groupWalk ? "group" : "particle",
+                    r.theta, r.leafSize, r.order, r.medianError, r.p99Error, r.maxError,
+                    r.interactionsPerParticle, r.buildMs, r.walkMs, r.pareto ? "*" : "");
+    }
+
+    // the fronts alone, fastest first, for picking production settings
+    std::printf("\nPareto fronts (p99 error vs walk time):\n");
+    for (int galaxyType = 0; galaxyType < galaxyNameCount; galaxyType++) {
+        std::vector<AccuracyResult> front;
+        for (const AccuracyResult& r : results) {
+            if (r.galaxyType == galaxyType && r.pareto) front.push_back(r);
+        }
+        if (front.empty()) continue;
+        std::sort(front.begin(), front.end(), [](const AccuracyResult& a, const AccuracyResult& b) {
+            return a.walkMs < b.walkMs;
+        });
+        std::printf("  %s:\n", galaxyNames[galaxyType]);
+        for (const AccuracyResult& r : front) {
+            std::printf("    %-8s theta %.2f leaf %2d order %d: p99 %.3e in %.3f ms\n",
+                        r.groupWalk ? "group" : "particle", r.theta, r.leafSize, r.order,
+                        r.p99Error, r.walkMs);
+        }
+    }
+}
+
+void printCsv(const AccuracyOptions& options, const std::vector<AccuracyResult>& results)
+{
+    std::printf("galaxy,n,walk,theta,leaf_size,order,err_median,err_p99,err_max,"
+                "interactions_per_particle,build_ms,walk_ms,pareto\n");
+    for (const AccuracyResult& r : results) {
+        std::printf("%s,%d,%s,%g,%d,%d,%.6e,%.6e,%.6e,%.2f,%.4f,%.4f,%d\n",
+                    galaxyNames[r.galaxyType], options.numParticles,
+                    r.groupWalk ? "group" : "particle", r.theta, r.leafSize, r.order,
+                    r.medianError, r.p99Error, r.maxError, r.interactionsPerParticle,
+                    r.buildMs, r.walkMs, r.pareto ? 1 : 0);
+    }
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    AccuracyOptions options;
+    if (!parseArgs(argc, argv, options)) {
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    const int n = options.numParticles;
+    std::vector<AccuracyResult> allResults;
+
+    for (int galaxyType : options.galaxies) {
+        ParticleSystem particles(n);
+        generateGalaxy(galaxyType, particles, n, options.seed);
+        if (options.evolveSteps > 0) {
+            BarnesHutCPUSimulator simulator(particles, options.dt);
+            for (int step = 0; step < options.evolveSteps; step++) simulator.update();
+        }
+
+        auto referenceStart = ProfileClock::now();
+        std::vector<glm::dvec3> reference = directAccelerations(particles);
+        std::cerr << galaxyNames[galaxyType] << ": direct sum " << elapsedMs(referenceStart, ProfileClock::now())
+                  << " ms" << std::endl;
+
+        std::vector<AccuracyResult> results;
+        for (int order : options.orders) {
+            for (int leafSize : options.leafSizes) {
+                for (float theta : options.thetas) {
+                    for (int walk = 0; walk < 2; walk++) {
+                        bool group = walk == 1;
+                        if (group ? !options.groupWalk : !options.particleWalk) continue;
+                        AccuracyResult result;
+                        if (order == 1) {
+                            result = measureSetting<1>(options, particles, reference, theta, leafSize, group);
+                        } else if (order == 2) {
+                            result = measureSetting<2>(options, particles, reference, theta, leafSize, group);
+                        } else {
+                            result = measureSetting<3>(options, particles, reference, theta, leafSize, group);
+                        }
+                        result.galaxyType = galaxyType;
+                        results.push_back(result);
+                    }
+                }
+            }
+        }
+
+        markPareto(results);
+        allResults.insert(allResults.end(), results.begin(), results.end());
+    }
+
+    if (options.format == "csv") {
+        printCsv(options, allResults);
+    } else {
+        printTable(allResults);
+    }
+    return 0;
+}
@@ -0,0 +1,336 @@
+// Microbenchmarks: times each simulation phase in isolation over a sweep of
+// particle counts and galaxy generators and reports median / p95 per case as
+// JSON on stdout, for comparing builds and catching regressions.
+#include "particle.h"
+#include "physics.h"
+#include "generate.h"
+#include "octree.h"
+#include "seqnbody.h"
+#include "profiling.h"
+#include "cli.h"
+#include "perf_counters.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+namespace {
+
+const char* const phaseNames[] = {
+    "generate", "tree_build", "force_walk", "group_walk",
+    "leapfrog_drift", "leapfrog_kick", "stabilize", "seq_update"
+};
+const int phaseNameCount = sizeof(phaseNames) / sizeof(phaseNames[0]);
+
+struct BenchOptions
+{
+    std::vector<int> sizes = { 1000, 10000, 100000, 1000000 };
+    std::vector<int> galaxies = { 0, 1, 2, 3, 4 };
+    std::vector<std::string> phases = std::vector<std::string>(phaseNames, phaseNames + phaseNameCount);
+    int warmup = 2;
+    int repetitions = 10;
+    float theta = 0.5f;
+    float dt = 0.01f;
+    // the O(N^2) sequential update is skipped above this many particles
+    int maxDirect = 20000;
+    bool hardwareCounters = false;
+    // initial-condition seed, fixed so runs compare like with like
+    uint64_t seed = 1;
+};
+
+struct BenchResult
+{
+    std::string phase;
+    int galaxyType = 0;
+    int numParticles = 0;
+    int repetitions = 0;
+    double medianMs = 0.0;
+    double p95Ms = 0.0;
+    double minMs = 0.0;
+    double meanMs = 0.0;
+    // hardware counts per timed run; available == 0 without counters
+    CounterValues counters;
+    uint32_t available = 0;
+};
+
+// opened once by main with --counters; null for timing only
+PerfCounters* hardwareCounters = nullptr;
+
+void printUsage(const char* program)
+{
+    std::cerr << "usage: " << program << " [options]\n"
+              << "  --n N[,N...]            particle counts (default 1000,10000,100000,1000000)\n"
+              << "  --galaxy NAME[,NAME...] random|disk|spiral|collision|dense or all (default all)\n"
+              << "  --phase NAME[,NAME...]  generate|tree_build|force_walk|group_walk|leapfrog_drift|\n"
+              << "                          leapfrog_kick|stabilize|seq_update or all (default all)\n"
+              << "  --warmup N              untimed runs before each case (default 2)\n"
+              << "  --reps N                timed runs per case (default 10)\n"
+              << "  --theta THETA           Barnes-Hut opening angle (default 0.5)\n"
+              << "  --dt DT                 leapfrog time step (default 0.01)\n"
+              << "  --max-direct N          largest N for seq_update (default 20000)\n"
+              << "  --seed S                initial-condition seed, 0 for a random one (default 1)\n"
+              << "  --counters              add mean hardware counts per run (perf_event_open),\n"
+              << "                          timing only when not permitted\n";
+}
+
+bool parseArgs(int argc, char** argv, BenchOptions& options)
+{
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+
+        if (arg == "--help" || arg == "-h") {
+            return false;
+        } else if (arg == "--counters") {
+            options.hardwareCounters = true;
+        } else if (i + 1 >= argc) {
+            std::cerr << "Missing value for " << arg << std::endl;
+            return false;
+        } else if (arg == "--n") {
+            options.sizes.clear();
+            for (const std::string& item : splitList(argv[++i])) {
+                int n = std::atoi(item.c_str());
+                if (n < 2) {
+                    std::cerr << "Particle counts must be at least 2" << std::endl;
+                    return false;
+                }
+                options.sizes.push_back(n);
+            }
+        } else if (arg == "--galaxy") {
+            std::string value = argv[++i];
+            if (value == "all") continue;
+            options.galaxies.clear();
+            for (const std::string& item : splitList(value)) {
+                int type = parseGalaxy(item);
+                if (type < 0) {
+                    std::cerr << "Unknown galaxy " << item << std::endl;
+                    return false;
+                }
+                options.galaxies.push_back(type);
+            }
+        } else if (arg == "--phase") {
+            std::string value = argv[++i];
+            if (value == "all") continue;
+            options.phases.clear();
+            for (const std::string& item : splitList(value)) {
+                if (std::find(phaseNames, phaseNames + phaseNameCount, item) == phaseNames + phaseNameCount) {
+                    std::cerr << "Unknown phase " << item << std::endl;
+                    return false;
+                }
+                options.phases.push_back(item);
+            }
+        } else if (arg == "--seed") {
+            options.seed = std::strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--warmup") {
+            options.warmup = std::max(0, std::atoi(argv[++i]));
+        } else if (arg == "--reps") {
+            options.repetitions = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--theta") {
+            options.theta = static_cast<float>(std::atof(argv[++i]));
+        } else if (arg == "--dt") {
+            options.dt = static_cast<float>(std::atof(argv[++i]));
+        } else if (arg == "--max-direct") {
+            options.maxDirect = std::atoi(argv[++i]);
+        } else {
+            std::cerr << "Unknown option " << arg << std::endl;
+            return false;
+        }
+    }
+    return !options.sizes.empty() && !options.galaxies.empty() && !options.phases.empty();
+}
+
+// nearest-rank percentile of sorted samples
+double percentile(const std::vector<double>& sorted, double p)
+{
+    size_t rank = static_cast<size_t>(p / 100.0 * sorted.size() + 0.999999);
+    rank = std::min(std::max<size_t>(rank, 1), sorted.size());
+    return sorted[rank - 1];
+}
+
+// warmup untimed runs, then repetitions timed runs of body; setup runs
+// untimed before every one of them
+BenchResult measure(const BenchOptions& options, const std::function<void()>& setup,
+                    const std::function<void()>& body)
+{
+    for (int r = 0; r < options.warmup; r++) {
+        setup();
+        body();
+    }
+
+    std::vector<double> samples;
+    samples.reserve(options.repetitions);
+    CounterValues counted;
+    for (int r = 0; r < options.repetitions; r++) {
+        setup();
+        const CounterValues before = hardwareCounters ? hardwareCounters->read() : CounterValues();
+        auto start = ProfileClock::now();
+        body();
+        samples.push_back(elapsedMs(start, ProfileClock::now()));
+        if (hardwareCounters) counted += hardwareCounters->read() - before;
+    }
+    std::sort(samples.begin(), samples.end());
+
+    BenchResult result;
+    if (hardwareCounters) {
+        for (int e = 0; e < PERF_EVENT_COUNT; e++) result.counters[e] = counted[e] / options.repetitions;
+        result.available = hardwareCounters->getAvailable();
+    }
+    result.repetitions = options.repetitions;
+    result.medianMs = percentile(samples, 50.0);
+    result.p95Ms = percentile(samples, 95.0);
+    result.minMs = samples.front();
+    double sum = 0.0;
+    for (double sample : samples) sum += sample;
+    result.meanMs = sum / samples.size();
+    return result;
+}
+
+// Times one phase on a freshly generated galaxy. Phases that move the
+// particles (the leapfrog passes, stabilize, seq_update) run on a copy that
+// setup restores, so every repetition starts from the same state.
+bool runPhase(const BenchOptions& options, const std::string& phase, int galaxyType, int n,
+              const ParticleSystem& initial, ParticleSystem& particles, BenchResult& result)
+{
+    auto restore = [&]() {
+        for (int i = 0; i < n; i++) particles.setParticle(i, initial.getParticle(i));
+    };
+    auto none = []() {};
+
+    if (phase == "generate") {
+        result = measure(options, none, [&]() { generateGalaxy(galaxyType, particles, n, options.seed); });
+    } else if (phase == "tree_build") {
+        Octree octree(options.theta);
+        restore();
+        result = measure(options, none, [&]() { octree.buildTree(particles); });
+    } else if (phase == "force_walk") {
+        Octree octree(options.theta);
+        restore();
+        octree.buildTree(particles);
+        std::vector<glm::vec3> forces(n);
+        result = measure(options, none, [&]() {
+            #pragma omp parallel for schedule(dynamic, 64)
+            for (long i = 0; i < n; i++) {
+                forces[i] = octree.calculateForce(particles.getPosition(i), particles.getMass(i),
+                                                  Physics::G, Physics::SOFTENING);
+            }
+        });
+    } else if (phase == "group_walk") {
+        Octree octree(options.theta);
+        restore();
+        octree.buildTree(particles);
+        std::vector<glm::vec3> accelerations;
+        result = measure(options, none, [&]() {
+            octree.calculateGroupAccelerations(Physics::G, Physics::SOFTENING, accelerations);
+        });
+    } else if (phase == "leapfrog_drift") {
+        result = measure(options, restore, [&]() { Physics::integrateLeapFrog(particles, options.dt); });
+    } else if (phase == "leapfrog_kick") {
+        result = measure(options, restore, [&]() { Physics::finalizeLeapFrog(particles, options.dt); });
+    } else if (phase == "stabilize") {
+        result = measure(options, restore, [&]() { Physics::stabilizeOrbits(particles); });
+    } else if (phase == "seq_update") {
+        if (n > options.maxDirect) return false;
+        SequentialNBodySimulator simulator(particles, options.dt);
+        result = measure(options, restore, [&]() { simulator.update(); });
+    } else {
+        return false;
+    }
+
+    result.phase = phase;
+    result.galaxyType = galaxyType;
+    result.numParticles = n;
+    return true;
+}
+
+int threadCount()
+{
+#ifdef _OPENMP
+    return omp_get_max_threads();
+#else
+    return 1;
+#endif
+}
+
+void printResults(const BenchOptions& options, const std::vector<BenchResult>& results)
+{
+    std::printf("{\n");
+    std::printf("  \"threads\": %d,\n", threadCount());
+#ifdef NBODY_SOA_LAYOUT
+    std::printf("  \"layout\": \"soa\",\n");
+#else
+    std::printf("  \"layout\": \"aos\",\n");
+#endif
+    std::printf("  \"multipole_order\": %d,\n", NBODY_MULTIPOLE_ORDER);
+    std::printf("  \"theta\": %g,\n", options.theta);
+    std::printf("  \"dt\": %g,\n", options.dt);
+    std::printf("  \"warmup\": %d,\n", options.warmup);
+    std::printf("  \"repetitions\": %d,\n", options.repetitions);
+    std::printf("  \"hardware_counters\": %s,\n", hardwareCounters ? "true" : "false");
+    std::printf("  \"results\": [\n");
+    for (size_t k = 0; k < results.size(); k++) {
+        const BenchResult& r = results[k];
+        std::printf("    { \"phase\": \"%s\", \"galaxy\": \"%s\", \"n\": %d, "
+                    "\"median_ms\": %.4f, \"p95_ms\": %.4f, \"min_ms\": %.4f, \"mean_ms\": %.4f, "
+                    "\"ns_per_particle\": %.3f",
+                    r.phase.c_str(), galaxyNames[r.galaxyType], r.numParticles,
+                    r.medianMs, r.p95Ms, r.minMs, r.meanMs,
+                    r.medianMs * 1.0e6 / r.numParticles);
+        if (r.available) {
+            std::printf(", \"counters\": {");
+            for (int e = 0; e < PERF_EVENT_COUNT; e++) {
+                if (r.available & (1u << e)) std::printf(" \"%s\": %.0f,", perfEventName(e), r.counters[e]);
+            }
+            std::printf(" \"ipc\": %.3f, \"l1d_mpki\": %.3f, \"llc_mpki\": %.3f }",
+                        r.counters.ipc(), r.counters.perKiloInstruction(PERF_L1D_MISSES),
+                        r.counters.perKiloInstruction(PERF_LLC_MISSES));
+        }
+        std::printf(" }%s\n", k + 1 < results.size() ? "," : "");
+    }
+    std::printf("  ]\n");
+    std::printf("}\n");
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    BenchOptions options;
+    if (!parseArgs(argc, argv, options)) {
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    PerfCounters counters;
+    if (options.hardwareCounters) {
+        if (counters.open()) {
+            hardwareCounters = &counters;
+        } else {
+            std::cerr << "Hardware counters unavailable (no PMU access, see perf_event_paranoid); timing only" << std::endl;
+        }
+    }
+
+    std::vector<BenchResult> results;
+    for (int n : options.sizes) {
+        ParticleSystem initial(n);
+        ParticleSystem particles(n);
+        for (int galaxyType : options.galaxies) {
+            generateGalaxy(galaxyType, initial, n, options.seed);
+            for (const std::string& phase : options.phases) {
+                BenchResult result;
+                if (runPhase(options, phase, galaxyType, n, initial, particles, result)) {
+                    results.push_back(result);
+                    std::cerr << phase << " " << galaxyNames[galaxyType] << " n=" << n
+                              << ": median " << result.medianMs << " ms" << std::endl;
+                }
+            }
+        }
+    }
+
+    printResults(options, results);
+    return 0;
+}
@@ -0,0 +1,597 @@
+// Headless batch driver: runs a simulation at full speed without a window and
+// reports throughput and per-phase timings as JSON (or CSV) on stdout.
+#include "particle.h"
+#include "physics.h"
+#include "generate.h"
+#include "seqnbody.h"
+#include "bhut.h"
+#include "fmmsim.h"
+#include "integrator.h"
+#include "diagnostics.h"
+#include "profiling.h"
+#include "cli.h"
+#include "trace.h"
+#include "perf_counters.h"
+#include "checkpoint.h"
+#include "trajectory.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+namespace {
+
+struct RunOptions
+{
+    std::string sim = "bh";
+    std::string integrator = "leapfrog";
+    int galaxyType = 0;
+    int numParticles = 1000;
+    // initial-condition seed, 0 picks a random one
+    uint64_t seed = 1;
+    float dt = 0.01f;
+    bool dtSet = false;
+    float theta = 0.5f;
+    bool thetaSet = false;
+    int order = 3;
+    int steps = 100;
+    int warmup = 0;
+    int rebuildFrequency = 1;
+    float refitTolerance = 0.25f;
+    int maxTimeBin = 0;
+    float timestepAccuracy = 0.025f;
+    TreeBuildMode buildMode = TreeBuildMode::Morton;
+    bool stabilize = true;
+    // Barnes-Hut: fused step pipeline, off to validate against the separate passes
+    bool fused = true;
+    bool symmetric = false;
+    bool groupWalk = true;
+    int leafCapacity = 16;
+    int diagnosticsInterval = 0;
+    bool hardwareCounters = false;
+    std::string format = "json";
+    // Chrome trace JSON written after the run; needs NBODY_TRACING
+    std::string tracePath;
+    // checkpoint written every checkpointInterval steps (0: only at the end)
+    std::string checkpointPath;
+    int checkpointInterval = 0;
+    // checkpoint to resume from instead of generating a galaxy
+    std::string restartPath;
+    // positions streamed every trajectoryInterval steps, timed steps only
+    std::string trajectoryPath;
+    int trajectoryInterval = 1;
+    TrajectoryWriter::Options trajectoryOptions;
+};
+
+struct RunResult
+{
+    double wallSeconds = 0.0;
+    float stabilizeMs = 0.0f;
+    PhaseTimings phases;
+    // every diagnostics measurement, warmup included
+    std::vector<Diagnostics> diagnostics;
+    // per timed step; empty when counters are off or unavailable
+    std::vector<PhaseCounters> counters;
+    bool countersRequested = false;
+    // simulation step the run resumed from and the checkpoint load time
+    uint64_t startStep = 0;
+    float restartMs = 0.0f;
+    // checkpoint writes, excluded from wallSeconds
+    int checkpointWrites = 0;
+    float checkpointMs = 0.0f;
+    bool checkpointFailed = false;
+    bool trajectoryRequested = false;
+    TrajectoryStats trajectory;
+};
+
+void printUsage(const char* program)
+{
+    std::cerr << "usage: " << program << " [options]\n"
+              << "  --sim seq|bh|fmm        simulation engine (default bh)\n"
+              << "  --galaxy NAME           random|disk|spiral|collision|dense (default random)\n"
+              << "  --integrator NAME       leapfrog|yoshida4|forest-ruth|hermite4 (default leapfrog;\n"
+              << "                          hermite4 needs --sim seq)\n"
+              << "  --n N                   particle count (default 1000)\n"
+              << "  --seed S                initial-condition seed, 0 for a random one (default 1)\n"
+              << "  --dt DT                 physics time step (default 0.01)\n"
+              << "  --theta THETA           opening angle (default 0.5 for bh, 0.7 for fmm)\n"
+              << "  --order P               FMM expansion order 1-8 (default 3)\n"
+              << "  --steps N               timed steps (default 100)\n"
+              << "  --warmup N              untimed steps before measuring (default 0)\n"
+              << "  --rebuild-frequency N   Barnes-Hut: rebuild the tree at least every N steps,\n"
+              << "                          refit it in between (default 1)\n"
+              << "  --refit-tolerance X     tree-quality loss that forces an early rebuild (default 0.25)\n"
+              << "  --time-bins K           Barnes-Hut: block timesteps down to dt / 2^K (default 0, global dt)\n"
+              << "  --eta ETA               block timestep accuracy, dt = sqrt(2 eta eps / |a|) (default 0.025)\n"
+              << "  --build MODE            morton|insertion octree construction (default morton)\n"
+              << "  --walk group|particle   Barnes-Hut tree walk per group or per particle (default group)\n"
+              << "  --leaf-size N           Barnes-Hut bodies per octree leaf, 1-64 (default 16)\n"
+              << "  --symmetric             sequential: visit each pair once (Newton's third law)\n"
+              << "  --diagnostics K         energy, momenta and virial ratio every K steps (default 0, off)\n"
+              << "  --counters              per-phase hardware counters (perf_event_open), timing only\n"
+              << "                          when not permitted\n"
+              << "  --no-stabilize          skip the per-step orbit stabilisation pass\n"
+              << "  --unfused               Barnes-Hut: run each pass of a global leapfrog step separately\n"
+              << "                          instead of the fused pipeline (for validation)\n"
+              << "  --format json|csv       output format (default json)\n"
+              << "  --trace FILE            write a Chrome/Perfetto trace (NBODY_TRACING builds)\n"
+              << "  --checkpoint FILE       write a binary checkpoint after the run\n"
+              << "  --checkpoint-every K    also write it every K steps, warmup included (default 0)\n"
+              << "  --restart FILE          resume from a checkpoint; its N, galaxy, dt and theta\n"
+              << "                          replace --n and --galaxy, and --dt / --theta unless given\n"
+              << "  --trajectory FILE       stream positions of the timed steps to FILE from a writer thread\n"
+              << "  --trajectory-every K    record every K-th step (default 1)\n"
+              << "  --trajectory-bits B     quantise to 2^B cells per axis, 0 for raw floats (default 16)\n"
+              << "  --trajectory-keyframe K frames between keyframes (default 32)\n";
+}
+
+bool parseArgs(int argc, char** argv, RunOptions& options)
+{
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+
+        if (arg == "--help" || arg == "-h") {
+            return false;
+        } else if (arg == "--counters") {
+            options.hardwareCounters = true;
+        } else if (arg == "--no-stabilize") {
+            options.stabilize = false;
+        } else if (arg == "--unfused") {
+            options.fused = false;
+        } else if (arg == "--symmetric") {
+            options.symmetric = true;
+        } else if (!hasValue) {
+            std::cerr << "Missing value for " << arg << std::endl;
+            return false;
+        } else if (arg == "--sim") {
+            options.sim = argv[++i];
+        } else if (arg == "--integrator") {
+            options.integrator = argv[++i];
+        } else if (arg == "--galaxy") {
+            options.galaxyType = parseGalaxy(argv[++i]);
+        } else if (arg == "--n") {
+            options.numParticles = std::atoi(argv[++i]);
+        } else if (arg == "--seed") {
+            options.seed = std::strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--dt") {
+            options.dt = static_cast<float>(std::atof(argv[++i]));
+            options.dtSet = true;
+        } else if (arg == "--theta") {
+            options.theta = static_cast<float>(std::atof(argv[++i]));
+            options.thetaSet = true;
+        } else if (arg == "--order") {
+            options.order = std::atoi(argv[++i]);
+        } else if (arg == "--steps") {
+            options.steps = std::atoi(argv[++i]);
+        } else if (arg == "--warmup") {
+            options.warmup = std::atoi(argv[++i]);
+        } else if (arg == "--rebuild-frequency") {
+            options.rebuildFrequency = std::atoi(argv[++i]);
+        } else if (arg == "--refit-tolerance") {
+            options.refitTolerance = static_cast<float>(std::atof(argv[++i]));
+        } else if (arg == "--time-bins") {
+            options.maxTimeBin = std::atoi(argv[++i]);
+        } else if (arg == "--trace") {
+            options.tracePath = argv[++i];
+        } else if (arg == "--checkpoint") {
+            options.checkpointPath = argv[++i];
+        } else if (arg == "--checkpoint-every") {
+            options.checkpointInterval = std::atoi(argv[++i]);
+        } else if (arg == "--restart") {
+            options.restartPath = argv[++i];
+        } else if (arg == "--trajectory") {
+            options.trajectoryPath = argv[++i];
+        } else if (arg == "--trajectory-every") {
+            options.trajectoryInterval = std::atoi(argv[++i]);
+        } else if (arg == "--trajectory-bits") {
+            options.trajectoryOptions.quantizationBits = std::atoi(argv[++i]);
+        } else if (arg == "--trajectory-keyframe") {
+            options.trajectoryOptions.keyframeInterval = std::atoi(argv[++i]);
+        } else if (arg == "--diagnostics") {
+            options.diagnosticsInterval = std::atoi(argv[++i]);
+        } else if (arg == "--eta") {
+            options.timestepAccuracy = static_cast<float>(std::atof(argv[++i]));
+        } else if (arg == "--build") {
+            std::string mode = argv[++i];
+            if (mode == "morton") {
+                options.buildMode = TreeBuildMode::Morton;
+            } else if (mode == "insertion") {
+                options.buildMode = TreeBuildMode::Insertion;
+            } else {
+                std::cerr << "--build must be morton or insertion" << std::endl;
+                return false;
+            }
+        } else if (arg == "--leaf-size") {
+            options.leafCapacity = std::atoi(argv[++i]);
+        } else if (arg == "--walk") {
+            std::string walk = argv[++i];
+            if (walk == "group" || walk == "particle") {
+                options.groupWalk = walk == "group";
+            } else {
+                std::cerr << "--walk must be group or particle" << std::endl;
+                return false;
+            }
+        } else if (arg == "--format") {
+            options.format = argv[++i];
+        } else {
+            std::cerr << "Unknown option " << arg << std::endl;
+            return false;
+        }
+    }
+
+    if (options.sim != "seq" && options.sim != "bh" && options.sim != "fmm") {
+        std::cerr << "--sim must be seq, bh or fmm" << std::endl;
+        return false;
+    }
+    if (options.integrator != Integrators::KickDriftKick::NAME &&
+        options.integrator != Integrators::Yoshida4::NAME &&
+        options.integrator != Integrators::ForestRuth::NAME &&
+        options.integrator != Integrators::Hermite4::NAME) {
+        std::cerr << "--integrator must be leapfrog, yoshida4, forest-ruth or hermite4" << std::endl;
+        return false;
+    }
+    if (options.integrator == Integrators::Hermite4::NAME && options.sim != "seq") {
+        std::cerr << "--integrator hermite4 needs the jerks only --sim seq computes" << std::endl;
+        return false;
+    }
+    if (options.sim == "fmm" && !options.thetaSet) {
+        options.theta = 0.7f;
+    }
+    if (options.galaxyType < 0) {
+        std::cerr << "--galaxy must be one of random, disk, spiral, collision, dense" << std::endl;
+        return false;
+    }
+    if (options.numParticles < 2 || options.steps < 1 || options.warmup < 0) {
+        std::cerr << "--n must be at least 2 and --steps at least 1" << std::endl;
+        return false;
+    }
+    if (options.checkpointInterval < 0 || (options.checkpointInterval > 0 && options.checkpointPath.empty())) {
+        std::cerr << "--checkpoint-every needs a positive K and --checkpoint FILE" << std::endl;
+        return false;
+    }
+    if (options.trajectoryInterval < 1 || options.trajectoryOptions.keyframeInterval < 1 ||
+        options.trajectoryOptions.quantizationBits < 0 || options.trajectoryOptions.quantizationBits > 24) {
+        std::cerr << "--trajectory-every and --trajectory-keyframe must be positive, --trajectory-bits 0-24" << std::endl;
+        return false;
+    }
+    if (options.format != "json" && options.format != "csv") {
+        std::cerr << "--format must be json or csv" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// same per-substep sequence as the viewer's main loop, minus rendering.
+// Simulators that stabilise within update() (Barnes-Hut) skip the pass here.
+template <typename Simulator>
+RunResult runSimulation(Simulator& simulator, ParticleSystem& particleSystem, const RunOptions& options,
+                        CheckpointInfo& clock, bool stabilizeInUpdate = false)
+{
+    const bool stabilize = options.stabilize && !stabilizeInUpdate;
+    RunResult result;
+    simulator.setDiagnosticsInterval(options.diagnosticsInterval);
+    result.countersRequested = options.hardwareCounters;
+    const bool counting = options.hardwareCounters && simulator.enableHardwareCounters(true);
+    auto collectDiagnostics = [&]() {
+        const Diagnostics& d = simulator.getDiagnostics();
+        if (d.valid() && (result.diagnostics.empty() || result.diagnostics.back().step != d.step)) {
+            result.diagnostics.push_back(d);
+        }
+    };
+    auto saveCheckpoint = [&]() {
+        auto writeStart = ProfileClock::now();
+        result.checkpointFailed |= !writeCheckpoint(options.checkpointPath, particleSystem, clock);
+        result.checkpointMs += elapsedMs(writeStart, ProfileClock::now());
+        result.checkpointWrites++;
+    };
+    auto advanceClock = [&]() {
+        clock.step++;
+        clock.time += options.dt;
+        if (options.checkpointInterval > 0 && clock.step % options.checkpointInterval == 0) saveCheckpoint();
+    };
+
+    for (int step = 0; step < options.warmup; step++) {
+        if (stabilize) Physics::stabilizeOrbits(particleSystem);
+        simulator.update();
+        collectDiagnostics();
+        advanceClock();
+    }
+
+    TrajectoryWriter trajectory;
+    result.trajectoryRequested = !options.trajectoryPath.empty();
+    if (result.trajectoryRequested &&
+        !trajectory.open(options.trajectoryPath, particleSystem, options.trajectoryOptions)) {
+        result.trajectory.failed = true;
+    }
+
+    auto runStart = ProfileClock::now();
+    const float checkpointMsBefore = result.checkpointMs;
+
+    for (int step = 0; step < options.steps; step++) {
+        auto stabilizeStart = ProfileClock::now();
+        if (stabilize) Physics::stabilizeOrbits(particleSystem);
+        result.stabilizeMs += elapsedMs(stabilizeStart, ProfileClock::now());
+
+        simulator.update();
+        result.phases += simulator.getLastTimings();
+        if (counting) result.counters.push_back(simulator.getLastCounters());
+        collectDiagnostics();
+        advanceClock();
+        if (trajectory.isOpen() && (step + 1) % options.trajectoryInterval == 0) {
+            trajectory.submit(particleSystem, clock.step, clock.time);
+        }
+    }
+
+    result.wallSeconds = std::chrono::duration<double>(ProfileClock::now() - runStart).count() -
+                         (result.checkpointMs - checkpointMsBefore) / 1000.0;
+
+    // draining the queue is the writer's cost, not the simulation's
+    if (trajectory.isOpen()) {
+        trajectory.close();
+        result.trajectory = trajectory.getStats();
+    }
+
+    if (!options.checkpointPath.empty() &&
+        (options.checkpointInterval == 0 || clock.step % options.checkpointInterval != 0)) {
+        saveCheckpoint();
+    }
+    return result;
+}
+
+// builds the engine chosen by --sim with the given integrator and runs it
+template <typename Integrator>
+RunResult runEngine(ParticleSystem& particleSystem, const RunOptions& options, CheckpointInfo& clock)
+{
+    if (options.sim == "seq") {
+        BasicSequentialNBodySimulator<Integrator> simulator(particleSystem, options.dt);
+        simulator.setSymmetricForces(options.symmetric);
+        return runSimulation(simulator, particleSystem, options, clock);
+    }
+    if constexpr (!Integrator::NEEDS_JERK) {
+        if (options.sim == "fmm") {
+            BasicFastMultipoleSimulator<Integrator> simulator(particleSystem, options.dt, options.theta, options.order);
+            return runSimulation(simulator, particleSystem, options, clock);
+        }
+        BasicBarnesHutSimulator<Integrator> simulator(particleSystem, options.dt, options.theta);
+        simulator.setRebuildFrequency(options.rebuildFrequency);
+        simulator.setRefitTolerance(options.refitTolerance);
+        simulator.setMaxTimeBin(options.maxTimeBin);
+        simulator.setTimestepAccuracy(options.timestepAccuracy);
+        simulator.setTreeBuildMode(options.buildMode);
+        simulator.setGroupWalk(options.groupWalk);
+        simulator.setLeafCapacity(static_cast<uint32_t>(std::max(1, options.leafCapacity)));
+        simulator.setOrbitStabilization(options.stabilize);
+        simulator.setFusedPipeline(options.fused);
+        return runSimulation(simulator, particleSystem, options, clock, true);
+    }
+    return RunResult();
+}
+
+void printCounterValues(const CounterValues& values, uint32_t available, double steps)
+{
+    std::printf("{");
+    for (int e = 0; e < PERF_EVENT_COUNT; e++) {
+        if (available & (1u << e)) std::printf(" \"%s\": %.0f,", perfEventName(e), values[e] / steps);
+    }
+    std::printf(" \"ipc\": %.3f, \"l1d_mpki\": %.3f, \"llc_mpki\": %.3f, \"branch_mpki\": %.3f, "
+                "\"vector_ops_pki\": %.3f }",
+                values.ipc(), values.perKiloInstruction(PERF_L1D_MISSES),
+                values.perKiloInstruction(PERF_LLC_MISSES), values.perKiloInstruction(PERF_BRANCH_MISSES),
+                values.perKiloInstruction(PERF_VECTOR_OPS));
+}
+
+// "counters": per-step means by phase, then every step's raw counts in
+// the order of "events"; a string when they could not be opened
+void printCounters(const RunResult& result)
+{
+    if (result.counters.empty()) {
+        std::printf("  \"counters\": \"unavailable\"");
+        return;
+    }
+    PhaseCounters totals;
+    for (const PhaseCounters& step : result.counters) totals += step;
+    const double steps = static_cast<double>(result.counters.size());
+
+    std::printf("  \"counters\": {\n    \"events\": [");
+    bool first = true;
+    for (int e = 0; e < PERF_EVENT_COUNT; e++) {
+        if (!(totals.available & (1u << e))) continue;
+        std::printf("%s\"%s\"", first ? "" : ", ", perfEventName(e));
+        first = false;
+    }
+    std::printf("],\n    \"per_step\": {\n      \"build\": ");
+    printCounterValues(totals.build, totals.available, steps);
+    std::printf(",\n      \"walk\": ");
+    printCounterValues(totals.walk, totals.available, steps);
+    std::printf(",\n      \"integrate\": ");
+    printCounterValues(totals.integrate, totals.available, steps);
+    std::printf("\n    },\n    \"steps\": [\n");
+
+    auto printRaw = [&](const CounterValues& values) {
+        std::printf("[");
+        bool firstValue = true;
+        for (int e = 0; e < PERF_EVENT_COUNT; e++) {
+            if (!(totals.available & (1u << e))) continue;
+            std::printf("%s%.0f", firstValue ? "" : ", ", values[e]);
+            firstValue = false;
+        }
+        std::printf("]");
+    };
+    for (size_t k = 0; k < result.counters.size(); k++) {
+        std::printf("      { \"build\": ");
+        printRaw(result.counters[k].build);
+        std::printf(", \"walk\": ");
+        printRaw(result.counters[k].walk);
+        std::printf(", \"integrate\": ");
+        printRaw(result.counters[k].integrate);
+        std::printf(" }%s\n", k + 1 < result.counters.size() ? "," : "");
+    }
+    std::printf("    ]\n  }");
+}
+
+void printResult(const RunOptions& options, const RunResult& result)
+{
+    int threads = 1;
+#ifdef _OPENMP
+    threads = omp_get_max_threads();
+#endif
+    double steps = static_cast<double>(options.steps);
+    double stepsPerSec = result.wallSeconds > 0.0 ? steps / result.wallSeconds : 0.0;
+
+    if (options.format == "csv") {
+        // diagnostics columns hold the last measurement, empty when off
+        std::printf("sim,integrator,galaxy,n,dt,theta,steps,threads,wall_s,steps_per_sec,"
+                    "stabilize_ms,integrate_ms,tree_build_ms,forces_ms,finalize_ms,diagnostics_ms,update_ms,"
+                    "tree_rebuilds,force_evaluations,energy_drift,angular_momentum_drift,virial_ratio\n");
+        std::printf("%s,%s,%s,%d,%g,%g,%d,%d,%.6f,%.3f,%.4f,%.4f,%.4f,%.4f,%.4f,%.4f,%.4f,%d,%ld",
+                    options.sim.c_str(), options.integrator.c_str(), galaxyNames[options.galaxyType], options.numParticles,
+                    options.dt, options.theta, options.steps, threads,
+                    result.wallSeconds, stepsPerSec,
+                    result.stabilizeMs / steps, result.phases.integrate / steps,
+                    result.phases.treeBuild / steps, result.phases.forces / steps,
+                    result.phases.finalize / steps, result.phases.diagnostics / steps,
+                    result.phases.total / steps,
+                    result.phases.treeRebuilds, result.phases.forceEvaluations);
+        if (result.diagnostics.empty()) {
+            std::printf(",,,\n");
+        } else {
+            const Diagnostics& last = result.diagnostics.back();
+            std::printf(",%.6e,%.6e,%.6f\n", last.energyDrift, last.angularMomentumDrift, last.virialRatio());
+        }
+        return;
+    }
+
+    std::printf("{\n");
+    std::printf("  \"sim\": \"%s\",\n", options.sim.c_str());
+    std::printf("  \"integrator\": \"%s\",\n", options.integrator.c_str());
+    std::printf("  \"galaxy\": \"%s\",\n", galaxyNames[options.galaxyType]);
+    std::printf("  \"n\": %d,\n", options.numParticles);
+    std::printf("  \"seed\": %llu,\n", static_cast<unsigned long long>(options.seed));
+    std::printf("  \"dt\": %g,\n", options.dt);
+    std::printf("  \"theta\": %g,\n", options.theta);
+    // the fused pipeline covers global leapfrog steps only
+    const bool fused = options.sim == "bh" && options.fused && options.integrator == "leapfrog" &&
+                       options.maxTimeBin == 0;
+    std::printf("  \"fused\": %s,\n", fused ? "true" : "false");
+    std::printf("  \"steps\": %d,\n", options.steps);
+    std::printf("  \"threads\": %d,\n", threads);
+    std::printf("  \"wall_s\": %.6f,\n", result.wallSeconds);
+    std::printf("  \"steps_per_sec\": %.3f,\n", stepsPerSec);
+    std::printf("  \"tree_rebuilds\": %d,\n", result.phases.treeRebuilds);
+    std::printf("  \"force_evaluations\": %ld,\n", result.phases.forceEvaluations);
+    std::printf("  \"phase_ms_per_step\": {\n");
+    std::printf("    \"stabilize\": %.4f,\n", result.stabilizeMs / steps);
+    std::printf("    \"integrate\": %.4f,\n", result.phases.integrate / steps);
+    std::printf("    \"tree_build\": %.4f,\n", result.phases.treeBuild / steps);
+    std::printf("    \"forces\": %.4f,\n", result.phases.forces / steps);
+    std::printf("    \"finalize\": %.4f,\n", result.phases.finalize / steps);
+    std::printf("    \"diagnostics\": %.4f,\n", result.phases.diagnostics / steps);
+    std::printf("    \"update\": %.4f\n", result.phases.total / steps);
+    std::printf("  }");
+    if (result.countersRequested) {
+        std::printf(",\n");
+        printCounters(result);
+    }
+    if (!options.checkpointPath.empty() || !options.restartPath.empty()) {
+        std::printf(",\n  \"checkpoint\": {\n");
+        std::printf("    \"start_step\": %llu,\n", static_cast<unsigned long long>(result.startStep));
+        std::printf("    \"restart_ms\": %.3f,\n", result.restartMs);
+        std::printf("    \"writes\": %d,\n", result.checkpointWrites);
+        std::printf("    \"write_ms\": %.3f\n",
+                    result.checkpointWrites > 0 ? result.checkpointMs / result.checkpointWrites : 0.0f);
+        std::printf("  }");
+    }
+    if (result.trajectoryRequested) {
+        const TrajectoryStats& t = result.trajectory;
+        std::printf(",\n  \"trajectory\": {\n");
+        std::printf("    \"frames\": %ld,\n", t.framesWritten);
+        std::printf("    \"dropped\": %ld,\n", t.framesDropped);
+        std::printf("    \"bytes\": %llu,\n", static_cast<unsigned long long>(t.bytesWritten));
+        std::printf("    \"bytes_per_frame\": %.1f,\n",
+                    t.framesWritten > 0 ? static_cast<double>(t.bytesWritten) / t.framesWritten : 0.0);
+        std::printf("    \"compression\": %.3f,\n", t.compressionRatio());
+        std::printf("    \"submit_ms\": %.4f,\n", t.framesWritten > 0 ? t.submitMs / t.framesWritten : 0.0);
+        std::printf("    \"blocked_ms\": %.4f,\n", t.blockedMs);
+        std::printf("    \"failed\": %s\n", t.failed ? "true" : "false");
+        std::printf("  }");
+    }
+    if (!result.diagnostics.empty()) {
+        std::printf(",\n  \"diagnostics\": [\n");
+        for (size_t k = 0; k < result.diagnostics.size(); k++) {
+            const Diagnostics& d = result.diagnostics[k];
+            std::printf("    { \"step\": %ld, \"kinetic\": %.8e, \"potential\": %.8e, \"energy\": %.8e, "
+                        "\"energy_drift\": %.6e, \"momentum\": [%.6e, %.6e, %.6e], "
+                        "\"angular_momentum\": [%.6e, %.6e, %.6e], \"angular_momentum_drift\": %.6e, "
+                        "\"virial_ratio\": %.6f }%s\n",
+                        d.step, d.kinetic, d.potential, d.totalEnergy(), d.energyDrift,
+                        d.momentum.x, d.momentum.y, d.momentum.z,
+                        d.angularMomentum.x, d.angularMomentum.y, d.angularMomentum.z,
+                        d.angularMomentumDrift, d.virialRatio(),
+                        k + 1 < result.diagnostics.size() ? "," : "");
+        }
+        std::printf("  ]");
+    }
+    std::printf("\n}\n");
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    RunOptions options;
+    if (!parseArgs(argc, argv, options)) {
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    ParticleSystem particleSystem;
+    CheckpointInfo clock;
+    float restartMs = 0.0f;
+    if (!options.restartPath.empty()) {
+        auto loadStart = ProfileClock::now();
+        if (!loadCheckpoint(options.restartPath, particleSystem, clock)) return 1;
+        restartMs = elapsedMs(loadStart, ProfileClock::now());
+        if (particleSystem.size() < 2) {
+            std::cerr << "Checkpoint " << options.restartPath << " holds fewer than 2 particles" << std::endl;
+            return 1;
+        }
+        options.numParticles = static_cast<int>(particleSystem.size());
+        if (clock.galaxyType >= 0 && clock.galaxyType < galaxyNameCount) options.galaxyType = clock.galaxyType;
+        if (!options.dtSet) options.dt = clock.dt;
+        if (!options.thetaSet) options.theta = clock.theta;
+        options.seed = clock.seed;
+    } else {
+        particleSystem.resize(options.numParticles);
+        options.seed = generateGalaxy(options.galaxyType, particleSystem, options.numParticles, options.seed);
+        clock.galaxyType = options.galaxyType;
+        clock.seed = options.seed;
+    }
+    clock.dt = options.dt;
+    clock.theta = options.theta;
+    const uint64_t startStep = clock.step;
+
+    RunResult result;
+    if (options.integrator == Integrators::Yoshida4::NAME) {
+        result = runEngine<Integrators::Yoshida4>(particleSystem, options, clock);
+    } else if (options.integrator == Integrators::ForestRuth::NAME) {
+        result = runEngine<Integrators::ForestRuth>(particleSystem, options, clock);
+    } else if (options.integrator == Integrators::Hermite4::NAME) {
+        result = runEngine<Integrators::Hermite4>(particleSystem, options, clock);
+    } else {
+        result = runEngine<Integrators::KickDriftKick>(particleSystem, options, clock);
+    }
+
+    result.restartMs = restartMs;
+    result.startStep = startStep;
+    printResult(options, result);
+    if (result.checkpointFailed || result.trajectory.failed) return 1;
+    if (!options.tracePath.empty() && !Trace::writeChromeTrace(options.tracePath)) return 1;
+    return 0;
+}
@@ -3,205 +3,1152 @@
 
 #include "octree_node.h"
 #include "particle.h"
+#include "morton.h"
+#include "interaction_list.h"
+#include "multipole.h"
+#include "trace.h"
 #include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
 #include <limits>
-#include <stack>
+#include <numeric>
+#include <vector>
 #include <exception>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
-class Octree
+// expansion order of the cell moments: 1 monopole, 2 quadrupole, 3 octupole
+#ifndef NBODY_MULTIPOLE_ORDER
+#define NBODY_MULTIPOLE_ORDER 2
+#endif
+
+enum class TreeBuildMode
+{
+    Insertion,  // one particle at a time, top-down
+    Morton      // radix-sorted Morton keys, parallel bottom-up (Karras radix tree)
+};
+
+// Barnes-Hut octree whose cells carry multipole moments up to MultipoleOrder
+// (see multipole.h). Higher orders make every accepted cell more accurate,
+// so a larger theta, with fewer cells opened, meets the same error budget.
+template <int MultipoleOrder>
+class BasicOctree
 {
 private:
-    std::shared_ptr<OctreeNode> root;
+    using Moments = Multipole<MultipoleOrder>;
+    static constexpr bool HAS_MOMENTS = MultipoleOrder >= 2;
+
+    static constexpr size_t MAX_TREE_DEPTH = 20;
+    // a depth-first walk keeps at most 7 pending siblings per level plus the current node
+    static constexpr size_t MAX_STACK_SIZE = 8 * (Morton::MAX_LEVEL + 2);
+    static constexpr uint32_t ROOT = 0;
+    // shared-prefix length of a radix-tree range whose keys are all identical
+    static constexpr int IDENTICAL_KEYS = Morton::KEY_BITS;
+    // bodies per group in the group walk; the largest subtrees at or below
+    // this size become groups
+    static constexpr uint32_t GROUP_SIZE = 32;
+    static constexpr uint32_t DEFAULT_LEAF_CAPACITY = 16;
+    static constexpr uint32_t MAX_LEAF_CAPACITY = 64;
+
+    // a group's members are groupBodies[first, first + count)
+    struct BodyGroup
+    {
+        uint32_t first;
+        uint32_t count;
+    };
+
+    // node storage is reused between frames: clear() keeps the capacity, so
+    // after the first build a rebuild does no heap allocation
+    std::vector<OctreeNode> nodes;
+    // moments beyond the monopole, indexed like nodes (empty for order 1)
+    std::vector<Moments> multipoles;
+    // bmax of every node: distance from its centre of mass to its farthest
+    // body (an upper bound carried up from the children for internal nodes)
+    std::vector<float> extents;
     float theta;
-    
+    TreeBuildMode buildMode;
+    // a cell is split only when it holds more bodies than this
+    uint32_t leafCapacity;
+
+    // refit state: the build the topology came from, every node's opening
+    // radius right after it, and the tree quality after the latest refit
+    TreeBuildMode builtMode;
+    std::vector<float> builtRadius;
+    float treeQuality = 1.0f;
+    float refitTolerance = 0.25f;
+    bool refitting = false;
+
+    // position + mass of every particle, in tree order (Morton order for the
+    // Morton build), and the particle index each entry came from
+    std::vector<glm::vec4> bodies;
+    std::vector<uint32_t> bodyIndex;
+
     glm::vec3 cachedMinBound;
     glm::vec3 cachedMaxBound;
     bool boundsNeedUpdate;
-    
+
     size_t maxTreeDepth;
-    size_t nodeCount;
+
+    // Morton build scratch, kept across frames
+    std::vector<uint64_t> mortonKeys;
+    std::vector<uint64_t> keyScratch;
+    std::vector<uint32_t> indexScratch;
+    std::vector<uint32_t> radixLeft;
+    std::vector<uint32_t> radixRight;
+    std::vector<uint32_t> radixFirst;
+    std::vector<uint32_t> radixLast;
+    std::vector<int> radixDelta;
+    std::vector<uint32_t> radixParent;
+    std::vector<uint32_t> emitOffset;
+    std::vector<uint32_t> nodeParent;
+    std::vector<std::atomic<uint32_t>> arrivals;
+
+    // insertion build: bodies of a leaf form a linked list until the final
+    // pass lays every leaf out contiguously
+    std::vector<uint32_t> leafNext;
+
+    // group walk state: built with the tree, lists are per thread
+    std::vector<BodyGroup> groups;
+    std::vector<uint32_t> groupBodies;
+    std::vector<uint32_t> subtreeBodies;
+    std::vector<uint32_t> walkOrder;
+    std::vector<InteractionList> threadLists;
+    std::vector<MultipoleInteractionList<MultipoleOrder>> threadCells;
+    // body and cell terms summed by the last calculateGroupAccelerations
+    long groupInteractions = 0;
 
 public:
-    Octree(float theta = 0.5f) 
-        : root(nullptr), theta(theta), boundsNeedUpdate(true), 
-          maxTreeDepth(0), nodeCount(0) {}
+    BasicOctree(float theta = 0.5f)
+        : theta(theta), buildMode(TreeBuildMode::Morton),
+          leafCapacity(DEFAULT_LEAF_CAPACITY), builtMode(TreeBuildMode::Morton),
+          boundsNeedUpdate(true), maxTreeDepth(0) {}
 
     void setTheta(float newTheta) {
         theta = std::max(0.1f, std::min(1.0f, newTheta));
     }
 
-    void buildTree(ParticleSystem &particles)
+    void setBuildMode(TreeBuildMode mode) { buildMode = mode; }
+    TreeBuildMode getBuildMode() const { return buildMode; }
+
+    // Bodies a leaf may hold before it is split (1 to MAX_LEAF_CAPACITY).
+    // Fewer, fuller leaves mean fewer nodes and a shallower tree; inside a
+    // leaf bodies are summed directly. Takes effect at the next build.
+    void setLeafCapacity(uint32_t capacity) {
+        leafCapacity = std::max(1u, std::min(MAX_LEAF_CAPACITY, capacity));
+    }
+    uint32_t getLeafCapacity() const { return leafCapacity; }
+
+    size_t getNodeCount() const { return nodes.size(); }
+    size_t getMaxDepth() const { return maxTreeDepth; }
+
+    // particle indices in tree order; iterating particles in this order keeps
+    // consecutive force walks on neighbouring nodes
+    const std::vector<uint32_t> &getBodyOrder() const { return bodyIndex; }
+
+    size_t getGroupCount() const { return groups.size(); }
+
+    // read-only views for solvers that build on this tree (FMM)
+    const std::vector<OctreeNode> &getNodes() const { return nodes; }
+    const std::vector<glm::vec4> &getBodies() const { return bodies; }
+
+    void buildTree(const ParticleSystem &particles)
     {
-        if (particles.size() == 0) {
-            root = nullptr;
-            return;
+        buildTreeWithin(particles, nullptr);
+    }
+
+    // the same when the particles' bounding box is already known, as from a
+    // fused drift pass, sparing the build its own pass over the positions
+    void buildTree(const ParticleSystem &particles, const ParticleBounds &bounds)
+    {
+        buildTreeWithin(particles, &bounds);
+    }
+
+    // Moves the tree onto the particles' current positions in O(N) without
+    // changing its topology: bodies are repacked in the same order, then
+    // moments are recomputed bottom-up and every node's cube grows to cover
+    // its bodies. The forces stay exact to the usual tree error, but grown
+    // cubes overlap and get opened more often. Returns false when a full
+    // build is due instead: no tree yet, a different particle count, or a
+    // tree quality (see measureQuality) worse than 1 + refitTolerance.
+    bool refit(const ParticleSystem &particles)
+    {
+        NBODY_TRACE_SCOPE("tree.refit");
+        if (nodes.empty() || particles.size() != bodies.size()) return false;
+
+        packBodies(particles);
+
+        refitting = true;
+        if (builtMode == TreeBuildMode::Morton && nodes.size() > 1) {
+            accumulateMomentsBottomUp();
+        } else {
+            calculateCenterOfMass();
         }
-        
-        maxTreeDepth = 0;
-        nodeCount = 0;
-        
-        root = nullptr;
-        
-        calculateBounds(particles);
-        
-        glm::vec3 center = (cachedMinBound + cachedMaxBound) * 0.5f;
-        float halfWidth = std::max(std::max(
-                              cachedMaxBound.x - center.x,
-                              cachedMaxBound.y - center.y),
-                          cachedMaxBound.z - center.z);
-        
-        root = std::make_shared<OctreeNode>(center, halfWidth);
-        nodeCount++;
-        
-        const size_t MAX_TREE_DEPTH = 20;
-        
-        for (size_t i = 0; i < particles.size(); i++) {
-            insertParticleSafely(&particles[i], root, 0, MAX_TREE_DEPTH);
-        }
-        
-        calculateCenterOfMass(root);
-    }
-    
-    glm::vec3 calculateForce(const Particle &particle, float G, float softening)
+        refitting = false;
+
+        treeQuality = measureQuality();
+        return treeQuality <= 1.0f + refitTolerance;
+    }
+
+    // allowed quality loss before refit() asks for a rebuild
+    void setRefitTolerance(float tolerance) { refitTolerance = std::max(0.0f, tolerance); }
+
+    // estimated walk cost relative to the last full build: 1 right after it
+    float getTreeQuality() const { return treeQuality; }
+
+    // interactions, when given, receives the number of body and cell terms
+    // summed
+    glm::vec3 calculateForce(const glm::vec3 &particlePos, float particleMass, float G, float softening,
+                             uint32_t *interactions = nullptr) const
     {
-        if (!root) return glm::vec3(0.0f);
-        
+        if (interactions) *interactions = 0;
+        if (nodes.empty()) return glm::vec3(0.0f);
+
         glm::vec3 force(0.0f);
-        glm::vec3 particlePos(particle.position);
-        
-        std::stack<std::shared_ptr<OctreeNode>> nodeStack;
-        nodeStack.push(root);
-        
-        while (!nodeStack.empty()) {
-            std::shared_ptr<OctreeNode> node = nodeStack.top();
-            nodeStack.pop();
-            
-            if (!node) continue;
-            
-            if (node->totalMass <= 0.0f) continue;
-            
-            if (node->isExternal() && node->particle == &particle) continue;
-            
-            glm::vec3 direction = node->centerOfMass - particlePos;
-            float distSquared = glm::dot(direction, direction) + softening;
-            
-            if (node->isExternal() || 
-                (node->halfWidth * node->halfWidth) / distSquared < theta * theta) {
-                
+        uint32_t terms = 0;
+
+        uint32_t nodeStack[MAX_STACK_SIZE];
+        size_t stackSize = 0;
+        nodeStack[stackSize++] = ROOT;
+
+        // the particle's own leaf needs no special case: its offset is exactly
+        // zero, so it contributes no force
+        while (stackSize > 0) {
+            const uint32_t index = nodeStack[--stackSize];
+            const OctreeNode &node = nodes[index];
+
+            if (node.totalMass <= 0.0f) continue;
+
+            bool external = node.isExternal();
+            bool singleBody = external && node.bodyCount == 1;
+
+            glm::vec3 direction = node.centerOfMass - particlePos;
+            const float gapSquared = glm::dot(direction, direction);
+            float distSquared = gapSquared + softening;
+
+            if (singleBody || acceptCell(index, gapSquared)) {
+
                 float distance = std::sqrt(distSquared);
-                
+
                 if (distance < 1e-5f) distance = 1e-5f;
-                
-                float forceMagnitude = G * particle.mass * node->totalMass / distSquared;
+
+                float forceMagnitude = G * particleMass * node.totalMass / distSquared;
                 force += direction * (forceMagnitude / distance);
-            } 
+                terms++;
+
+                // a single-body leaf has no higher moments
+                if constexpr (HAS_MOMENTS) {
+                    if (!singleBody) {
+                        force += (G * particleMass) * multipoles[index].acceleration(direction, distSquared);
+                    }
+                }
+            }
+            else if (external) {
+                // a leaf too close to approximate: sum its bodies directly
+                for (uint32_t b = node.firstBody; b < node.firstBody + node.bodyCount; b++) {
+                    glm::vec3 offset = glm::vec3(bodies[b]) - particlePos;
+                    float bodyDistSquared = glm::dot(offset, offset) + softening;
+                    float distance = std::max(std::sqrt(bodyDistSquared), 1e-5f);
+                    float forceMagnitude = G * particleMass * bodies[b].w / bodyDistSquared;
+                    force += offset * (forceMagnitude / distance);
+                }
+                terms += node.bodyCount;
+            }
             else {
                 for (int i = 0; i < 8; i++) {
-                    if (node->children[i]) {
-                        nodeStack.push(node->children[i]);
+                    if (node.children[i] != OctreeNode::NULL_INDEX) {
+                        nodeStack[stackSize++] = node.children[i];
                     }
                 }
             }
         }
-        
+
+        if (interactions) *interactions = terms;
         return force;
     }
 
+    // Gravitational potential at a point from the same walk as calculateForce
+    // (monopole plus the cell moments), except that cells holding pos are
+    // always opened. Bodies sitting exactly at pos are skipped, so for a
+    // particle's own position this is the potential of all the others.
+    float calculatePotential(const glm::vec3 &pos, float G, float softening) const
+    {
+        if (nodes.empty()) return 0.0f;
+
+        float potential = 0.0f;
+
+        uint32_t nodeStack[MAX_STACK_SIZE];
+        size_t stackSize = 0;
+        nodeStack[stackSize++] = ROOT;
+
+        while (stackSize > 0) {
+            const uint32_t index = nodeStack[--stackSize];
+            const OctreeNode &node = nodes[index];
+
+            if (node.totalMass <= 0.0f) continue;
+
+            bool external = node.isExternal();
+            bool singleBody = external && node.bodyCount == 1;
+
+            glm::vec3 direction = node.centerOfMass - pos;
+            const float gapSquared = glm::dot(direction, direction);
+            float distSquared = gapSquared + softening;
+
+            // a cell holding pos would count its own body's self-energy
+            glm::vec3 fromCenter = glm::abs(pos - node.center);
+            bool holdsPos = fromCenter.x <= node.halfWidth && fromCenter.y <= node.halfWidth &&
+                            fromCenter.z <= node.halfWidth;
+
+            if (singleBody || (!holdsPos && acceptCell(index, gapSquared))) {
+                if (singleBody && direction == glm::vec3(0.0f)) continue;
+                potential -= G * node.totalMass / std::sqrt(distSquared);
+
+                if constexpr (HAS_MOMENTS) {
+                    if (!singleBody) {
+                        potential += G * multipoles[index].potential(direction, distSquared);
+                    }
+                }
+            }
+            else if (external) {
+                for (uint32_t b = node.firstBody; b < node.firstBody + node.bodyCount; b++) {
+                    glm::vec3 offset = glm::vec3(bodies[b]) - pos;
+                    if (offset == glm::vec3(0.0f)) continue;
+                    potential -= G * bodies[b].w / std::sqrt(glm::dot(offset, offset) + softening);
+                }
+            }
+            else {
+                for (int i = 0; i < 8; i++) {
+                    if (node.children[i] != OctreeNode::NULL_INDEX) {
+                        nodeStack[stackSize++] = node.children[i];
+                    }
+                }
+            }
+        }
+
+        return potential;
+    }
+
+    // Group walk: every group of up to GROUP_SIZE nearby bodies walks the tree
+    // once. A cell is accepted for the whole group when it passes the opening
+    // test at the group bounding box's nearest point, which is conservative
+    // for every member; leaves reached are added body by body. Each member
+    // then sums the shared lists (bodies, and cells with their moments) in
+    // SIMD loops. Writes the acceleration (not force) to
+    // accelerations[particle index]. With an active mask (indexed by
+    // particle) only active bodies are summed and groups without one skip
+    // the walk; the other entries stay zero.
+    // softening must be positive: a member's own body sits in its list.
+    void calculateGroupAccelerations(float G, float softening, std::vector<glm::vec3> &accelerations,
+                                     const std::vector<uint8_t> *active = nullptr)
+    {
+        NBODY_TRACE_SCOPE("forces.group_walk");
+        accelerations.assign(bodies.size(), glm::vec3(0.0f));
+        groupInteractions = 0;
+        if (nodes.empty()) return;
+
+        const long groupCount = static_cast<long>(groups.size());
+
+        threadLists.resize(static_cast<size_t>(Morton::threadCount()));
+        threadCells.resize(threadLists.size());
+        long interactions = 0;
+
+        #pragma omp parallel for schedule(dynamic, 1) reduction(+:interactions)
+        for (long gi = 0; gi < groupCount; gi++) {
+#ifdef _OPENMP
+            const int thread = omp_get_thread_num();
+#else
+            const int thread = 0;
+#endif
+            InteractionList &list = threadLists[thread];
+            MultipoleInteractionList<MultipoleOrder> &cells = threadCells[thread];
+            const BodyGroup &group = groups[gi];
+
+            if (active) {
+                bool anyActive = false;
+                for (uint32_t k = group.first; k < group.first + group.count && !anyActive; k++) {
+                    anyActive = (*active)[bodyIndex[groupBodies[k]]] != 0;
+                }
+                if (!anyActive) continue;
+            }
+
+            glm::vec3 boxMin(std::numeric_limits<float>::max());
+            glm::vec3 boxMax(std::numeric_limits<float>::lowest());
+            for (uint32_t k = group.first; k < group.first + group.count; k++) {
+                glm::vec3 p(bodies[groupBodies[k]]);
+                boxMin = glm::min(boxMin, p);
+                boxMax = glm::max(boxMax, p);
+            }
+
+            list.clear();
+            cells.clear();
+            buildInteractionList(boxMin, boxMax, softening, list, cells);
+            const long terms = static_cast<long>(list.size() + cells.size());
+            list.pad();
+            if constexpr (HAS_MOMENTS) cells.pad();
+
+            for (uint32_t k = group.first; k < group.first + group.count; k++) {
+                const uint32_t body = groupBodies[k];
+                if (active && !(*active)[bodyIndex[body]]) continue;
+                const glm::vec3 position(bodies[body]);
+                glm::vec3 acceleration = list.accelerationAt(position, G, softening);
+                if constexpr (HAS_MOMENTS) {
+                    acceleration += cells.accelerationAt(position, G, softening);
+                }
+                accelerations[bodyIndex[body]] = acceleration;
+                interactions += terms;
+            }
+        }
+        groupInteractions = interactions;
+    }
+
+    // body and cell terms summed over all targets by the last
+    // calculateGroupAccelerations
+    long getGroupInteractionCount() const { return groupInteractions; }
+
 private:
-    void calculateBounds(ParticleSystem &particles) {
-        cachedMinBound = glm::vec3(std::numeric_limits<float>::max());
-        cachedMaxBound = glm::vec3(std::numeric_limits<float>::lowest());
+    // Opening test d > bmax / theta on the unsoftened distance d from the
+    // cell's centre of mass, with bmax its extent (extents). For theta <= 1
+    // (larger values are capped at 1) every accepted cell's bodies lie
+    // within a sphere around the centre of mass that excludes the target, so
+    // the expansion converges, and a cell holding the target is never taken.
+    bool acceptCell(uint32_t index, float distSquared) const {
+        const float openingRadius = extents[index] / std::min(theta, 1.0f);
+        return distSquared > openingRadius * openingRadius;
+    }
+
+    void buildInteractionList(const glm::vec3 &boxMin, const glm::vec3 &boxMax,
+                              float softening, InteractionList &list,
+                              MultipoleInteractionList<MultipoleOrder> &cells) const
+    {
+        uint32_t nodeStack[MAX_STACK_SIZE];
+        size_t stackSize = 0;
+        nodeStack[stackSize++] = ROOT;
+
+        while (stackSize > 0) {
+            const uint32_t index = nodeStack[--stackSize];
+            const OctreeNode &node = nodes[index];
+
+            if (node.totalMass <= 0.0f) continue;
+
+            const bool external = node.isExternal();
+            if (external && node.bodyCount == 1) {
+                list.add(glm::vec3(bodies[node.firstBody]), bodies[node.firstBody].w);
+                continue;
+            }
+
+            // offset from the centre of mass to the nearest point of the box,
+            // no farther than from any member
+            glm::vec3 nearest = glm::clamp(node.centerOfMass, boxMin, boxMax);
+            glm::vec3 gap = node.centerOfMass - nearest;
+
+            if (acceptCell(index, glm::dot(gap, gap))) {
+                if constexpr (HAS_MOMENTS) {
+                    cells.add(node.centerOfMass, node.totalMass, multipoles[index]);
+                } else {
+                    list.add(node.centerOfMass, node.totalMass);
+                }
+            } else if (external) {
+                for (uint32_t b = node.firstBody; b < node.firstBody + node.bodyCount; b++) {
+                    list.add(glm::vec3(bodies[b]), bodies[b].w);
+                }
+            } else {
+                for (int i = 0; i < 8; i++) {
+                    if (node.children[i] != OctreeNode::NULL_INDEX) {
+                        nodeStack[stackSize++] = node.children[i];
+                    }
+                }
+            }
+        }
+    }
+
+    // up to the 1 / theta scale, how far from a cell's centre of mass a
+    // target must be for the walk to accept it (acceptCell)
+    float openingRadius(uint32_t index) const {
+        return extents[index];
+    }
+
+    // Tree-quality metric for refits: estimated walk cost relative to the
+    // last build. A cell is opened by the targets inside its opening sphere;
+    // their number is taken as the density its parent had at build time,
+    // subtreeBodies / builtRadius^3, times the sphere's volume. Summing this
+    // over cells with the current and with the built radii gives the ratio.
+    // It runs before the walk, so it errs high rather than letting one walk
+    // on a badly grown tree cost many times a rebuild.
+    float measureQuality() const {
+        NBODY_TRACE_SCOPE("tree.quality");
+        const long count = static_cast<long>(nodes.size());
+        const double total = static_cast<double>(bodies.size());
+        double current = 0.0, built = 0.0;
+
+        #pragma omp parallel for reduction(+:current, built) schedule(dynamic, 256) if(count > 4096)
+        for (long i = 0; i < count; i++) {
+            const OctreeNode &parent = nodes[i];
+            if (builtRadius[i] <= 0.0f) continue;
+            const double r = builtRadius[i];
+            const double density = subtreeBodies[i] / (r * r * r);
+
+            for (int c = 0; c < 8; c++) {
+                const uint32_t child = parent.children[c];
+                if (child == OctreeNode::NULL_INDEX) continue;
+                const double now = openingRadius(child);
+                const double then = builtRadius[child];
+                // no cell is opened by more targets than there are
+                current += std::min(density * now * now * now, total);
+                built += density * then * then * then;
+            }
+        }
+        return built > 0.0 ? static_cast<float>(current / built) : 1.0f;
+    }
+
+    // Splits the tree into groups: the largest subtrees holding at most
+    // GROUP_SIZE bodies, or a single leaf holding more (leafCapacity above
+    // GROUP_SIZE, or coincident bodies)
+    void buildGroups() {
+        NBODY_TRACE_SCOPE("tree.groups");
+        groups.clear();
+        groupBodies.clear();
+        if (nodes.empty()) return;
+
+        // preorder, then a reverse sweep counts bodies below every node
+        walkOrder.clear();
+        walkOrder.push_back(ROOT);
+        for (size_t k = 0; k < walkOrder.size(); k++) {
+            const OctreeNode &node = nodes[walkOrder[k]];
+            for (int i = 0; i < 8; i++) {
+                if (node.children[i] != OctreeNode::NULL_INDEX) walkOrder.push_back(node.children[i]);
+            }
+        }
+
+        subtreeBodies.resize(nodes.size());
+        for (size_t k = walkOrder.size(); k-- > 0;) {
+            const OctreeNode &node = nodes[walkOrder[k]];
+            uint32_t count = node.bodyCount;
+            for (int i = 0; i < 8; i++) {
+                if (node.children[i] != OctreeNode::NULL_INDEX) count += subtreeBodies[node.children[i]];
+            }
+            subtreeBodies[walkOrder[k]] = count;
+        }
+
+        // depth-first from the root; a group's bodies are gathered by a
+        // second depth-first walk of its subtree, so they stay in tree order
+        walkOrder.clear();
+        walkOrder.push_back(ROOT);
+        while (!walkOrder.empty()) {
+            uint32_t index = walkOrder.back();
+            walkOrder.pop_back();
+            const OctreeNode &node = nodes[index];
+            if (subtreeBodies[index] == 0) continue;
+
+            if (node.isExternal() || subtreeBodies[index] <= GROUP_SIZE) {
+                BodyGroup group;
+                group.first = static_cast<uint32_t>(groupBodies.size());
+                appendSubtreeBodies(index);
+                group.count = static_cast<uint32_t>(groupBodies.size()) - group.first;
+                groups.push_back(group);
+                continue;
+            }
+
+            for (int i = 7; i >= 0; i--) {
+                if (node.children[i] != OctreeNode::NULL_INDEX) walkOrder.push_back(node.children[i]);
+            }
+        }
+    }
+
+    void appendSubtreeBodies(uint32_t root) {
+        uint32_t nodeStack[MAX_STACK_SIZE];
+        size_t stackSize = 0;
+        nodeStack[stackSize++] = root;
+
+        while (stackSize > 0) {
+            const OctreeNode &node = nodes[nodeStack[--stackSize]];
+            for (uint32_t b = node.firstBody; b < node.firstBody + node.bodyCount; b++) {
+                groupBodies.push_back(b);
+            }
+            for (int i = 7; i >= 0; i--) {
+                if (node.children[i] != OctreeNode::NULL_INDEX) nodeStack[stackSize++] = node.children[i];
+            }
+        }
+    }
+
+    // bounds null: compute them from the positions
+    void buildTreeWithin(const ParticleSystem &particles, const ParticleBounds *bounds)
+    {
+        NBODY_TRACE_SCOPE("tree.build");
+        nodes.clear();
+        maxTreeDepth = 0;
+
+        if (particles.size() == 0) {
+            bodies.clear();
+            bodyIndex.clear();
+            return;
+        }
+
+        if (bounds) {
+            setBounds(bounds->min, bounds->max);
+        } else {
+            calculateBounds(particles);
+        }
+
+        if (buildMode == TreeBuildMode::Morton) {
+            buildMorton(particles);
+        } else {
+            buildInsertion(particles);
+        }
+        builtMode = buildMode;
+
+        buildGroups();
 
-        for (size_t i = 0; i < particles.size(); i++) {
-            const glm::vec3 pos(particles[i].position);
-            cachedMaxBound = glm::max(cachedMaxBound, pos);
-            cachedMinBound = glm::min(cachedMinBound, pos);
+        builtRadius.resize(nodes.size());
+        const long count = static_cast<long>(nodes.size());
+        #pragma omp parallel for if(count > 4096)
+        for (long i = 0; i < count; i++) {
+            builtRadius[i] = openingRadius(static_cast<uint32_t>(i));
         }
+        treeQuality = 1.0f;
+    }
+
+    void calculateBounds(const ParticleSystem &particles) {
+        NBODY_TRACE_SCOPE("tree.bounds");
+        float minX = std::numeric_limits<float>::max();
+        float minY = minX, minZ = minX;
+        float maxX = std::numeric_limits<float>::lowest();
+        float maxY = maxX, maxZ = maxX;
+        const long n = static_cast<long>(particles.size());
+
+        #pragma omp parallel for reduction(min:minX, minY, minZ) reduction(max:maxX, maxY, maxZ) if(n > 65536)
+        for (long i = 0; i < n; i++) {
+            const glm::vec3 pos = particles.getPosition(i);
+            minX = std::min(minX, pos.x); maxX = std::max(maxX, pos.x);
+            minY = std::min(minY, pos.y); maxY = std::max(maxY, pos.y);
+            minZ = std::min(minZ, pos.z); maxZ = std::max(maxZ, pos.z);
+        }
+
+        setBounds(glm::vec3(minX, minY, minZ), glm::vec3(maxX, maxY, maxZ));
+    }
+
+    // root box from the particles' bounding box, padded
+    void setBounds(const glm::vec3 &minBound, const glm::vec3 &maxBound) {
+        cachedMinBound = minBound;
+        cachedMaxBound = maxBound;
 
         float padding = 0.1f * glm::length(cachedMaxBound - cachedMinBound);
-        if (padding < 0.5f) padding = 0.5f; 
-        
+        if (padding < 0.5f) padding = 0.5f;
+
         cachedMaxBound += glm::vec3(padding);
         cachedMinBound -= glm::vec3(padding);
     }
-    
-    void insertParticleSafely(Particle *particle, std::shared_ptr<OctreeNode> node, 
-                              size_t depth, size_t maxDepth) {
-        
-        if (!node || !particle || depth > maxDepth) {
+
+    void getRootCell(glm::vec3 &center, float &halfWidth) const {
+        center = (cachedMinBound + cachedMaxBound) * 0.5f;
+        halfWidth = std::max(std::max(
+                        cachedMaxBound.x - center.x,
+                        cachedMaxBound.y - center.y),
+                    cachedMaxBound.z - center.z);
+    }
+
+    void packBodies(const ParticleSystem &particles) {
+        const long n = static_cast<long>(particles.size());
+        bodies.resize(n);
+
+        #pragma omp parallel for if(n > 65536)
+        for (long k = 0; k < n; k++) {
+            bodies[k] = glm::vec4(particles.getPosition(bodyIndex[k]), particles.getMass(bodyIndex[k]));
+        }
+    }
+
+    // Moments of a node from its bodies or children. During a refit the
+    // node's cube also grows to cover its bodies' current positions, so the
+    // opening test stays valid for bodies that have left their cell.
+    void setLeafMoments(uint32_t index) {
+        OctreeNode &node = nodes[index];
+        node.totalMass = 0.0f;
+        node.centerOfMass = glm::vec3(0.0f);
+        if constexpr (HAS_MOMENTS) multipoles[index].clear();
+
+        extents[index] = 0.0f;
+
+        if (node.bodyCount == 1) {
+            node.centerOfMass = glm::vec3(bodies[node.firstBody]);
+            node.totalMass = bodies[node.firstBody].w;
+            if (refitting) growBounds(node, node.centerOfMass, node.centerOfMass);
             return;
         }
-        
+
+        glm::vec3 boxMin(std::numeric_limits<float>::max());
+        glm::vec3 boxMax(std::numeric_limits<float>::lowest());
+        for (uint32_t b = node.firstBody; b < node.firstBody + node.bodyCount; b++) {
+            const glm::vec3 position(bodies[b]);
+            node.totalMass += bodies[b].w;
+            node.centerOfMass += bodies[b].w * position;
+            boxMin = glm::min(boxMin, position);
+            boxMax = glm::max(boxMax, position);
+        }
+        if (node.totalMass > 0.0f) {
+            node.centerOfMass /= node.totalMass;
+        }
+        if (refitting) growBounds(node, boxMin, boxMax);
+
+        float extentSquared = 0.0f;
+        for (uint32_t b = node.firstBody; b < node.firstBody + node.bodyCount; b++) {
+            const glm::vec3 offset = glm::vec3(bodies[b]) - node.centerOfMass;
+            extentSquared = std::max(extentSquared, glm::dot(offset, offset));
+        }
+        extents[index] = std::sqrt(extentSquared);
+
+        if constexpr (HAS_MOMENTS) {
+            Moments &moments = multipoles[index];
+            for (uint32_t b = node.firstBody; b < node.firstBody + node.bodyCount; b++) {
+                moments.addBody(bodies[b].w, glm::vec3(bodies[b]) - node.centerOfMass);
+            }
+        }
+    }
+
+    void setInternalMoments(uint32_t index) {
+        OctreeNode &node = nodes[index];
+        node.centerOfMass = glm::vec3(0.0f);
+        node.totalMass = 0.0f;
+
+        glm::vec3 boxMin(std::numeric_limits<float>::max());
+        glm::vec3 boxMax(std::numeric_limits<float>::lowest());
+        for (int i = 0; i < 8; i++) {
+            if (node.children[i] == OctreeNode::NULL_INDEX) continue;
+
+            const OctreeNode &child = nodes[node.children[i]];
+            boxMin = glm::min(boxMin, child.center - glm::vec3(child.halfWidth));
+            boxMax = glm::max(boxMax, child.center + glm::vec3(child.halfWidth));
+            if (child.totalMass > 0.0f) {
+                node.totalMass += child.totalMass;
+                node.centerOfMass += child.totalMass * child.centerOfMass;
+            }
+        }
+
+        if (node.totalMass > 0.0f) {
+            node.centerOfMass /= node.totalMass;
+        }
+        if (refitting) growBounds(node, boxMin, boxMax);
+
+        float extent = 0.0f;
+        for (int i = 0; i < 8; i++) {
+            const uint32_t child = node.children[i];
+            if (child == OctreeNode::NULL_INDEX || nodes[child].totalMass <= 0.0f) continue;
+            extent = std::max(extent, glm::length(nodes[child].centerOfMass - node.centerOfMass) + extents[child]);
+        }
+        extents[index] = extent;
+
+        if constexpr (HAS_MOMENTS) {
+            Moments &moments = multipoles[index];
+            moments.clear();
+            for (int i = 0; i < 8; i++) {
+                if (node.children[i] == OctreeNode::NULL_INDEX) continue;
+
+                const OctreeNode &child = nodes[node.children[i]];
+                if (child.totalMass > 0.0f) {
+                    moments.addChild(multipoles[node.children[i]], child.totalMass,
+                                     child.centerOfMass - node.centerOfMass);
+                }
+            }
+        }
+    }
+
+    // smallest cube holding both the node's cube and the box
+    static void growBounds(OctreeNode &node, glm::vec3 boxMin, glm::vec3 boxMax) {
+        boxMin = glm::min(boxMin, node.center - glm::vec3(node.halfWidth));
+        boxMax = glm::max(boxMax, node.center + glm::vec3(node.halfWidth));
+        glm::vec3 halfExtent = (boxMax - boxMin) * 0.5f;
+        node.center = boxMin + halfExtent;
+        node.halfWidth = std::max(halfExtent.x, std::max(halfExtent.y, halfExtent.z));
+    }
+
+    // --- insertion build ---------------------------------------------------
+
+    void buildInsertion(const ParticleSystem &particles) {
+        NBODY_TRACE_SCOPE("tree.insert");
+        const size_t n = particles.size();
+        bodyIndex.resize(n);
+        std::iota(bodyIndex.begin(), bodyIndex.end(), 0u);
+        packBodies(particles);
+        leafNext.resize(n);
+
+        // with one body per leaf the octree has fewer than 2N nodes in practice
+        const size_t expectedNodes = 2 * n / leafCapacity + 1;
+        if (nodes.capacity() < expectedNodes) {
+            nodes.reserve(expectedNodes);
+        }
+
+        glm::vec3 center;
+        float halfWidth;
+        getRootCell(center, halfWidth);
+        nodes.emplace_back(center, halfWidth);
+
+        for (size_t i = 0; i < n; i++) {
+            insertBody(static_cast<uint32_t>(i), ROOT, 0);
+        }
+
+        layOutLeaves();
+        packBodies(particles);
+        calculateCenterOfMass();
+    }
+
+    uint32_t createChild(uint32_t nodeIndex, int octant) {
+        // emplace_back may reallocate, so the parent is re-read by index afterwards
+        glm::vec3 childCenter = nodes[nodeIndex].getOctantCenter(octant);
+        float childHalfWidth = nodes[nodeIndex].halfWidth * 0.5f;
+        uint32_t childIndex = static_cast<uint32_t>(nodes.size());
+        nodes.emplace_back(childCenter, childHalfWidth);
+        nodes[nodeIndex].children[octant] = childIndex;
+        return childIndex;
+    }
+
+    // The root cell contains every body (calculateBounds pads it), so each
+    // body ends in some leaf: a full leaf is split and its bodies pushed one
+    // level down, except at MAX_TREE_DEPTH, where the leaf keeps growing
+    // (coincident bodies end up there)
+    void insertBody(uint32_t body, uint32_t nodeIndex, size_t depth) {
         maxTreeDepth = std::max(maxTreeDepth, depth);
-        
-        glm::vec3 pos(particle->position);
-        if (pos.x < node->center.x - node->halfWidth || pos.x > node->center.x + node->halfWidth ||
-            pos.y < node->center.y - node->halfWidth || pos.y > node->center.y + node->halfWidth ||
-            pos.z < node->center.z - node->halfWidth || pos.z > node->center.z + node->halfWidth) {
-            return;
+
+        if (nodes[nodeIndex].isExternal()) {
+            OctreeNode &node = nodes[nodeIndex];
+            if (node.bodyCount < leafCapacity || depth >= MAX_TREE_DEPTH) {
+                leafNext[body] = node.bodyCount > 0 ? node.firstBody : OctreeNode::NULL_INDEX;
+                node.firstBody = body;
+                node.bodyCount++;
+                return;
+            }
+
+            uint32_t existing = node.firstBody;
+            node.firstBody = 0;
+            node.bodyCount = 0;
+            while (existing != OctreeNode::NULL_INDEX) {
+                uint32_t next = leafNext[existing];
+                insertIntoChild(existing, nodeIndex, depth);
+                existing = next;
+            }
         }
-        
-        if (!node->hasChildren() && !node->particle) {
-            node->particle = particle;
-            return;
+
+        insertIntoChild(body, nodeIndex, depth);
+    }
+
+    void insertIntoChild(uint32_t body, uint32_t nodeIndex, size_t depth) {
+        int octant = nodes[nodeIndex].getOctantForPosition(glm::vec3(bodies[body]));
+
+        uint32_t child = nodes[nodeIndex].children[octant];
+        if (child == OctreeNode::NULL_INDEX) {
+            child = createChild(nodeIndex, octant);
+        }
+
+        insertBody(body, child, depth + 1);
+    }
+
+    // Reorders bodies depth-first so every leaf, and every subtree, owns a
+    // contiguous range of the body array
+    void layOutLeaves() {
+        indexScratch.clear();
+
+        walkOrder.clear();
+        walkOrder.push_back(ROOT);
+        while (!walkOrder.empty()) {
+            OctreeNode &node = nodes[walkOrder.back()];
+            walkOrder.pop_back();
+
+            if (node.isExternal()) {
+                uint32_t body = node.bodyCount > 0 ? node.firstBody : OctreeNode::NULL_INDEX;
+                node.firstBody = static_cast<uint32_t>(indexScratch.size());
+                for (; body != OctreeNode::NULL_INDEX; body = leafNext[body]) {
+                    indexScratch.push_back(body);
+                }
+                continue;
+            }
+
+            for (int i = 7; i >= 0; i--) {
+                if (node.children[i] != OctreeNode::NULL_INDEX) walkOrder.push_back(node.children[i]);
+            }
         }
-        
-        if (node->isExternal()) {
-            Particle *existingParticle = node->particle;
-            
-            node->particle = nullptr;
-            
-            int existingOctant = node->getOctantForPosition(glm::vec3(existingParticle->position));
-            
-            if (!node->children[existingOctant]) {
-                glm::vec3 childCenter = node->getOctantCenter(existingOctant);
-                node->children[existingOctant] = std::make_shared<OctreeNode>(
-                    childCenter, node->halfWidth * 0.5f);
-                nodeCount++;
-            }
-            
-            insertParticleSafely(existingParticle, node->children[existingOctant], depth + 1, maxDepth);
-        }
-        
-        int octant = node->getOctantForPosition(pos);
-        
-        if (!node->children[octant]) {
-            glm::vec3 childCenter = node->getOctantCenter(octant);
-            node->children[octant] = std::make_shared<OctreeNode>(
-                childCenter, node->halfWidth * 0.5f);
-            nodeCount++;
-        }
-        
-        insertParticleSafely(particle, node->children[octant], depth + 1, maxDepth);
-    }
-
-    void calculateCenterOfMass(std::shared_ptr<OctreeNode> node) {
-        if (!node) return;
-        
-        node->centerOfMass = glm::vec3(0.0f);
-        node->totalMass = 0.0f;
-
-        if (node->isExternal() && node->particle) {
-            node->centerOfMass = glm::vec3(node->particle->position);
-            node->totalMass = node->particle->mass;
+
+        // bodyIndex was the identity, so body numbers are particle indices;
+        // the caller repacks bodies in the new order
+        bodyIndex.swap(indexScratch);
+    }
+
+    void calculateCenterOfMass() {
+        NBODY_TRACE_SCOPE("tree.moments");
+        if constexpr (HAS_MOMENTS) multipoles.resize(nodes.size());
+        extents.resize(nodes.size());
+
+        // children are always appended after their parent, so a reverse sweep
+        // over the node array is a bottom-up pass with no recursion
+        for (size_t n = nodes.size(); n-- > 0;) {
+            const uint32_t index = static_cast<uint32_t>(n);
+
+            if (nodes[index].isExternal()) {
+                setLeafMoments(index);
+            } else {
+                setInternalMoments(index);
+            }
+        }
+    }
+
+    // --- Morton build ------------------------------------------------------
+    //
+    // 1. quantise positions to 63-bit keys and radix sort them
+    // 2. build a binary radix tree over the sorted keys, every internal node
+    //    independently (Karras 2012)
+    // 3. each radix node emits the octree levels its prefix crosses; a prefix
+    //    scan gives every octree node its index, then nodes are linked
+    // 4. moments are accumulated bottom-up, the last child to finish
+    //    processing its parent
+
+    bool isRadixLeaf(uint32_t node, uint32_t n) const { return node >= n - 1; }
+
+    uint32_t radixRangeFirst(uint32_t node, uint32_t n) const {
+        return isRadixLeaf(node, n) ? node - (n - 1) : radixFirst[node];
+    }
+
+    uint32_t radixRangeSize(uint32_t node, uint32_t n) const {
+        return isRadixLeaf(node, n) ? 1 : radixLast[node] - radixFirst[node] + 1;
+    }
+
+    int radixNodeDelta(uint32_t node, uint32_t n) const {
+        return isRadixLeaf(node, n) ? IDENTICAL_KEYS : radixDelta[node];
+    }
+
+    // a radix node whose bodies all go into a single octree leaf: a range of
+    // identical keys (a radix leaf is one), or a range of at most
+    // leafCapacity bodies that starts a new octree cell
+    bool isLeafEmitter(uint32_t node, uint32_t n) const {
+        if (radixNodeDelta(node, n) >= IDENTICAL_KEYS) return true;
+        return radixRangeSize(node, n) <= leafCapacity && radixLevel(node, n) > parentLevel(node, n);
+    }
+
+    // whether an ancestor already put this node's bodies into a leaf. Ranges
+    // only grow towards the root, so the search stops at the first ancestor
+    // too large to be a leaf.
+    bool insideLeaf(uint32_t node, uint32_t n) const {
+        for (uint32_t ancestor = radixParent[node]; ancestor != OctreeNode::NULL_INDEX;
+             ancestor = radixParent[ancestor]) {
+            if (isLeafEmitter(ancestor, n)) return true;
+            if (radixRangeSize(ancestor, n) > leafCapacity) return false;
+        }
+        return false;
+    }
+
+    // length of the common key prefix of sorted entries i and j; ties between
+    // equal keys are broken by index so every range is still well defined
+    int commonPrefix(long i, long j, long n) const {
+        if (j < 0 || j >= n) return -1;
+        uint64_t a = mortonKeys[i];
+        uint64_t b = mortonKeys[j];
+        if (a != b) {
+            return Morton::countLeadingZeros(a ^ b) - (64 - Morton::KEY_BITS);
+        }
+        return IDENTICAL_KEYS + Morton::countLeadingZeros(static_cast<uint64_t>(i ^ j)) - 32;
+    }
+
+    void buildRadixNode(long i, long n) {
+        int d = commonPrefix(i, i + 1, n) - commonPrefix(i, i - 1, n) > 0 ? 1 : -1;
+        int deltaMin = commonPrefix(i, i - d, n);
+
+        long lengthMax = 2;
+        while (commonPrefix(i, i + lengthMax * d, n) > deltaMin) lengthMax *= 2;
+
+        long length = 0;
+        for (long step = lengthMax / 2; step >= 1; step /= 2) {
+            if (commonPrefix(i, i + (length + step) * d, n) > deltaMin) length += step;
+        }
+
+        long j = i + length * d;
+        int deltaNode = commonPrefix(i, j, n);
+
+        long split = 0;
+        long step = length;
+        do {
+            step = (step + 1) / 2;
+            if (commonPrefix(i, i + (split + step) * d, n) > deltaNode) split += step;
+        } while (step > 1);
+
+        long gamma = i + split * d + std::min(d, 0);
+        long first = std::min(i, j);
+        long last = std::max(i, j);
+
+        uint32_t left = static_cast<uint32_t>(first == gamma ? (n - 1) + gamma : gamma);
+        uint32_t right = static_cast<uint32_t>(last == gamma + 1 ? (n - 1) + gamma + 1 : gamma + 1);
+
+        radixLeft[i] = left;
+        radixRight[i] = right;
+        radixFirst[i] = static_cast<uint32_t>(first);
+        radixLast[i] = static_cast<uint32_t>(last);
+        radixDelta[i] = std::min(deltaNode, IDENTICAL_KEYS);
+        radixParent[left] = static_cast<uint32_t>(i);
+        radixParent[right] = static_cast<uint32_t>(i);
+    }
+
+    // octree level of the deepest cell containing the radix node's whole range
+    int radixLevel(uint32_t node, uint32_t n) const {
+        return std::min(radixNodeDelta(node, n), IDENTICAL_KEYS) / 3;
+    }
+
+    int parentLevel(uint32_t node, uint32_t n) const {
+        uint32_t parent = radixParent[node];
+        return parent == OctreeNode::NULL_INDEX ? -1 : radixLevel(parent, n);
+    }
+
+    uint32_t emittedCount(uint32_t node, uint32_t n) const {
+        if (insideLeaf(node, n)) return 0;
+        if (isLeafEmitter(node, n)) return 1;
+        return static_cast<uint32_t>(radixLevel(node, n) - parentLevel(node, n));
+    }
+
+    void buildMorton(const ParticleSystem &particles) {
+        NBODY_TRACE_SCOPE("tree.morton");
+        const long n = static_cast<long>(particles.size());
+
+        glm::vec3 center;
+        float rootHalfWidth;
+        getRootCell(center, rootHalfWidth);
+        const glm::vec3 origin = center - glm::vec3(rootHalfWidth);
+        const float scale = static_cast<float>(Morton::AXIS_CELLS) / (2.0f * rootHalfWidth);
+
+        mortonKeys.resize(n);
+        bodyIndex.resize(n);
+
+        #pragma omp parallel for if(n > 65536)
+        for (long i = 0; i < n; i++) {
+            mortonKeys[i] = Morton::encode(particles.getPosition(i), origin, scale);
+            bodyIndex[i] = static_cast<uint32_t>(i);
+        }
+
+        Morton::radixSortPairs(mortonKeys, bodyIndex, keyScratch, indexScratch);
+        packBodies(particles);
+
+        if (n == 1) {
+            nodes.emplace_back(center, rootHalfWidth);
+            nodes[ROOT].firstBody = 0;
+            nodes[ROOT].bodyCount = 1;
+            if constexpr (HAS_MOMENTS) multipoles.resize(1);
+            extents.resize(1);
+            setLeafMoments(ROOT);
             return;
         }
-        
-        for (int i = 0; i < 8; i++) {
-            if (node->children[i]) {
-                calculateCenterOfMass(node->children[i]);
 
-                if (node->children[i]->totalMass > 0.0f) {
-                    node->totalMass += node->children[i]->totalMass;
-                    node->centerOfMass += node->children[i]->totalMass * node->children[i]->centerOfMass;
+        const long internalCount = n - 1;
+        const long radixCount = 2 * n - 1;
+        radixLeft.resize(internalCount);
+        radixRight.resize(internalCount);
+        radixFirst.resize(internalCount);
+        radixLast.resize(internalCount);
+        radixDelta.resize(internalCount);
+        radixParent.resize(radixCount);
+        radixParent[0] = OctreeNode::NULL_INDEX;
+
+        #pragma omp parallel for if(n > 4096)
+        for (long i = 0; i < internalCount; i++) {
+            buildRadixNode(i, n);
+        }
+
+        const uint32_t un = static_cast<uint32_t>(n);
+        emitOffset.resize(radixCount);
+
+        #pragma omp parallel for if(n > 4096)
+        for (long x = 0; x < radixCount; x++) {
+            emitOffset[x] = emittedCount(static_cast<uint32_t>(x), un);
+        }
+
+        const uint32_t nodeTotal = Morton::exclusiveScan(emitOffset);
+        nodes.resize(nodeTotal);
+        nodeParent.resize(nodeTotal);
+
+        // create every node first; links are written in a second pass so no
+        // thread overwrites a parent another thread is still initialising
+        int deepest = 0;
+        #pragma omp parallel for reduction(max:deepest) if(n > 4096)
+        for (long x = 0; x < radixCount; x++) {
+            uint32_t node = static_cast<uint32_t>(x);
+            uint32_t count = emittedCount(node, un);
+            if (count == 0) continue;
+
+            uint64_t key = mortonKeys[radixRangeFirst(node, un)];
+            int level = parentLevel(node, un) + 1;
+            bool leaf = isLeafEmitter(node, un);
+
+            for (uint32_t k = 0; k < count; k++, level++) {
+                uint32_t cx, cy, cz;
+                Morton::cellCoordinates(key, level, cx, cy, cz);
+                float cellHalfWidth = std::ldexp(rootHalfWidth, -level);
+                glm::vec3 cellCenter = origin + (glm::vec3(static_cast<float>(cx),
+                                                           static_cast<float>(cy),
+                                                           static_cast<float>(cz)) * 2.0f + 1.0f) * cellHalfWidth;
+
+                uint32_t index = emitOffset[x] + k;
+                OctreeNode &octNode = nodes[index];
+                octNode = OctreeNode(cellCenter, cellHalfWidth);
+                if (leaf) {
+                    octNode.firstBody = radixRangeFirst(node, un);
+                    octNode.bodyCount = radixRangeSize(node, un);
                 }
+                nodeParent[index] = k > 0 ? index - 1 : deepestEmittedAncestor(node, un);
+                deepest = std::max(deepest, level);
             }
         }
-        
-        if (node->totalMass > 0.0f) {
-            node->centerOfMass /= node->totalMass;
+        maxTreeDepth = static_cast<size_t>(deepest);
+
+        #pragma omp parallel for if(n > 4096)
+        for (long i = 1; i < static_cast<long>(nodeTotal); i++) {
+            uint32_t parent = nodeParent[i];
+            const OctreeNode &child = nodes[i];
+            const OctreeNode &parentNode = nodes[parent];
+            int octant = parentNode.getOctantForPosition(child.center);
+            nodes[parent].children[octant] = static_cast<uint32_t>(i);
+        }
+
+        accumulateMomentsBottomUp();
+    }
+
+    uint32_t deepestEmittedAncestor(uint32_t node, uint32_t n) const {
+        uint32_t ancestor = radixParent[node];
+        while (ancestor != OctreeNode::NULL_INDEX) {
+            uint32_t count = emittedCount(ancestor, n);
+            if (count > 0) return emitOffset[ancestor] + count - 1;
+            ancestor = radixParent[ancestor];
+        }
+        return OctreeNode::NULL_INDEX;
+    }
+
+    void accumulateMomentsBottomUp() {
+        NBODY_TRACE_SCOPE("tree.moments");
+        const long count = static_cast<long>(nodes.size());
+        if constexpr (HAS_MOMENTS) multipoles.resize(nodes.size());
+        extents.resize(nodes.size());
+        if (arrivals.size() < nodes.size()) {
+            arrivals = std::vector<std::atomic<uint32_t>>(nodes.capacity());
+        }
+
+        #pragma omp parallel for if(count > 4096)
+        for (long i = 0; i < count; i++) {
+            arrivals[i].store(0, std::memory_order_relaxed);
+        }
+
+        #pragma omp parallel for schedule(dynamic, 256) if(count > 4096)
+        for (long i = 0; i < count; i++) {
+            if (!nodes[i].isExternal()) continue;
+
+            setLeafMoments(static_cast<uint32_t>(i));
+
+            uint32_t parent = nodeParent[i];
+            while (parent != OctreeNode::NULL_INDEX) {
+                uint32_t childCount = 0;
+                for (int c = 0; c < 8; c++) {
+                    if (nodes[parent].children[c] != OctreeNode::NULL_INDEX) childCount++;
+                }
+                // acq_rel: the last arrival sees every sibling's finished moments
+                if (arrivals[parent].fetch_add(1, std::memory_order_acq_rel) + 1 < childCount) break;
+
+                setInternalMoments(parent);
+                parent = nodeParent[parent];
+            }
         }
     }
 };
 
-#endif // OCTREE_H
\ No newline at end of file
+using Octree = BasicOctree<NBODY_MULTIPOLE_ORDER>;
+
+#endif // OCTREE_H
@@ -2,41 +2,49 @@
 #define OCTREE_NODE_H
 
 #include <glm/glm.hpp>
-#include <vector>
-#include <memory>
-#include "particle.h"
+#include <cstdint>
 
+// Nodes live in one contiguous array owned by the Octree and refer to each
+// other by 32-bit index, so the tree has no per-node heap allocation and the
+// walk never touches a refcount. A leaf owns the range
+// [firstBody, firstBody + bodyCount) of the Octree's packed body array.
 class OctreeNode {
 public:
+    static constexpr uint32_t NULL_INDEX = 0xFFFFFFFFu;
+
     glm::vec3 center;
     float halfWidth;
 
     glm::vec3 centerOfMass;
     float totalMass;
 
-    Particle *particle;
-    std::shared_ptr<OctreeNode> children[8];
+    uint32_t firstBody;
+    uint32_t bodyCount;
+    uint32_t children[8];
+
+    OctreeNode() : OctreeNode(glm::vec3(0.0f), 0.0f) {}
 
     OctreeNode(const glm::vec3 &center, float halfWidth)
         : center(center), halfWidth(halfWidth), 
-          centerOfMass(0.0f), totalMass(0.0f), particle(nullptr) {
+          centerOfMass(0.0f), totalMass(0.0f), firstBody(0), bodyCount(0) {
         for (int i = 0; i < 8; i++) {
-            children[i] = nullptr;
+            children[i] = NULL_INDEX;
         }
     }
 
     bool isExternal() const {
         for (int i = 0; i < 8; i++) {
-            if (children[i]) return false;
+            if (children[i] != NULL_INDEX) return false;
         }
         return true;
     }
 
     bool hasChildren() const {
-        for (int i = 0; i < 8; i++) {
-            if (children[i]) return true;
-        }
-        return false;
+        return !isExternal();
+    }
+
+    bool hasParticle() const {
+        return bodyCount > 0;
     }
 
     int getOctantForPosition(const glm::vec3 &position) const {
@@ -57,4 +65,4 @@ public:
     }
 };
 
-#endif // OCTREE_NODE_H
\ No newline at end of file
+#endif // OCTREE_NODE_H
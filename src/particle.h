@@ -1,6 +1,10 @@
 #ifndef PARTICLE_H
-#define PARTICLE_H 
-#include "library.h"
+#define PARTICLE_H
+#include <glm/glm.hpp>
+#include <cstddef>
+#include <memory>
+#include <vector>
+#include "particle_buffer.h"
 
 struct Particle
 {
@@ -20,32 +24,181 @@ struct Particle
 
 };
 
+// axis-aligned box around particle positions
+struct ParticleBounds
+{
+    glm::vec3 min;
+    glm::vec3 max;
+};
+
+// Storage layout is a compile-time choice (CMake option NBODY_SOA_LAYOUT) so
+// both can be benchmarked. Either way kernels go through the accessors below;
+// hot loops may branch on NBODY_SOA_LAYOUT to stream the raw arrays instead.
+// Particle stays the value type used to read or write one whole particle.
+
+#ifdef NBODY_SOA_LAYOUT
+
+// raw pointers to the ten aligned streams of an SoA ParticleSystem
+struct ParticleStreams
+{
+    float *x, *y, *z;
+    float *vx, *vy, *vz;
+    float *ax, *ay, *az;
+    float *m;
+};
+
 class ParticleSystem
 {
 private:
-    Particle *particles;
+    using Stream = ParticleBuffer<float, 64>;
+
     size_t numParticles;
-    bool ownmemory;
+    Stream x, y, z;
+    Stream vx, vy, vz;
+    Stream ax, ay, az;
+    Stream m;
+    std::vector<glm::vec4> renderView;
 
 public:
-    ParticleSystem(Particle *existingParticles, size_t n)
-        : particles(existingParticles), numParticles(n), ownmemory(false) {}
-
-    ~ParticleSystem()
-    {
-        if (ownmemory && particles)
-        {
-            delete[] particles;
+    explicit ParticleSystem(size_t n = 0) : numParticles(0) { resize(n); }
+
+    ParticleSystem(const ParticleSystem&) = delete;
+    ParticleSystem& operator=(const ParticleSystem&) = delete;
+
+    void resize(size_t n) {
+        for (Stream* s : { &x, &y, &z, &vx, &vy, &vz, &ax, &ay, &az, &m }) {
+            s->resize(n, 0.0f);
+        }
+        numParticles = n;
+    }
+
+    void reserve(size_t n) {
+        for (Stream* s : { &x, &y, &z, &vx, &vy, &vz, &ax, &ay, &az, &m }) {
+            s->reserve(n);
         }
+        renderView.reserve(n);
+    }
+
+    // Points the streams at n particles of external storage (each stream
+    // 64-byte aligned) without copying; owner is held until the streams are
+    // regrown or the system is destroyed.
+    void adoptStreams(const ParticleStreams& external, size_t n, const std::shared_ptr<const void>& owner) {
+        x.adopt(external.x, n, owner);   y.adopt(external.y, n, owner);   z.adopt(external.z, n, owner);
+        vx.adopt(external.vx, n, owner); vy.adopt(external.vy, n, owner); vz.adopt(external.vz, n, owner);
+        ax.adopt(external.ax, n, owner); ay.adopt(external.ay, n, owner); az.adopt(external.az, n, owner);
+        m.adopt(external.m, n, owner);
+        numParticles = n;
     }
+
     size_t size() const { return numParticles; }
 
-    Particle &operator[](size_t i) { return particles[i]; }
-    const Particle &operator[](size_t i) const { return particles[i]; }
-    Particle *data() { return particles; }
-    const Particle *data() const { return particles; }
+    glm::vec3 getPosition(size_t i) const { return glm::vec3(x[i], y[i], z[i]); }
+    glm::vec3 getVelocity(size_t i) const { return glm::vec3(vx[i], vy[i], vz[i]); }
+    glm::vec3 getAcceleration(size_t i) const { return glm::vec3(ax[i], ay[i], az[i]); }
+    float getMass(size_t i) const { return m[i]; }
+
+    void setPosition(size_t i, const glm::vec3& p) { x[i] = p.x; y[i] = p.y; z[i] = p.z; }
+    void setVelocity(size_t i, const glm::vec3& v) { vx[i] = v.x; vy[i] = v.y; vz[i] = v.z; }
+    void setAcceleration(size_t i, const glm::vec3& a) { ax[i] = a.x; ay[i] = a.y; az[i] = a.z; }
+    void setMass(size_t i, float mass) { m[i] = mass; }
+
+    Particle getParticle(size_t i) const {
+        return Particle(getPosition(i), getVelocity(i), getAcceleration(i), m[i]);
+    }
+
+    void setParticle(size_t i, const Particle& p) {
+        setPosition(i, glm::vec3(p.position));
+        setVelocity(i, glm::vec3(p.velocity));
+        setAcceleration(i, glm::vec3(p.acceleration));
+        m[i] = p.mass;
+    }
+
+    ParticleStreams streams() {
+        return { x.data(), y.data(), z.data(),
+                 vx.data(), vy.data(), vz.data(),
+                 ax.data(), ay.data(), az.data(),
+                 m.data() };
+    }
+
+    // packed position + mass per particle, the layout the particle VBO expects
+    const glm::vec4* packRenderData() {
+        renderView.resize(numParticles);
+        packRenderData(renderView.data());
+        return renderView.data();
+    }
+
+    // the same into size() elements at out
+    void packRenderData(glm::vec4* out) const {
+        const long n = static_cast<long>(numParticles);
+        #pragma omp parallel for simd if(n > 65536)
+        for (long i = 0; i < n; i++) {
+            out[i] = glm::vec4(x[i], y[i], z[i], m[i]);
+        }
+    }
+};
+
+#else
+
+class ParticleSystem
+{
+private:
+    ParticleBuffer<Particle, 64> particles;
+    std::vector<glm::vec4> renderView;
+
+public:
+    explicit ParticleSystem(size_t n = 0) : particles(n) {}
+
+    ParticleSystem(const ParticleSystem&) = delete;
+    ParticleSystem& operator=(const ParticleSystem&) = delete;
+
+    void resize(size_t n) { particles.resize(n); }
 
+    void reserve(size_t n) {
+        particles.reserve(n);
+        renderView.reserve(n);
+    }
+
+    // Views n particles of external storage (64-byte aligned) without
+    // copying; owner is held until the array is regrown or destroyed.
+    void adoptParticles(Particle* external, size_t n, const std::shared_ptr<const void>& owner) {
+        particles.adopt(external, n, owner);
+    }
+
+    size_t size() const { return particles.size(); }
+
+    glm::vec3 getPosition(size_t i) const { return glm::vec3(particles[i].position); }
+    glm::vec3 getVelocity(size_t i) const { return glm::vec3(particles[i].velocity); }
+    glm::vec3 getAcceleration(size_t i) const { return glm::vec3(particles[i].acceleration); }
+    float getMass(size_t i) const { return particles[i].mass; }
+
+    void setPosition(size_t i, const glm::vec3& p) { particles[i].position = glm::vec4(p, 0.0f); }
+    void setVelocity(size_t i, const glm::vec3& v) { particles[i].velocity = glm::vec4(v, 0.0f); }
+    void setAcceleration(size_t i, const glm::vec3& a) { particles[i].acceleration = glm::vec4(a, 0.0f); }
+    void setMass(size_t i, float mass) { particles[i].mass = mass; }
+
+    Particle getParticle(size_t i) const { return particles[i]; }
+    void setParticle(size_t i, const Particle& p) { particles[i] = p; }
+
+    Particle *data() { return particles.data(); }
+    const Particle *data() const { return particles.data(); }
+
+    // packed position + mass per particle, the layout the particle VBO expects
+    const glm::vec4* packRenderData() {
+        renderView.resize(particles.size());
+        packRenderData(renderView.data());
+        return renderView.data();
+    }
+
+    // the same into size() elements at out
+    void packRenderData(glm::vec4* out) const {
+        const long n = static_cast<long>(particles.size());
+        #pragma omp parallel for if(n > 65536)
+        for (long i = 0; i < n; i++) {
+            out[i] = glm::vec4(glm::vec3(particles[i].position), particles[i].mass);
+        }
+    }
 };
 
+#endif // NBODY_SOA_LAYOUT
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,131 @@
+#ifndef PARTICLE_BUFFER_H
+#define PARTICLE_BUFFER_H
+
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#if defined(NBODY_HUGE_PAGES) && defined(__linux__)
+#include <sys/mman.h>
+#endif
+
+// Growable array of trivially copyable elements that either owns
+// Alignment-byte aligned heap storage or views memory owned by someone else,
+// typically a checkpoint mapped with mmap. A viewed buffer keeps its owner
+// alive and is used in place; growing it past its size copies the elements
+// to the heap and drops the view.
+//
+// With NBODY_HUGE_PAGES on Linux, allocations of a huge page or more are
+// huge-page aligned and advised as transparent huge pages, so streams of
+// millions of particles cost a few TLB entries instead of thousands.
+template <typename T, size_t Alignment = 64>
+class ParticleBuffer
+{
+    static_assert(std::is_trivially_copyable<T>::value, "ParticleBuffer elements are copied with memcpy");
+
+public:
+    static constexpr size_t HUGE_PAGE_BYTES = size_t(2) << 20;
+
+private:
+    T* items = nullptr;
+    size_t count = 0;
+    size_t capacity = 0;
+    // alignment items were allocated with, needed to free them
+    size_t allocAlignment = Alignment;
+    // non-null while items point into memory this buffer does not own
+    std::shared_ptr<const void> owner;
+
+public:
+    ParticleBuffer() = default;
+    explicit ParticleBuffer(size_t n, const T& value = T()) { resize(n, value); }
+
+    ParticleBuffer(const ParticleBuffer&) = delete;
+    ParticleBuffer& operator=(const ParticleBuffer&) = delete;
+
+    ParticleBuffer(ParticleBuffer&& other) noexcept { swap(other); }
+    ParticleBuffer& operator=(ParticleBuffer&& other) noexcept {
+        ParticleBuffer(std::move(other)).swap(*this);
+        return *this;
+    }
+
+    ~ParticleBuffer() { release(); }
+
+    void swap(ParticleBuffer& other) noexcept {
+        std::swap(items, other.items);
+        std::swap(count, other.count);
+        std::swap(capacity, other.capacity);
+        std::swap(allocAlignment, other.allocAlignment);
+        owner.swap(other.owner);
+    }
+
+    void resize(size_t n, const T& value = T()) {
+        if (n > capacity) reserve(n);
+        // only [size(), n) is constructed, which reserve() leaves untouched.
+        // The parallel first touch places those pages near the threads that
+        // use them.
+        const long first = static_cast<long>(count);
+        const long last = static_cast<long>(n);
+        #pragma omp parallel for if(last - first > 65536)
+        for (long i = first; i < last; i++) new (items + i) T(value);
+        count = n;
+    }
+
+    void reserve(size_t n) {
+        if (n <= capacity) return;
+        size_t bytes = n * sizeof(T);
+        size_t alignment = Alignment;
+#if defined(NBODY_HUGE_PAGES) && defined(__linux__)
+        if (bytes >= HUGE_PAGE_BYTES) {
+            alignment = HUGE_PAGE_BYTES > Alignment ? HUGE_PAGE_BYTES : Alignment;
+            bytes = (bytes + HUGE_PAGE_BYTES - 1) / HUGE_PAGE_BYTES * HUGE_PAGE_BYTES;
+        }
+#endif
+        T* grown = static_cast<T*>(::operator new(bytes, std::align_val_t(alignment)));
+#if defined(NBODY_HUGE_PAGES) && defined(__linux__)
+        // only advice: without THP the memory is simply backed by small pages
+        if (alignment != Alignment) madvise(grown, bytes, MADV_HUGEPAGE);
+#endif
+        const size_t kept = count;
+        if (kept > 0) std::memcpy(static_cast<void*>(grown), items, kept * sizeof(T));
+        release();
+        items = grown;
+        count = kept;
+        capacity = bytes / sizeof(T);
+        allocAlignment = alignment;
+    }
+
+    // Views n elements at data without copying. data must be Alignment-byte
+    // aligned; dataOwner is held until the buffer is released or regrown.
+    void adopt(T* data, size_t n, std::shared_ptr<const void> dataOwner) {
+        release();
+        items = data;
+        count = capacity = n;
+        owner = std::move(dataOwner);
+    }
+
+    bool isAdopted() const { return owner != nullptr; }
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+
+    T* data() { return items; }
+    const T* data() const { return items; }
+
+    T& operator[](size_t i) { return items[i]; }
+    const T& operator[](size_t i) const { return items[i]; }
+
+private:
+    void release() noexcept {
+        if (owner) {
+            owner.reset();
+        } else if (items) {
+            ::operator delete(items, std::align_val_t(allocAlignment));
+        }
+        items = nullptr;
+        count = capacity = 0;
+    }
+};
+
+#endif // PARTICLE_BUFFER_H
@@ -0,0 +1,329 @@
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include <array>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Hardware events counted per simulation phase
+enum PerfEvent
+{
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_L1D_MISSES,
+    PERF_LLC_MISSES,
+    PERF_BRANCH_MISSES,
+    // retired packed SIMD floating-point instructions, a proxy for
+    // vectorised FLOPs (vendor-specific raw event, see PerfCounters)
+    PERF_VECTOR_OPS,
+    PERF_EVENT_COUNT
+};
+
+inline const char *perfEventName(int event)
+{
+    static const char *const names[PERF_EVENT_COUNT] = {
+        "cycles", "instructions", "l1d_misses", "llc_misses", "branch_misses", "vector_ops"
+    };
+    return names[event];
+}
+
+// one reading of every event, summed over threads
+struct CounterValues
+{
+    std::array<double, PERF_EVENT_COUNT> values{};
+
+    double &operator[](int event) { return values[event]; }
+    double operator[](int event) const { return values[event]; }
+
+    CounterValues &operator+=(const CounterValues &other) {
+        for (int e = 0; e < PERF_EVENT_COUNT; e++) values[e] += other.values[e];
+        return *this;
+    }
+    CounterValues &operator-=(const CounterValues &other) {
+        for (int e = 0; e < PERF_EVENT_COUNT; e++) values[e] -= other.values[e];
+        return *this;
+    }
+    friend CounterValues operator+(CounterValues a, const CounterValues &b) { return a += b; }
+    friend CounterValues operator-(CounterValues a, const CounterValues &b) { return a -= b; }
+
+    double ipc() const {
+        return values[PERF_CYCLES] > 0.0 ? values[PERF_INSTRUCTIONS] / values[PERF_CYCLES] : 0.0;
+    }
+    // events per thousand instructions
+    double perKiloInstruction(int event) const {
+        return values[PERF_INSTRUCTIONS] > 0.0 ? 1000.0 * values[event] / values[PERF_INSTRUCTIONS] : 0.0;
+    }
+};
+
+// counters of one simulator update(), split like PhaseTimings: build is the
+// tree build or refit, walk the force evaluation, integrate everything else
+struct PhaseCounters
+{
+    CounterValues build;
+    CounterValues walk;
+    CounterValues integrate;
+    // bit e set when event e was counted; 0 without counters
+    uint32_t available = 0;
+
+    PhaseCounters &operator+=(const PhaseCounters &other) {
+        build += other.build;
+        walk += other.walk;
+        integrate += other.integrate;
+        available = other.available;
+        return *this;
+    }
+};
+
+// perf_event_open counters on the calling thread and every OpenMP worker,
+// counting user space only (allowed at the default perf_event_paranoid of
+// 2). Each event is opened on its own, so the kernel may multiplex them;
+// readings are scaled by time enabled / time running. Events that cannot
+// be opened on some thread are left out, and open() returns false when
+// none can (no PMU in a VM, permissions, not Linux), so callers fall back
+// to timing only.
+//
+// The vector-ops event is a raw PMU event: FP_ARITH_INST_RETIRED.*_PACKED
+// on Intel, retired SSE/AVX ops on AMD. Set NBODY_PERF_VECTOR_EVENT to a
+// raw config in hex to override it.
+class PerfCounters
+{
+private:
+    std::vector<std::array<int, PERF_EVENT_COUNT>> threadFds;
+    uint32_t available = 0;
+
+public:
+    PerfCounters() = default;
+    PerfCounters(const PerfCounters &) = delete;
+    PerfCounters &operator=(const PerfCounters &) = delete;
+    ~PerfCounters() { close(); }
+
+    // opened counters, or null with a note on stderr when none can be
+    static std::shared_ptr<PerfCounters> tryOpen()
+    {
+        auto counters = std::make_shared<PerfCounters>();
+        if (!counters->open()) {
+            std::cerr << "Hardware counters unavailable (no PMU access, see perf_event_paranoid); timing only" << std::endl;
+            return nullptr;
+        }
+        return counters;
+    }
+
+    bool open()
+    {
+        close();
+#ifdef __linux__
+        uint64_t vectorConfig = 0;
+        const bool haveVectorEvent = vectorEventConfig(vectorConfig);
+
+#ifdef _OPENMP
+        const int threads = omp_get_max_threads();
+#else
+        const int threads = 1;
+#endif
+        threadFds.assign(threads, std::array<int, PERF_EVENT_COUNT>());
+        for (auto &fds : threadFds) fds.fill(-1);
+
+        // counters attach to the thread that opens them
+        #pragma omp parallel num_threads(threads)
+        {
+#ifdef _OPENMP
+            const int thread = omp_get_thread_num();
+#else
+            const int thread = 0;
+#endif
+            for (int e = 0; e < PERF_EVENT_COUNT; e++) {
+                if (e == PERF_VECTOR_OPS && !haveVectorEvent) continue;
+                threadFds[thread][e] = openEvent(e, vectorConfig);
+            }
+        }
+
+        for (int e = 0; e < PERF_EVENT_COUNT; e++) {
+            bool everywhere = true;
+            for (const auto &fds : threadFds) everywhere = everywhere && fds[e] >= 0;
+            if (everywhere) {
+                available |= 1u << e;
+            } else {
+                for (auto &fds : threadFds) {
+                    if (fds[e] >= 0) ::close(fds[e]);
+                    fds[e] = -1;
+                }
+            }
+        }
+        if (available == 0) threadFds.clear();
+#endif
+        return available != 0;
+    }
+
+    void close()
+    {
+#ifdef __linux__
+        for (const auto &fds : threadFds) {
+            for (int fd : fds) {
+                if (fd >= 0) ::close(fd);
+            }
+        }
+#endif
+        threadFds.clear();
+        available = 0;
+    }
+
+    // bit e set when event e is counted
+    uint32_t getAvailable() const { return available; }
+
+    // running totals since open(); subtract two readings for an interval
+    CounterValues read() const
+    {
+        CounterValues total;
+#ifdef __linux__
+        for (const auto &fds : threadFds) {
+            for (int e = 0; e < PERF_EVENT_COUNT; e++) {
+                if (fds[e] < 0) continue;
+                // value, time enabled, time running
+                uint64_t data[3] = { 0, 0, 0 };
+                if (::read(fds[e], data, sizeof(data)) != static_cast<ssize_t>(sizeof(data))) continue;
+                double value = static_cast<double>(data[0]);
+                if (data[2] > 0 && data[2] < data[1]) value *= static_cast<double>(data[1]) / data[2];
+                total[e] += value;
+            }
+        }
+#endif
+        return total;
+    }
+
+private:
+#ifdef __linux__
+    static int openEvent(int event, uint64_t vectorConfig)
+    {
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+        switch (event) {
+            case PERF_CYCLES:
+                attr.type = PERF_TYPE_HARDWARE;
+                attr.config = PERF_COUNT_HW_CPU_CYCLES;
+                break;
+            case PERF_INSTRUCTIONS:
+                attr.type = PERF_TYPE_HARDWARE;
+                attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+                break;
+            case PERF_L1D_MISSES:
+                attr.type = PERF_TYPE_HW_CACHE;
+                attr.config = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                              (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+                break;
+            case PERF_LLC_MISSES:
+                attr.type = PERF_TYPE_HARDWARE;
+                attr.config = PERF_COUNT_HW_CACHE_MISSES;
+                break;
+            case PERF_BRANCH_MISSES:
+                attr.type = PERF_TYPE_HARDWARE;
+                attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+                break;
+            default:
+                attr.type = PERF_TYPE_RAW;
+                attr.config = vectorConfig;
+                break;
+        }
+        return static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+    }
+
+    static bool vectorEventConfig(uint64_t &config)
+    {
+        if (const char *override = std::getenv("NBODY_PERF_VECTOR_EVENT")) {
+            config = std::strtoull(override, nullptr, 16);
+            return config != 0;
+        }
+#if defined(__x86_64__) || defined(__i386__)
+        std::ifstream cpuinfo("/proc/cpuinfo");
+        std::string line;
+        while (std::getline(cpuinfo, line)) {
+            if (line.compare(0, 9, "vendor_id") != 0) continue;
+            if (line.find("GenuineIntel") != std::string::npos) {
+                // FP_ARITH_INST_RETIRED, umask: 128/256/512-bit packed single and double
+                config = 0xFCC7;
+                return true;
+            }
+            if (line.find("AuthenticAMD") != std::string::npos) {
+                // retired SSE/AVX operations, all types
+                config = 0xFF03;
+                return true;
+            }
+            return false;
+        }
+#endif
+        return false;
+    }
+#endif
+};
+
+// Per-phase counts of a simulator's update(): begin() at the start of the
+// step, addBuild/addWalk around each tree build and force evaluation,
+// finish() at the end. Everything is a no-op until enable() succeeds.
+class PhaseCounterRecorder
+{
+private:
+    // shared so simulators stay copyable
+    std::shared_ptr<PerfCounters> counters;
+    PhaseCounters last;
+
+public:
+    // false, leaving timing only, when disabled or the counters cannot be opened
+    bool enable(bool on)
+    {
+        counters = on ? PerfCounters::tryOpen() : nullptr;
+        last = PhaseCounters();
+        return counters != nullptr;
+    }
+
+    CounterValues read() const { return counters ? counters->read() : CounterValues(); }
+
+    // clears the step's counters and returns the starting reading
+    CounterValues begin()
+    {
+        last = PhaseCounters();
+        return read();
+    }
+
+    // from the reading before a build to the one before its walk
+    void addBuild(const CounterValues &buildStart, const CounterValues &buildEnd)
+    {
+        if (counters) last.build += buildEnd - buildStart;
+    }
+
+    // from the reading before a walk to now
+    void addWalk(const CounterValues &walkStart)
+    {
+        if (counters) last.walk += read() - walkStart;
+    }
+
+    // whatever the step counted outside builds and walks is integration
+    void finish(const CounterValues &stepStart)
+    {
+        if (!counters) return;
+        last.integrate = read() - stepStart - last.build - last.walk;
+        last.available = counters->getAvailable();
+    }
+
+    // counters of the last step; available == 0 without counters
+    const PhaseCounters &getLast() const { return last; }
+};
+
+#endif // PERF_COUNTERS_H
@@ -0,0 +1,68 @@
+#ifndef PHILOX_H
+#define PHILOX_H
+
+#include <array>
+#include <cmath>
+#include <cstdint>
+
+// Philox4x32-10 (Salmon et al., "Parallel Random Numbers: As Easy as 1, 2,
+// 3", SC11): a counter-based generator. Four 32-bit outputs are a pure
+// function of a 128-bit counter and a 64-bit key, so any thread can produce
+// any part of the sequence without shared state.
+struct Philox4x32
+{
+    using Block = std::array<uint32_t, 4>;
+
+    static Block generate(Block counter, uint64_t key) {
+        uint32_t k0 = static_cast<uint32_t>(key);
+        uint32_t k1 = static_cast<uint32_t>(key >> 32);
+        for (int round = 0; round < 10; round++) {
+            const uint64_t p0 = static_cast<uint64_t>(0xD2511F53u) * counter[0];
+            const uint64_t p1 = static_cast<uint64_t>(0xCD9E8D57u) * counter[2];
+            counter = { static_cast<uint32_t>(p1 >> 32) ^ counter[1] ^ k0, static_cast<uint32_t>(p1),
+                        static_cast<uint32_t>(p0 >> 32) ^ counter[3] ^ k1, static_cast<uint32_t>(p0) };
+            k0 += 0x9E3779B9u;
+            k1 += 0xBB67AE85u;
+        }
+        return counter;
+    }
+};
+
+// The random numbers of one particle: the Philox stream keyed by the seed
+// and counted by (particle, draw). Generators take a fresh ParticleRandom
+// per particle, so the result is the same whichever thread builds it.
+class ParticleRandom
+{
+private:
+    uint64_t seed;
+    uint64_t particle;
+    uint32_t blockIndex = 0;
+    Philox4x32::Block block = {};
+    int used = 4;
+
+public:
+    ParticleRandom(uint64_t seed, uint64_t particle) : seed(seed), particle(particle) {}
+
+    uint32_t next() {
+        if (used == 4) {
+            block = Philox4x32::generate({ static_cast<uint32_t>(particle), static_cast<uint32_t>(particle >> 32),
+                                           blockIndex++, 0u }, seed);
+            used = 0;
+        }
+        return block[used++];
+    }
+
+    // [0, 1) with 24 random bits, exact in a float
+    float uniform() { return static_cast<float>(next() >> 8) * (1.0f / 16777216.0f); }
+
+    float uniform(float lo, float hi) { return lo + (hi - lo) * uniform(); }
+
+    // Box-Muller; the second value of the pair is not kept
+    float normal(float mean, float stddev) {
+        const float u1 = static_cast<float>((next() >> 8) + 1) * (1.0f / 16777216.0f);
+        const float u2 = uniform();
+        return mean + stddev * std::sqrt(-2.0f * std::log(u1)) * std::cos(6.28318531f * u2);
+    }
+};
+
+#endif // PHILOX_H
@@ -2,19 +2,19 @@
 #define PHYSICS_H
 
 #include "particle.h"
+#include "trace.h"
 #include <glm/glm.hpp>
+#include <algorithm>
 #include <cmath>
+#include <limits>
 
 namespace Physics
 {
     constexpr float G = 1.0f;
     constexpr float SOFTENING = 0.1f;
 
-    inline glm::vec3 calculateForce(const Particle &p1, const Particle &p2)
+    inline glm::vec3 calculateForce(const glm::vec3 &pos1, float mass1, const glm::vec3 &pos2, float mass2)
     {
-        glm::vec3 pos1(p1.position);
-        glm::vec3 pos2(p2.position);
-        
         glm::vec3 direction = pos2 - pos1;
         
         float distSquared = glm::dot(direction, direction) + SOFTENING;
@@ -24,14 +24,13 @@ namespace Physics
             direction /= dist;
         }
         
-        float forceMagnitude = G * p1.mass * p2.mass / distSquared;
+        float forceMagnitude = G * mass1 * mass2 / distSquared;
         
         return direction * forceMagnitude;
     }
 
-    inline glm::vec3 calculateBlackHoleForce(const Particle &p, float blackHoleMass = 1000.0f)
+    inline glm::vec3 calculateBlackHoleForce(const glm::vec3 &pos, float mass, float blackHoleMass = 1000.0f)
     {
-        glm::vec3 pos(p.position);
         glm::vec3 center(0.0f); 
         
         glm::vec3 direction = center - pos;
@@ -43,32 +42,233 @@ namespace Physics
             direction /= dist;
         }
         
-        float forceMagnitude = G * blackHoleMass * p.mass / distSquared;
+        float forceMagnitude = G * blackHoleMass * mass / distSquared;
         
         return direction * forceMagnitude;
     }
 
-    inline void integrateLeapFrog(Particle &p, float dt)
+    // first half kick and drift for particles [begin, size())
+    inline void integrateLeapFrog(ParticleSystem &particles, float dt, size_t begin = 0)
     {
-        glm::vec3 velocity(p.velocity);
-        glm::vec3 acceleration(p.acceleration);
+        NBODY_TRACE_SCOPE("integrate.kick_drift");
+        const long n = static_cast<long>(particles.size());
+#ifdef NBODY_SOA_LAYOUT
+        ParticleStreams s = particles.streams();
+        #pragma omp parallel for simd
+        for (long i = static_cast<long>(begin); i < n; i++) {
+            s.vx[i] += s.ax[i] * dt * 0.5f;
+            s.vy[i] += s.ay[i] * dt * 0.5f;
+            s.vz[i] += s.az[i] * dt * 0.5f;
+            s.x[i] += s.vx[i] * dt;
+            s.y[i] += s.vy[i] * dt;
+            s.z[i] += s.vz[i] * dt;
+        }
+#else
+        Particle *data = particles.data();
+        #pragma omp parallel for
+        for (long i = static_cast<long>(begin); i < n; i++) {
+            Particle &p = data[i];
+            glm::vec3 velocity(p.velocity);
+            glm::vec3 acceleration(p.acceleration);
 
-        velocity += acceleration * dt * 0.5f;
-        
-        glm::vec3 position(p.position);
-        position += velocity * dt;
-        p.position = glm::vec4(position, 0.0f);
-        
-        p.velocity = glm::vec4(velocity, 0.0f);
+            velocity += acceleration * dt * 0.5f;
+            
+            glm::vec3 position(p.position);
+            position += velocity * dt;
+            p.position = glm::vec4(position, 0.0f);
+            
+            p.velocity = glm::vec4(velocity, 0.0f);
+        }
+#endif
+    }
+
+    // second half kick for particles [begin, size())
+    inline void finalizeLeapFrog(ParticleSystem &particles, float dt, size_t begin = 0)
+    {
+        NBODY_TRACE_SCOPE("integrate.kick");
+        const long n = static_cast<long>(particles.size());
+#ifdef NBODY_SOA_LAYOUT
+        ParticleStreams s = particles.streams();
+        #pragma omp parallel for simd
+        for (long i = static_cast<long>(begin); i < n; i++) {
+            s.vx[i] += s.ax[i] * dt * 0.5f;
+            s.vy[i] += s.ay[i] * dt * 0.5f;
+            s.vz[i] += s.az[i] * dt * 0.5f;
+        }
+#else
+        Particle *data = particles.data();
+        #pragma omp parallel for
+        for (long i = static_cast<long>(begin); i < n; i++) {
+            Particle &p = data[i];
+            glm::vec3 velocity(p.velocity);
+            glm::vec3 acceleration(p.acceleration);
+            
+            velocity += acceleration * dt * 0.5f;
+            p.velocity = glm::vec4(velocity, 0.0f);
+        }
+#endif
+    }
+
+    // drift only: x += v dt for particles [begin, size())
+    inline void drift(ParticleSystem &particles, float dt, size_t begin = 0)
+    {
+        NBODY_TRACE_SCOPE("integrate.drift");
+        const long n = static_cast<long>(particles.size());
+#ifdef NBODY_SOA_LAYOUT
+        ParticleStreams s = particles.streams();
+        #pragma omp parallel for simd
+        for (long i = static_cast<long>(begin); i < n; i++) {
+            s.x[i] += s.vx[i] * dt;
+            s.y[i] += s.vy[i] * dt;
+            s.z[i] += s.vz[i] * dt;
+        }
+#else
+        Particle *data = particles.data();
+        #pragma omp parallel for
+        for (long i = static_cast<long>(begin); i < n; i++) {
+            Particle &p = data[i];
+            p.position += glm::vec4(glm::vec3(p.velocity) * dt, 0.0f);
+        }
+#endif
+    }
+
+    // kick only: v += a dt for particles [begin, size())
+    inline void kick(ParticleSystem &particles, float dt, size_t begin = 0)
+    {
+        NBODY_TRACE_SCOPE("integrate.kick");
+        const long n = static_cast<long>(particles.size());
+#ifdef NBODY_SOA_LAYOUT
+        ParticleStreams s = particles.streams();
+        #pragma omp parallel for simd
+        for (long i = static_cast<long>(begin); i < n; i++) {
+            s.vx[i] += s.ax[i] * dt;
+            s.vy[i] += s.ay[i] * dt;
+            s.vz[i] += s.az[i] * dt;
+        }
+#else
+        Particle *data = particles.data();
+        #pragma omp parallel for
+        for (long i = static_cast<long>(begin); i < n; i++) {
+            Particle &p = data[i];
+            p.velocity += glm::vec4(glm::vec3(p.acceleration) * dt, 0.0f);
+        }
+#endif
+    }
+
+    inline void clearAccelerations(ParticleSystem &particles)
+    {
+        const long n = static_cast<long>(particles.size());
+#ifdef NBODY_SOA_LAYOUT
+        ParticleStreams s = particles.streams();
+        #pragma omp parallel for simd
+        for (long i = 0; i < n; i++) {
+            s.ax[i] = 0.0f;
+            s.ay[i] = 0.0f;
+            s.az[i] = 0.0f;
+        }
+#else
+        Particle *data = particles.data();
+        #pragma omp parallel for
+        for (long i = 0; i < n; i++) {
+            data[i].acceleration = glm::vec4(0.0f);
+        }
+#endif
     }
 
-    inline void finalizeLeapFrog(Particle &p, float dt)
+    // Orbit stabilisation of one star around center: the radial velocity is
+    // damped so orbits circularise, then the whole velocity slightly to
+    // simulate friction. Stars within 0.1 of the center are left alone.
+    inline glm::vec3 stabilizedVelocity(const glm::vec3 &pos, const glm::vec3 &vel, const glm::vec3 &center,
+                                        float damping)
     {
-        glm::vec3 velocity(p.velocity);
-        glm::vec3 acceleration(p.acceleration);
+        glm::vec3 toCenter = center - pos;
+        float dist = glm::length(toCenter);
+
+        if (dist < 0.1f) return vel;
+
+        glm::vec3 dirToCenter = toCenter / dist;
+
+        float radialVelocity = glm::dot(vel, dirToCenter);
+
+        glm::vec3 tangentialVelocity = vel - (radialVelocity * dirToCenter);
+
+        glm::vec3 newVel = tangentialVelocity + radialVelocity * dirToCenter * 0.95f;
+
+        return newVel * damping;
+    }
+
+    inline void stabilizeOrbits(ParticleSystem& particleSystem, float damping = 0.9995f) {
+        NBODY_TRACE_SCOPE("stabilize");
+        // fun maths to recalculate velocity so it stablizilizes and simulates friction (ignoring the blackhole)
+        const long n = static_cast<long>(particleSystem.size());
+        if (n == 0) return;
+        const glm::vec3 center = particleSystem.getPosition(0);
         
-        velocity += acceleration * dt * 0.5f;
-        p.velocity = glm::vec4(velocity, 0.0f);
+        #pragma omp parallel for
+        for (long j = 1; j < n; j++) {
+            particleSystem.setVelocity(j, stabilizedVelocity(particleSystem.getPosition(j),
+                                                             particleSystem.getVelocity(j), center, damping));
+        }
+    }
+
+    // The first half of a leapfrog step fused into one streaming pass:
+    // optional orbit stabilisation (as stabilizeOrbits), the half kick and
+    // the drift of integrateLeapFrog, and the bounding box of the drifted
+    // positions for the tree build. Each particle is read and written once
+    // instead of once per pass.
+    inline ParticleBounds stabilizeKickDrift(ParticleSystem &particles, float dt, bool stabilize,
+                                             float damping = 0.9995f)
+    {
+        NBODY_TRACE_SCOPE("integrate.fused_kick_drift");
+        const long n = static_cast<long>(particles.size());
+        float minX = std::numeric_limits<float>::max();
+        float minY = minX, minZ = minX;
+        float maxX = std::numeric_limits<float>::lowest();
+        float maxY = maxX, maxZ = maxX;
+        if (n == 0) return ParticleBounds{ glm::vec3(0.0f), glm::vec3(0.0f) };
+        // the black hole drifts in the same pass; stabilisation uses where it started
+        const glm::vec3 center = particles.getPosition(0);
+
+#ifdef NBODY_SOA_LAYOUT
+        ParticleStreams s = particles.streams();
+        #pragma omp parallel for reduction(min:minX, minY, minZ) reduction(max:maxX, maxY, maxZ)
+        for (long i = 0; i < n; i++) {
+            glm::vec3 velocity(s.vx[i], s.vy[i], s.vz[i]);
+            if (stabilize && i > 0) {
+                velocity = stabilizedVelocity(glm::vec3(s.x[i], s.y[i], s.z[i]), velocity, center, damping);
+            }
+            s.vx[i] = velocity.x + s.ax[i] * dt * 0.5f;
+            s.vy[i] = velocity.y + s.ay[i] * dt * 0.5f;
+            s.vz[i] = velocity.z + s.az[i] * dt * 0.5f;
+            s.x[i] += s.vx[i] * dt;
+            s.y[i] += s.vy[i] * dt;
+            s.z[i] += s.vz[i] * dt;
+            minX = std::min(minX, s.x[i]); maxX = std::max(maxX, s.x[i]);
+            minY = std::min(minY, s.y[i]); maxY = std::max(maxY, s.y[i]);
+            minZ = std::min(minZ, s.z[i]); maxZ = std::max(maxZ, s.z[i]);
+        }
+#else
+        Particle *data = particles.data();
+        #pragma omp parallel for reduction(min:minX, minY, minZ) reduction(max:maxX, maxY, maxZ)
+        for (long i = 0; i < n; i++) {
+            Particle &p = data[i];
+            glm::vec3 velocity(p.velocity);
+            glm::vec3 position(p.position);
+            if (stabilize && i > 0) {
+                velocity = stabilizedVelocity(position, velocity, center, damping);
+            }
+
+            velocity += glm::vec3(p.acceleration) * dt * 0.5f;
+            position += velocity * dt;
+            p.position = glm::vec4(position, 0.0f);
+            p.velocity = glm::vec4(velocity, 0.0f);
+
+            minX = std::min(minX, position.x); maxX = std::max(maxX, position.x);
+            minY = std::min(minY, position.y); maxY = std::max(maxY, position.y);
+            minZ = std::min(minZ, position.z); maxZ = std::max(maxZ, position.z);
+        }
+#endif
+        return ParticleBounds{ glm::vec3(minX, minY, minZ), glm::vec3(maxX, maxY, maxZ) };
     }
 }
 
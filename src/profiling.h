@@ -0,0 +1,40 @@
+#ifndef PROFILING_H
+#define PROFILING_H
+
+#include <chrono>
+
+// wall-clock breakdown of a single simulator update(), in milliseconds
+struct PhaseTimings
+{
+    float integrate = 0.0f;
+    float treeBuild = 0.0f;
+    float forces = 0.0f;
+    float finalize = 0.0f;
+    // conserved-quantity diagnostics, on the steps that measure them
+    float diagnostics = 0.0f;
+    float total = 0.0f;
+    // full tree builds in the update(s), as opposed to refits
+    int treeRebuilds = 0;
+    // particles whose force was computed
+    long forceEvaluations = 0;
+
+    PhaseTimings& operator+=(const PhaseTimings& other) {
+        integrate += other.integrate;
+        treeBuild += other.treeBuild;
+        forces += other.forces;
+        finalize += other.finalize;
+        diagnostics += other.diagnostics;
+        total += other.total;
+        treeRebuilds += other.treeRebuilds;
+        forceEvaluations += other.forceEvaluations;
+        return *this;
+    }
+};
+
+using ProfileClock = std::chrono::high_resolution_clock;
+
+inline float elapsedMs(ProfileClock::time_point start, ProfileClock::time_point end) {
+    return std::chrono::duration<float, std::milli>(end - start).count();
+}
+
+#endif // PROFILING_H
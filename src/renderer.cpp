@@ -1,6 +1,4 @@
 #include "particle.h"
-#include "physics.h"
-#include "seqnbody.h"
 #include "octree.h"
 #include "cosntlib.h"
 #include "camera.h"
@@ -9,8 +7,12 @@
 #include <imgui.h>
 #include <backends/imgui_impl_glfw.h>
 #include <backends/imgui_impl_opengl3.h>
+#include <algorithm>
 #include <chrono>
+#include <string>
 #include "menu.h"
+#include "replay.h"
+#include "simulation_thread.h"
 
 // Debug function to check OpenGL errors
 void checkGLError(const char* operation) {
@@ -28,37 +30,6 @@ void checkGLError(const char* operation) {
         std::cerr << "OpenGL error after " << operation << ": " << errorString << " (" << error << ")" << std::endl;
     }
 }
-void stabilizeOrbits(ParticleSystem& particleSystem, float damping = 0.9995f) {
-    // fun maths to recalculate velocity so it stablizilizes and simulates friction (ignoring the blackhole)
-    for (size_t j = 1; j < particleSystem.size(); j++) {
-        
-        glm::vec3 pos(particleSystem[j].position);
-        glm::vec3 vel(particleSystem[j].velocity);
-        glm::vec3 center(particleSystem[0].position); 
-        
-        glm::vec3 toCenter = center - pos;
-        float dist = glm::length(toCenter);
-        
-        if (dist < 0.1f) continue; 
-        
-        glm::vec3 dirToCenter = toCenter / dist;
-        
-        float radialVelocity = glm::dot(vel, dirToCenter);
-        
-        glm::vec3 tangentialDir = glm::cross(glm::cross(dirToCenter, vel), dirToCenter);
-        if (glm::length(tangentialDir) > 0.0001f) {
-            tangentialDir = glm::normalize(tangentialDir);
-        }
-        
-        glm::vec3 tangentialVelocity = vel - (radialVelocity * dirToCenter);
-        
-        glm::vec3 newVel = tangentialVelocity + radialVelocity * dirToCenter * 0.95f;
-        
-        newVel *= damping;
-        
-        particleSystem[j].velocity = glm::vec4(newVel, 0.0f);
-    }
-}
 void framebuffer_size_callback(GLFWwindow* window, int width, int height);
 void key_callback(GLFWwindow* window, int key, int scancode, int action, int mods);
 
@@ -118,8 +89,16 @@ unsigned int createFramebuffer(unsigned int& textureColorBuffer, unsigned int wi
     return framebuffer;
 }
 
-int main()
+int main(int argc, char** argv)
 {
+    // --replay FILE plays a recorded trajectory instead of simulating
+    std::string replayPath;
+    for (int i = 1; i + 1 < argc; i++) {
+        if (std::string(argv[i]) == "--replay") replayPath = argv[++i];
+    }
+    TrajectoryPlayer player;
+    if (!replayPath.empty() && !player.open(replayPath)) return -1;
+    const bool replaying = player.isOpen();
 
     glfwInit();
     glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
@@ -177,31 +156,37 @@ int main()
     
     glBindVertexArray(particleVAO);
     glBindBuffer(GL_ARRAY_BUFFER, particleVBO);
-    glBufferData(GL_ARRAY_BUFFER, MAX_PARTICLES * sizeof(Particle), NULL, GL_DYNAMIC_DRAW);
+    // one packed vec4 (position xyz, mass w) per particle, see ParticleSystem::packRenderData
+    // regrown when a state brings more particles than it holds
+    size_t vboCapacity = std::max<size_t>(numParticles, player.getNumParticles());
+    glBufferData(GL_ARRAY_BUFFER, vboCapacity * sizeof(glm::vec4), NULL, GL_DYNAMIC_DRAW);
     
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Particle), (void*)0);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(glm::vec4), (void*)0);
     glEnableVertexAttribArray(0);
     
-    glVertexAttribPointer(1, 1, GL_FLOAT, GL_FALSE, sizeof(Particle), (void*)(3 * sizeof(float) + sizeof(glm::vec4) * 2));
-    glEnableVertexAttribArray(1);
-
-    Particle* particles = new Particle[MAX_PARTICLES];
-    generateRandomGalaxy(particles, numParticles);
-    
-    ParticleSystem particleSystem(particles, numParticles);
-    SequentialNBodySimulator seqSimulator(particleSystem, physicsTimeStep);
-    BarnesHutCPUSimulator bhSimulator(particleSystem, physicsTimeStep, theta);
+    // galaxy.vert sizes and brightens points by a_mass, which the original
+    // Particle layout always fed a zero (acceleration.w). Keep that look
+    // rather than sourcing the real masses from w: the black hole's would
+    // make a sprite thousands of pixels wide.
+    glDisableVertexAttribArray(1);
+    glVertexAttrib1f(1, 0.0f);
 
     int colorType = 0; 
     bool enablePostProcessing = true;
     
     float fps = 0.0f;
     float frameTime = 0.0f;
-    float simulationTime = 0.0f;
     int frameCount = 0;
     auto lastTime = std::chrono::high_resolution_clock::now();
 
     SimulationMenu menu;
+    if (replaying) menu.setReplay(&player);
+
+    // the simulation steps on its own thread; this one only draws the
+    // newest state it published and posts the menu's changes to it
+    SimulationSettings settings = menu.getSettings();
+    SimulationThread simulation(numParticles, menu.getGalaxyType(), settings);
+    if (!replaying) simulation.start();
 
     menu.initialize(
         [&](glm::vec3& pos, glm::vec3& front, glm::vec3& up, float& yawVal, float& pitchVal) {
@@ -232,23 +217,14 @@ int main()
         
         processInput(window);
         
-        auto simStart = std::chrono::high_resolution_clock::now();
-        
-        if (!pauseSimulation) {
-            for (int i = 0; i < simSpeed; i++) {
-                
-                stabilizeOrbits(particleSystem);
-                
-                if (simulationType == 0) {
-                    seqSimulator.update();
-                } else {
-                    bhSimulator.update();
-                }
-            }
+        // never waits: without a new state the last one is drawn again
+        bool newState = false;
+        if (replaying) {
+            player.advance(deltaTime);
+        } else {
+            newState = simulation.acquireState();
         }
-        
-        auto simEnd = std::chrono::high_resolution_clock::now();
-        simulationTime = std::chrono::duration<float, std::milli>(simEnd - simStart).count();
+        const SimulationState& state = simulation.getState();
         
         frameCount++;
         auto currentTime = std::chrono::high_resolution_clock::now();
@@ -260,8 +236,21 @@ int main()
             lastTime = currentTime;
         }
         
-        glBindBuffer(GL_ARRAY_BUFFER, particleVBO);
-        glBufferSubData(GL_ARRAY_BUFFER, 0, numParticles * sizeof(Particle), particles);
+        // render scopes time command submission on the CPU; the GPU runs
+        // them asynchronously
+        const GLsizei drawCount = static_cast<GLsizei>(replaying ? player.getNumParticles() : state.renderData.size());
+        if (replaying || newState) {
+            NBODY_TRACE_SCOPE("render.vbo_upload");
+            const glm::vec4* renderData = replaying ? player.packRenderData() : state.renderData.data();
+            glBindBuffer(GL_ARRAY_BUFFER, particleVBO);
+            if (static_cast<size_t>(drawCount) > vboCapacity) {
+                // headroom so a growing particle count does not reallocate every time
+                vboCapacity = std::max<size_t>(drawCount, vboCapacity + vboCapacity / 2);
+                glBufferData(GL_ARRAY_BUFFER, vboCapacity * sizeof(glm::vec4), NULL, GL_DYNAMIC_DRAW);
+                checkGLError("particle VBO reallocation");
+            }
+            glBufferSubData(GL_ARRAY_BUFFER, 0, drawCount * sizeof(glm::vec4), renderData);
+        }
         
         glm::mat4 projection = glm::perspective(glm::radians(fov), (float)SCR_WIDTH / (float)SCR_HEIGHT, 0.1f, 1000.0f);
         glm::mat4 view = glm::lookAt(cameraPos, cameraPos + cameraFront, cameraUp);
@@ -269,80 +258,99 @@ int main()
         glm::mat4 mvp = projection * view * model;
         
         if (enablePostProcessing) {
-            glBindFramebuffer(GL_FRAMEBUFFER, galaxyFBO1);
-            glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
-            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-            
-            glBindFramebuffer(GL_FRAMEBUFFER, galaxyFBO2);
-            glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
-            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-            
-            glBindFramebuffer(GL_FRAMEBUFFER, blurFBO1);
-            glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
-            glClear(GL_COLOR_BUFFER_BIT);
-            
-            glBindFramebuffer(GL_FRAMEBUFFER, blurFBO2);
-            glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
-            glClear(GL_COLOR_BUFFER_BIT);
-            
-            glBindFramebuffer(GL_FRAMEBUFFER, galaxyFBO1);
-            glDisable(GL_POINT_SMOOTH);
-            glDisable(GL_LINE_SMOOTH);
-            glEnable(GL_BLEND);
-            glBlendFunc(GL_ONE, GL_ONE);
-            
-            glUseProgram(galaxyShader);
-            glUniformMatrix4fv(glGetUniformLocation(galaxyShader, "u_mvp"), 1, GL_FALSE, glm::value_ptr(mvp));
-            glBindVertexArray(particleVAO);
-            glDrawArrays(GL_POINTS, 0, numParticles);
-            
-            glBindFramebuffer(GL_FRAMEBUFFER, galaxyFBO2);
-            glEnable(GL_POINT_SMOOTH);
-            glEnable(GL_LINE_SMOOTH);
-            
-            glUseProgram(galaxyShader);
-            glUniformMatrix4fv(glGetUniformLocation(galaxyShader, "u_mvp"), 1, GL_FALSE, glm::value_ptr(mvp));
-            glBindVertexArray(particleVAO);
-            glDrawArrays(GL_POINTS, 0, numParticles);
-            
-            glBindFramebuffer(GL_FRAMEBUFFER, blurFBO1);
-            glUseProgram(blurShader);
-            glUniform1i(glGetUniformLocation(blurShader, "u_texture"), 0);
-            glUniform1i(glGetUniformLocation(blurShader, "u_horizontal"), 1);
-            glActiveTexture(GL_TEXTURE0);
-            glBindTexture(GL_TEXTURE_2D, galaxyColorBuffer2);
-            
-            glBindVertexArray(quadVAO);
-            glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
-            
-            glBindFramebuffer(GL_FRAMEBUFFER, blurFBO2);
-            glUseProgram(blurShader);
-            glUniform1i(glGetUniformLocation(blurShader, "u_texture"), 0);
-            glUniform1i(glGetUniformLocation(blurShader, "u_horizontal"), 0);
-            glActiveTexture(GL_TEXTURE0);
-            glBindTexture(GL_TEXTURE_2D, blurColorBuffer1);
+            {
+                NBODY_TRACE_SCOPE("render.clear_targets");
+                glBindFramebuffer(GL_FRAMEBUFFER, galaxyFBO1);
+                glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+                glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+                
+                glBindFramebuffer(GL_FRAMEBUFFER, galaxyFBO2);
+                glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+                glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+                
+                glBindFramebuffer(GL_FRAMEBUFFER, blurFBO1);
+                glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+                glClear(GL_COLOR_BUFFER_BIT);
+                
+                glBindFramebuffer(GL_FRAMEBUFFER, blurFBO2);
+                glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+                glClear(GL_COLOR_BUFFER_BIT);
+            }
             
-            glBindVertexArray(quadVAO);
-            glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+            {
+                NBODY_TRACE_SCOPE("render.galaxy_pass");
+                glBindFramebuffer(GL_FRAMEBUFFER, galaxyFBO1);
+                glDisable(GL_POINT_SMOOTH);
+                glDisable(GL_LINE_SMOOTH);
+                glEnable(GL_BLEND);
+                glBlendFunc(GL_ONE, GL_ONE);
+                
+                glUseProgram(galaxyShader);
+                glUniformMatrix4fv(glGetUniformLocation(galaxyShader, "u_mvp"), 1, GL_FALSE, glm::value_ptr(mvp));
+                glBindVertexArray(particleVAO);
+                glDrawArrays(GL_POINTS, 0, drawCount);
+            }
             
-            glBindFramebuffer(GL_FRAMEBUFFER, 0);
-            glClearColor(0.0f, 0.0f, 0.05f, 1.0f);
-            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+            {
+                NBODY_TRACE_SCOPE("render.glow_pass");
+                glBindFramebuffer(GL_FRAMEBUFFER, galaxyFBO2);
+                glEnable(GL_POINT_SMOOTH);
+                glEnable(GL_LINE_SMOOTH);
+                
+                glUseProgram(galaxyShader);
+                glUniformMatrix4fv(glGetUniformLocation(galaxyShader, "u_mvp"), 1, GL_FALSE, glm::value_ptr(mvp));
+                glBindVertexArray(particleVAO);
+                glDrawArrays(GL_POINTS, 0, drawCount);
+            }
             
-            glUseProgram(postShader);
-            glUniform1i(glGetUniformLocation(postShader, "u_color_type"), colorType);
-            glUniform1i(glGetUniformLocation(postShader, "u_galaxy"), 0);
-            glUniform1i(glGetUniformLocation(postShader, "u_blur"), 1);
+            {
+                NBODY_TRACE_SCOPE("render.blur_horizontal");
+                glBindFramebuffer(GL_FRAMEBUFFER, blurFBO1);
+                glUseProgram(blurShader);
+                glUniform1i(glGetUniformLocation(blurShader, "u_texture"), 0);
+                glUniform1i(glGetUniformLocation(blurShader, "u_horizontal"), 1);
+                glActiveTexture(GL_TEXTURE0);
+                glBindTexture(GL_TEXTURE_2D, galaxyColorBuffer2);
+                
+                glBindVertexArray(quadVAO);
+                glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+            }
             
-            glActiveTexture(GL_TEXTURE0);
-            glBindTexture(GL_TEXTURE_2D, galaxyColorBuffer1);
-            glActiveTexture(GL_TEXTURE1);
-            glBindTexture(GL_TEXTURE_2D, blurColorBuffer2);
+            {
+                NBODY_TRACE_SCOPE("render.blur_vertical");
+                glBindFramebuffer(GL_FRAMEBUFFER, blurFBO2);
+                glUseProgram(blurShader);
+                glUniform1i(glGetUniformLocation(blurShader, "u_texture"), 0);
+                glUniform1i(glGetUniformLocation(blurShader, "u_horizontal"), 0);
+                glActiveTexture(GL_TEXTURE0);
+                glBindTexture(GL_TEXTURE_2D, blurColorBuffer1);
+                
+                glBindVertexArray(quadVAO);
+                glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+            }
             
-            glBindVertexArray(quadVAO);
-            glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+            {
+                NBODY_TRACE_SCOPE("render.composite");
+                glBindFramebuffer(GL_FRAMEBUFFER, 0);
+                glClearColor(0.0f, 0.0f, 0.05f, 1.0f);
+                glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+                
+                glUseProgram(postShader);
+                glUniform1i(glGetUniformLocation(postShader, "u_color_type"), colorType);
+                glUniform1i(glGetUniformLocation(postShader, "u_galaxy"), 0);
+                glUniform1i(glGetUniformLocation(postShader, "u_blur"), 1);
+                
+                glActiveTexture(GL_TEXTURE0);
+                glBindTexture(GL_TEXTURE_2D, galaxyColorBuffer1);
+                glActiveTexture(GL_TEXTURE1);
+                glBindTexture(GL_TEXTURE_2D, blurColorBuffer2);
+                
+                glBindVertexArray(quadVAO);
+                glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+            }
             
         } else {
+            NBODY_TRACE_SCOPE("render.points");
             glBindFramebuffer(GL_FRAMEBUFFER, 0);
             glClearColor(0.0f, 0.0f, 0.05f, 1.0f);
             glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
@@ -350,17 +358,15 @@ int main()
             glUseProgram(galaxyShader);
             glUniformMatrix4fv(glGetUniformLocation(galaxyShader, "u_mvp"), 1, GL_FALSE, glm::value_ptr(mvp));
             glBindVertexArray(particleVAO);
-            glDrawArrays(GL_POINTS, 0, numParticles);
+            glDrawArrays(GL_POINTS, 0, drawCount);
         }
         
-        menu.updatePerformanceMetrics(fps, frameTime, simulationTime);
-
-        bool galaxyRegenerated = menu.renderMenu(particles, particleSystem, seqSimulator, bhSimulator);
+        menu.updatePerformanceMetrics(fps, frameTime);
+        if (!replaying) menu.updateSimulationState(state);
 
-        if (galaxyRegenerated) {
-            particleSystem = ParticleSystem(particles, numParticles);
-            seqSimulator = SequentialNBodySimulator(particleSystem, physicsTimeStep);
-            bhSimulator = BarnesHutCPUSimulator(particleSystem, physicsTimeStep, theta);
+        {
+            NBODY_TRACE_SCOPE("render.menu");
+            menu.renderMenu(simulation);
         }
 
         pauseSimulation = menu.isPaused();
@@ -368,6 +374,12 @@ int main()
         simSpeed = menu.getSimSpeed();
         physicsTimeStep = menu.getTimeStep();
         theta = menu.getTheta();
+
+        const SimulationSettings changed = menu.getSettings();
+        if (changed != settings) {
+            settings = changed;
+            simulation.post([changed](SimulationThread& sim) { sim.applySettings(changed); });
+        }
         enablePostProcessing = menu.isPostProcessingEnabled();
         colorType = menu.getColorType();
         numParticles = menu.getNumParticles();
@@ -376,8 +388,8 @@ int main()
         glfwSwapBuffers(window);
         glfwPollEvents();
     }
-    
-    delete[] particles;
+
+    simulation.stop();
     
     glDeleteVertexArrays(1, &particleVAO);
     glDeleteBuffers(1, &particleVBO);
@@ -0,0 +1,262 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include "trajectory.h"
+#include "trace.h"
+#include <glm/glm.hpp>
+#include <algorithm>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Plays a trajectory file back for the viewer without simulating. A reader
+// thread decodes the frames just ahead of the playback cursor (behind it
+// when playing backwards) into a small cache; the render thread only
+// interpolates between the two cached frames around the cursor and packs
+// them in the particle VBO layout. When a frame is not decoded yet, as right
+// after a seek, the last picture stays up instead of stalling the frame.
+class TrajectoryPlayer
+{
+public:
+    // decoded frames kept ahead of the cursor
+    static constexpr int PREFETCH_FRAMES = 4;
+
+private:
+    struct CachedFrame
+    {
+        long frame = -1;
+        std::vector<glm::vec3> positions;
+    };
+
+    TrajectoryReader reader;
+    size_t numParticles = 0;
+    size_t frameCount = 0;
+    std::vector<uint64_t> frameSteps;
+    std::vector<double> frameTimes;
+    std::vector<float> masses;
+
+    // playback state, render thread only
+    double cursor = 0.0;
+    // frames per second, negative plays backwards
+    float speed = 30.0f;
+    bool paused = false;
+    bool looping = true;
+    bool interpolate = true;
+
+    // shared with the reader thread
+    std::mutex mutex;
+    std::condition_variable wanted;
+    std::vector<CachedFrame> cache;
+    long wantedFrame = 0;
+    int direction = 1;
+    bool wrapAround = true;
+    bool stopping = false;
+    std::thread prefetcher;
+
+    std::vector<glm::vec4> renderView;
+    long shownFrame = -1;
+
+public:
+    TrajectoryPlayer() = default;
+    TrajectoryPlayer(const TrajectoryPlayer&) = delete;
+    TrajectoryPlayer& operator=(const TrajectoryPlayer&) = delete;
+    ~TrajectoryPlayer() { close(); }
+
+    bool open(const std::string& path) {
+        close();
+        if (!reader.open(path)) return false;
+        numParticles = reader.getNumParticles();
+        frameCount = reader.getFrameCount();
+        frameSteps.resize(frameCount);
+        frameTimes.resize(frameCount);
+        for (size_t f = 0; f < frameCount; f++) {
+            frameSteps[f] = reader.getFrameStep(f);
+            frameTimes[f] = reader.getFrameTime(f);
+        }
+        masses = reader.getMasses();
+
+        cursor = 0.0;
+        shownFrame = -1;
+        renderView.assign(numParticles, glm::vec4(0.0f));
+        cache.assign(PREFETCH_FRAMES + 2, CachedFrame());
+        wantedFrame = 0;
+        direction = 1;
+        stopping = false;
+        prefetcher = std::thread(&TrajectoryPlayer::run, this);
+        return true;
+    }
+
+    void close() {
+        if (prefetcher.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            wanted.notify_one();
+            prefetcher.join();
+        }
+        reader.close();
+        cache.clear();
+        frameCount = 0;
+        numParticles = 0;
+    }
+
+    bool isOpen() const { return frameCount > 0; }
+    size_t getNumParticles() const { return numParticles; }
+    size_t getFrameCount() const { return frameCount; }
+
+    double getCursor() const { return cursor; }
+    float getSpeed() const { return speed; }
+    bool isPaused() const { return paused; }
+    bool isLooping() const { return looping; }
+    bool isInterpolating() const { return interpolate; }
+
+    void setSpeed(float framesPerSecond) { speed = framesPerSecond; }
+    void setPaused(bool pause) { paused = pause; }
+    void setLooping(bool loop) { looping = loop; }
+    void setInterpolating(bool enable) { interpolate = enable; }
+
+    // simulation step and time at the cursor
+    uint64_t getStep() const { return frameCount ? frameSteps[static_cast<size_t>(cursor)] : 0; }
+    double getTime() const {
+        if (!frameCount) return 0.0;
+        const size_t f0 = static_cast<size_t>(cursor);
+        const size_t f1 = std::min(f0 + 1, frameCount - 1);
+        const double a = cursor - f0;
+        return (1.0 - a) * frameTimes[f0] + a * frameTimes[f1];
+    }
+
+    void seek(double frame) {
+        if (!frameCount) return;
+        cursor = std::max(0.0, std::min(frame, static_cast<double>(frameCount - 1)));
+        request();
+    }
+
+    // moves the cursor by the wall-clock time since the last call
+    void advance(float seconds) {
+        if (!frameCount) return;
+        if (!paused && frameCount > 1) {
+            const double last = static_cast<double>(frameCount - 1);
+            double next = cursor + static_cast<double>(speed) * seconds;
+            if (looping) {
+                next = std::fmod(next, last);
+                if (next < 0.0) next += last;
+            }
+            cursor = std::max(0.0, std::min(next, last));
+        }
+        request();
+    }
+
+    // Positions at the cursor with masses in w, the layout of
+    // ParticleSystem::packRenderData. Returns the last picture while the
+    // frames around the cursor are still being decoded.
+    const glm::vec4* packRenderData() {
+        NBODY_TRACE_SCOPE("replay.pack");
+        if (!frameCount) return renderView.data();
+        const long f0 = static_cast<long>(cursor);
+        const long f1 = std::min(f0 + 1, static_cast<long>(frameCount) - 1);
+        const float a = interpolate ? static_cast<float>(cursor - f0) : 0.0f;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        const CachedFrame* first = find(f0);
+        const CachedFrame* second = find(f1);
+        if (!first) return renderView.data();
+
+        const long n = static_cast<long>(numParticles);
+        const glm::vec3* p0 = first->positions.data();
+        if (second && a > 0.0f) {
+            const glm::vec3* p1 = second->positions.data();
+            #pragma omp parallel for if(n > 65536)
+            for (long i = 0; i < n; i++) {
+                renderView[i] = glm::vec4(p0[i] + a * (p1[i] - p0[i]), masses[i]);
+            }
+        } else if (shownFrame != f0) {
+            #pragma omp parallel for if(n > 65536)
+            for (long i = 0; i < n; i++) {
+                renderView[i] = glm::vec4(p0[i], masses[i]);
+            }
+        }
+        shownFrame = second && a > 0.0f ? -1 : f0;
+        return renderView.data();
+    }
+
+private:
+    void request() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            wantedFrame = static_cast<long>(cursor);
+            direction = paused || speed >= 0.0f ? 1 : -1;
+            wrapAround = looping;
+        }
+        wanted.notify_one();
+    }
+
+    const CachedFrame* find(long frame) const {
+        for (const CachedFrame& cached : cache) {
+            if (cached.frame == frame) return &cached;
+        }
+        return nullptr;
+    }
+
+    // the k-th frame the cursor needs, or -1 past the end
+    long neededFrame(int k) const {
+        const long count = static_cast<long>(frameCount);
+        // playing forwards needs f0 and f1 first, backwards f1 and f0
+        long frame = direction > 0 ? wantedFrame + k : wantedFrame + 1 - k;
+        if (wrapAround && count > 1) {
+            frame %= count;
+            if (frame < 0) frame += count;
+        }
+        return frame >= 0 && frame < count ? frame : -1;
+    }
+
+    bool isNeeded(long frame) const {
+        for (int k = 0; k <= PREFETCH_FRAMES; k++) {
+            if (neededFrame(k) == frame) return true;
+        }
+        return false;
+    }
+
+    void run() {
+        std::vector<glm::vec3> decoded;
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;) {
+            long next = -1;
+            wanted.wait(lock, [&]() {
+                if (stopping) return true;
+                for (int k = 0; k <= PREFETCH_FRAMES && next < 0; k++) {
+                    const long frame = neededFrame(k);
+                    if (frame >= 0 && !find(frame)) next = frame;
+                }
+                return next >= 0;
+            });
+            if (stopping) return;
+
+            // decode unlocked so the render thread keeps interpolating
+            lock.unlock();
+            const bool ok = reader.readFrame(static_cast<size_t>(next), decoded);
+            lock.lock();
+            // an unreadable frame is cached with the last positions decoded
+            // so it is not retried on every wake-up
+            if (!ok && decoded.size() != numParticles) decoded.assign(numParticles, glm::vec3(0.0f));
+
+            // reuse the slot of a frame the cursor has moved past
+            CachedFrame* slot = nullptr;
+            for (CachedFrame& cached : cache) {
+                if (cached.frame < 0 || !isNeeded(cached.frame)) {
+                    slot = &cached;
+                    break;
+                }
+            }
+            if (!slot) continue;
+            slot->frame = next;
+            slot->positions.swap(decoded);
+        }
+    }
+};
+
+#endif // REPLAY_H
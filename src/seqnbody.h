@@ -3,48 +3,151 @@
 
 #include "particle.h"
 #include "physics.h"
+#include "profiling.h"
+#include "direct_sum.h"
+#include "integrator.h"
+#include "diagnostics.h"
+#include "trace.h"
+#include "perf_counters.h"
+#include "octree.h"
+#include <iostream>
+#include <memory>
+#include <vector>
 
-class SequentialNBodySimulator {
+// Direct-sum simulator. The black hole (particle 0) is an external potential
+// at the origin: it is not integrated, and it acts on particles 1..n-1
+// through calculateBlackHoleForce, on top of their pairwise gravity.
+template <typename Integrator = Integrators::KickDriftKick>
+class BasicSequentialNBodySimulator {
 private:
     ParticleSystem* particleSystem; 
     float dt;
     float blackHoleMass; 
+    bool symmetricForces = false;
+    DirectSumKernel directSum;
+    Integrator integrator;
+    DiagnosticsMonitor diagnostics;
+    // built only to measure diagnostics; the forces are direct sums
+    Octree diagnosticsTree;
+    PhaseTimings lastTimings;
+    // hardware counters per phase (no build phase here)
+    PhaseCounterRecorder counters;
 
 public:
-    SequentialNBodySimulator() : particleSystem(nullptr), dt(0.0f), blackHoleMass(1000.0f) {}
+    BasicSequentialNBodySimulator() : particleSystem(nullptr), dt(0.0f), blackHoleMass(1000.0f) {}
     
-    SequentialNBodySimulator(ParticleSystem& ps, float timeStep, float bhMass = 1000.0f) 
+    BasicSequentialNBodySimulator(ParticleSystem& ps, float timeStep, float bhMass = 1000.0f) 
         : particleSystem(&ps), dt(timeStep), blackHoleMass(bhMass) {}
 
     void update() {
         if (!particleSystem) return; 
+        NBODY_TRACE_SCOPE("seq.update");
         
-        for (size_t i = 0; i < particleSystem->size(); i++) {
-            Physics::integrateLeapFrog((*particleSystem)[i], dt);
-        }
+        const long n = static_cast<long>(particleSystem->size());
+        
+        auto startTime = ProfileClock::now();
+        const CounterValues startCounters = counters.begin();
+        float forcesMs = 0.0f;
+        long evaluated = 0;
+        auto lastForcesEnd = startTime;
+        
+        integrator.step(*particleSystem, dt, 1, [&](std::vector<glm::vec3>* jerks) {
+            auto forcesStart = ProfileClock::now();
+            const CounterValues forcesCounters = counters.read();
+            calculateForces(jerks);
+            lastForcesEnd = ProfileClock::now();
+            forcesMs += elapsedMs(forcesStart, lastForcesEnd);
+            evaluated += n > 0 ? n - 1 : 0;
+            counters.addWalk(forcesCounters);
+        });
 
-        for (size_t i = 0; i < particleSystem->size(); i++) {
-            (*particleSystem)[i].acceleration = glm::vec4(0.0f);
+        auto endTime = ProfileClock::now();
+        counters.finish(startCounters);
+
+        lastTimings.total = elapsedMs(startTime, endTime);
+        lastTimings.treeBuild = 0.0f;
+        lastTimings.forces = forcesMs;
+        lastTimings.finalize = elapsedMs(lastForcesEnd, endTime);
+        lastTimings.integrate = lastTimings.total - lastTimings.forces - lastTimings.finalize;
+        lastTimings.forceEvaluations = evaluated;
+
+        lastTimings.diagnostics = 0.0f;
+        if (diagnostics.step()) {
+            // the tree holds the black hole as particle 0 at the origin,
+            // which is the external potential the forces use
+            auto diagnosticsStart = ProfileClock::now();
+            diagnosticsTree.buildTree(*particleSystem);
+            diagnostics.measure(*particleSystem, diagnosticsTree, Physics::G, Physics::SOFTENING);
+            lastTimings.diagnostics = elapsedMs(diagnosticsStart, ProfileClock::now());
+            lastTimings.total += lastTimings.diagnostics;
         }
+    }
 
-        for (size_t i = 1; i < particleSystem->size(); i++) {
-            glm::vec3 bhForce = Physics::calculateBlackHoleForce((*particleSystem)[i], (*particleSystem)[0].mass);
-            glm::vec3 acc = bhForce / (*particleSystem)[i].mass;
-            
-            for (size_t j = 1; j < particleSystem->size(); j++) {
-                if (i != j) {
-                    glm::vec3 force = Physics::calculateForce((*particleSystem)[i], (*particleSystem)[j]);
-                    acc += force / (*particleSystem)[i].mass;
-                }
-            }
-            
-            (*particleSystem)[i].acceleration = glm::vec4(acc, 0.0f);
+    // visit each pair once and apply Newton's third law (half the pair count)
+    void setSymmetricForces(bool enable) {
+        symmetricForces = enable;
+    }
+
+    // measure energy, momenta and virial ratio every K steps (0 = off)
+    void setDiagnosticsInterval(int everySteps) {
+        diagnostics.setInterval(everySteps);
+    }
+
+    const Diagnostics& getDiagnostics() const {
+        return diagnostics.getLatest();
+    }
+
+    const PhaseTimings& getLastTimings() const {
+        return lastTimings;
+    }
+
+    // per-phase perf_event_open counters; false (timing only) when they
+    // cannot be opened
+    bool enableHardwareCounters(bool enable) {
+        return counters.enable(enable);
+    }
+
+    // counters of the last update(); the walk is the direct sum
+    const PhaseCounters& getLastCounters() const {
+        return counters.getLast();
+    }
+
+private:
+    // accelerations (and jerks when asked) of particles 1..n-1
+    void calculateForces(std::vector<glm::vec3>* jerks) {
+        NBODY_TRACE_SCOPE("forces.direct");
+        Physics::clearAccelerations(*particleSystem);
+
+        // pairwise gravity among particles 1..n-1; the black hole acts
+        // separately through calculateBlackHoleForce
+        if (jerks) {
+            directSum.computeAccelerationsAndJerks(*particleSystem, 1, Physics::G, Physics::SOFTENING);
+        } else {
+            directSum.computeAccelerations(*particleSystem, 1, Physics::G, Physics::SOFTENING, symmetricForces);
         }
 
-        for (size_t i = 1; i < particleSystem->size(); i++) {
-            Physics::finalizeLeapFrog((*particleSystem)[i], dt);
+        const long n = static_cast<long>(particleSystem->size());
+        const float bhMass = particleSystem->getMass(0);
+        #pragma omp parallel for if(n > 65536)
+        for (long i = 1; i < n; i++) {
+            glm::vec3 pos = particleSystem->getPosition(i);
+            float mass = particleSystem->getMass(i);
+            glm::vec3 bhForce = Physics::calculateBlackHoleForce(pos, mass, bhMass);
+            particleSystem->setAcceleration(i, bhForce / mass + directSum.getAcceleration(i - 1));
+
+            if (jerks) {
+                // d/dt of G M d / r^3 for the fixed hole at the origin
+                glm::vec3 d = -pos;
+                glm::vec3 dv = -particleSystem->getVelocity(i);
+                float r2 = glm::dot(d, d) + Physics::SOFTENING;
+                float inv3 = 1.0f / (r2 * std::sqrt(r2));
+                glm::vec3 bhJerk = Physics::G * bhMass * inv3 * (dv - 3.0f * glm::dot(d, dv) / r2 * d);
+                (*jerks)[i] = bhJerk + directSum.getJerk(i - 1);
+            }
         }
     }
 };
 
-#endif // SEQNBODY_H
\ No newline at end of file
+using SequentialNBodySimulator = BasicSequentialNBodySimulator<>;
+
+#endif // SEQNBODY_H
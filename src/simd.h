@@ -0,0 +1,143 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+#include <cmath>
+#if defined(__AVX512F__) || defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+// Thin float-vector wrapper over the widest instruction set the compiler was
+// told to target (-march / -mavx2 ...): AVX-512, AVX2+FMA, SSE2, else scalar.
+// Loads and stores expect SimdFloat::WIDTH-aligned pointers; pad arrays to a
+// multiple of WIDTH (AlignedAllocator's 64 bytes covers every width here).
+#if defined(__AVX512F__)
+
+struct SimdFloat
+{
+    static constexpr int WIDTH = 16;
+    __m512 v;
+
+    SimdFloat() = default;
+    SimdFloat(__m512 value) : v(value) {}
+
+    static SimdFloat zero() { return _mm512_setzero_ps(); }
+    static SimdFloat broadcast(float value) { return _mm512_set1_ps(value); }
+    static SimdFloat load(const float *p) { return _mm512_load_ps(p); }
+    void store(float *p) const { _mm512_store_ps(p, v); }
+
+    friend SimdFloat operator+(SimdFloat a, SimdFloat b) { return _mm512_add_ps(a.v, b.v); }
+    friend SimdFloat operator-(SimdFloat a, SimdFloat b) { return _mm512_sub_ps(a.v, b.v); }
+    friend SimdFloat operator*(SimdFloat a, SimdFloat b) { return _mm512_mul_ps(a.v, b.v); }
+
+    // a * b + c
+    static SimdFloat fma(SimdFloat a, SimdFloat b, SimdFloat c) { return _mm512_fmadd_ps(a.v, b.v, c.v); }
+    // c - a * b
+    static SimdFloat fnma(SimdFloat a, SimdFloat b, SimdFloat c) { return _mm512_fnmadd_ps(a.v, b.v, c.v); }
+
+    static SimdFloat rsqrtEstimate(SimdFloat x) { return _mm512_rsqrt14_ps(x.v); }
+
+    float sum() const { return _mm512_reduce_add_ps(v); }
+};
+
+#elif defined(__AVX2__) && defined(__FMA__)
+
+struct SimdFloat
+{
+    static constexpr int WIDTH = 8;
+    __m256 v;
+
+    SimdFloat() = default;
+    SimdFloat(__m256 value) : v(value) {}
+
+    static SimdFloat zero() { return _mm256_setzero_ps(); }
+    static SimdFloat broadcast(float value) { return _mm256_set1_ps(value); }
+    static SimdFloat load(const float *p) { return _mm256_load_ps(p); }
+    void store(float *p) const { _mm256_store_ps(p, v); }
+
+    friend SimdFloat operator+(SimdFloat a, SimdFloat b) { return _mm256_add_ps(a.v, b.v); }
+    friend SimdFloat operator-(SimdFloat a, SimdFloat b) { return _mm256_sub_ps(a.v, b.v); }
+    friend SimdFloat operator*(SimdFloat a, SimdFloat b) { return _mm256_mul_ps(a.v, b.v); }
+
+    static SimdFloat fma(SimdFloat a, SimdFloat b, SimdFloat c) { return _mm256_fmadd_ps(a.v, b.v, c.v); }
+    static SimdFloat fnma(SimdFloat a, SimdFloat b, SimdFloat c) { return _mm256_fnmadd_ps(a.v, b.v, c.v); }
+
+    static SimdFloat rsqrtEstimate(SimdFloat x) { return _mm256_rsqrt_ps(x.v); }
+
+    float sum() const {
+        __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+        s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+        s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 0x55));
+        return _mm_cvtss_f32(s);
+    }
+};
+
+#elif defined(__SSE2__)
+
+struct SimdFloat
+{
+    static constexpr int WIDTH = 4;
+    __m128 v;
+
+    SimdFloat() = default;
+    SimdFloat(__m128 value) : v(value) {}
+
+    static SimdFloat zero() { return _mm_setzero_ps(); }
+    static SimdFloat broadcast(float value) { return _mm_set1_ps(value); }
+    static SimdFloat load(const float *p) { return _mm_load_ps(p); }
+    void store(float *p) const { _mm_store_ps(p, v); }
+
+    friend SimdFloat operator+(SimdFloat a, SimdFloat b) { return _mm_add_ps(a.v, b.v); }
+    friend SimdFloat operator-(SimdFloat a, SimdFloat b) { return _mm_sub_ps(a.v, b.v); }
+    friend SimdFloat operator*(SimdFloat a, SimdFloat b) { return _mm_mul_ps(a.v, b.v); }
+
+    static SimdFloat fma(SimdFloat a, SimdFloat b, SimdFloat c) { return _mm_add_ps(_mm_mul_ps(a.v, b.v), c.v); }
+    static SimdFloat fnma(SimdFloat a, SimdFloat b, SimdFloat c) { return _mm_sub_ps(c.v, _mm_mul_ps(a.v, b.v)); }
+
+    static SimdFloat rsqrtEstimate(SimdFloat x) { return _mm_rsqrt_ps(x.v); }
+
+    float sum() const {
+        __m128 s = _mm_add_ps(v, _mm_movehl_ps(v, v));
+        s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 0x55));
+        return _mm_cvtss_f32(s);
+    }
+};
+
+#else
+
+struct SimdFloat
+{
+    static constexpr int WIDTH = 1;
+    float v;
+
+    SimdFloat() = default;
+    SimdFloat(float value) : v(value) {}
+
+    static SimdFloat zero() { return 0.0f; }
+    static SimdFloat broadcast(float value) { return value; }
+    static SimdFloat load(const float *p) { return *p; }
+    void store(float *p) const { *p = v; }
+
+    friend SimdFloat operator+(SimdFloat a, SimdFloat b) { return a.v + b.v; }
+    friend SimdFloat operator-(SimdFloat a, SimdFloat b) { return a.v - b.v; }
+    friend SimdFloat operator*(SimdFloat a, SimdFloat b) { return a.v * b.v; }
+
+    static SimdFloat fma(SimdFloat a, SimdFloat b, SimdFloat c) { return a.v * b.v + c.v; }
+    static SimdFloat fnma(SimdFloat a, SimdFloat b, SimdFloat c) { return c.v - a.v * b.v; }
+
+    static SimdFloat rsqrtEstimate(SimdFloat x) { return 1.0f / std::sqrt(x.v); }
+
+    float sum() const { return v; }
+};
+
+#endif
+
+// 1/sqrt(x): hardware estimate (12 or 14 bits) plus one Newton-Raphson step,
+// y' = y * (1.5 - 0.5 * x * y * y), which brings it to ~22-23 bits
+inline SimdFloat rsqrt(SimdFloat x)
+{
+    SimdFloat y = SimdFloat::rsqrtEstimate(x);
+    SimdFloat halfX = x * SimdFloat::broadcast(0.5f);
+    return y * SimdFloat::fnma(halfX * y, y, SimdFloat::broadcast(1.5f));
+}
+
+#endif // SIMD_H
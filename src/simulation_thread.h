@@ -0,0 +1,347 @@
+#ifndef SIMULATION_THREAD_H
+#define SIMULATION_THREAD_H
+
+#include "particle.h"
+#include "physics.h"
+#include "seqnbody.h"
+#include "bhut.h"
+#include "fmmsim.h"
+#include "generate.h"
+#include "checkpoint.h"
+#include "trajectory.h"
+#include "diagnostics.h"
+#include "profiling.h"
+#include "trace.h"
+#include "triple_buffer.h"
+#include <glm/glm.hpp>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Knobs the menu edits; posted to the simulation thread when they change.
+// dt and theta take effect when the simulators are next rebuilt, on
+// regeneration or checkpoint load.
+struct SimulationSettings
+{
+    bool paused = false;
+    int simulationType = 1;
+    // substeps per published state
+    float simSpeed = 1.0f;
+    // published states per second, 0 steps as fast as the simulator allows
+    float maxStatesPerSecond = 60.0f;
+    float dt = 0.01f;
+    float theta = 0.5f;
+    bool symmetricForces = false;
+    int expansionOrder = 3;
+    float fmmTheta = 0.7f;
+    int diagnosticsInterval = 0;
+    // Barnes-Hut fused step pipeline; off for validating against the separate passes
+    bool fusedPipeline = true;
+
+    bool operator==(const SimulationSettings& other) const {
+        return paused == other.paused && simulationType == other.simulationType &&
+               simSpeed == other.simSpeed && maxStatesPerSecond == other.maxStatesPerSecond &&
+               dt == other.dt && theta == other.theta && symmetricForces == other.symmetricForces &&
+               expansionOrder == other.expansionOrder && fmmTheta == other.fmmTheta &&
+               diagnosticsInterval == other.diagnosticsInterval && fusedPipeline == other.fusedPipeline;
+    }
+    bool operator!=(const SimulationSettings& other) const { return !(*this == other); }
+};
+
+// One completed simulation state as the render thread sees it
+struct SimulationState
+{
+    // ParticleSystem::packRenderData layout
+    std::vector<glm::vec4> renderData;
+    uint64_t step = 0;
+    double time = 0.0;
+    // wall time of the substeps behind this state
+    float stepMs = 0.0f;
+    float stepsPerSecond = 0.0f;
+    Diagnostics diagnostics;
+    // bumped when the particles are replaced by regeneration or a checkpoint
+    uint64_t generation = 0;
+    int galaxyType = 0;
+    // generateGalaxy seed of the particles, 0 when unknown
+    uint64_t seed = 0;
+    float dt = 0.01f;
+    float theta = 0.5f;
+    bool recording = false;
+    TrajectoryStats trajectory;
+};
+
+// Runs the simulators on a thread of their own so the render rate and the
+// step rate are independent. The render thread never touches the particles:
+// it changes them by posting commands, which run on the simulation thread
+// between steps, and draws the newest state published through a triple
+// buffer, which neither side waits on.
+class SimulationThread
+{
+public:
+    using Command = std::function<void(SimulationThread&)>;
+
+private:
+    ParticleSystem particles;
+    SequentialNBodySimulator seqSimulator;
+    BarnesHutCPUSimulator bhSimulator;
+    FastMultipoleSimulator fmmSimulator;
+
+    // simulation thread only once started
+    SimulationSettings settings;
+    // dt and theta of the current simulators
+    float timeStep;
+    float theta;
+    int galaxyType;
+    uint64_t seed = 0;
+    uint64_t step = 0;
+    double time = 0.0;
+    uint64_t generation = 0;
+    float stepMs = 0.0f;
+    float stepsPerSecond = 0.0f;
+    bool recording = false;
+    TrajectoryWriter trajectory;
+    // the particles changed since the last published state
+    bool changed = true;
+
+    TripleBuffer<SimulationState> states;
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::vector<Command> commands;
+    bool stopping = false;
+    std::thread worker;
+
+public:
+    SimulationThread(int numParticles, int type, const SimulationSettings& initial)
+        : particles(numParticles),
+          seqSimulator(particles, initial.dt),
+          bhSimulator(particles, initial.dt, initial.theta),
+          fmmSimulator(particles, initial.dt),
+          settings(initial), timeStep(initial.dt), theta(initial.theta), galaxyType(type) {
+        seed = generateGalaxy(type, particles, numParticles);
+        rebuildSimulators();
+        publishState();
+    }
+
+    SimulationThread(const SimulationThread&) = delete;
+    SimulationThread& operator=(const SimulationThread&) = delete;
+    ~SimulationThread() { stop(); }
+
+    void start() {
+        if (worker.joinable()) return;
+        stopping = false;
+        worker = std::thread(&SimulationThread::run, this);
+    }
+
+    // finishes the command or step in flight; queued commands are dropped
+    void stop() {
+        if (!worker.joinable()) return;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_one();
+        worker.join();
+        trajectory.close();
+    }
+
+    // render thread: queues cmd to run on the simulation thread before its next step
+    void post(Command cmd) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            commands.push_back(std::move(cmd));
+        }
+        wake.notify_one();
+    }
+
+    // render thread: picks up the newest published state, false if there is
+    // none since the last call
+    bool acquireState() { return states.acquire(); }
+    const SimulationState& getState() const { return states.readBuffer(); }
+
+    // The calls below are for commands, which run on the simulation thread.
+
+    void applySettings(const SimulationSettings& updated) {
+        settings = updated;
+        seqSimulator.setSymmetricForces(settings.symmetricForces);
+        fmmSimulator.setExpansionOrder(settings.expansionOrder);
+        fmmSimulator.setTheta(settings.fmmTheta);
+        seqSimulator.setDiagnosticsInterval(settings.diagnosticsInterval);
+        bhSimulator.setDiagnosticsInterval(settings.diagnosticsInterval);
+        fmmSimulator.setDiagnosticsInterval(settings.diagnosticsInterval);
+        bhSimulator.setFusedPipeline(settings.fusedPipeline);
+    }
+
+    BarnesHutCPUSimulator& getBarnesHut() { return bhSimulator; }
+
+    // seed 0 draws a random one
+    void regenerate(int type, int numParticles, uint64_t galaxySeed) {
+        particles.resize(numParticles);
+        seed = generateGalaxy(type, particles, numParticles, galaxySeed);
+        galaxyType = type;
+        step = 0;
+        time = 0.0;
+        replaceParticles();
+    }
+
+    bool saveCheckpoint(const std::string& path) {
+        CheckpointInfo info;
+        info.step = step;
+        info.time = time;
+        info.dt = timeStep;
+        info.theta = theta;
+        info.galaxyType = galaxyType;
+        info.seed = seed;
+        return writeCheckpoint(path, particles, info);
+    }
+
+    bool restoreCheckpoint(const std::string& path) {
+        CheckpointInfo info;
+        if (!loadCheckpoint(path, particles, info)) return false;
+        if (info.galaxyType >= 0) galaxyType = info.galaxyType;
+        seed = info.seed;
+        settings.dt = info.dt;
+        settings.theta = info.theta;
+        step = info.step;
+        time = info.time;
+        replaceParticles();
+        return true;
+    }
+
+    bool startRecording(const std::string& path, const TrajectoryWriter::Options& options) {
+        trajectory.close();
+        recording = trajectory.open(path, particles, options);
+        changed = true;
+        return recording;
+    }
+
+    void stopRecording() {
+        trajectory.close();
+        recording = false;
+        changed = true;
+    }
+
+private:
+    // new particles need new simulators, and a recording holds one particle count
+    void replaceParticles() {
+        rebuildSimulators();
+        stopRecording();
+        generation++;
+        changed = true;
+    }
+
+    void rebuildSimulators() {
+        timeStep = settings.dt;
+        theta = settings.theta;
+        seqSimulator = SequentialNBodySimulator(particles, timeStep);
+        bhSimulator = BarnesHutCPUSimulator(particles, timeStep, theta);
+        fmmSimulator = FastMultipoleSimulator(particles, timeStep);
+        // Barnes-Hut stabilises within its step, fused into its first pass
+        bhSimulator.setOrbitStabilization(true);
+        applySettings(settings);
+    }
+
+    const Diagnostics& currentDiagnostics() const {
+        if (settings.simulationType == 0) return seqSimulator.getDiagnostics();
+        if (settings.simulationType == 1) return bhSimulator.getDiagnostics();
+        return fmmSimulator.getDiagnostics();
+    }
+
+    void advance() {
+        NBODY_TRACE_SCOPE("sim.advance");
+        const ProfileClock::time_point start = ProfileClock::now();
+        for (int i = 0; i < settings.simSpeed; i++) {
+            if (settings.simulationType != 1) Physics::stabilizeOrbits(particles);
+
+            if (settings.simulationType == 0) {
+                seqSimulator.update();
+            } else if (settings.simulationType == 1) {
+                bhSimulator.update();
+            } else {
+                fmmSimulator.update();
+            }
+            step++;
+            time += timeStep;
+        }
+        // queues the positions; never waits for the writer
+        if (recording) trajectory.submit(particles, step, time);
+        stepMs = elapsedMs(start, ProfileClock::now());
+        changed = true;
+    }
+
+    void publishState() {
+        NBODY_TRACE_SCOPE("sim.publish");
+        SimulationState& state = states.writeBuffer();
+        state.renderData.resize(particles.size());
+        particles.packRenderData(state.renderData.data());
+        state.step = step;
+        state.time = time;
+        state.stepMs = stepMs;
+        state.stepsPerSecond = stepsPerSecond;
+        state.diagnostics = currentDiagnostics();
+        state.generation = generation;
+        state.galaxyType = galaxyType;
+        state.seed = seed;
+        state.dt = settings.dt;
+        state.theta = settings.theta;
+        state.recording = recording;
+        if (recording) state.trajectory = trajectory.getStats();
+        states.publish();
+        changed = false;
+    }
+
+    void run() {
+        using Seconds = std::chrono::duration<double>;
+        ProfileClock::time_point nextState = ProfileClock::now();
+        ProfileClock::time_point rateStart = nextState;
+        uint64_t rateSteps = step;
+        std::vector<Command> pending;
+
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                auto woken = [this]() { return stopping || !commands.empty(); };
+                if (settings.paused) {
+                    wake.wait(lock, woken);
+                } else if (settings.maxStatesPerSecond > 0.0f) {
+                    wake.wait_until(lock, nextState, woken);
+                }
+                if (stopping) return;
+                pending.swap(commands);
+            }
+            for (Command& cmd : pending) cmd(*this);
+            if (!pending.empty()) changed = true;
+            pending.clear();
+
+            const ProfileClock::time_point now = ProfileClock::now();
+            if (!settings.paused && now >= nextState) {
+                advance();
+                if (settings.maxStatesPerSecond > 0.0f) {
+                    const auto period = std::chrono::duration_cast<ProfileClock::duration>(
+                        Seconds(1.0 / settings.maxStatesPerSecond));
+                    // a slow step does not earn a burst of catch-up steps
+                    nextState = std::max(nextState + period, now);
+                }
+            }
+
+            const double window = Seconds(ProfileClock::now() - rateStart).count();
+            // regeneration restarts the step count
+            if (step < rateSteps) rateSteps = step;
+            if (window >= 1.0 || settings.paused) {
+                stepsPerSecond = settings.paused ? 0.0f : static_cast<float>((step - rateSteps) / window);
+                rateStart = ProfileClock::now();
+                rateSteps = step;
+            }
+
+            if (changed) publishState();
+        }
+    }
+};
+
+#endif // SIMULATION_THREAD_H
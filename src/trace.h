@@ -0,0 +1,235 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Scoped hot-path tracing. NBODY_TRACE_SCOPE("name") times the enclosing
+// scope; the name must be a string literal. Configure with -DNBODY_TRACING=ON
+// to compile the scopes in. Without it they expand to nothing and the
+// functions below return empty results.
+//
+// Each thread records into its own ring buffer. Only the owning thread
+// writes a buffer, so a record costs two clock reads and a release store
+// with no lock. Readers (the exporter and collectStats) copy the rings
+// while they are written and drop any slot the writer lapped during the
+// copy. The registry mutex is taken only the first time a thread records.
+namespace Trace
+{
+    // log2 buckets of the duration in microseconds: [0, 2), [2, 4), ...
+    constexpr int HISTOGRAM_BUCKETS = 16;
+
+    struct Event
+    {
+        const char *name;
+        // nanoseconds since the first traced event of the process
+        int64_t start;
+        int64_t duration;
+    };
+
+    // durations of one scope name over the recent window
+    struct Stat
+    {
+        const char *name = nullptr;
+        long count = 0;
+        float p50Ms = 0.0f;
+        float p99Ms = 0.0f;
+        float maxMs = 0.0f;
+        std::array<float, HISTOGRAM_BUCKETS> histogram{};
+    };
+
+#ifdef NBODY_TRACING
+    constexpr bool ENABLED = true;
+
+    class ThreadBuffer
+    {
+    public:
+        // events kept per thread, a power of two
+        static constexpr uint64_t CAPACITY = 1u << 14;
+
+        explicit ThreadBuffer(int id) : threadId(id), events(CAPACITY) {}
+
+        void push(const char *name, int64_t start, int64_t duration) {
+            const uint64_t h = head.load(std::memory_order_relaxed);
+            events[h & (CAPACITY - 1)] = Event{ name, start, duration };
+            head.store(h + 1, std::memory_order_release);
+        }
+
+        // appends the events currently held, oldest first
+        void copyTo(std::vector<Event> &out) const {
+            const uint64_t end = head.load(std::memory_order_acquire);
+            const uint64_t begin = end > CAPACITY ? end - CAPACITY : 0;
+            const size_t first = out.size();
+            for (uint64_t k = begin; k < end; k++) out.push_back(events[k & (CAPACITY - 1)]);
+
+            // Slots the writer reused while we copied are torn: drop them.
+            // The fence keeps the copies above from moving past the re-read.
+            // The writer may be filling slot after (head not yet bumped), so
+            // only slots from after + 1 - CAPACITY on are intact.
+            std::atomic_thread_fence(std::memory_order_acquire);
+            const uint64_t after = head.load(std::memory_order_relaxed);
+            const uint64_t valid = after + 1 > CAPACITY ? after + 1 - CAPACITY : 0;
+            if (valid > begin) {
+                const size_t torn = static_cast<size_t>(std::min(valid - begin, end - begin));
+                out.erase(out.begin() + first, out.begin() + first + torn);
+            }
+        }
+
+        int getThreadId() const { return threadId; }
+
+    private:
+        int threadId;
+        std::vector<Event> events;
+        std::atomic<uint64_t> head{0};
+    };
+
+    inline std::mutex &registryMutex() {
+        static std::mutex mutex;
+        return mutex;
+    }
+
+    // buffers live until exit so readers never see one freed
+    inline std::vector<std::unique_ptr<ThreadBuffer>> &registry() {
+        static std::vector<std::unique_ptr<ThreadBuffer>> buffers;
+        return buffers;
+    }
+
+    inline ThreadBuffer &localBuffer() {
+        thread_local ThreadBuffer *buffer = nullptr;
+        if (!buffer) {
+            std::lock_guard<std::mutex> lock(registryMutex());
+            auto &buffers = registry();
+            buffers.push_back(std::make_unique<ThreadBuffer>(static_cast<int>(buffers.size())));
+            buffer = buffers.back().get();
+        }
+        return *buffer;
+    }
+
+    inline int64_t now() {
+        using Clock = std::chrono::steady_clock;
+        static const Clock::time_point epoch = Clock::now();
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - epoch).count();
+    }
+
+    class Scope
+    {
+    public:
+        explicit Scope(const char *scopeName) : name(scopeName), start(now()) {}
+        ~Scope() { localBuffer().push(name, start, now() - start); }
+        Scope(const Scope &) = delete;
+        Scope &operator=(const Scope &) = delete;
+
+    private:
+        const char *name;
+        int64_t start;
+    };
+
+    // every buffered event, tagged with its thread
+    inline void snapshot(std::vector<Event> &events, std::vector<int> &threads) {
+        events.clear();
+        threads.clear();
+        std::lock_guard<std::mutex> lock(registryMutex());
+        for (const auto &buffer : registry()) {
+            buffer->copyTo(events);
+            threads.resize(events.size(), buffer->getThreadId());
+        }
+    }
+
+    // Writes the buffered events as Chrome trace JSON ("X" complete events),
+    // which chrome://tracing and ui.perfetto.dev open directly.
+    inline bool writeChromeTrace(const std::string &path) {
+        std::vector<Event> events;
+        std::vector<int> threads;
+        snapshot(events, threads);
+
+        FILE *file = std::fopen(path.c_str(), "w");
+        if (!file) {
+            std::cerr << "Failed to open trace file " << path << std::endl;
+            return false;
+        }
+        std::fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+        for (size_t k = 0; k < events.size(); k++) {
+            const Event &e = events[k];
+            std::fprintf(file, "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}%s\n",
+                         e.name, threads[k], e.start / 1000.0, e.duration / 1000.0,
+                         k + 1 < events.size() ? "," : "");
+        }
+        std::fprintf(file, "]}\n");
+        return std::fclose(file) == 0;
+    }
+
+    // Per-name percentiles and histograms of the events that ended in the
+    // last windowMs; costs a copy of every ring, so poll it a few times a
+    // second at most.
+    inline std::vector<Stat> collectStats(float windowMs = 2000.0f) {
+        std::vector<Event> events;
+        std::vector<int> threads;
+        snapshot(events, threads);
+
+        const int64_t cutoff = now() - static_cast<int64_t>(windowMs * 1.0e6f);
+        std::vector<Stat> stats;
+        std::vector<std::vector<int64_t>> durations;
+        for (const Event &e : events) {
+            if (e.start + e.duration < cutoff) continue;
+            // names are literals: compare by pointer, then by text for
+            // literals the linker did not merge
+            size_t s = 0;
+            while (s < stats.size() && stats[s].name != e.name && std::strcmp(stats[s].name, e.name) != 0) s++;
+            if (s == stats.size()) {
+                stats.emplace_back();
+                stats.back().name = e.name;
+                durations.emplace_back();
+            }
+            durations[s].push_back(e.duration);
+        }
+
+        for (size_t s = 0; s < stats.size(); s++) {
+            std::vector<int64_t> &d = durations[s];
+            std::sort(d.begin(), d.end());
+            Stat &stat = stats[s];
+            stat.count = static_cast<long>(d.size());
+            stat.p50Ms = d[(d.size() - 1) / 2] / 1.0e6f;
+            stat.p99Ms = d[(d.size() - 1) * 99 / 100] / 1.0e6f;
+            stat.maxMs = d.back() / 1.0e6f;
+            for (int64_t ns : d) {
+                int bucket = 0;
+                for (int64_t us = ns / 2000; us > 0 && bucket < HISTOGRAM_BUCKETS - 1; us >>= 1) bucket++;
+                stat.histogram[bucket] += 1.0f;
+            }
+        }
+        std::sort(stats.begin(), stats.end(), [](const Stat &a, const Stat &b) {
+            return std::strcmp(a.name, b.name) < 0;
+        });
+        return stats;
+    }
+
+#define NBODY_TRACE_CONCAT_INNER(a, b) a##b
+#define NBODY_TRACE_CONCAT(a, b) NBODY_TRACE_CONCAT_INNER(a, b)
+#define NBODY_TRACE_SCOPE(name) ::Trace::Scope NBODY_TRACE_CONCAT(traceScope, __LINE__)(name)
+
+#else
+    constexpr bool ENABLED = false;
+
+    inline bool writeChromeTrace(const std::string &path) {
+        std::cerr << "Tracing is compiled out; configure with -DNBODY_TRACING=ON to write " << path << std::endl;
+        return false;
+    }
+
+    inline std::vector<Stat> collectStats(float = 2000.0f) { return {}; }
+
+#define NBODY_TRACE_SCOPE(name) ((void)0)
+
+#endif // NBODY_TRACING
+}
+
+#endif // TRACE_H
@@ -0,0 +1,681 @@
+#ifndef TRAJECTORY_H
+#define TRAJECTORY_H
+
+#include "particle.h"
+#include "profiling.h"
+#include "trace.h"
+#include <glm/glm.hpp>
+#include <algorithm>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+// Trajectory files: a header, the particle masses (constant over a run), one
+// frame per submitted snapshot, then a frame index and a footer pointing at
+// it.
+//
+// Positions are stored raw (quantizationBits 0) or quantised to a grid of
+// 2^bits cells per axis over the root octree cell (the cube around every
+// particle) of the last keyframe, the same grid Morton keys use at depth
+// bits. A keyframe stores each particle's cell coordinates; the next frame
+// stores the change since the keyframe, and later frames the difference from
+// a linear extrapolation of the previous two (the change in velocity).
+// Values are zigzag encoded and bit-packed per axis in blocks of 64 at the
+// width of the block's largest, so a particle on a smooth orbit costs a few
+// bits per axis instead of 32. The error is at most half a cell, and it does
+// not accumulate because deltas are taken between quantised positions.
+//
+// The index gives random access: seek to the frame's keyframe and decode
+// forward. A file whose writer crashed has no index; TrajectoryReader then
+// rebuilds it by walking the frame headers.
+
+constexpr uint32_t TRAJECTORY_VERSION = 1;
+constexpr uint32_t TRAJECTORY_BYTE_ORDER = 0x01020304u;
+constexpr uint32_t TRAJECTORY_FRAME_MARKER = 0x4d415246u; // "FRAM"
+constexpr uint32_t TRAJECTORY_KEYFRAME = 1u;
+
+struct TrajectoryHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t headerBytes;
+    uint32_t byteOrder;
+    // 0 for raw float positions
+    uint32_t quantizationBits;
+    uint64_t numParticles;
+    uint32_t keyframeInterval;
+    uint32_t reserved;
+};
+
+struct TrajectoryFrameHeader
+{
+    uint32_t marker;
+    uint32_t flags;
+    uint64_t step;
+    double time;
+    // quantisation grid of the frame's keyframe
+    float origin[3];
+    float cellSize;
+    uint64_t payloadBytes;
+};
+
+struct TrajectoryIndexEntry
+{
+    uint64_t offset;
+    uint64_t step;
+    double time;
+    uint32_t flags;
+    // index of the keyframe decoding starts from
+    uint32_t keyframe;
+};
+
+struct TrajectoryFooter
+{
+    uint64_t indexOffset;
+    uint64_t frameCount;
+    char magic[8];
+};
+
+static_assert(std::is_trivially_copyable<TrajectoryFrameHeader>::value, "frame headers are written with fwrite");
+
+namespace TrajectoryDetail
+{
+    const char MAGIC[8] = { 'N', 'B', 'O', 'D', 'Y', 'T', 'R', 'J' };
+    const char INDEX_MAGIC[8] = { 'N', 'B', 'O', 'D', 'Y', 'I', 'D', 'X' };
+
+    // residuals bit-packed together, each block at the width of its largest
+    const size_t PACK_BLOCK = 64;
+
+    inline uint32_t zigzag(int32_t value) {
+        return (static_cast<uint32_t>(value) << 1) ^ static_cast<uint32_t>(value >> 31);
+    }
+
+    inline int32_t unzigzag(uint32_t value) {
+        return static_cast<int32_t>(value >> 1) ^ -static_cast<int32_t>(value & 1);
+    }
+
+    // one width byte, then count values of that many bits, least significant first
+    inline void packBlock(std::vector<uint8_t>& out, const uint32_t* values, size_t count) {
+        uint32_t all = 0;
+        for (size_t k = 0; k < count; k++) all |= values[k];
+        int width = 0;
+        while (width < 32 && (all >> width) != 0) width++;
+        out.push_back(static_cast<uint8_t>(width));
+
+        uint64_t bits = 0;
+        int held = 0;
+        for (size_t k = 0; k < count; k++) {
+            bits |= static_cast<uint64_t>(values[k]) << held;
+            held += width;
+            while (held >= 8) {
+                out.push_back(static_cast<uint8_t>(bits));
+                bits >>= 8;
+                held -= 8;
+            }
+        }
+        if (held > 0) out.push_back(static_cast<uint8_t>(bits));
+    }
+
+    // false when the block runs past end or is malformed
+    inline bool unpackBlock(const uint8_t*& in, const uint8_t* end, uint32_t* values, size_t count) {
+        if (in == end) return false;
+        const int width = *in++;
+        if (width > 32 || static_cast<size_t>(end - in) < (count * width + 7) / 8) return false;
+        const uint64_t mask = (uint64_t(1) << width) - 1;
+
+        uint64_t bits = 0;
+        int held = 0;
+        for (size_t k = 0; k < count; k++) {
+            while (held < width) {
+                bits |= static_cast<uint64_t>(*in++) << held;
+                held += 8;
+            }
+            values[k] = static_cast<uint32_t>(bits & mask);
+            bits >>= width;
+            held -= width;
+        }
+        return true;
+    }
+
+    // deltas wrap like the unsigned sums that undo them, so no value overflows
+    inline int32_t wrappingSub(int32_t a, int32_t b) {
+        return static_cast<int32_t>(static_cast<uint32_t>(a) - static_cast<uint32_t>(b));
+    }
+
+    inline int32_t wrappingAdd(int32_t a, int32_t b) {
+        return static_cast<int32_t>(static_cast<uint32_t>(a) + static_cast<uint32_t>(b));
+    }
+
+    // cell expected from the previous two frames, framesSinceKeyframe >= 1
+    inline int32_t predict(uint32_t framesSinceKeyframe, int32_t previous, int32_t beforePrevious) {
+        if (framesSinceKeyframe == 0) return 0;
+        if (framesSinceKeyframe == 1) return previous;
+        return wrappingSub(wrappingAdd(previous, previous), beforePrevious);
+    }
+
+    inline int32_t quantize(float p, float origin, float cellSize) {
+        const double cell = std::floor((static_cast<double>(p) - origin) / cellSize + 0.5);
+        // non-finite positions land on the origin
+        if (!(cell == cell)) return 0;
+        return static_cast<int32_t>(std::max(-2147483647.0, std::min(2147483647.0, cell)));
+    }
+}
+
+// what the simulation paid for recording and what the file cost
+struct TrajectoryStats
+{
+    long framesWritten = 0;
+    long framesDropped = 0;
+    uint64_t bytesWritten = 0;
+    // bytes the same frames take as raw float positions
+    uint64_t rawBytes = 0;
+    // time spent in submit(), and the part of it waiting for a free buffer
+    double submitMs = 0.0;
+    double blockedMs = 0.0;
+    bool failed = false;
+
+    double compressionRatio() const {
+        return bytesWritten > 0 ? static_cast<double>(rawBytes) / bytesWritten : 0.0;
+    }
+};
+
+// Streams snapshots to a trajectory file from a background thread. submit()
+// copies the positions into one of bufferedFrames preallocated buffers and
+// returns; the worker encodes and writes them in order. When every buffer is
+// queued, submit() waits for the worker (backpressure) or, with
+// dropWhenFull, skips the frame, so memory stays at bufferedFrames copies.
+class TrajectoryWriter
+{
+public:
+    struct Options
+    {
+        // grid cells per axis are 2^quantizationBits; 0 writes raw floats
+        int quantizationBits = 16;
+        // frames between keyframes, the random-access granularity
+        int keyframeInterval = 32;
+        // 2 double-buffers, 3 triple-buffers
+        int bufferedFrames = 3;
+        bool dropWhenFull = false;
+    };
+
+private:
+    struct Slot
+    {
+        std::vector<float> x, y, z;
+        uint64_t step = 0;
+        double time = 0.0;
+    };
+
+    Options options;
+    size_t numParticles = 0;
+    std::vector<Slot> slots;
+    std::deque<int> freeSlots;
+    std::deque<int> queuedSlots;
+    std::mutex mutex;
+    std::condition_variable slotFreed;
+    std::condition_variable slotQueued;
+    bool closing = false;
+    std::thread worker;
+    TrajectoryStats stats;
+
+    // worker-thread state
+    FILE* file = nullptr;
+    uint64_t fileOffset = 0;
+    std::vector<TrajectoryIndexEntry> index;
+    // quantised positions of the last two frames
+    std::vector<int32_t> cells[3];
+    std::vector<int32_t> earlierCells[3];
+    std::vector<uint32_t> residuals;
+    std::vector<uint8_t> payload;
+    float origin[3] = { 0.0f, 0.0f, 0.0f };
+    float cellSize = 1.0f;
+    uint32_t lastKeyframe = 0;
+
+public:
+    TrajectoryWriter() = default;
+    TrajectoryWriter(const TrajectoryWriter&) = delete;
+    TrajectoryWriter& operator=(const TrajectoryWriter&) = delete;
+    ~TrajectoryWriter() { close(); }
+
+    bool open(const std::string& path, ParticleSystem& particles) { return open(path, particles, Options()); }
+
+    // starts a file for the particles' count and masses
+    bool open(const std::string& path, ParticleSystem& particles, const Options& writerOptions) {
+        close();
+        options = writerOptions;
+        options.quantizationBits = std::max(0, std::min(24, options.quantizationBits));
+        options.keyframeInterval = std::max(1, options.keyframeInterval);
+        options.bufferedFrames = std::max(1, options.bufferedFrames);
+
+        file = std::fopen(path.c_str(), "wb");
+        if (!file) {
+            std::cerr << "Failed to open trajectory " << path << std::endl;
+            return false;
+        }
+        TrajectoryHeader header;
+        std::memset(&header, 0, sizeof(header));
+        std::memcpy(header.magic, TrajectoryDetail::MAGIC, sizeof(header.magic));
+        header.version = TRAJECTORY_VERSION;
+        header.headerBytes = sizeof(TrajectoryHeader);
+        header.byteOrder = TRAJECTORY_BYTE_ORDER;
+        header.quantizationBits = static_cast<uint32_t>(options.quantizationBits);
+        header.numParticles = particles.size();
+        header.keyframeInterval = static_cast<uint32_t>(options.keyframeInterval);
+
+        numParticles = particles.size();
+        std::vector<float> masses(numParticles);
+        for (size_t i = 0; i < numParticles; i++) masses[i] = particles.getMass(i);
+
+        stats = TrajectoryStats();
+        stats.failed = std::fwrite(&header, sizeof(header), 1, file) != 1 ||
+                       std::fwrite(masses.data(), sizeof(float), numParticles, file) != numParticles;
+        fileOffset = sizeof(header) + numParticles * sizeof(float);
+        stats.bytesWritten = fileOffset;
+        index.clear();
+        lastKeyframe = 0;
+
+        slots.assign(options.bufferedFrames, Slot());
+        freeSlots.clear();
+        queuedSlots.clear();
+        for (int s = 0; s < options.bufferedFrames; s++) {
+            slots[s].x.resize(numParticles);
+            slots[s].y.resize(numParticles);
+            slots[s].z.resize(numParticles);
+            freeSlots.push_back(s);
+        }
+        for (int a = 0; a < 3; a++) {
+            cells[a].assign(numParticles, 0);
+            earlierCells[a].assign(numParticles, 0);
+        }
+        residuals.resize(numParticles);
+        closing = false;
+        worker = std::thread(&TrajectoryWriter::run, this);
+        return !stats.failed;
+    }
+
+    bool isOpen() const { return file != nullptr; }
+
+    // Queues the current positions. Returns false when the frame was dropped,
+    // the particle count changed or the file failed.
+    bool submit(ParticleSystem& particles, uint64_t step, double time) {
+        NBODY_TRACE_SCOPE("trajectory.submit");
+        if (!file || particles.size() != numParticles) return false;
+        auto submitStart = ProfileClock::now();
+
+        std::unique_lock<std::mutex> lock(mutex);
+        if (freeSlots.empty()) {
+            if (options.dropWhenFull) {
+                stats.framesDropped++;
+                stats.submitMs += elapsedMs(submitStart, ProfileClock::now());
+                return false;
+            }
+            auto waitStart = ProfileClock::now();
+            slotFreed.wait(lock, [this]() { return !freeSlots.empty(); });
+            stats.blockedMs += elapsedMs(waitStart, ProfileClock::now());
+        }
+        const int s = freeSlots.front();
+        freeSlots.pop_front();
+        lock.unlock();
+
+        // the slot belongs to this thread until it is queued
+        Slot& slot = slots[s];
+        slot.step = step;
+        slot.time = time;
+#ifdef NBODY_SOA_LAYOUT
+        ParticleStreams streams = particles.streams();
+        std::memcpy(slot.x.data(), streams.x, numParticles * sizeof(float));
+        std::memcpy(slot.y.data(), streams.y, numParticles * sizeof(float));
+        std::memcpy(slot.z.data(), streams.z, numParticles * sizeof(float));
+#else
+        const Particle* data = particles.data();
+        for (size_t i = 0; i < numParticles; i++) {
+            slot.x[i] = data[i].position.x;
+            slot.y[i] = data[i].position.y;
+            slot.z[i] = data[i].position.z;
+        }
+#endif
+
+        lock.lock();
+        queuedSlots.push_back(s);
+        stats.submitMs += elapsedMs(submitStart, ProfileClock::now());
+        const bool ok = !stats.failed;
+        lock.unlock();
+        slotQueued.notify_one();
+        return ok;
+    }
+
+    // Writes every queued frame and the index, then closes the file.
+    bool close() {
+        if (!file) return true;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            closing = true;
+        }
+        slotQueued.notify_one();
+        worker.join();
+
+        const uint64_t indexOffset = fileOffset;
+        TrajectoryFooter footer;
+        footer.indexOffset = indexOffset;
+        footer.frameCount = index.size();
+        std::memcpy(footer.magic, TrajectoryDetail::INDEX_MAGIC, sizeof(footer.magic));
+        bool ok = !stats.failed &&
+                  std::fwrite(index.data(), sizeof(TrajectoryIndexEntry), index.size(), file) == index.size() &&
+                  std::fwrite(&footer, sizeof(footer), 1, file) == 1;
+        ok = std::fclose(file) == 0 && ok;
+        file = nullptr;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        stats.bytesWritten += index.size() * sizeof(TrajectoryIndexEntry) + sizeof(footer);
+        stats.failed = !ok;
+        if (!ok) std::cerr << "Failed to write trajectory" << std::endl;
+        return ok;
+    }
+
+    TrajectoryStats getStats() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return stats;
+    }
+
+private:
+    void run() {
+        for (;;) {
+            std::unique_lock<std::mutex> lock(mutex);
+            slotQueued.wait(lock, [this]() { return closing || !queuedSlots.empty(); });
+            if (queuedSlots.empty()) return;
+            const int s = queuedSlots.front();
+            queuedSlots.pop_front();
+            const bool failed = stats.failed;
+            lock.unlock();
+
+            // after a write error frames are still consumed so submit() never waits forever
+            uint64_t written = 0;
+            const bool ok = failed || writeFrame(slots[s], written);
+
+            lock.lock();
+            freeSlots.push_back(s);
+            if (!failed) {
+                stats.failed = !ok;
+                stats.framesWritten++;
+                stats.bytesWritten += written;
+                stats.rawBytes += numParticles * 3 * sizeof(float);
+            }
+            lock.unlock();
+            slotFreed.notify_one();
+        }
+    }
+
+    bool writeFrame(const Slot& slot, uint64_t& written) {
+        NBODY_TRACE_SCOPE("trajectory.write");
+        const uint32_t frame = static_cast<uint32_t>(index.size());
+        const bool raw = options.quantizationBits == 0;
+        const bool keyframe = raw || frame == 0 ||
+                              frame - lastKeyframe >= static_cast<uint32_t>(options.keyframeInterval);
+        if (keyframe) lastKeyframe = frame;
+
+        payload.clear();
+        const float* axes[3] = { slot.x.data(), slot.y.data(), slot.z.data() };
+        if (!raw) {
+            if (keyframe) fitGrid(axes);
+            const uint32_t sinceKeyframe = frame - lastKeyframe;
+            for (int a = 0; a < 3; a++) {
+                for (size_t i = 0; i < numParticles; i++) {
+                    const int32_t cell = TrajectoryDetail::quantize(axes[a][i], origin[a], cellSize);
+                    const int32_t predicted = TrajectoryDetail::predict(sinceKeyframe, cells[a][i], earlierCells[a][i]);
+                    residuals[i] = TrajectoryDetail::zigzag(TrajectoryDetail::wrappingSub(cell, predicted));
+                    earlierCells[a][i] = cells[a][i];
+                    cells[a][i] = cell;
+                }
+                for (size_t i = 0; i < numParticles; i += TrajectoryDetail::PACK_BLOCK) {
+                    TrajectoryDetail::packBlock(payload, residuals.data() + i,
+                                                std::min(TrajectoryDetail::PACK_BLOCK, numParticles - i));
+                }
+            }
+        }
+        const uint64_t payloadBytes = raw ? 3 * numParticles * sizeof(float) : payload.size();
+
+        TrajectoryFrameHeader header;
+        std::memset(&header, 0, sizeof(header));
+        header.marker = TRAJECTORY_FRAME_MARKER;
+        header.flags = keyframe ? TRAJECTORY_KEYFRAME : 0u;
+        header.step = slot.step;
+        header.time = slot.time;
+        for (int a = 0; a < 3; a++) header.origin[a] = origin[a];
+        header.cellSize = cellSize;
+        header.payloadBytes = payloadBytes;
+
+        if (std::fwrite(&header, sizeof(header), 1, file) != 1) return false;
+        if (raw) {
+            for (const float* axis : axes) {
+                if (std::fwrite(axis, sizeof(float), numParticles, file) != numParticles) return false;
+            }
+        } else if (std::fwrite(payload.data(), 1, payload.size(), file) != payload.size()) {
+            return false;
+        }
+        index.push_back({ fileOffset, slot.step, slot.time, header.flags, lastKeyframe });
+        written = sizeof(header) + payloadBytes;
+        fileOffset += written;
+        return true;
+    }
+
+    // the root cell: the cube around every finite position
+    void fitGrid(const float* const axes[3]) {
+        glm::vec3 lo(0.0f), hi(0.0f);
+        bool any = false;
+        for (size_t i = 0; i < numParticles; i++) {
+            const glm::vec3 p(axes[0][i], axes[1][i], axes[2][i]);
+            if (!std::isfinite(p.x) || !std::isfinite(p.y) || !std::isfinite(p.z)) continue;
+            lo = any ? glm::min(lo, p) : p;
+            hi = any ? glm::max(hi, p) : p;
+            any = true;
+        }
+        const glm::vec3 extent = hi - lo;
+        const float size = std::max(std::max(extent.x, extent.y), std::max(extent.z, 1.0e-6f));
+        const glm::vec3 center = 0.5f * (lo + hi);
+        for (int a = 0; a < 3; a++) origin[a] = center[a] - 0.5f * size;
+        cellSize = size / static_cast<float>(1u << options.quantizationBits);
+    }
+};
+
+// Random access to a trajectory file. Reading frames in order decodes each
+// once; a jump decodes forward from the frame's keyframe.
+class TrajectoryReader
+{
+private:
+    FILE* file = nullptr;
+    TrajectoryHeader header;
+    std::vector<float> masses;
+    std::vector<TrajectoryIndexEntry> index;
+    std::vector<uint8_t> payload;
+    std::vector<int32_t> cells[3];
+    std::vector<int32_t> earlierCells[3];
+    std::vector<size_t> blockStarts;
+    // frame the cells hold, -1 for none
+    long decodedFrame = -1;
+
+public:
+    TrajectoryReader() = default;
+    TrajectoryReader(const TrajectoryReader&) = delete;
+    TrajectoryReader& operator=(const TrajectoryReader&) = delete;
+    ~TrajectoryReader() { close(); }
+
+    bool open(const std::string& path) {
+        close();
+        file = std::fopen(path.c_str(), "rb");
+        if (!file) {
+            std::cerr << "Failed to open trajectory " << path << std::endl;
+            return false;
+        }
+        if (std::fread(&header, sizeof(header), 1, file) != 1 ||
+            std::memcmp(header.magic, TrajectoryDetail::MAGIC, sizeof(header.magic)) != 0 ||
+            header.version != TRAJECTORY_VERSION || header.headerBytes != sizeof(TrajectoryHeader) ||
+            header.byteOrder != TRAJECTORY_BYTE_ORDER || header.quantizationBits > 24) {
+            std::cerr << path << " is not a trajectory this build can read" << std::endl;
+            close();
+            return false;
+        }
+        masses.resize(header.numParticles);
+        if (std::fread(masses.data(), sizeof(float), masses.size(), file) != masses.size()) {
+            std::cerr << "Trajectory " << path << " is truncated" << std::endl;
+            close();
+            return false;
+        }
+        if (!readIndex() && !scanFrames()) {
+            std::cerr << "Trajectory " << path << " has no readable frames" << std::endl;
+            close();
+            return false;
+        }
+        for (int a = 0; a < 3; a++) {
+            cells[a].assign(header.numParticles, 0);
+            earlierCells[a].assign(header.numParticles, 0);
+        }
+        decodedFrame = -1;
+        return true;
+    }
+
+    void close() {
+        if (file) std::fclose(file);
+        file = nullptr;
+        index.clear();
+    }
+
+    bool isOpen() const { return file != nullptr; }
+    size_t getFrameCount() const { return index.size(); }
+    size_t getNumParticles() const { return static_cast<size_t>(header.numParticles); }
+    int getQuantizationBits() const { return static_cast<int>(header.quantizationBits); }
+    uint64_t getFrameStep(size_t frame) const { return index[frame].step; }
+    double getFrameTime(size_t frame) const { return index[frame].time; }
+    const std::vector<float>& getMasses() const { return masses; }
+
+    // decodes frame into positions (resized to the particle count)
+    bool readFrame(size_t frame, std::vector<glm::vec3>& positions) {
+        NBODY_TRACE_SCOPE("trajectory.read");
+        if (!file || frame >= index.size()) return false;
+        positions.resize(header.numParticles);
+
+        long first = static_cast<long>(index[frame].keyframe);
+        if (decodedFrame >= first && decodedFrame < static_cast<long>(frame)) first = decodedFrame + 1;
+        TrajectoryFrameHeader frameHeader;
+        for (long f = first; f <= static_cast<long>(frame); f++) {
+            if (!readPayload(static_cast<size_t>(f), frameHeader) ||
+                !decode(static_cast<uint32_t>(f) - index[f].keyframe)) {
+                decodedFrame = -1;
+                return false;
+            }
+            decodedFrame = f;
+        }
+        const long n = static_cast<long>(positions.size());
+        if (header.quantizationBits == 0) {
+            const float* axes = reinterpret_cast<const float*>(payload.data());
+            #pragma omp parallel for if(n > 65536)
+            for (long i = 0; i < n; i++) {
+                positions[i] = glm::vec3(axes[i], axes[n + i], axes[2 * n + i]);
+            }
+        } else {
+            #pragma omp parallel for if(n > 65536)
+            for (long i = 0; i < n; i++) {
+                positions[i] = glm::vec3(frameHeader.origin[0] + cells[0][i] * frameHeader.cellSize,
+                                         frameHeader.origin[1] + cells[1][i] * frameHeader.cellSize,
+                                         frameHeader.origin[2] + cells[2][i] * frameHeader.cellSize);
+            }
+        }
+        return true;
+    }
+
+private:
+    bool readIndex() {
+        TrajectoryFooter footer;
+        if (std::fseek(file, -static_cast<long>(sizeof(footer)), SEEK_END) != 0 ||
+            std::fread(&footer, sizeof(footer), 1, file) != 1 ||
+            std::memcmp(footer.magic, TrajectoryDetail::INDEX_MAGIC, sizeof(footer.magic)) != 0 ||
+            std::fseek(file, static_cast<long>(footer.indexOffset), SEEK_SET) != 0) {
+            return false;
+        }
+        index.resize(footer.frameCount);
+        return std::fread(index.data(), sizeof(TrajectoryIndexEntry), index.size(), file) == index.size();
+    }
+
+    // rebuilds the index of a file whose writer never closed it
+    bool scanFrames() {
+        index.clear();
+        uint64_t offset = sizeof(TrajectoryHeader) + header.numParticles * sizeof(float);
+        uint32_t keyframe = 0;
+        TrajectoryFrameHeader frameHeader;
+        while (std::fseek(file, static_cast<long>(offset), SEEK_SET) == 0 &&
+               std::fread(&frameHeader, sizeof(frameHeader), 1, file) == 1 &&
+               frameHeader.marker == TRAJECTORY_FRAME_MARKER) {
+            // skip a frame whose payload was cut short
+            if (std::fseek(file, static_cast<long>(offset + sizeof(frameHeader) + frameHeader.payloadBytes) - 1, SEEK_SET) != 0 ||
+                std::fgetc(file) == EOF) {
+                break;
+            }
+            if (frameHeader.flags & TRAJECTORY_KEYFRAME) keyframe = static_cast<uint32_t>(index.size());
+            if (index.empty() && !(frameHeader.flags & TRAJECTORY_KEYFRAME)) break;
+            index.push_back({ offset, frameHeader.step, frameHeader.time, frameHeader.flags, keyframe });
+            offset += sizeof(frameHeader) + frameHeader.payloadBytes;
+        }
+        return !index.empty();
+    }
+
+    bool readPayload(size_t frame, TrajectoryFrameHeader& frameHeader) {
+        if (std::fseek(file, static_cast<long>(index[frame].offset), SEEK_SET) != 0 ||
+            std::fread(&frameHeader, sizeof(frameHeader), 1, file) != 1 ||
+            frameHeader.marker != TRAJECTORY_FRAME_MARKER) {
+            return false;
+        }
+        payload.resize(frameHeader.payloadBytes);
+        return std::fread(payload.data(), 1, payload.size(), file) == payload.size();
+    }
+
+    bool decode(uint32_t sinceKeyframe) {
+        const size_t n = static_cast<size_t>(header.numParticles);
+        if (header.quantizationBits == 0) return payload.size() == 3 * n * sizeof(float);
+
+        // each block's size follows from its width byte, so one pass finds
+        // where every block starts and the blocks then decode in parallel
+        const size_t blocksPerAxis = (n + TrajectoryDetail::PACK_BLOCK - 1) / TrajectoryDetail::PACK_BLOCK;
+        blockStarts.resize(3 * blocksPerAxis);
+        size_t offset = 0;
+        for (size_t b = 0; b < blockStarts.size(); b++) {
+            if (offset >= payload.size()) return false;
+            const size_t first = (b % blocksPerAxis) * TrajectoryDetail::PACK_BLOCK;
+            const size_t count = std::min(TrajectoryDetail::PACK_BLOCK, n - first);
+            blockStarts[b] = offset;
+            offset += 1 + (count * payload[offset] + 7) / 8;
+        }
+        if (offset != payload.size()) return false;
+
+        const long blocks = static_cast<long>(blockStarts.size());
+        bool ok = true;
+        #pragma omp parallel for reduction(&&:ok) if(n > 65536)
+        for (long b = 0; b < blocks; b++) {
+            const int a = static_cast<int>(b / blocksPerAxis);
+            const size_t first = (b % blocksPerAxis) * TrajectoryDetail::PACK_BLOCK;
+            const size_t count = std::min(TrajectoryDetail::PACK_BLOCK, n - first);
+            const uint8_t* in = payload.data() + blockStarts[b];
+            uint32_t block[TrajectoryDetail::PACK_BLOCK];
+            if (!TrajectoryDetail::unpackBlock(in, payload.data() + payload.size(), block, count)) {
+                ok = false;
+                continue;
+            }
+            for (size_t k = 0; k < count; k++) {
+                const size_t i = first + k;
+                const int32_t predicted = TrajectoryDetail::predict(sinceKeyframe, cells[a][i], earlierCells[a][i]);
+                earlierCells[a][i] = cells[a][i];
+                cells[a][i] = TrajectoryDetail::wrappingAdd(predicted, TrajectoryDetail::unzigzag(block[k]));
+            }
+        }
+        return ok;
+    }
+};
+
+#endif // TRAJECTORY_H
@@ -0,0 +1,48 @@
+#ifndef TRIPLE_BUFFER_H
+#define TRIPLE_BUFFER_H
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+// Single-producer single-consumer handoff of the latest value. The writer
+// fills its back buffer and publishes it; the reader takes the newest
+// published buffer whenever it likes. Neither side ever waits: the two
+// swap buffers through one atomic exchange of the middle slot, and values
+// the reader never picked up are overwritten.
+template <typename T>
+class TripleBuffer
+{
+private:
+    // middle holds a buffer index in the low bits and FRESH when it carries
+    // a value published since the reader last took one
+    static constexpr uint8_t INDEX = 3;
+    static constexpr uint8_t FRESH = 4;
+
+    std::array<T, 3> buffers;
+    std::atomic<uint8_t> middle{1};
+    // writer only
+    uint8_t back = 0;
+    // reader only
+    uint8_t front = 2;
+
+public:
+    // writer side: the buffer to fill, then publish() it
+    T& writeBuffer() { return buffers[back]; }
+
+    void publish() {
+        back = middle.exchange(static_cast<uint8_t>(back | FRESH), std::memory_order_acq_rel) & INDEX;
+    }
+
+    // reader side: swaps in the newest published value, false when there is
+    // none newer than readBuffer()
+    bool acquire() {
+        if (!(middle.load(std::memory_order_relaxed) & FRESH)) return false;
+        front = middle.exchange(front, std::memory_order_acq_rel) & INDEX;
+        return true;
+    }
+
+    const T& readBuffer() const { return buffers[front]; }
+};
+
+#endif // TRIPLE_BUFFER_H
@@ -0,0 +1,43 @@
+// Morton radix sort and prefix scan must be exact whatever team size OpenMP
+// grants; ctest runs this with OMP_THREAD_LIMIT below OMP_NUM_THREADS.
+// Exits nonzero on the first failure.
+#include "morton.h"
+#include <cstdint>
+#include <iostream>
+#include <random>
+#include <vector>
+
+int main() {
+    int failures = 0;
+    // large enough for the parallel paths
+    const size_t n = 200000;
+
+    std::vector<uint64_t> keys(n), keyScratch;
+    std::vector<uint32_t> values(n), valueScratch;
+    std::mt19937_64 rng(1);
+    for (size_t i = 0; i < n; i++) {
+        keys[i] = rng() & ((uint64_t(1) << 30) - 1);
+        values[i] = static_cast<uint32_t>(i);
+    }
+    const std::vector<uint64_t> original = keys;
+
+    Morton::radixSortPairs(keys, values, keyScratch, valueScratch, 30);
+    bool sorted = true, paired = true;
+    for (size_t i = 0; i < n; i++) {
+        if (i > 0 && keys[i] < keys[i - 1]) sorted = false;
+        if (original[values[i]] != keys[i]) paired = false;
+        // stable: equal keys keep their input order
+        if (i > 0 && keys[i] == keys[i - 1] && values[i] < values[i - 1]) sorted = false;
+    }
+    if (!sorted) { std::cerr << "FAILED: radixSortPairs leaves keys out of order" << std::endl; failures++; }
+    if (!paired) { std::cerr << "FAILED: radixSortPairs separates keys from values" << std::endl; failures++; }
+
+    std::vector<uint32_t> counts(n, 1);
+    const uint32_t total = Morton::exclusiveScan(counts);
+    bool scanned = total == n;
+    for (size_t i = 0; i < n; i++) scanned = scanned && counts[i] == i;
+    if (!scanned) { std::cerr << "FAILED: exclusiveScan" << std::endl; failures++; }
+
+    if (failures == 0) std::cout << "morton_test: all checks passed" << std::endl;
+    return failures == 0 ? 0 : 1;
+}
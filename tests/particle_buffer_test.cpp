@@ -0,0 +1,96 @@
+// Growing a ParticleBuffer, owned or viewing external memory, must keep its
+// elements. Exits nonzero on the first failure.
+#include "particle.h"
+#include "particle_buffer.h"
+#include <iostream>
+#include <memory>
+#include <new>
+
+namespace
+{
+
+int failures = 0;
+
+void check(bool condition, const char* what) {
+    if (!condition) {
+        std::cerr << "FAILED: " << what << std::endl;
+        failures++;
+    }
+}
+
+bool holdsSequence(const ParticleBuffer<float>& buffer, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        if (buffer[i] != static_cast<float>(i + 1)) return false;
+    }
+    return true;
+}
+
+void testGrowOwned() {
+    ParticleBuffer<float> buffer;
+    buffer.resize(4);
+    for (size_t i = 0; i < 4; i++) buffer[i] = static_cast<float>(i + 1);
+
+    buffer.reserve(100);
+    check(buffer.size() == 4, "reserve keeps the size");
+    check(holdsSequence(buffer, 4), "reserve keeps the elements");
+
+    buffer.resize(200, -1.0f);
+    check(buffer.size() == 200, "resize past capacity sets the size");
+    check(holdsSequence(buffer, 4), "resize past capacity keeps the elements");
+    bool filled = true;
+    for (size_t i = 4; i < 200; i++) filled = filled && buffer[i] == -1.0f;
+    check(filled, "resize fills only the new elements");
+}
+
+void testGrowViewed() {
+    // stands in for a mapped checkpoint
+    std::shared_ptr<float> external(new (std::align_val_t(64)) float[4],
+                                    [](float* p) { ::operator delete[](p, std::align_val_t(64)); });
+    for (size_t i = 0; i < 4; i++) external.get()[i] = static_cast<float>(i + 1);
+
+    ParticleBuffer<float> buffer;
+    buffer.adopt(external.get(), 4, external);
+    check(buffer.isAdopted(), "adopt views the memory");
+
+    buffer.resize(8, -1.0f);
+    check(!buffer.isAdopted(), "growing a view copies it to the heap");
+    check(buffer.data() != external.get(), "the grown buffer owns new storage");
+    check(buffer.size() == 8 && holdsSequence(buffer, 4), "growing a view keeps the elements");
+    check(buffer[4] == -1.0f && buffer[7] == -1.0f, "growing a view fills the new elements");
+}
+
+void testGrowHugePage() {
+    // large enough for the huge-page allocation path when it is enabled
+    const size_t n = ParticleBuffer<float>::HUGE_PAGE_BYTES / sizeof(float) + 1;
+    ParticleBuffer<float> buffer(n / 2);
+    for (size_t i = 0; i < n / 2; i++) buffer[i] = static_cast<float>(i + 1);
+
+    buffer.resize(n, -1.0f);
+    check(buffer.size() == n && holdsSequence(buffer, n / 2), "huge-page growth keeps the elements");
+    check(buffer[n / 2] == -1.0f && buffer[n - 1] == -1.0f, "huge-page growth fills the new elements");
+}
+
+void testReserveParticles() {
+    ParticleSystem particles(3);
+    for (size_t i = 0; i < 3; i++) particles.setPosition(i, glm::vec3(static_cast<float>(i)));
+
+    particles.reserve(1000);
+    check(particles.size() == 3, "ParticleSystem::reserve keeps the count");
+    bool kept = true;
+    for (size_t i = 0; i < 3; i++) kept = kept && particles.getPosition(i) == glm::vec3(static_cast<float>(i));
+    check(kept, "ParticleSystem::reserve keeps the particles");
+
+    particles.resize(5);
+    check(particles.getPosition(2) == glm::vec3(2.0f), "ParticleSystem::resize after reserve keeps the particles");
+}
+
+} // namespace
+
+int main() {
+    testGrowOwned();
+    testGrowViewed();
+    testGrowHugePage();
+    testReserveParticles();
+    if (failures == 0) std::cout << "particle_buffer_test: all checks passed" << std::endl;
+    return failures == 0 ? 0 : 1;
+}